@@ -3,6 +3,8 @@
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include "../Database/AppConfigDatabase.h"
+#include "../Job/ArchiveStreamWriter.h"
+#include "../PluginIndex.h"
 
 #include <EmbeddedResources.h>
 
@@ -11,11 +13,15 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
 
 static const std::string ORTHANC_STORAGE = "OrthancStorage";
 static const std::string STORAGE_DIRECTORY = "StorageDirectory";
 static std::string DB_NAME = "saola-plugin";
 
+// Upper bound of the concurrent lookups of the planning of one export
+static const unsigned int MAX_EXPAND_THREADS = 32;
+
 SaolaConfiguration::SaolaConfiguration(/* args */)
 {
   OrthancPlugins::OrthancConfiguration configuration;
@@ -35,6 +41,42 @@ SaolaConfiguration::SaolaConfiguration(/* args */)
   LOG(WARNING) << "SaolaConfiguration - Path to the storage area: " << pathStorage;
   boost::filesystem::path defaultDbPath = boost::filesystem::path(pathStorage) / (DB_NAME + "." + databaseServerIdentifier_ + ".db");
   this->dbPath_ = saola.GetStringValue("Path", defaultDbPath.string());
+  this->queueBackend_ = saola.GetStringValue("QueueBackend", "SQLite"); // "SQLite", "SegmentLog" or "Memory"
+  this->databaseMaintenanceInterval_ = saola.GetIntegerValue("DatabaseMaintenanceInterval", 60);
+  this->databaseConvertToIncrementalVacuum_ = saola.GetBooleanValue("DatabaseConvertToIncrementalVacuum", false);
+  this->exportZeroCopy_ = saola.GetBooleanValue("ExportZeroCopy", false);
+  this->exportAllowHardlinks_ = saola.GetBooleanValue("ExportAllowHardlinks", false);
+  this->exportMmapThresholdMB_ = saola.GetUnsignedIntegerValue("ExportMmapThresholdMB", 16);
+  this->exportLoaderBudgetMB_ = saola.GetUnsignedIntegerValue("ExportLoaderBudgetMB", 256);
+
+  // The transcoding is CPU-bound: one thread per core. The reads and
+  // the writes are I/O-bound, and are mostly waiting for the storage.
+  const unsigned int cores = std::max(1u, boost::thread::hardware_concurrency());
+  this->exportLoaderThreads_ = saola.GetUnsignedIntegerValue("ExportLoaderThreads", std::max(2u, cores / 2));
+  this->exportTranscoderThreads_ = saola.GetUnsignedIntegerValue("ExportTranscoderThreads", cores);
+  this->exportWriterThreads_ = saola.GetUnsignedIntegerValue("ExportWriterThreads", std::max(2u, cores / 2));
+
+  // The planning of an export looks up the resources concurrently, in
+  // REST calls that are not bound to the reads of the storage
+  this->exportExpandThreads_ = std::min(MAX_EXPAND_THREADS, saola.GetUnsignedIntegerValue("ExportExpandThreads", std::max(2u, cores)));
+  this->exportStepBudgetMs_ = saola.GetUnsignedIntegerValue("ExportStepBudgetMs", 200);
+  this->exportIncremental_ = saola.GetBooleanValue("ExportIncremental", false);
+  this->exportPathIndex_ = saola.GetBooleanValue("ExportPathIndex", false);
+  this->exportIndexBackend_ = saola.GetStringValue("ExportIndexBackend", "REST");
+  PluginIndex::StringToBackend(this->exportIndexBackend_);  // Fail at startup if invalid
+  this->exportDeduplication_ = saola.GetBooleanValue("ExportDeduplication", false);
+  this->exportIoReadMBPerSecond_ = saola.GetUnsignedIntegerValue("ExportIoReadMBPerSecond", 0);
+  this->exportIoWriteMBPerSecond_ = saola.GetUnsignedIntegerValue("ExportIoWriteMBPerSecond", 0);
+  this->exportIoOperationsPerSecond_ = saola.GetUnsignedIntegerValue("ExportIoOperationsPerSecond", 0);
+  this->exportIoMaxConcurrent_ = saola.GetUnsignedIntegerValue("ExportIoMaxConcurrent", 0);
+  this->exportIoIngestPercent_ = std::max(1u, std::min(100u, saola.GetUnsignedIntegerValue("ExportIoIngestPercent", 50)));
+  this->exportChecksums_ = saola.GetBooleanValue("ExportChecksums", false);
+  this->exportAsynchronous_ = saola.GetBooleanValue("ExportAsynchronous", false);
+  this->exportExecutorThreads_ = std::max(1u, saola.GetUnsignedIntegerValue("ExportExecutorThreads", 2));
+  this->exportExecutorRetention_ = saola.GetUnsignedIntegerValue("ExportExecutorRetention", 100);
+  this->exportArchiveFormat_ = saola.GetStringValue("ExportArchiveFormat", "Directory");
+  Saola::StringToArchiveFormat(this->exportArchiveFormat_);  // Fail at startup if invalid
+  this->exportCompressionLevel_ = std::min(9u, saola.GetUnsignedIntegerValue("ExportCompressionLevel", 6));
 
   this->enableInMemJobCache_ = saola.GetBooleanValue("EnableInMemJobCache", false);
   this->inMemJobCacheLimit_ = saola.GetIntegerValue("InMemJobCacheLimit", 100);
@@ -102,7 +144,6 @@ void SaolaConfiguration::GetApps(std::map<std::string, std::shared_ptr<AppConfig
     Saola::AppConfigDatabase::Instance().GetAppConfigs(appConfigs);
     if (!appConfigs.empty())
     {
-      std::map<std::string, std::shared_ptr<AppConfiguration>> configMap;
       for (const auto& appConfig : appConfigs)
       {
         configMap.emplace(appConfig["Id"].asString(), std::make_shared<AppConfiguration>(appConfig));
@@ -263,6 +304,33 @@ void SaolaConfiguration::ToJson(Json::Value &json)
   json["Root"] = this->root_;
   json["DatabaseServerIdentifier"] = this->databaseServerIdentifier_;
   json["DbPath"] = this->dbPath_;
+  json["QueueBackend"] = this->queueBackend_;
+  json["DatabaseMaintenanceInterval"] = this->databaseMaintenanceInterval_;
+  json["DatabaseConvertToIncrementalVacuum"] = this->databaseConvertToIncrementalVacuum_;
+  json["ExportZeroCopy"] = this->exportZeroCopy_;
+  json["ExportAllowHardlinks"] = this->exportAllowHardlinks_;
+  json["ExportMmapThresholdMB"] = this->exportMmapThresholdMB_;
+  json["ExportLoaderBudgetMB"] = this->exportLoaderBudgetMB_;
+  json["ExportLoaderThreads"] = this->exportLoaderThreads_;
+  json["ExportTranscoderThreads"] = this->exportTranscoderThreads_;
+  json["ExportWriterThreads"] = this->exportWriterThreads_;
+  json["ExportExpandThreads"] = this->exportExpandThreads_;
+  json["ExportStepBudgetMs"] = this->exportStepBudgetMs_;
+  json["ExportIncremental"] = this->exportIncremental_;
+  json["ExportPathIndex"] = this->exportPathIndex_;
+  json["ExportIndexBackend"] = this->exportIndexBackend_;
+  json["ExportDeduplication"] = this->exportDeduplication_;
+  json["ExportIoReadMBPerSecond"] = this->exportIoReadMBPerSecond_;
+  json["ExportIoWriteMBPerSecond"] = this->exportIoWriteMBPerSecond_;
+  json["ExportIoOperationsPerSecond"] = this->exportIoOperationsPerSecond_;
+  json["ExportIoMaxConcurrent"] = this->exportIoMaxConcurrent_;
+  json["ExportIoIngestPercent"] = this->exportIoIngestPercent_;
+  json["ExportChecksums"] = this->exportChecksums_;
+  json["ExportAsynchronous"] = this->exportAsynchronous_;
+  json["ExportExecutorThreads"] = this->exportExecutorThreads_;
+  json["ExportExecutorRetention"] = this->exportExecutorRetention_;
+  json["ExportArchiveFormat"] = this->exportArchiveFormat_;
+  json["ExportCompressionLevel"] = this->exportCompressionLevel_;
   json["PollingDBIntervalInSeconds"] = this->pollingDBIntervalInSeconds_;
 
   json["Apps"] = Json::arrayValue;
@@ -34,6 +34,55 @@ private:
 
   std::string dbPath_;
 
+  std::string queueBackend_;
+
+  int databaseMaintenanceInterval_ = 60; // In second(s), 0 to disable
+
+  bool databaseConvertToIncrementalVacuum_ = false;
+
+  bool exportZeroCopy_ = false;
+
+  bool exportAllowHardlinks_ = false;
+
+  unsigned int exportMmapThresholdMB_ = 16; // 0 to disable
+
+  unsigned int exportLoaderBudgetMB_ = 256;
+
+  // Default sizes of the stages of the export pipeline, from the number of cores
+  unsigned int exportLoaderThreads_ = 0;
+
+  unsigned int exportTranscoderThreads_ = 0;
+
+  unsigned int exportWriterThreads_ = 0;
+
+  unsigned int exportExpandThreads_ = 0;
+
+  unsigned int exportStepBudgetMs_ = 200;
+
+  bool exportIncremental_ = false;
+
+  bool exportPathIndex_ = false;
+
+  std::string exportIndexBackend_ = "REST";
+
+  bool exportDeduplication_ = false;
+
+  unsigned int exportIoReadMBPerSecond_ = 0;
+  unsigned int exportIoWriteMBPerSecond_ = 0;
+  unsigned int exportIoOperationsPerSecond_ = 0;
+  unsigned int exportIoMaxConcurrent_ = 0;
+  unsigned int exportIoIngestPercent_ = 50;
+
+  bool exportChecksums_ = false;
+
+  bool exportAsynchronous_ = false;
+  unsigned int exportExecutorThreads_ = 2;
+  unsigned int exportExecutorRetention_ = 100;
+
+  std::string exportArchiveFormat_ = "Directory";
+
+  unsigned int exportCompressionLevel_ = 6;
+
   int pollingDBIntervalInSeconds_ = 30; // 30 seconds
 
   std::map<std::string, std::shared_ptr<AppConfiguration>> apps_;
@@ -113,6 +162,141 @@ public:
     return this->dbPath_;
   }
 
+  const std::string& GetQueueBackend() const
+  {
+    return this->queueBackend_;
+  }
+
+  int GetDatabaseMaintenanceInterval() const
+  {
+    return this->databaseMaintenanceInterval_;
+  }
+
+  bool IsDatabaseConvertToIncrementalVacuum() const
+  {
+    return this->databaseConvertToIncrementalVacuum_;
+  }
+
+  bool IsExportZeroCopy() const
+  {
+    return this->exportZeroCopy_;
+  }
+
+  bool IsExportAllowHardlinks() const
+  {
+    return this->exportAllowHardlinks_;
+  }
+
+  unsigned int GetExportMmapThresholdMB() const
+  {
+    return this->exportMmapThresholdMB_;
+  }
+
+  unsigned int GetExportLoaderBudgetMB() const
+  {
+    return this->exportLoaderBudgetMB_;
+  }
+
+  unsigned int GetExportLoaderThreads() const
+  {
+    return this->exportLoaderThreads_;
+  }
+
+  unsigned int GetExportTranscoderThreads() const
+  {
+    return this->exportTranscoderThreads_;
+  }
+
+  unsigned int GetExportWriterThreads() const
+  {
+    return this->exportWriterThreads_;
+  }
+
+  unsigned int GetExportExpandThreads() const
+  {
+    return this->exportExpandThreads_;
+  }
+
+  unsigned int GetExportStepBudgetMs() const
+  {
+    return this->exportStepBudgetMs_;
+  }
+
+  bool IsExportIncremental() const
+  {
+    return this->exportIncremental_;
+  }
+
+  bool IsExportPathIndex() const
+  {
+    return this->exportPathIndex_;
+  }
+
+  const std::string& GetExportIndexBackend() const
+  {
+    return this->exportIndexBackend_;
+  }
+
+  bool IsExportDeduplication() const
+  {
+    return this->exportDeduplication_;
+  }
+
+  unsigned int GetExportIoReadMBPerSecond() const
+  {
+    return this->exportIoReadMBPerSecond_;
+  }
+
+  unsigned int GetExportIoWriteMBPerSecond() const
+  {
+    return this->exportIoWriteMBPerSecond_;
+  }
+
+  unsigned int GetExportIoOperationsPerSecond() const
+  {
+    return this->exportIoOperationsPerSecond_;
+  }
+
+  unsigned int GetExportIoMaxConcurrent() const
+  {
+    return this->exportIoMaxConcurrent_;
+  }
+
+  unsigned int GetExportIoIngestPercent() const
+  {
+    return this->exportIoIngestPercent_;
+  }
+
+  bool IsExportChecksums() const
+  {
+    return this->exportChecksums_;
+  }
+
+  bool IsExportAsynchronous() const
+  {
+    return this->exportAsynchronous_;
+  }
+
+  unsigned int GetExportExecutorThreads() const
+  {
+    return this->exportExecutorThreads_;
+  }
+
+  unsigned int GetExportExecutorRetention() const
+  {
+    return this->exportExecutorRetention_;
+  }
+
+  const std::string& GetExportArchiveFormat() const
+  {
+    return this->exportArchiveFormat_;
+  }
+
+  unsigned int GetExportCompressionLevel() const
+  {
+    return this->exportCompressionLevel_;
+  }
+
   const bool EnableInMemJobCache() const
   {
     return this->enableInMemJobCache_;
@@ -1,12 +1,14 @@
 #include "RestApi.h"
 #include "../Constants.h"
 #include "../Config/SaolaConfiguration.h"
-#include "../SaolaDatabase.h"
+#include "../Database/EventQueueStore.h"
 
 #include "../DTO/StableEventDTOUpdate.h"
 #include "../Scheduler/StableEventScheduler.h"
 
 #include "../Job/ExporterJob.h"
+#include "../Job/ExportExecutor.h"
+#include "../PluginIndex.h"
 
 #include "../Cache/InMemoryJobCache.h"
 
@@ -274,12 +276,12 @@ static void GetStableEventByIds(OrthancPluginRestOutput *output,
   }
 
   std::list<StableEventDTOGet> events;
-  SaolaDatabase::Instance().GetByIds(ids, events);
+  EventQueueStore::Instance().GetByIds(ids, events);
 
   std::map<int64_t, Json::Value> jobMap;
   {
     std::list<TransferJobDTOGet> jobs;
-    SaolaDatabase::Instance().GetTransferJobsByByQueueIds(ids, jobs);
+    EventQueueStore::Instance().GetTransferJobsByByQueueIds(ids, jobs);
     for (const auto& job : jobs)
     {
       Json::Value val;
@@ -317,6 +319,54 @@ static void GetStableEventByIds(OrthancPluginRestOutput *output,
   OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
 }
 
+// Cursor of the keyset pagination of the event queues: "<sort>:<value>:<id>"
+static bool IsKeysetSort(const std::string& sortBy)
+{
+  return sortBy == "id" || sortBy == "last_updated_time" || sortBy == "creation_time";
+}
+
+static std::string FormatCursor(const std::string& sortBy,
+                                const StableEventDTOGet& event)
+{
+  std::string value;
+  if (sortBy == "last_updated_time")
+  {
+    value = event.last_updated_time_;
+  }
+  else if (sortBy == "creation_time")
+  {
+    value = event.creation_time_;
+  }
+
+  return sortBy + ":" + value + ":" + std::to_string(event.id_);
+}
+
+static bool ParseCursor(Pagination& page,
+                        const std::string& cursor)
+{
+  std::vector<std::string> tokens;
+  Orthanc::Toolbox::TokenizeString(tokens, cursor, ':');
+
+  if (tokens.size() != 3 ||
+      !IsKeysetSort(tokens[0]))
+  {
+    return false;
+  }
+
+  try
+  {
+    page.sort_by_ = tokens[0];
+    page.after_value_ = tokens[1];
+    page.after_id_ = boost::lexical_cast<int64_t>(tokens[2]);
+    page.has_after_ = true;
+    return true;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    return false;
+  }
+}
+
 static void GetStableEvents(OrthancPluginRestOutput *output,
                             const char *url,
                             const OrthancPluginHttpRequest *request)
@@ -329,6 +379,8 @@ static void GetStableEvents(OrthancPluginRestOutput *output,
   }
 
   Pagination page;
+  StableEventFilter filter;
+  std::string cursor;
   for (uint32_t i = 0; i < request->getCount; i++)
   {
     std::string key(request->getKeys[i]);
@@ -341,10 +393,55 @@ static void GetStableEvents(OrthancPluginRestOutput *output,
     {
       page.offset_ = boost::lexical_cast<unsigned int>(value);
     }
+    else if (key == "sort_by")
+    {
+      page.sort_by_ = value;
+    }
+    else if (key == "cursor")
+    {
+      cursor = value;
+    }
+    else if (key == "app_id")
+    {
+      filter.app_id_ = value;
+    }
+    else if (key == "app_type")
+    {
+      filter.app_type_ = value;
+    }
+    else if (key == "min_retry")
+    {
+      filter.min_retry_ = boost::lexical_cast<int>(value);
+    }
+    else if (key == "max_retry")
+    {
+      filter.max_retry_ = boost::lexical_cast<int>(value);
+    }
+    else if (key == "min_age")  // In seconds
+    {
+      filter.created_before_ = Saola::GetNextXSecondsFromNowInString(-boost::lexical_cast<int>(value));
+    }
+    else if (key == "max_age")  // In seconds
+    {
+      filter.created_after_ = Saola::GetNextXSecondsFromNowInString(-boost::lexical_cast<int>(value));
+    }
+  }
+
+  if (!cursor.empty())
+  {
+    // The cursor carries its own sort order, which must not change between pages
+    const std::string requestedSort = page.sort_by_;
+    if (!ParseCursor(page, cursor) ||
+        (requestedSort != "id" && requestedSort != page.sort_by_))
+    {
+      LOG(ERROR) << "[GetStableEvents] ERROR Invalid cursor: " << cursor;
+      OrthancPluginSendHttpStatusCode(context, output, 400);
+      return;
+    }
   }
 
   std::list<StableEventDTOGet> events;
-  SaolaDatabase::Instance().FindAll(page, events);
+  EventQueueStore::Instance().List(page, filter, events);
   Json::Value answer = Json::objectValue;
   answer["databaseIdentifier"] = SaolaConfiguration::Instance().GetDataBaseServerIdentifier();
   answer["events"] = Json::arrayValue;
@@ -355,6 +452,14 @@ static void GetStableEvents(OrthancPluginRestOutput *output,
     answer["events"].append(value);
   }
 
+  // A full page means that there might be more events to read
+  if (!events.empty() &&
+      events.size() == page.limit_ &&
+      IsKeysetSort(page.sort_by_))
+  {
+    answer["nextCursor"] = FormatCursor(page.sort_by_, events.back());
+  }
+
   std::string s = answer.toStyledString();
   OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
 }
@@ -401,13 +506,141 @@ static void SaveStableEvent(OrthancPluginRestOutput *output,
     dto.delay_ = requestBody["delay"].asInt();
   }
 
-  auto id = SaolaDatabase::Instance().AddEvent(dto);
+  auto id = EventQueueStore::Instance().Enqueue(dto);
   Json::Value answer = Json::objectValue;
   answer["id"] = id;
   std::string s = answer.toStyledString();
   OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
 }
 
+static bool IsValidBulkEvent(const Json::Value& event)
+{
+  return (event.isObject() &&
+          event.isMember("iuid") && event["iuid"].isString() &&
+          event.isMember("resource_id") && event["resource_id"].isString() &&
+          event.isMember("resource_type") && event["resource_type"].isString() &&
+          (!event.isMember("delay") || event["delay"].isInt()));
+}
+
+static void GetStableEventStatistics(OrthancPluginRestOutput *output,
+                                    const char *url,
+                                    const OrthancPluginHttpRequest *request)
+{
+  OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "GET");
+    return;
+  }
+
+  // File, WAL and free pages sizes of the queue storage
+  Json::Value stats;
+  EventQueueStore::Instance().GetStatistics(stats);
+
+  std::string s = stats.toStyledString();
+  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+}
+
+static void SaveStableEventsBulk(OrthancPluginRestOutput *output,
+                                 const char *url,
+                                 const OrthancPluginHttpRequest *request)
+{
+  OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    return OrthancPluginSendMethodNotAllowed(context, output, "Post");
+  }
+
+  Json::Value requestBody;
+  if (!OrthancPlugins::ReadJson(requestBody, request->body, request->bodySize))
+  {
+    OrthancPluginSendHttpStatusCode(context, output, 400);
+    return;
+  }
+
+  // Either an array of events, or one resource sent to a list of apps:
+  // {"iuid": ..., "resource_id": ..., "resource_type": ..., "apps": [...]}
+  Json::Value events = Json::arrayValue;
+  if (requestBody.isArray())
+  {
+    events = requestBody;
+  }
+  else if (IsValidBulkEvent(requestBody) &&
+           requestBody.isMember("apps") &&
+           requestBody["apps"].isArray())
+  {
+    for (const auto& app : requestBody["apps"])
+    {
+      Json::Value event = requestBody;
+      event.removeMember("apps");
+      event["app"] = app;
+      events.append(event);
+    }
+  }
+  else
+  {
+    LOG(ERROR) << "[SaveStableEventsBulk] ERROR Expected an array of events, or a resource with a list of apps";
+    OrthancPluginSendHttpStatusCode(context, output, 400);
+    return;
+  }
+
+  // Validate all the events against the same snapshot of the apps
+  // before inserting any of them
+  std::map<std::string, std::shared_ptr<AppConfiguration>> apps;
+  SaolaConfiguration::Instance().GetApps(apps);
+
+  std::list<StableEventDTOCreate> dtos;
+  for (Json::ArrayIndex i = 0; i < events.size(); i++)
+  {
+    const Json::Value& event = events[i];
+    if (!IsValidBulkEvent(event) ||
+        !event.isMember("app") ||
+        !event["app"].isString())
+    {
+      LOG(ERROR) << "[SaveStableEventsBulk] ERROR Invalid event at index " << i;
+      OrthancPluginSendHttpStatusCode(context, output, 400);
+      return;
+    }
+
+    auto app = apps.find(event["app"].asString());
+    if (app == apps.end())
+    {
+      LOG(ERROR) << "[SaveStableEventsBulk] ERROR Cannot find any AppConfiguration " << event["app"].asString() << " at index " << i;
+      OrthancPluginSendHttpStatusCode(context, output, 404);
+      return;
+    }
+
+    // The strings are owned by "events" and "apps", that outlive "dtos"
+    StableEventDTOCreate dto;
+    dto.iuid_ = event["iuid"].asCString();
+    dto.resource_id_ = event["resource_id"].asCString();
+    dto.resouce_type_ = event["resource_type"].asCString();
+    dto.app_id_ = event["app"].asCString();
+    dto.app_type_ = app->second->type_.c_str();
+    dto.delay_ = app->second->delay_;
+    if (event.isMember("delay"))
+    {
+      dto.delay_ = event["delay"].asInt();
+    }
+
+    dtos.push_back(dto);
+  }
+
+  std::list<int64_t> ids;
+  EventQueueStore::Instance().EnqueueBatch(dtos, ids);
+
+  Json::Value answer = Json::objectValue;
+  answer["ids"] = Json::arrayValue;
+  for (const auto& id : ids)
+  {
+    answer["ids"].append(id);
+  }
+
+  std::string s = answer.toStyledString();
+  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+}
+
 static void ExecuteStableEvents(OrthancPluginRestOutput *output,
                                 const char *url,
                                 const OrthancPluginHttpRequest *request)
@@ -462,7 +695,7 @@ static void ExecuteStableEvents(OrthancPluginRestOutput *output,
       dto.delay_ = requestBody["delay"].asInt();
     }
 
-    auto id = SaolaDatabase::Instance().AddEvent(dto);
+    auto id = EventQueueStore::Instance().Enqueue(dto);
     Json::Value answer = Json::objectValue;
     answer["id"] = id;
     std::string s = answer.toStyledString();
@@ -500,7 +733,7 @@ void DeleteStableEvents(OrthancPluginRestOutput *output,
     ids.push_back(item.asInt64());
   }
 
-  SaolaDatabase::Instance().DeleteEventByIds(ids);
+  EventQueueStore::Instance().DeleteEventByIds(ids);
 
   Json::Value answer = Json::objectValue;
   std::string s = answer.toStyledString();
@@ -550,7 +783,7 @@ void ResetStableEvents(OrthancPluginRestOutput *output,
   }
 
   Json::Value answer = Json::objectValue;
-  answer["result"] = SaolaDatabase::Instance().ResetEvents(ids);
+  answer["result"] = EventQueueStore::Instance().ResetEvents(ids);
   std::string s = answer.toStyledString();
 
   OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
@@ -577,10 +810,9 @@ void UpdateTransferJobs(OrthancPluginRestOutput *output,
   if (status == "success")
   {
     TransferJobDTOGet dto;
-    if (SaolaDatabase::Instance().GetById(jobId, dto))
+    if (EventQueueStore::Instance().GetById(jobId, dto))
     {
-      SaolaDatabase::Instance().DeleteTransferJobsByQueueId(dto.queue_id_);
-      SaolaDatabase::Instance().DeleteEventByIds(std::list<int64_t>{dto.queue_id_});
+      EventQueueStore::Instance().Complete(dto.queue_id_);
       ok = true;
     }
     else
@@ -591,13 +823,13 @@ void UpdateTransferJobs(OrthancPluginRestOutput *output,
   else if (status == "failure")
   {
     TransferJobDTOGet dto;
-    if (SaolaDatabase::Instance().GetById(jobId, dto))
+    if (EventQueueStore::Instance().GetById(jobId, dto))
     {
-      SaolaDatabase::Instance().DeleteTransferJobsByQueueId(dto.queue_id_);
+      EventQueueStore::Instance().DeleteTransferJobsByQueueId(dto.queue_id_);
       StableEventDTOGet dtoGet;
-      if (SaolaDatabase::Instance().GetById(dto.queue_id_, dtoGet))
+      if (EventQueueStore::Instance().GetById(dto.queue_id_, dtoGet))
       {
-        SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dtoGet.id_, "Lua Trigger Callback returns failure", dtoGet.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dtoGet.delay_sec_).c_str()));
+        EventQueueStore::Instance().Fail(StableEventDTOUpdate(dtoGet.id_, "Lua Trigger Callback returns failure", dtoGet.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dtoGet.delay_sec_).c_str()));
         ok = true;
       }
     }
@@ -610,6 +842,41 @@ void UpdateTransferJobs(OrthancPluginRestOutput *output,
 }
 
 
+// Compares the backends of PluginIndex on an existing study, that
+// should be large enough for the timings to be meaningful. The
+// benchmark runs as an Orthanc job, whose ID is returned.
+static void BenchmarkPluginIndex(OrthancPluginRestOutput *output,
+                                 const char *url,
+                                 const OrthancPluginHttpRequest *request)
+{
+  OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    return OrthancPluginSendMethodNotAllowed(context, output, "POST");
+  }
+
+  Json::Value requestBody;
+  if (!OrthancPlugins::ReadJson(requestBody, request->body, request->bodySize) ||
+      !requestBody.isMember("ID"))
+  {
+    LOG(WARNING) << "[BenchmarkPluginIndex] Missing param: ID";
+    return OrthancPluginSendHttpStatusCode(context, output, 400);
+  }
+
+  const std::string id = PluginIndex::Instance().SubmitBenchmark(requestBody["ID"].asString(),
+                                                                requestBody.isMember("Limit") ? requestBody["Limit"].asUInt() : 0,
+                                                                requestBody.isMember("Rounds") ? requestBody["Rounds"].asUInt() : 2);
+
+  // Same answer as the asynchronous jobs of Orthanc, the timings are in the content of the job
+  Json::Value result;
+  result["ID"] = id;
+  result["Path"] = "/jobs/" + id;
+
+  std::string s = result.toStyledString();
+  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+}
+
 void ExportSingleResource(OrthancPluginRestOutput *output,
                           const char *url,
                           const OrthancPluginHttpRequest *request)
@@ -676,10 +943,30 @@ void ExportSingleResource(OrthancPluginRestOutput *output,
     job->SetTranscode(Orthanc::GetTransferSyntax(requestBody["Transcode"].asString()));
   }
   job->AddResource(resourceId);
-  if (requestBody.isMember("ThreadCount"))
-  {
-    job->SetLoaderThreads(requestBody["ThreadCount"].asInt());
-  }
+  job->SetLoaderThreads(requestBody.isMember("ThreadCount") ? requestBody["ThreadCount"].asUInt() :
+                        SaolaConfiguration::Instance().GetExportLoaderThreads());
+  job->SetTranscoderThreads(requestBody.isMember("TranscoderThreadCount") ? requestBody["TranscoderThreadCount"].asUInt() :
+                            SaolaConfiguration::Instance().GetExportTranscoderThreads());
+  job->SetWriterThreads(requestBody.isMember("WriterThreadCount") ? requestBody["WriterThreadCount"].asUInt() :
+                        SaolaConfiguration::Instance().GetExportWriterThreads());
+  job->SetExpandThreads(requestBody.isMember("ExpandThreadCount") ? requestBody["ExpandThreadCount"].asUInt() :
+                        SaolaConfiguration::Instance().GetExportExpandThreads());
+  job->SetZeroCopy(requestBody.isMember("ZeroCopy") ? requestBody["ZeroCopy"].asBool() : SaolaConfiguration::Instance().IsExportZeroCopy(),
+                   SaolaConfiguration::Instance().IsExportAllowHardlinks());
+  job->SetMmapThreshold(static_cast<uint64_t>(SaolaConfiguration::Instance().GetExportMmapThresholdMB()) * 1024 * 1024);
+  job->SetLoaderMemoryBudget(static_cast<uint64_t>(SaolaConfiguration::Instance().GetExportLoaderBudgetMB()) * 1024 * 1024);
+  job->SetStepBudget(SaolaConfiguration::Instance().GetExportStepBudgetMs());
+  job->SetIncremental(requestBody.isMember("Incremental") ? requestBody["Incremental"].asBool() :
+                      SaolaConfiguration::Instance().IsExportIncremental());
+  job->SetDeduplication(requestBody.isMember("Deduplicate") ? requestBody["Deduplicate"].asBool() :
+                        SaolaConfiguration::Instance().IsExportDeduplication());
+  job->SetIoShare(requestBody.isMember("IoShare") ? requestBody["IoShare"].asUInt() : 1);
+  job->SetChecksums(requestBody.isMember("Checksums") ? requestBody["Checksums"].asBool() :
+                    SaolaConfiguration::Instance().IsExportChecksums());
+  job->SetArchiveFormat(Saola::StringToArchiveFormat(requestBody.isMember("ArchiveFormat") ? requestBody["ArchiveFormat"].asString() :
+                                                     SaolaConfiguration::Instance().GetExportArchiveFormat()),
+                        static_cast<uint8_t>(requestBody.isMember("CompressionLevel") ? requestBody["CompressionLevel"].asUInt() :
+                                             SaolaConfiguration::Instance().GetExportCompressionLevel()));
 
   job->SetDescription("Export Single Resource to directory");
 
@@ -688,6 +975,19 @@ void ExportSingleResource(OrthancPluginRestOutput *output,
     return OrthancPlugins::OrthancJob::SubmitFromRestApiPost(output, requestBody, job.release());
   }
 
+  if (requestBody.isMember("Asynchronous") ? requestBody["Asynchronous"].asBool() :
+      SaolaConfiguration::Instance().IsExportAsynchronous())
+  {
+    // Run by the pool of the plugin, the HTTP thread is released at once
+    const std::string id = Saola::ExportExecutor::Instance().Submit(job.release());
+
+    Json::Value answer = Json::objectValue;
+    answer["ID"] = id;
+    answer["Path"] = SaolaConfiguration::Instance().GetRoot() + "exports/" + id;
+    std::string s = answer.toStyledString();
+    return OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+  }
+
 
   LOG(INFO) << "[ExportSingleResource] Starting manual job execution";
   
@@ -751,6 +1051,96 @@ void ExportSingleResource(OrthancPluginRestOutput *output,
 */
 }
 
+// Progress of an asynchronous export. With "since=<Version>", waits
+// until the export changes (at most "timeout" milliseconds, 30s max)
+void GetExport(OrthancPluginRestOutput *output,
+               const char *url,
+               const OrthancPluginHttpRequest *request)
+{
+  OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    return OrthancPluginSendMethodNotAllowed(context, output, "GET");
+  }
+
+  const std::string id = request->groups[0];
+
+  bool wait = false;
+  uint64_t since = 0;
+  unsigned int timeout = 10000;
+
+  try
+  {
+    for (uint32_t i = 0; i < request->getCount; i++)
+    {
+      std::string key(request->getKeys[i]);
+      std::string value(request->getValues[i]);
+      if (key == "since")
+      {
+        since = boost::lexical_cast<uint64_t>(value);
+        wait = true;
+      }
+      else if (key == "timeout")  // In milliseconds
+      {
+        timeout = boost::lexical_cast<unsigned int>(value);
+      }
+    }
+  }
+  catch (boost::bad_lexical_cast &)
+  {
+    return OrthancPluginSendHttpStatusCode(context, output, 400);
+  }
+
+  Json::Value answer;
+  const bool found = (wait ?
+                      Saola::ExportExecutor::Instance().WaitExport(answer, id, since, timeout) :
+                      Saola::ExportExecutor::Instance().GetExport(answer, id));
+
+  if (!found)
+  {
+    return OrthancPluginSendHttpStatusCode(context, output, 404);
+  }
+
+  std::string s = answer.toStyledString();
+  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+}
+
+void ListExports(OrthancPluginRestOutput *output,
+                 const char *url,
+                 const OrthancPluginHttpRequest *request)
+{
+  OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    return OrthancPluginSendMethodNotAllowed(context, output, "GET");
+  }
+
+  Json::Value answer;
+  Saola::ExportExecutor::Instance().ListExports(answer);
+
+  std::string s = answer.toStyledString();
+  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+}
+
+void CancelExport(OrthancPluginRestOutput *output,
+                  const char *url,
+                  const OrthancPluginHttpRequest *request)
+{
+  OrthancPluginContext *context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    return OrthancPluginSendMethodNotAllowed(context, output, "POST");
+  }
+
+  Json::Value answer = Json::objectValue;
+  answer["result"] = Saola::ExportExecutor::Instance().Cancel(request->groups[0]);
+  std::string s = answer.toStyledString();
+  OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+}
+
 void DeleteStudyResource(OrthancPluginRestOutput *output,
                          const char *url,
                          const OrthancPluginHttpRequest *request)
@@ -1209,9 +1599,15 @@ void RegisterRestEndpoint()
   OrthancPlugins::RegisterRestCallback<DeleteStableEvents>(SaolaConfiguration::Instance().GetRoot() + "delete-event-queues", true);
   OrthancPlugins::RegisterRestCallback<ResetStableEvents>(SaolaConfiguration::Instance().GetRoot() + "reset-event-queues", true);
   OrthancPlugins::RegisterRestCallback<ExecuteStableEvents>(SaolaConfiguration::Instance().GetRoot() + "execute-event-queues", true);
+  OrthancPlugins::RegisterRestCallback<GetStableEventStatistics>(SaolaConfiguration::Instance().GetRoot() + "event-queues/statistics", true);   // Before "event-queues/([^/]*)"
+  OrthancPlugins::RegisterRestCallback<SaveStableEventsBulk>(SaolaConfiguration::Instance().GetRoot() + "event-queues/bulk", true);   // Before "event-queues/([^/]*)"
   OrthancPlugins::RegisterRestCallback<GetStableEventByIds>(SaolaConfiguration::Instance().GetRoot() + "event-queues/([^/]*)", true);
   OrthancPlugins::RegisterRestCallback<UpdateTransferJobs>(SaolaConfiguration::Instance().GetRoot() + "transfer-jobs/([^/]*)/([^/]*)", true);
   OrthancPlugins::RegisterRestCallback<ExportSingleResource>(SaolaConfiguration::Instance().GetRoot() + "export", true);
+  OrthancPlugins::RegisterRestCallback<ListExports>(SaolaConfiguration::Instance().GetRoot() + "exports", true);
+  OrthancPlugins::RegisterRestCallback<CancelExport>(SaolaConfiguration::Instance().GetRoot() + "exports/([^/]*)/cancel", true);   // Before "exports/([^/]*)"
+  OrthancPlugins::RegisterRestCallback<GetExport>(SaolaConfiguration::Instance().GetRoot() + "exports/([^/]*)", true);
+  OrthancPlugins::RegisterRestCallback<BenchmarkPluginIndex>(SaolaConfiguration::Instance().GetRoot() + "index/benchmark", true);
   OrthancPlugins::RegisterRestCallback<DeleteStudyResource>(SaolaConfiguration::Instance().GetRoot() + "studies/([^/]*)/delete", true);    // For compatibility
   OrthancPlugins::RegisterRestCallback<DeleteSeriesResource>(SaolaConfiguration::Instance().GetRoot() + "studies/([^/]*)/series/([^/]*)/delete", true);
   OrthancPlugins::RegisterRestCallback<DicomCStoreStudy>(SaolaConfiguration::Instance().GetRoot() + "modalities/([^/]*)/store", true);     // For compatibility
@@ -0,0 +1,63 @@
+#include "EventQueueStore.h"
+#include "InMemoryEventQueueStore.h"
+#include "SegmentLogEventQueueStore.h"
+#include "../SaolaDatabase.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+const std::string EventQueueStore::SQLITE = "SQLite";
+const std::string EventQueueStore::MEMORY = "Memory";
+const std::string EventQueueStore::SEGMENT_LOG = "SegmentLog";
+
+static IEventQueueStore* store_ = NULL;
+static SegmentLogEventQueueStore* segmentLog_ = NULL;
+
+void EventQueueStore::Open(const std::string& backend,
+                           const std::string& path)
+{
+  if (backend == SQLITE)
+  {
+    SaolaDatabase::Instance().Open(path);
+    store_ = &SaolaDatabase::Instance();
+  }
+  else if (backend == MEMORY)
+  {
+    static InMemoryEventQueueStore memory;
+    store_ = &memory;
+  }
+  else if (backend == SEGMENT_LOG)
+  {
+    // The segments are stored in a directory next to the SQLite file
+    static SegmentLogEventQueueStore segmentLog;
+    segmentLog.Open(path + ".segments");
+    segmentLog_ = &segmentLog;
+    store_ = &segmentLog;
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Unknown event queue backend: " + backend);
+  }
+
+  LOG(WARNING) << "[EventQueueStore] Using the " << backend << " backend for the event queues";
+}
+
+void EventQueueStore::Close()
+{
+  if (segmentLog_ != NULL)
+  {
+    segmentLog_->Close();
+  }
+}
+
+IEventQueueStore& EventQueueStore::Instance()
+{
+  if (store_ == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
+                                    "The event queue backend is not opened");
+  }
+
+  return *store_;
+}
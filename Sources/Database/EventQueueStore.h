@@ -0,0 +1,25 @@
+#pragma once
+
+#include "IEventQueueStore.h"
+
+#include <string>
+
+// Gives access to the event queue backend that is selected by the
+// "QueueBackend" configuration option
+class EventQueueStore
+{
+public:
+  static const std::string SQLITE;
+  static const std::string MEMORY;
+  static const std::string SEGMENT_LOG;
+
+  // Must be called once, before the schedulers are started. "path" is
+  // the location of the data on the disk, if the backend needs one.
+  static void Open(const std::string& backend,
+                   const std::string& path);
+
+  // Stops the background activity of the backend, if any
+  static void Close();
+
+  static IEventQueueStore& Instance();
+};
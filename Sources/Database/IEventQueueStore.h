@@ -0,0 +1,88 @@
+#pragma once
+
+#include "../DTO/StableEventDTOCreate.h"
+#include "../DTO/StableEventDTOUpdate.h"
+#include "../DTO/StableEventDTOGet.h"
+
+#include "../DTO/TransferJobDTOCreate.h"
+#include "../DTO/TransferJobDTOGet.h"
+
+#include "../Pagination.h"
+#include "../StableEventFilter.h"
+
+#include <list>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#include <json/value.h>
+
+// Storage backend of the stable event queue (StableEventQueues and the
+// TransferJobs attached to its rows). The scheduler, the job callbacks
+// and the REST API only talk to this interface, so that a backend can
+// be swapped without touching the scheduling logic.
+class IEventQueueStore : public boost::noncopyable
+{
+public:
+  virtual ~IEventQueueStore()
+  {
+  }
+
+  virtual int64_t Enqueue(const StableEventDTOCreate& obj) = 0;
+
+  // Enqueues all the events at once (either all of them or none of
+  // them are stored). "ids" receives the new identifiers, in order.
+  virtual void EnqueueBatch(const std::list<StableEventDTOCreate>& objs,
+                            std::list<int64_t>& ids) = 0;
+
+  // Returns at most "limit" events whose app type is (or is not, if
+  // "included" is false) in "appTypes", whose retry is lower or equal
+  // to "maxRetry" and that are due for execution
+  virtual void GetDueBatch(const std::list<std::string>& appTypes,
+                           bool included,
+                           int maxRetry,
+                           int limit,
+                           std::list<StableEventDTOGet>& results) = 0;
+
+  // The event has been processed: drop it along with its transfer jobs
+  virtual bool Complete(int64_t id) = 0;
+
+  // The event has failed: record the reason, the new retry count and
+  // the new last update time
+  virtual bool Fail(const StableEventDTOUpdate& obj) = 0;
+
+  // The event stays pending without having failed (e.g. a retried
+  // event whose job has just been submitted): record the same fields
+  // as "Fail()", so that the next attempt is delayed accordingly
+  virtual bool Reschedule(const StableEventDTOUpdate& obj) = 0;
+
+  // Results are sorted by "page.sort_by_", then by id
+  virtual void List(const Pagination& page,
+                    const StableEventFilter& filter,
+                    std::list<StableEventDTOGet>& results) = 0;
+
+  virtual bool GetById(int64_t id, StableEventDTOGet& result) = 0;
+
+  virtual bool GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results) = 0;
+
+  // An empty list of ids removes all the events
+  virtual bool DeleteEventByIds(const std::list<int64_t>& ids) = 0;
+
+  // An empty list of ids resets all the events
+  virtual bool ResetEvents(const std::list<int64_t>& ids) = 0;
+
+  virtual void SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result) = 0;
+
+  virtual bool DeleteTransferJobByIds(const std::list<std::string>& ids) = 0;
+
+  virtual bool DeleteTransferJobsByQueueId(int64_t id) = 0;
+
+  virtual bool GetById(const std::string& id, TransferJobDTOGet& result) = 0;
+
+  virtual bool GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results) = 0;
+
+  virtual bool GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results) = 0;
+
+  // Size and health of the storage, as reported by the REST API
+  virtual void GetStatistics(Json::Value& stats) = 0;
+};
@@ -0,0 +1,498 @@
+#include "InMemoryEventQueueStore.h"
+#include "../TimeUtil.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+static bool IsAppTypeSelected(const std::set<std::string>& appTypes,
+                              bool included,
+                              const std::string& appType)
+{
+  return (appTypes.find(appType) != appTypes.end()) == included;
+}
+
+// Mimics "ORDER BY <column>, id" of the SQLite backend
+static bool LessThan(const StableEventDTOGet& a,
+                     const StableEventDTOGet& b,
+                     const std::string& sortBy)
+{
+  int c = 0;
+  if (sortBy == "iuid") c = a.iuid_.compare(b.iuid_);
+  else if (sortBy == "resource_id") c = a.resource_id_.compare(b.resource_id_);
+  else if (sortBy == "resource_type") c = a.resource_type_.compare(b.resource_type_);
+  else if (sortBy == "app_id") c = a.app_id_.compare(b.app_id_);
+  else if (sortBy == "app_type") c = a.app_type_.compare(b.app_type_);
+  else if (sortBy == "delay_sec") c = (a.delay_sec_ < b.delay_sec_ ? -1 : (a.delay_sec_ > b.delay_sec_ ? 1 : 0));
+  else if (sortBy == "retry") c = (a.retry_ < b.retry_ ? -1 : (a.retry_ > b.retry_ ? 1 : 0));
+  else if (sortBy == "failed_reason") c = a.failed_reason_.compare(b.failed_reason_);
+  else if (sortBy == "last_updated_time") c = a.last_updated_time_.compare(b.last_updated_time_);
+  else if (sortBy == "creation_time") c = a.creation_time_.compare(b.creation_time_);
+
+  return c < 0 || (c == 0 && a.id_ < b.id_);
+}
+
+static std::string GetDueTime(const StableEventDTOGet& event)
+{
+  return boost::posix_time::to_iso_string(boost::posix_time::from_iso_string(event.last_updated_time_) +
+                                          boost::posix_time::seconds(event.delay_sec_));
+}
+
+void InMemoryEventQueueStore::Index(const StableEventDTOGet& event)
+{
+  dueIndex_.insert(std::make_pair(GetDueTime(event), event.id_));
+}
+
+void InMemoryEventQueueStore::Unindex(const StableEventDTOGet& event)
+{
+  dueIndex_.erase(std::make_pair(GetDueTime(event), event.id_));
+}
+
+void InMemoryEventQueueStore::DeleteEventInternal(int64_t id)
+{
+  DeleteTransferJobsByQueueIdInternal(id);
+
+  auto it = events_.find(id);
+  if (it != events_.end())
+  {
+    Unindex(it->second);
+    events_.erase(it);
+  }
+}
+
+void InMemoryEventQueueStore::DeleteTransferJobsByQueueIdInternal(int64_t id)
+{
+  for (auto it = transferJobs_.begin(); it != transferJobs_.end(); )
+  {
+    if (it->second.queue_id_ == id)
+    {
+      it = transferJobs_.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+int64_t InMemoryEventQueueStore::EnqueueInternal(const StableEventDTOCreate& obj)
+{
+  const std::string now = boost::posix_time::to_iso_string(Saola::GetNow());
+
+  StableEventDTOGet event;
+  event.id_ = nextId_++;
+  event.iuid_ = obj.iuid_;
+  event.resource_id_ = obj.resource_id_;
+  event.resource_type_ = obj.resouce_type_;
+  event.app_id_ = obj.app_id_;
+  event.app_type_ = obj.app_type_;
+  event.delay_sec_ = obj.delay_;
+  event.retry_ = 0;
+  event.last_updated_time_ = now;
+  event.creation_time_ = now;
+
+  events_[event.id_] = event;
+  Index(event);
+  return event.id_;
+}
+
+int64_t InMemoryEventQueueStore::Enqueue(const StableEventDTOCreate& obj)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return EnqueueInternal(obj);
+}
+
+void InMemoryEventQueueStore::EnqueueBatch(const std::list<StableEventDTOCreate>& objs,
+                                           std::list<int64_t>& ids)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (const auto& obj : objs)
+  {
+    ids.push_back(EnqueueInternal(obj));
+  }
+}
+
+void InMemoryEventQueueStore::GetDueBatch(const std::list<std::string>& appTypes,
+                                          bool included,
+                                          int maxRetry,
+                                          int limit,
+                                          std::list<StableEventDTOGet>& results)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (appTypes.empty())
+  {
+    return;
+  }
+
+  std::set<std::string> types(appTypes.begin(), appTypes.end());
+
+  // Same condition as "Saola::IsOverDue()": the due time is strictly in the past
+  const std::string now = boost::posix_time::to_iso_string(Saola::GetNow());
+
+  std::vector<const StableEventDTOGet*> candidates;
+  for (auto it = dueIndex_.begin(); it != dueIndex_.end() && it->first < now; ++it)
+  {
+    const StableEventDTOGet& event = events_[it->second];
+    if (event.retry_ <= maxRetry &&
+        IsAppTypeSelected(types, included, event.app_type_))
+    {
+      candidates.push_back(&event);
+    }
+  }
+
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const StableEventDTOGet* a, const StableEventDTOGet* b)
+                   {
+                     return a->retry_ < b->retry_ || (a->retry_ == b->retry_ && a->id_ < b->id_);
+                   });
+
+  for (size_t i = 0; i < candidates.size() && static_cast<int>(i) < limit; i++)
+  {
+    results.push_back(*candidates[i]);
+  }
+}
+
+bool InMemoryEventQueueStore::Complete(int64_t id)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  DeleteEventInternal(id);
+  return true;
+}
+
+bool InMemoryEventQueueStore::Fail(const StableEventDTOUpdate& obj)
+{
+  return Reschedule(obj);
+}
+
+bool InMemoryEventQueueStore::Reschedule(const StableEventDTOUpdate& obj)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  auto it = events_.find(obj.id_);
+  if (it != events_.end())
+  {
+    Unindex(it->second);
+    it->second.failed_reason_ = obj.failed_reason_;
+    it->second.retry_ = obj.retry_;
+    it->second.last_updated_time_ = obj.last_updated_time_;
+    Index(it->second);
+  }
+
+  return true;
+}
+
+// Whether the event comes strictly after the cursor of keyset pagination
+static bool IsAfterCursor(const StableEventDTOGet& event,
+                          const Pagination& page)
+{
+  std::string value;
+  if (page.sort_by_ == "id")
+  {
+    return event.id_ > page.after_id_;
+  }
+  else if (page.sort_by_ == "last_updated_time")
+  {
+    value = event.last_updated_time_;
+  }
+  else if (page.sort_by_ == "creation_time")
+  {
+    value = event.creation_time_;
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Keyset pagination is not available when sorting by: " + page.sort_by_);
+  }
+
+  return (value > page.after_value_ ||
+          (value == page.after_value_ && event.id_ > page.after_id_));
+}
+
+static bool IsMatch(const StableEventDTOGet& event,
+                    const StableEventFilter& filter)
+{
+  return ((filter.app_id_.empty() || event.app_id_ == filter.app_id_) &&
+          (filter.app_type_.empty() || event.app_type_ == filter.app_type_) &&
+          (filter.min_retry_ < 0 || event.retry_ >= filter.min_retry_) &&
+          (filter.max_retry_ < 0 || event.retry_ <= filter.max_retry_) &&
+          (filter.created_before_.empty() || event.creation_time_ <= filter.created_before_) &&
+          (filter.created_after_.empty() || event.creation_time_ >= filter.created_after_));
+}
+
+void InMemoryEventQueueStore::List(const Pagination& page,
+                                   const StableEventFilter& filter,
+                                   std::list<StableEventDTOGet>& results)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::vector<const StableEventDTOGet*> sorted;
+  for (const auto& it : events_)
+  {
+    if (IsMatch(it.second, filter))
+    {
+      sorted.push_back(&it.second);
+    }
+  }
+
+  const std::string sortBy = page.sort_by_;
+  if (sortBy != "id")
+  {
+    std::sort(sorted.begin(), sorted.end(),
+              [&sortBy](const StableEventDTOGet* a, const StableEventDTOGet* b) { return LessThan(*a, *b, sortBy); });
+  }
+
+  size_t start = page.offset_;
+  if (page.has_after_)
+  {
+    start = std::partition_point(sorted.begin(), sorted.end(),
+                                 [&page](const StableEventDTOGet* a) { return !IsAfterCursor(*a, page); }) - sorted.begin();
+  }
+
+  for (size_t i = start; i < sorted.size() && results.size() < page.limit_; i++)
+  {
+    results.push_back(*sorted[i]);
+  }
+}
+
+bool InMemoryEventQueueStore::GetById(int64_t id, StableEventDTOGet& result)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  auto it = events_.find(id);
+  if (it == events_.end())
+  {
+    return false;
+  }
+
+  result = it->second;
+  return true;
+}
+
+bool InMemoryEventQueueStore::GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  bool ok = false;
+  for (const auto& id : ids)
+  {
+    auto it = events_.find(id);
+    if (it != events_.end())
+    {
+      results.push_back(it->second);
+      ok = true;
+    }
+  }
+
+  return ok;
+}
+
+bool InMemoryEventQueueStore::DeleteEventByIds(const std::list<int64_t>& ids)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (ids.empty())
+  {
+    transferJobs_.clear();
+    events_.clear();
+    dueIndex_.clear();
+    return true;
+  }
+
+  for (const auto& id : ids)
+  {
+    DeleteEventInternal(id);
+  }
+
+  return true;
+}
+
+bool InMemoryEventQueueStore::ResetEvents(const std::list<int64_t>& ids)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  const std::string now = boost::posix_time::to_iso_string(Saola::GetNow());
+
+  std::list<int64_t> targets = ids;
+  if (targets.empty())
+  {
+    for (const auto& it : events_)
+    {
+      targets.push_back(it.first);
+    }
+  }
+
+  for (const auto& id : targets)
+  {
+    auto it = events_.find(id);
+    if (it != events_.end())
+    {
+      Unindex(it->second);
+      it->second.failed_reason_ = "Reset";
+      it->second.retry_ = 0;
+      it->second.last_updated_time_ = now;
+      Index(it->second);
+    }
+  }
+
+  return true;
+}
+
+void InMemoryEventQueueStore::SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  const std::string now = boost::posix_time::to_iso_string(Saola::GetNow());
+
+  auto it = transferJobs_.find(dto.id_);
+  if (it == transferJobs_.end())
+  {
+    TransferJobDTOGet job;
+    job.id_ = dto.id_;
+    job.queue_id_ = dto.queue_id_;
+    job.last_updated_time_ = now;
+    job.creation_time_ = now;
+    transferJobs_[dto.id_] = job;
+  }
+  else
+  {
+    it->second.queue_id_ = dto.queue_id_;
+    it->second.last_updated_time_ = now;
+  }
+
+  result = transferJobs_[dto.id_];
+}
+
+bool InMemoryEventQueueStore::DeleteTransferJobByIds(const std::list<std::string>& ids)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (const auto& id : ids)
+  {
+    transferJobs_.erase(id);
+  }
+
+  return true;
+}
+
+bool InMemoryEventQueueStore::DeleteTransferJobsByQueueId(int64_t id)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  DeleteTransferJobsByQueueIdInternal(id);
+  return true;
+}
+
+bool InMemoryEventQueueStore::GetById(const std::string& id, TransferJobDTOGet& result)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  auto it = transferJobs_.find(id);
+  if (it == transferJobs_.end())
+  {
+    return false;
+  }
+
+  result = it->second;
+  return true;
+}
+
+bool InMemoryEventQueueStore::GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results)
+{
+  return GetTransferJobsByByQueueIds(std::list<int64_t>{id}, results);
+}
+
+bool InMemoryEventQueueStore::GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::set<int64_t> queueIds(ids.begin(), ids.end());
+
+  bool ok = false;
+  for (const auto& it : transferJobs_)
+  {
+    if (queueIds.find(it.second.queue_id_) != queueIds.end())
+    {
+      results.push_back(it.second);
+      ok = true;
+    }
+  }
+
+  return ok;
+}
+
+void InMemoryEventQueueStore::GetStatistics(Json::Value& stats)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  stats = Json::objectValue;
+  stats["backend"] = "Memory";
+  stats["events"] = Json::Value::UInt64(events_.size());
+  stats["transferJobs"] = Json::Value::UInt64(transferJobs_.size());
+}
+
+void InMemoryEventQueueStore::Restore(const StableEventDTOGet& event)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  auto it = events_.find(event.id_);
+  if (it != events_.end())
+  {
+    Unindex(it->second);
+  }
+
+  events_[event.id_] = event;
+  Index(event);
+
+  if (event.id_ >= nextId_)
+  {
+    nextId_ = event.id_ + 1;
+  }
+}
+
+void InMemoryEventQueueStore::Restore(const TransferJobDTOGet& job)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  transferJobs_[job.id_] = job;
+}
+
+int64_t InMemoryEventQueueStore::GetNextId()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return nextId_;
+}
+
+void InMemoryEventQueueStore::SetNextId(int64_t id)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // Identifiers are never reused, even if the last events were deleted
+  if (id > nextId_)
+  {
+    nextId_ = id;
+  }
+}
+
+void InMemoryEventQueueStore::GetAll(std::list<StableEventDTOGet>& events,
+                                     std::list<TransferJobDTOGet>& jobs)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (const auto& it : events_)
+  {
+    events.push_back(it.second);
+  }
+
+  for (const auto& it : transferJobs_)
+  {
+    jobs.push_back(it.second);
+  }
+}
+
+size_t InMemoryEventQueueStore::GetSize()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return events_.size() + transferJobs_.size();
+}
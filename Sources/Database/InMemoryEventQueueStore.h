@@ -0,0 +1,96 @@
+#pragma once
+
+#include "IEventQueueStore.h"
+
+#include <map>
+#include <set>
+
+#include <boost/thread/mutex.hpp>
+
+// Non-persistent event queue, mostly useful for tests and benchmarks
+// of the scheduler without the cost of the SQLite backend
+class InMemoryEventQueueStore : public IEventQueueStore
+{
+private:
+  boost::mutex                                mutex_;
+  int64_t                                     nextId_;
+  std::map<int64_t, StableEventDTOGet>        events_;
+  std::map<std::string, TransferJobDTOGet>    transferJobs_;
+
+  // (due time, id) of each event, so that GetDueBatch() only visits
+  // the events that are due instead of scanning the whole queue
+  std::set<std::pair<std::string, int64_t> >  dueIndex_;
+
+  void Index(const StableEventDTOGet& event);
+
+  void Unindex(const StableEventDTOGet& event);
+
+  int64_t EnqueueInternal(const StableEventDTOCreate& obj);
+
+  void DeleteEventInternal(int64_t id);
+
+  void DeleteTransferJobsByQueueIdInternal(int64_t id);
+
+public:
+  InMemoryEventQueueStore() :
+    nextId_(1)
+  {
+  }
+
+  virtual int64_t Enqueue(const StableEventDTOCreate& obj) ORTHANC_OVERRIDE;
+
+  virtual void EnqueueBatch(const std::list<StableEventDTOCreate>& objs,
+                            std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual void GetDueBatch(const std::list<std::string>& appTypes,
+                           bool included,
+                           int maxRetry,
+                           int limit,
+                           std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool Complete(int64_t id) ORTHANC_OVERRIDE;
+
+  virtual bool Fail(const StableEventDTOUpdate& obj) ORTHANC_OVERRIDE;
+
+  virtual bool Reschedule(const StableEventDTOUpdate& obj) ORTHANC_OVERRIDE;
+
+  virtual void List(const Pagination& page,
+                    const StableEventFilter& filter,
+                    std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool GetById(int64_t id, StableEventDTOGet& result) ORTHANC_OVERRIDE;
+
+  virtual bool GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteEventByIds(const std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool ResetEvents(const std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual void SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteTransferJobByIds(const std::list<std::string>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteTransferJobsByQueueId(int64_t id) ORTHANC_OVERRIDE;
+
+  virtual bool GetById(const std::string& id, TransferJobDTOGet& result) ORTHANC_OVERRIDE;
+
+  virtual bool GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual void GetStatistics(Json::Value& stats) ORTHANC_OVERRIDE;
+
+  // Used by the persistent backends that rebuild their index from disk
+  void Restore(const StableEventDTOGet& event);
+
+  void Restore(const TransferJobDTOGet& job);
+
+  int64_t GetNextId();
+
+  void SetNextId(int64_t id);
+
+  void GetAll(std::list<StableEventDTOGet>& events,
+              std::list<TransferJobDTOGet>& jobs);
+
+  size_t GetSize();
+};
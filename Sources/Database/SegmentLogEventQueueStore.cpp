@@ -0,0 +1,947 @@
+#include "SegmentLogEventQueueStore.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <stdio.h>
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+static const uint32_t RECORD_MAGIC = 0x53414f4c;  // "SAOL"
+static const size_t RECORDS_PER_SEGMENT = 65536;  // 32MB per segment
+static const unsigned int COMPACTION_INTERVAL_SECONDS = 30;
+
+enum RecordType
+{
+  RecordType_Event = 1,               // Full state of an event (enqueue, failure, reset)
+  RecordType_EventTombstone = 2,      // Event acknowledged or deleted, along with its jobs
+  RecordType_Clear = 3,               // All the events and jobs deleted
+  RecordType_TransferJob = 4,         // Full state of a transfer job
+  RecordType_TransferJobTombstone = 5,
+  RecordType_TransferJobsOfEventTombstone = 6,
+  RecordType_Sequence = 7             // Next event identifier, written by the compaction
+};
+
+struct SegmentLogEventQueueStore::Record
+{
+  uint32_t magic_;
+  uint32_t checksum_;  // CRC-32 of all the bytes following this field
+  uint32_t type_;
+  int32_t  delay_sec_;
+  int32_t  retry_;
+  uint32_t reserved_;
+  int64_t  id_;
+  char     iuid_[80];
+  char     resource_id_[64];
+  char     resource_type_[16];
+  char     app_id_[64];
+  char     app_type_[32];
+  char     last_updated_time_[24];
+  char     creation_time_[24];
+  char     text_[176];   // Failed reason of an event, or identifier of a transfer job
+};
+
+static_assert(sizeof(SegmentLogEventQueueStore::Record) == 512, "Unexpected layout of the segment log records");
+
+static const size_t SEGMENT_SIZE = RECORDS_PER_SEGMENT * sizeof(SegmentLogEventQueueStore::Record);
+
+
+static uint32_t ComputeChecksum(const SegmentLogEventQueueStore::Record& record)
+{
+  boost::crc_32_type crc;
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(&record) + 2 * sizeof(uint32_t);
+  crc.process_bytes(start, sizeof(record) - 2 * sizeof(uint32_t));
+  return crc.checksum();
+}
+
+static void Seal(SegmentLogEventQueueStore::Record& record)
+{
+  record.magic_ = RECORD_MAGIC;
+  record.checksum_ = ComputeChecksum(record);
+}
+
+static void WriteField(char* target,
+                       size_t size,
+                       const std::string& value,
+                       bool truncate)
+{
+  if (value.size() >= size &&
+      !truncate)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Value too long for the segment log: " + value);
+  }
+
+  size_t length = std::min(value.size(), size - 1);
+  memcpy(target, value.c_str(), length);
+  target[length] = '\0';
+}
+
+template <size_t size>
+static std::string ReadField(const char (&field)[size])
+{
+  return std::string(field, strnlen(field, size));
+}
+
+
+class SegmentLogEventQueueStore::Segment : public boost::noncopyable
+{
+private:
+  unsigned int                               number_;
+  std::string                                path_;
+  boost::interprocess::file_mapping          mapping_;
+  boost::interprocess::mapped_region         region_;
+  size_t                                     count_;
+
+  static std::string CreateFile(const std::string& path)
+  {
+    if (!boost::filesystem::exists(path))
+    {
+#if defined(__linux__)
+      // Allocate the blocks of the whole segment before it is mapped:
+      // a full disk must be reported here, and not as a SIGBUS on the
+      // first write through the mapping
+      int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                        "Cannot create the segment of the event queue: " + path);
+      }
+
+      int error = posix_fallocate(fd, 0, SEGMENT_SIZE);
+      close(fd);
+
+      if (error != 0)
+      {
+        boost::system::error_code ec;
+        boost::filesystem::remove(path, ec);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                        "Cannot allocate the segment of the event queue " + path + ": " + strerror(error));
+      }
+#else
+      {
+        std::ofstream f(path.c_str(), std::ios::binary);
+      }
+
+      boost::filesystem::resize_file(path, SEGMENT_SIZE);
+#endif
+    }
+
+    return path;
+  }
+
+public:
+  Segment(unsigned int number,
+          const std::string& path) :
+    number_(number),
+    path_(path),
+    mapping_(CreateFile(path).c_str(), boost::interprocess::read_write),
+    region_(mapping_, boost::interprocess::read_write),
+    count_(0)
+  {
+    if (region_.get_size() < SEGMENT_SIZE)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile,
+                                      "Truncated segment of the event queue: " + path);
+    }
+  }
+
+  unsigned int GetNumber() const
+  {
+    return number_;
+  }
+
+  const std::string& GetPath() const
+  {
+    return path_;
+  }
+
+  size_t GetCount() const
+  {
+    return count_;
+  }
+
+  void SetCount(size_t count)
+  {
+    count_ = count;
+  }
+
+  bool IsFull() const
+  {
+    return count_ >= RECORDS_PER_SEGMENT;
+  }
+
+  const Record& GetRecord(size_t index) const
+  {
+    return reinterpret_cast<const Record*>(region_.get_address())[index];
+  }
+
+  void Append(const Record& record)
+  {
+    assert(!IsFull());
+    memcpy(reinterpret_cast<Record*>(region_.get_address()) + count_, &record, sizeof(Record));
+    count_++;
+  }
+
+  void Flush(bool async)
+  {
+    region_.flush(0, count_ * sizeof(Record), async);
+  }
+};
+
+
+static std::string GetSegmentFilename(unsigned int number)
+{
+  char buf[32];
+  sprintf(buf, "segment-%08u.log", number);
+  return buf;
+}
+
+static bool ParseSegmentFilename(unsigned int& number,
+                                 const std::string& filename)
+{
+  return (filename.size() == 20 &&
+          sscanf(filename.c_str(), "segment-%08u.log", &number) == 1);
+}
+
+static void CheckFits(const char* value,
+                      size_t size)
+{
+  if (strlen(value) >= size)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Value too long for the segment log: " + std::string(value));
+  }
+}
+
+// Checks that the event can be written to the log before it enters the index
+static void CheckFits(const StableEventDTOCreate& obj)
+{
+  typedef SegmentLogEventQueueStore::Record Record;
+  CheckFits(obj.iuid_, sizeof(Record::iuid_));
+  CheckFits(obj.resource_id_, sizeof(Record::resource_id_));
+  CheckFits(obj.resouce_type_, sizeof(Record::resource_type_));
+  CheckFits(obj.app_id_, sizeof(Record::app_id_));
+  CheckFits(obj.app_type_, sizeof(Record::app_type_));
+}
+
+static void ToRecord(SegmentLogEventQueueStore::Record& record,
+                     const StableEventDTOGet& event)
+{
+  record.type_ = RecordType_Event;
+  record.id_ = event.id_;
+  record.delay_sec_ = event.delay_sec_;
+  record.retry_ = event.retry_;
+  WriteField(record.iuid_, sizeof(record.iuid_), event.iuid_, false);
+  WriteField(record.resource_id_, sizeof(record.resource_id_), event.resource_id_, false);
+  WriteField(record.resource_type_, sizeof(record.resource_type_), event.resource_type_, false);
+  WriteField(record.app_id_, sizeof(record.app_id_), event.app_id_, false);
+  WriteField(record.app_type_, sizeof(record.app_type_), event.app_type_, false);
+  WriteField(record.last_updated_time_, sizeof(record.last_updated_time_), event.last_updated_time_, false);
+  WriteField(record.creation_time_, sizeof(record.creation_time_), event.creation_time_, false);
+  WriteField(record.text_, sizeof(record.text_), event.failed_reason_, true);
+}
+
+static void ToRecord(SegmentLogEventQueueStore::Record& record,
+                     const TransferJobDTOGet& job)
+{
+  record.type_ = RecordType_TransferJob;
+  record.id_ = job.queue_id_;
+  WriteField(record.text_, sizeof(record.text_), job.id_, false);
+  WriteField(record.last_updated_time_, sizeof(record.last_updated_time_), job.last_updated_time_, false);
+  WriteField(record.creation_time_, sizeof(record.creation_time_), job.creation_time_, false);
+}
+
+
+SegmentLogEventQueueStore::SegmentLogEventQueueStore() :
+  nextSegment_(0),
+  appendedRecords_(0),
+  running_(false),
+  compactor_(NULL)
+{
+}
+
+SegmentLogEventQueueStore::~SegmentLogEventQueueStore()
+{
+  if (running_)
+  {
+    LOG(ERROR) << "SegmentLogEventQueueStore::Close() should have been manually called";
+    Close();
+  }
+}
+
+void SegmentLogEventQueueStore::OpenNewSegment()
+{
+  boost::filesystem::path path = boost::filesystem::path(directory_) / GetSegmentFilename(nextSegment_);
+  std::unique_ptr<Segment> segment(new Segment(nextSegment_, path.string()));
+
+  if (!segments_.empty())
+  {
+    segments_.back()->Flush(true);
+  }
+
+  segments_.push_back(std::move(segment));
+  nextSegment_++;
+}
+
+void SegmentLogEventQueueStore::Reserve(size_t count)
+{
+  if (segments_.empty() ||
+      segments_.back()->GetCount() + std::min(count, RECORDS_PER_SEGMENT) > RECORDS_PER_SEGMENT)
+  {
+    OpenNewSegment();
+  }
+}
+
+void SegmentLogEventQueueStore::Append(Record& record)
+{
+  if (segments_.empty() ||
+      segments_.back()->IsFull())
+  {
+    OpenNewSegment();
+  }
+
+  Seal(record);
+  segments_.back()->Append(record);
+  appendedRecords_++;
+}
+
+void SegmentLogEventQueueStore::AppendEvent(int64_t id)
+{
+  StableEventDTOGet event;
+  if (index_.GetById(id, event))
+  {
+    Record record;
+    memset(&record, 0, sizeof(record));
+    ToRecord(record, event);
+    Append(record);
+  }
+}
+
+void SegmentLogEventQueueStore::Replay(const Record& record)
+{
+  switch (record.type_)
+  {
+    case RecordType_Event:
+    {
+      StableEventDTOGet event;
+      event.id_ = record.id_;
+      event.iuid_ = ReadField(record.iuid_);
+      event.resource_id_ = ReadField(record.resource_id_);
+      event.resource_type_ = ReadField(record.resource_type_);
+      event.app_id_ = ReadField(record.app_id_);
+      event.app_type_ = ReadField(record.app_type_);
+      event.delay_sec_ = record.delay_sec_;
+      event.retry_ = record.retry_;
+      event.failed_reason_ = ReadField(record.text_);
+      event.last_updated_time_ = ReadField(record.last_updated_time_);
+      event.creation_time_ = ReadField(record.creation_time_);
+      index_.Restore(event);
+      break;
+    }
+
+    case RecordType_EventTombstone:
+      index_.Complete(record.id_);
+      break;
+
+    case RecordType_Clear:
+      index_.DeleteEventByIds(std::list<int64_t>());
+      break;
+
+    case RecordType_TransferJob:
+    {
+      TransferJobDTOGet job;
+      job.id_ = ReadField(record.text_);
+      job.queue_id_ = record.id_;
+      job.last_updated_time_ = ReadField(record.last_updated_time_);
+      job.creation_time_ = ReadField(record.creation_time_);
+      index_.Restore(job);
+      break;
+    }
+
+    case RecordType_TransferJobTombstone:
+      index_.DeleteTransferJobByIds(std::list<std::string>{ReadField(record.text_)});
+      break;
+
+    case RecordType_TransferJobsOfEventTombstone:
+      index_.DeleteTransferJobsByQueueId(record.id_);
+      break;
+
+    case RecordType_Sequence:
+      index_.SetNextId(record.id_);
+      break;
+
+    default:
+      LOG(ERROR) << "[SegmentLogEventQueueStore] Ignoring a record of unknown type " << record.type_;
+      break;
+  }
+}
+
+void SegmentLogEventQueueStore::Recover()
+{
+  std::vector<unsigned int> numbers;
+
+  for (boost::filesystem::directory_iterator it(directory_), end; it != end; ++it)
+  {
+    unsigned int number;
+    if (boost::filesystem::is_regular_file(it->status()) &&
+        ParseSegmentFilename(number, it->path().filename().string()))
+    {
+      numbers.push_back(number);
+    }
+  }
+
+  std::sort(numbers.begin(), numbers.end());
+
+  for (size_t i = 0; i < numbers.size(); i++)
+  {
+    boost::filesystem::path path = boost::filesystem::path(directory_) / GetSegmentFilename(numbers[i]);
+    nextSegment_ = numbers[i] + 1;
+
+    // A segment is only written once all its blocks are allocated: a
+    // shorter one was being created during a crash, and is empty
+    if (boost::filesystem::file_size(path) < SEGMENT_SIZE)
+    {
+      LOG(WARNING) << "[SegmentLogEventQueueStore] Removing the incomplete segment " << path.string();
+      boost::filesystem::remove(path);
+      continue;
+    }
+
+    std::unique_ptr<Segment> segment(new Segment(numbers[i], path.string()));
+
+    // The unused part of a segment is filled with zeros. A record with
+    // a bad checksum is the result of a write interrupted by a crash,
+    // and marks the end of the log as well.
+    size_t count = 0;
+    while (count < RECORDS_PER_SEGMENT)
+    {
+      const Record& record = segment->GetRecord(count);
+      if (record.magic_ != RECORD_MAGIC)
+      {
+        break;
+      }
+
+      if (record.checksum_ != ComputeChecksum(record))
+      {
+        LOG(WARNING) << "[SegmentLogEventQueueStore] Truncating " << segment->GetPath()
+                     << " at record " << count << " (bad checksum)";
+        break;
+      }
+
+      Replay(record);
+      count++;
+    }
+
+    segment->SetCount(count);
+    appendedRecords_ += count;
+    segments_.push_back(std::move(segment));
+  }
+
+  LOG(WARNING) << "[SegmentLogEventQueueStore] Recovered " << index_.GetSize() << " live records out of "
+               << appendedRecords_ << " records in " << segments_.size() << " segment(s) from " << directory_;
+}
+
+bool SegmentLogEventQueueStore::NeedsCompaction()
+{
+  // Compact once the older segments are mostly made of dead records
+  return (segments_.size() >= 2 &&
+          appendedRecords_ > 2 * (index_.GetSize() + 1) + RECORDS_PER_SEGMENT / 2);
+}
+
+void SegmentLogEventQueueStore::Compact()
+{
+  std::list<StableEventDTOGet> events;
+  std::list<TransferJobDTOGet> jobs;
+  int64_t nextId;
+  unsigned int firstSnapshotSegment;
+  uint64_t before;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!NeedsCompaction())
+    {
+      return;
+    }
+
+    // The index is only changed under "mutex_", so this is the state
+    // after the last record of the current segments
+    index_.GetAll(events, jobs);
+    nextId = index_.GetNextId();
+
+    // The snapshot gets the next segment numbers, and the log goes on
+    // after them: the replay order is preserved while the snapshot is
+    // written without the lock. If the process crashes before the
+    // previous segments are removed, replaying them followed by a
+    // part of the snapshot gives the same state.
+    const size_t count = 1 + events.size() + jobs.size();
+    firstSnapshotSegment = nextSegment_;
+    nextSegment_ += static_cast<unsigned int>((count + RECORDS_PER_SEGMENT - 1) / RECORDS_PER_SEGMENT);
+    OpenNewSegment();
+
+    before = appendedRecords_;
+    appendedRecords_ = 0;
+  }
+
+  std::deque<std::unique_ptr<Segment> > snapshot;
+  uint64_t snapshotRecords = 0;
+
+  try
+  {
+    std::list<Record> records;
+
+    {
+      Record record;
+      memset(&record, 0, sizeof(record));
+      record.type_ = RecordType_Sequence;
+      record.id_ = nextId;
+      records.push_back(record);
+    }
+
+    for (const auto& event : events)
+    {
+      Record record;
+      memset(&record, 0, sizeof(record));
+      ToRecord(record, event);
+      records.push_back(record);
+    }
+
+    for (const auto& job : jobs)
+    {
+      Record record;
+      memset(&record, 0, sizeof(record));
+      ToRecord(record, job);
+      records.push_back(record);
+    }
+
+    for (auto& record : records)
+    {
+      if (snapshot.empty() ||
+          snapshot.back()->IsFull())
+      {
+        const unsigned int number = firstSnapshotSegment + static_cast<unsigned int>(snapshot.size());
+        boost::filesystem::path path = boost::filesystem::path(directory_) / GetSegmentFilename(number);
+        snapshot.push_back(std::unique_ptr<Segment>(new Segment(number, path.string())));
+      }
+
+      Seal(record);
+      snapshot.back()->Append(record);
+      snapshotRecords++;
+    }
+
+    for (const auto& segment : snapshot)
+    {
+      segment->Flush(false);
+    }
+  }
+  catch (...)
+  {
+    // The previous segments are kept, the partial snapshot is removed
+    while (!snapshot.empty())
+    {
+      std::string path = snapshot.back()->GetPath();
+      snapshot.pop_back();
+
+      boost::system::error_code ec;
+      boost::filesystem::remove(path, ec);
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      appendedRecords_ += before;
+    }
+
+    throw;
+  }
+
+  std::deque<std::unique_ptr<Segment> > obsolete;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while (segments_.front()->GetNumber() < firstSnapshotSegment)
+    {
+      obsolete.push_back(std::move(segments_.front()));
+      segments_.pop_front();
+    }
+
+    while (!snapshot.empty())
+    {
+      segments_.push_front(std::move(snapshot.back()));
+      snapshot.pop_back();
+    }
+
+    appendedRecords_ += snapshotRecords;
+  }
+
+  for (auto& segment : obsolete)
+  {
+    std::string path = segment->GetPath();
+    segment.reset();  // Unmaps the file before removing it
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+    if (ec)
+    {
+      LOG(ERROR) << "[SegmentLogEventQueueStore] Cannot remove " << path << ": " << ec.message();
+    }
+  }
+
+  LOG(INFO) << "[SegmentLogEventQueueStore] Compacted " << before << " records into " << snapshotRecords;
+}
+
+void SegmentLogEventQueueStore::CompactorWorker()
+{
+  unsigned int elapsed = 0;
+
+  while (running_)
+  {
+    boost::this_thread::sleep(boost::posix_time::seconds(1));
+    elapsed++;
+
+    try
+    {
+      {
+        // Bound the amount of data that could be lost on a power failure
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!segments_.empty())
+        {
+          segments_.back()->Flush(true);
+        }
+      }
+
+      if (elapsed >= COMPACTION_INTERVAL_SECONDS)
+      {
+        elapsed = 0;
+        Compact();
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "[SegmentLogEventQueueStore] Error during compaction: " << e.What();
+    }
+    catch (std::exception& e)
+    {
+      LOG(ERROR) << "[SegmentLogEventQueueStore] Error during compaction: " << e.what();
+    }
+  }
+}
+
+void SegmentLogEventQueueStore::Open(const std::string& directory)
+{
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (running_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    directory_ = directory;
+    boost::filesystem::create_directories(directory_);
+    Recover();
+
+    running_ = true;
+  }
+
+  compactor_ = new boost::thread(&SegmentLogEventQueueStore::CompactorWorker, this);
+}
+
+void SegmentLogEventQueueStore::Close()
+{
+  if (running_.exchange(false))
+  {
+    if (compactor_->joinable())
+    {
+      compactor_->join();
+    }
+    delete compactor_;
+    compactor_ = NULL;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!segments_.empty())
+    {
+      segments_.back()->Flush(false);
+    }
+  }
+}
+
+// In all the methods that change the queue, the room for the records
+// is reserved before the index is changed, and the records that do not
+// depend on the index are appended first: if the log cannot be
+// written, the index is left untouched.
+
+int64_t SegmentLogEventQueueStore::Enqueue(const StableEventDTOCreate& obj)
+{
+  CheckFits(obj);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  Reserve(1);
+
+  int64_t id = index_.Enqueue(obj);
+  AppendEvent(id);
+  return id;
+}
+
+void SegmentLogEventQueueStore::EnqueueBatch(const std::list<StableEventDTOCreate>& objs,
+                                             std::list<int64_t>& ids)
+{
+  // Reject the whole batch before anything is written to the log
+  for (const auto& obj : objs)
+  {
+    CheckFits(obj);
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // The batches larger than a segment are stored one segment at a time
+  std::list<StableEventDTOCreate>::const_iterator it = objs.begin();
+  while (it != objs.end())
+  {
+    std::list<StableEventDTOCreate> chunk;
+    while (it != objs.end() &&
+           chunk.size() < RECORDS_PER_SEGMENT)
+    {
+      chunk.push_back(*it);
+      ++it;
+    }
+
+    Reserve(chunk.size());
+
+    std::list<int64_t> tmp;
+    index_.EnqueueBatch(chunk, tmp);
+
+    for (const auto& id : tmp)
+    {
+      AppendEvent(id);
+    }
+
+    ids.splice(ids.end(), tmp);
+  }
+}
+
+void SegmentLogEventQueueStore::GetDueBatch(const std::list<std::string>& appTypes,
+                                            bool included,
+                                            int maxRetry,
+                                            int limit,
+                                            std::list<StableEventDTOGet>& results)
+{
+  index_.GetDueBatch(appTypes, included, maxRetry, limit, results);
+}
+
+bool SegmentLogEventQueueStore::Complete(int64_t id)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Record record;
+  memset(&record, 0, sizeof(record));
+  record.type_ = RecordType_EventTombstone;
+  record.id_ = id;
+  Append(record);
+
+  index_.Complete(id);
+  return true;
+}
+
+bool SegmentLogEventQueueStore::Fail(const StableEventDTOUpdate& obj)
+{
+  return Reschedule(obj);
+}
+
+bool SegmentLogEventQueueStore::Reschedule(const StableEventDTOUpdate& obj)
+{
+  CheckFits(obj.last_updated_time_, sizeof(Record::last_updated_time_));
+
+  boost::mutex::scoped_lock lock(mutex_);
+  Reserve(1);
+
+  index_.Reschedule(obj);
+  AppendEvent(obj.id_);
+  return true;
+}
+
+void SegmentLogEventQueueStore::List(const Pagination& page,
+                                     const StableEventFilter& filter,
+                                     std::list<StableEventDTOGet>& results)
+{
+  index_.List(page, filter, results);
+}
+
+bool SegmentLogEventQueueStore::GetById(int64_t id, StableEventDTOGet& result)
+{
+  return index_.GetById(id, result);
+}
+
+bool SegmentLogEventQueueStore::GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results)
+{
+  return index_.GetByIds(ids, results);
+}
+
+bool SegmentLogEventQueueStore::DeleteEventByIds(const std::list<int64_t>& ids)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (ids.empty())
+  {
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.type_ = RecordType_Clear;
+    Append(record);
+
+    index_.DeleteEventByIds(ids);
+  }
+  else
+  {
+    for (const auto& id : ids)
+    {
+      Record record;
+      memset(&record, 0, sizeof(record));
+      record.type_ = RecordType_EventTombstone;
+      record.id_ = id;
+      Append(record);
+
+      index_.Complete(id);
+    }
+  }
+
+  return true;
+}
+
+bool SegmentLogEventQueueStore::ResetEvents(const std::list<int64_t>& ids)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::list<int64_t> targets = ids;
+  if (targets.empty())
+  {
+    std::list<StableEventDTOGet> events;
+    std::list<TransferJobDTOGet> jobs;
+    index_.GetAll(events, jobs);
+
+    for (const auto& event : events)
+    {
+      targets.push_back(event.id_);
+    }
+  }
+
+  std::list<int64_t>::const_iterator it = targets.begin();
+  while (it != targets.end())
+  {
+    std::list<int64_t> chunk;
+    while (it != targets.end() &&
+           chunk.size() < RECORDS_PER_SEGMENT)
+    {
+      chunk.push_back(*it);
+      ++it;
+    }
+
+    Reserve(chunk.size());
+    index_.ResetEvents(chunk);
+
+    for (const auto& id : chunk)
+    {
+      AppendEvent(id);
+    }
+  }
+
+  return true;
+}
+
+void SegmentLogEventQueueStore::SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result)
+{
+  CheckFits(dto.id_.c_str(), sizeof(Record::text_));
+
+  boost::mutex::scoped_lock lock(mutex_);
+  Reserve(1);
+
+  index_.SaveTransferJob(dto, result);
+
+  Record record;
+  memset(&record, 0, sizeof(record));
+  ToRecord(record, result);
+  Append(record);
+}
+
+bool SegmentLogEventQueueStore::DeleteTransferJobByIds(const std::list<std::string>& ids)
+{
+  for (const auto& id : ids)
+  {
+    CheckFits(id.c_str(), sizeof(Record::text_));
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (const auto& id : ids)
+  {
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.type_ = RecordType_TransferJobTombstone;
+    WriteField(record.text_, sizeof(record.text_), id, false);
+    Append(record);
+
+    index_.DeleteTransferJobByIds(std::list<std::string>{id});
+  }
+
+  return true;
+}
+
+bool SegmentLogEventQueueStore::DeleteTransferJobsByQueueId(int64_t id)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Record record;
+  memset(&record, 0, sizeof(record));
+  record.type_ = RecordType_TransferJobsOfEventTombstone;
+  record.id_ = id;
+  Append(record);
+
+  index_.DeleteTransferJobsByQueueId(id);
+  return true;
+}
+
+bool SegmentLogEventQueueStore::GetById(const std::string& id, TransferJobDTOGet& result)
+{
+  return index_.GetById(id, result);
+}
+
+bool SegmentLogEventQueueStore::GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results)
+{
+  return index_.GetTransferJobsByByQueueId(id, results);
+}
+
+bool SegmentLogEventQueueStore::GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results)
+{
+  return index_.GetTransferJobsByByQueueIds(ids, results);
+}
+
+void SegmentLogEventQueueStore::GetStatistics(Json::Value& stats)
+{
+  index_.GetStatistics(stats);
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  size_t records = 0;
+  for (const auto& segment : segments_)
+  {
+    records += segment->GetCount();
+  }
+
+  stats["backend"] = "SegmentLog";
+  stats["path"] = directory_;
+  stats["segments"] = Json::Value::UInt64(segments_.size());
+  stats["records"] = Json::Value::UInt64(records);
+  stats["diskSize"] = Json::Value::UInt64(segments_.size() * SEGMENT_SIZE);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "InMemoryEventQueueStore.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+
+#include <boost/thread.hpp>
+
+// Event queue stored as an append-only log of fixed-size records in
+// memory-mapped segment files. Every change of an event or of a
+// transfer job appends a record; acknowledged events are recorded as
+// tombstones. The live state is kept in an InMemoryEventQueueStore,
+// which is rebuilt by replaying the segments at startup. A background
+// thread writes a snapshot of the live state into new segments and
+// removes the older ones once they are mostly made of dead records.
+class SegmentLogEventQueueStore : public IEventQueueStore
+{
+public:
+  struct Record;  // On-disk layout, defined in the .cpp
+
+private:
+  class Segment;
+
+  boost::mutex                             mutex_;   // Protects the log (the index has its own mutex)
+  std::string                              directory_;
+  InMemoryEventQueueStore                  index_;
+  std::deque<std::unique_ptr<Segment> >    segments_;   // Oldest first, the last one is active
+  unsigned int                             nextSegment_;
+  uint64_t                                 appendedRecords_;
+  std::atomic<bool>                        running_;
+  boost::thread*                           compactor_;
+
+  void OpenNewSegment();
+
+  // Opens a new segment if the active one has no room for "count"
+  // records (at most a segment), so that appending them cannot fail
+  void Reserve(size_t count);
+
+  void Append(Record& record);
+
+  void AppendEvent(int64_t id);
+
+  void Replay(const Record& record);
+
+  void Recover();
+
+  bool NeedsCompaction();
+
+  void Compact();
+
+  void CompactorWorker();
+
+public:
+  SegmentLogEventQueueStore();
+
+  virtual ~SegmentLogEventQueueStore();
+
+  void Open(const std::string& directory);
+
+  // Stops the compaction thread and flushes the active segment
+  void Close();
+
+  virtual int64_t Enqueue(const StableEventDTOCreate& obj) ORTHANC_OVERRIDE;
+
+  virtual void EnqueueBatch(const std::list<StableEventDTOCreate>& objs,
+                            std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual void GetDueBatch(const std::list<std::string>& appTypes,
+                           bool included,
+                           int maxRetry,
+                           int limit,
+                           std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool Complete(int64_t id) ORTHANC_OVERRIDE;
+
+  virtual bool Fail(const StableEventDTOUpdate& obj) ORTHANC_OVERRIDE;
+
+  virtual bool Reschedule(const StableEventDTOUpdate& obj) ORTHANC_OVERRIDE;
+
+  virtual void List(const Pagination& page,
+                    const StableEventFilter& filter,
+                    std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool GetById(int64_t id, StableEventDTOGet& result) ORTHANC_OVERRIDE;
+
+  virtual bool GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteEventByIds(const std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool ResetEvents(const std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual void SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteTransferJobByIds(const std::list<std::string>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteTransferJobsByQueueId(int64_t id) ORTHANC_OVERRIDE;
+
+  virtual bool GetById(const std::string& id, TransferJobDTOGet& result) ORTHANC_OVERRIDE;
+
+  virtual bool GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual bool GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results) ORTHANC_OVERRIDE;
+
+  virtual void GetStatistics(Json::Value& stats) ORTHANC_OVERRIDE;
+};
@@ -0,0 +1,118 @@
+#include "DicomBuffer.h"
+
+#include <OrthancException.h>
+
+#include <stdio.h>
+#include <boost/filesystem.hpp>
+
+void DicomBuffer::Clear()
+{
+  content_.clear();
+  region_.reset();
+  mapping_.reset();
+  instance_.reset();
+  memory_.reset();
+  exportedFile_.clear();
+}
+
+void DicomBuffer::MapFile(const std::string& path)
+{
+  Clear();
+
+  mapping_.reset(new boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only));
+  region_.reset(new boost::interprocess::mapped_region(*mapping_, boost::interprocess::read_only));
+  region_->advise(boost::interprocess::mapped_region::advice_sequential);
+}
+
+void DicomBuffer::ReadFile(const std::string& path)
+{
+  Clear();
+
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Cannot open " + path);
+  }
+
+  boost::system::error_code error;
+  const uintmax_t size = boost::filesystem::file_size(path, error);
+
+  if (!error)
+  {
+    content_.resize(size);
+  }
+
+  const size_t read = (content_.empty() ? 0 : fread(&content_[0], 1, content_.size(), fp));
+  const bool atEnd = (fgetc(fp) == EOF);
+  fclose(fp);
+
+  if (error ||
+      read != content_.size() ||
+      !atEnd)
+  {
+    content_.clear();
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "The size of " + path + " changed while it was read");
+  }
+}
+
+void DicomBuffer::SetInstance(OrthancPlugins::DicomInstance* instance)
+{
+  if (instance == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+  }
+
+  Clear();
+  instance_.reset(instance);
+}
+
+void DicomBuffer::SetMemoryBuffer(OrthancPlugins::MemoryBuffer* buffer)
+{
+  if (buffer == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+  }
+
+  Clear();
+  memory_.reset(buffer);
+}
+
+const void* DicomBuffer::GetData() const
+{
+  if (instance_.get() != NULL)
+  {
+    return instance_->GetBuffer();
+  }
+  else if (memory_.get() != NULL)
+  {
+    return memory_->GetData();
+  }
+  else if (region_.get() != NULL)
+  {
+    return region_->get_address();
+  }
+  else
+  {
+    return content_.empty() ? NULL : content_.c_str();
+  }
+}
+
+size_t DicomBuffer::GetSize() const
+{
+  if (instance_.get() != NULL)
+  {
+    return instance_->GetSize();
+  }
+  else if (memory_.get() != NULL)
+  {
+    return memory_->GetSize();
+  }
+  else if (region_.get() != NULL)
+  {
+    return region_->get_size();
+  }
+  else
+  {
+    return content_.size();
+  }
+}
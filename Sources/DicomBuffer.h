@@ -0,0 +1,70 @@
+#pragma once
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <memory>
+#include <string>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/noncopyable.hpp>
+
+// Content of a DICOM file on its way from the storage to the export
+// directory. Depending on how it was read, the bytes are owned in
+// memory, mapped from the source file, or kept in the buffer returned
+// by Orthanc or in the DICOM instance returned by the transcoder, so
+// that they are never copied again.
+class DicomBuffer : public boost::noncopyable
+{
+private:
+  std::string                                           content_;
+  std::unique_ptr<boost::interprocess::file_mapping>    mapping_;
+  std::unique_ptr<boost::interprocess::mapped_region>   region_;
+  std::unique_ptr<OrthancPlugins::DicomInstance>        instance_;
+  std::unique_ptr<OrthancPlugins::MemoryBuffer>         memory_;
+  std::string                                           exportedFile_;
+
+  void Clear();
+
+public:
+  // Filled by the caller
+  std::string& GetContent()
+  {
+    return content_;
+  }
+
+  // The source file must not be modified while the buffer is alive
+  void MapFile(const std::string& path);
+
+  // Reads the file in memory. Unlike MapFile(), the file can be
+  // modified meanwhile: ErrorCode_CorruptedFile is thrown if its size
+  // changes during the read.
+  void ReadFile(const std::string& path);
+
+  // Takes the ownership of a transcoded instance
+  void SetInstance(OrthancPlugins::DicomInstance* instance);
+
+  // Takes the ownership of a buffer allocated by Orthanc
+  void SetMemoryBuffer(OrthancPlugins::MemoryBuffer* buffer);
+
+  const void* GetData() const;
+
+  size_t GetSize() const;
+
+  bool IsMapped() const
+  {
+    return region_.get() != NULL;
+  }
+
+  // A file with the same content, written by another export, that can
+  // be copied instead of writing the buffer. Empty if none.
+  void SetExportedFile(const std::string& path)
+  {
+    exportedFile_ = path;
+  }
+
+  const std::string& GetExportedFile() const
+  {
+    return exportedFile_;
+  }
+};
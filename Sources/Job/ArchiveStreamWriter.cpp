@@ -0,0 +1,662 @@
+#include "ArchiveStreamWriter.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <zlib.h>
+
+#if defined(__linux__)
+#  include <unistd.h>
+#endif
+
+// The entries are accumulated up to this size before being written
+static const size_t BUFFER_SIZE = 8 * 1024 * 1024;
+
+static const size_t TAR_BLOCK_SIZE = 512;
+
+static const uint32_t ZIP32_LIMIT = 0xffffffffu;
+static const uint16_t ZIP16_LIMIT = 0xffffu;
+
+namespace Saola
+{
+  const char* EnumerationToString(ArchiveFormat format)
+  {
+    switch (format)
+    {
+      case ArchiveFormat_Directory:
+        return "Directory";
+
+      case ArchiveFormat_Tar:
+        return "Tar";
+
+      case ArchiveFormat_Zip:
+        return "Zip";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+  ArchiveFormat StringToArchiveFormat(const std::string& format)
+  {
+    if (format == "Directory")
+    {
+      return ArchiveFormat_Directory;
+    }
+    else if (format == "Tar")
+    {
+      return ArchiveFormat_Tar;
+    }
+    else if (format == "Zip")
+    {
+      return ArchiveFormat_Zip;
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                      "Unknown archive format (must be \"Directory\", \"Tar\" or \"Zip\"): " + format);
+    }
+  }
+
+  namespace
+  {
+    void Put16(std::string& target, uint16_t value)
+    {
+      target.push_back(static_cast<char>(value & 0xff));
+      target.push_back(static_cast<char>(value >> 8));
+    }
+
+    void Put32(std::string& target, uint32_t value)
+    {
+      Put16(target, static_cast<uint16_t>(value & 0xffff));
+      Put16(target, static_cast<uint16_t>(value >> 16));
+    }
+
+    void Put64(std::string& target, uint64_t value)
+    {
+      Put32(target, static_cast<uint32_t>(value & 0xffffffffu));
+      Put32(target, static_cast<uint32_t>(value >> 32));
+    }
+
+    uint32_t ComputeCrc32(const void* data, size_t size)
+    {
+      const Bytef* p = reinterpret_cast<const Bytef*>(data);
+      uLong crc = crc32(0L, Z_NULL, 0);
+
+      while (size > 0)
+      {
+        const uInt chunk = static_cast<uInt>(std::min<size_t>(size, 1024 * 1024 * 1024));
+        crc = crc32(crc, p, chunk);
+        p += chunk;
+        size -= chunk;
+      }
+
+      return static_cast<uint32_t>(crc);
+    }
+
+    // Raw deflate stream (ZIP entries), or gzip member (tar archives)
+    void Deflate(std::string& target,
+                 const void* data,
+                 size_t size,
+                 uint8_t level,
+                 bool gzip)
+    {
+      z_stream stream;
+      memset(&stream, 0, sizeof(stream));
+
+      if (deflateInit2(&stream, level, Z_DEFLATED, gzip ? MAX_WBITS + 16 : -MAX_WBITS,
+                       8, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "Cannot initialize zlib");
+      }
+
+      static const size_t CHUNK = 256 * 1024;
+
+      target.clear();
+      target.reserve(std::min<size_t>(deflateBound(&stream, static_cast<uLong>(size)), size + CHUNK));
+
+      const Bytef* p = reinterpret_cast<const Bytef*>(data);
+      size_t remaining = size;
+      int flush;
+
+      do
+      {
+        const size_t input = std::min<size_t>(remaining, 1024 * 1024 * 1024);
+        stream.next_in = const_cast<Bytef*>(p);
+        stream.avail_in = static_cast<uInt>(input);
+        p += input;
+        remaining -= input;
+        flush = (remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+
+        do
+        {
+          const size_t position = target.size();
+          target.resize(position + CHUNK);
+          stream.next_out = reinterpret_cast<Bytef*>(&target[position]);
+          stream.avail_out = static_cast<uInt>(CHUNK);
+
+          if (deflate(&stream, flush) == Z_STREAM_ERROR)
+          {
+            deflateEnd(&stream);
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "Error in zlib");
+          }
+
+          target.resize(position + CHUNK - stream.avail_out);
+        }
+        while (stream.avail_out == 0);
+      }
+      while (flush != Z_FINISH);
+
+      deflateEnd(&stream);
+    }
+
+    void FormatOctal(char* target,
+                     size_t width,
+                     uint64_t value)
+    {
+      // "width - 1" digits, followed by '\0'
+      for (size_t i = width - 1; i > 0; i--)
+      {
+        target[i - 1] = static_cast<char>('0' + (value & 7));
+        value >>= 3;
+      }
+
+      target[width - 1] = '\0';
+    }
+
+    void FormatTarHeader(std::string& target,
+                         const std::string& name,
+                         char type,
+                         uint64_t size)
+    {
+      char header[TAR_BLOCK_SIZE];
+      memset(header, 0, sizeof(header));
+
+      memcpy(header, name.c_str(), std::min<size_t>(name.size(), 100));
+      FormatOctal(header + 100, 8, 0644);  // Mode
+      FormatOctal(header + 108, 8, 0);     // Owner
+      FormatOctal(header + 116, 8, 0);     // Group
+
+      if (size < (static_cast<uint64_t>(1) << 33))
+      {
+        FormatOctal(header + 124, 12, size);
+      }
+      else
+      {
+        // GNU base-256 encoding of the files of 8GB or more
+        header[124] = static_cast<char>(0x80);
+        for (size_t i = 0; i < 8; i++)
+        {
+          header[135 - i] = static_cast<char>((size >> (8 * i)) & 0xff);
+        }
+      }
+
+      FormatOctal(header + 136, 12, static_cast<uint64_t>(time(NULL)));
+      header[156] = type;
+      memcpy(header + 257, "ustar", 6);
+      memcpy(header + 263, "00", 2);
+
+      // The checksum is computed with the checksum field set to spaces
+      memset(header + 148, ' ', 8);
+
+      unsigned int checksum = 0;
+      for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+      {
+        checksum += static_cast<unsigned char>(header[i]);
+      }
+
+      FormatOctal(header + 148, 7, checksum);
+      header[155] = ' ';
+
+      target.append(header, TAR_BLOCK_SIZE);
+    }
+
+    void PadTarBlock(std::string& target)
+    {
+      const size_t padding = (TAR_BLOCK_SIZE - target.size() % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+      target.append(padding, '\0');
+    }
+  }
+
+  ArchiveStreamWriter::ArchiveStreamWriter(const std::string& path,
+                                           ArchiveFormat format,
+                                           uint8_t compressionLevel,
+                                           bool isZip64) :
+    format_(format),
+    compressionLevel_(std::min<uint8_t>(compressionLevel, 9)),
+    isZip64_(isZip64),
+    path_(path),
+    temporaryPath_(path + ".tmp"),
+    file_(NULL),
+    size_(0),
+    writesCount_(0),
+    nextIndex_(0),
+    dosTime_(0),
+    dosDate_(0)
+  {
+    if (format_ != ArchiveFormat_Tar &&
+        format_ != ArchiveFormat_Zip)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    const boost::filesystem::path parent = boost::filesystem::path(path_).parent_path();
+    if (!parent.empty())
+    {
+      boost::filesystem::create_directories(parent);
+    }
+
+    file_ = fopen(temporaryPath_.c_str(), "wb");
+    if (file_ == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot create the archive " + temporaryPath_);
+    }
+
+    // The buffers are already large, each fwrite() is a single write
+    setvbuf(file_, NULL, _IONBF, 0);
+
+    const time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    dosTime_ = static_cast<uint16_t>((local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2));
+    dosDate_ = static_cast<uint16_t>(((std::max(local.tm_year, 80) - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday);
+  }
+
+  ArchiveStreamWriter::~ArchiveStreamWriter()
+  {
+    if (file_ != NULL)
+    {
+      // Not closed: the archive is incomplete
+      fclose(file_);
+
+      boost::system::error_code error;
+      boost::filesystem::remove(temporaryPath_, error);
+    }
+  }
+
+  void ArchiveStreamWriter::FlushBuffer()
+  {
+    if (!buffer_.empty())
+    {
+      if (fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot write the archive " + temporaryPath_);
+      }
+
+      writesCount_++;
+      buffer_.clear();
+    }
+  }
+
+  void ArchiveStreamWriter::Append(const std::string& block)
+  {
+    // The mutex must be locked
+    if (file_ == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    buffer_.append(block);
+    size_ += block.size();
+
+    if (buffer_.size() >= BUFFER_SIZE)
+    {
+      FlushBuffer();
+    }
+  }
+
+  void ArchiveStreamWriter::Commit(size_t index,
+                                   PendingEntry& entry)
+  {
+    // The mutex must be locked
+    if (index < nextIndex_ ||
+        pending_.find(index) != pending_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
+                                      "The archive entry " + boost::lexical_cast<std::string>(index) + " was already given");
+    }
+
+    PendingEntry& stored = pending_[index];
+    stored.skipped_ = entry.skipped_;
+    stored.block_.swap(entry.block_);
+    stored.entry_ = entry.entry_;
+    stored.owner_.swap(entry.owner_);
+
+    while (!pending_.empty() &&
+           pending_.begin()->first == nextIndex_)
+    {
+      PendingEntry& next = pending_.begin()->second;
+
+      if (!next.skipped_)
+      {
+        if (format_ == ArchiveFormat_Zip)
+        {
+          next.entry_.offset_ = size_;
+          entries_.push_back(next.entry_);
+        }
+
+        Append(next.block_);
+      }
+
+      pending_.erase(pending_.begin());
+      nextIndex_++;
+    }
+  }
+
+  void ArchiveStreamWriter::FormatTarEntry(std::string& target,
+                                           const std::string& name,
+                                           const void* data,
+                                           size_t size) const
+  {
+    target.clear();
+    target.reserve(3 * TAR_BLOCK_SIZE + size);
+
+    if (name.size() > 100)
+    {
+      // GNU extension for the long names
+      FormatTarHeader(target, "././@LongLink", 'L', name.size() + 1);
+      target.append(name.c_str(), name.size() + 1);
+      PadTarBlock(target);
+    }
+
+    FormatTarHeader(target, name, '0', size);
+    target.append(reinterpret_cast<const char*>(data), size);
+    PadTarBlock(target);
+  }
+
+  void ArchiveStreamWriter::AddEntry(size_t index,
+                                     const std::string& name,
+                                     const void* data,
+                                     size_t size,
+                                     const boost::shared_ptr<void>& owner)
+  {
+    if (size > 0 &&
+        data == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    PendingEntry pending;
+    pending.owner_ = owner;
+
+    // The compression is done outside of the mutex, by the calling thread
+    if (format_ == ArchiveFormat_Tar)
+    {
+      std::string& block = pending.block_;
+      FormatTarEntry(block, name, data, size);
+
+      if (compressionLevel_ > 0)
+      {
+        std::string compressed;
+        Deflate(compressed, block.data(), block.size(), compressionLevel_, true);
+        block.swap(compressed);
+      }
+    }
+    else
+    {
+      CentralEntry& entry = pending.entry_;
+      entry.name_ = name;
+      entry.crc32_ = ComputeCrc32(data, size);
+      entry.method_ = 0;  // Stored
+      entry.uncompressedSize_ = size;
+
+      std::string compressed;
+      if (compressionLevel_ > 0)
+      {
+        Deflate(compressed, data, size, compressionLevel_, false);
+        if (compressed.size() < size)
+        {
+          entry.method_ = 8;  // Deflated
+        }
+      }
+
+      entry.compressedSize_ = (entry.method_ == 8 ? compressed.size() : size);
+
+      const bool zip64 = (entry.compressedSize_ >= ZIP32_LIMIT ||
+                          entry.uncompressedSize_ >= ZIP32_LIMIT);
+      if (zip64 && !isZip64_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "ZIP64 is required for the entry " + name);
+      }
+
+      std::string& block = pending.block_;
+      block.reserve(64 + name.size() + entry.compressedSize_);
+      Put32(block, 0x04034b50);
+      Put16(block, zip64 ? 45 : 20);     // Version needed to extract
+      Put16(block, 0x0800);              // UTF-8 names
+      Put16(block, entry.method_);
+      Put16(block, dosTime_);
+      Put16(block, dosDate_);
+      Put32(block, entry.crc32_);
+      Put32(block, zip64 ? ZIP32_LIMIT : static_cast<uint32_t>(entry.compressedSize_));
+      Put32(block, zip64 ? ZIP32_LIMIT : static_cast<uint32_t>(entry.uncompressedSize_));
+      Put16(block, static_cast<uint16_t>(name.size()));
+      Put16(block, zip64 ? 20 : 0);      // Extra field
+      block.append(name);
+
+      if (zip64)
+      {
+        Put16(block, 0x0001);
+        Put16(block, 16);
+        Put64(block, entry.uncompressedSize_);
+        Put64(block, entry.compressedSize_);
+      }
+
+      if (entry.method_ == 8)
+      {
+        block.append(compressed);
+      }
+      else
+      {
+        block.append(reinterpret_cast<const char*>(data), size);
+      }
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    Commit(index, pending);
+  }
+
+  void ArchiveStreamWriter::SkipEntry(size_t index)
+  {
+    PendingEntry pending;
+    pending.skipped_ = true;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    Commit(index, pending);
+  }
+
+  void ArchiveStreamWriter::CloseZip(std::string& target)
+  {
+    const uint64_t directoryOffset = size_;
+
+    for (size_t i = 0; i < entries_.size(); i++)
+    {
+      const CentralEntry& entry = entries_[i];
+
+      std::string extra;
+      if (entry.uncompressedSize_ >= ZIP32_LIMIT)
+      {
+        Put64(extra, entry.uncompressedSize_);
+      }
+
+      if (entry.compressedSize_ >= ZIP32_LIMIT)
+      {
+        Put64(extra, entry.compressedSize_);
+      }
+
+      if (entry.offset_ >= ZIP32_LIMIT)
+      {
+        Put64(extra, entry.offset_);
+      }
+
+      if (!extra.empty())
+      {
+        if (!isZip64_)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "ZIP64 is required for archives larger than 4GB");
+        }
+
+        std::string header;
+        Put16(header, 0x0001);
+        Put16(header, static_cast<uint16_t>(extra.size()));
+        extra = header + extra;
+      }
+
+      Put32(target, 0x02014b50);
+      Put16(target, (3 << 8) | 45);      // Made by: Unix
+      Put16(target, extra.empty() ? 20 : 45);
+      Put16(target, 0x0800);
+      Put16(target, entry.method_);
+      Put16(target, dosTime_);
+      Put16(target, dosDate_);
+      Put32(target, entry.crc32_);
+      Put32(target, static_cast<uint32_t>(std::min<uint64_t>(entry.compressedSize_, ZIP32_LIMIT)));
+      Put32(target, static_cast<uint32_t>(std::min<uint64_t>(entry.uncompressedSize_, ZIP32_LIMIT)));
+      Put16(target, static_cast<uint16_t>(entry.name_.size()));
+      Put16(target, static_cast<uint16_t>(extra.size()));
+      Put16(target, 0);                  // Comment
+      Put16(target, 0);                  // Disk
+      Put16(target, 0);                  // Internal attributes
+      Put32(target, 0100644u << 16);     // External attributes
+      Put32(target, static_cast<uint32_t>(std::min<uint64_t>(entry.offset_, ZIP32_LIMIT)));
+      target.append(entry.name_);
+      target.append(extra);
+    }
+
+    const uint64_t directorySize = target.size();
+    const uint64_t count = entries_.size();
+
+    if (count >= ZIP16_LIMIT ||
+        directoryOffset >= ZIP32_LIMIT ||
+        directorySize >= ZIP32_LIMIT)
+    {
+      if (!isZip64_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "ZIP64 is required for this archive");
+      }
+
+      const uint64_t zip64EndOffset = directoryOffset + directorySize;
+
+      // ZIP64 end of central directory record
+      Put32(target, 0x06064b50);
+      Put64(target, 44);
+      Put16(target, (3 << 8) | 45);
+      Put16(target, 45);
+      Put32(target, 0);
+      Put32(target, 0);
+      Put64(target, count);
+      Put64(target, count);
+      Put64(target, directorySize);
+      Put64(target, directoryOffset);
+
+      // ZIP64 end of central directory locator
+      Put32(target, 0x07064b50);
+      Put32(target, 0);
+      Put64(target, zip64EndOffset);
+      Put32(target, 1);
+    }
+
+    Put32(target, 0x06054b50);
+    Put16(target, 0);
+    Put16(target, 0);
+    Put16(target, static_cast<uint16_t>(std::min<uint64_t>(count, ZIP16_LIMIT)));
+    Put16(target, static_cast<uint16_t>(std::min<uint64_t>(count, ZIP16_LIMIT)));
+    Put32(target, static_cast<uint32_t>(std::min<uint64_t>(directorySize, ZIP32_LIMIT)));
+    Put32(target, static_cast<uint32_t>(std::min<uint64_t>(directoryOffset, ZIP32_LIMIT)));
+    Put16(target, 0);
+  }
+
+  void ArchiveStreamWriter::Close()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (file_ == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    if (!pending_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
+                                      "The archive entry " + boost::lexical_cast<std::string>(nextIndex_) + " is missing");
+    }
+
+    std::string tail;
+
+    if (format_ == ArchiveFormat_Tar)
+    {
+      tail.assign(2 * TAR_BLOCK_SIZE, '\0');  // End of archive
+
+      if (compressionLevel_ > 0)
+      {
+        std::string compressed;
+        Deflate(compressed, tail.data(), tail.size(), compressionLevel_, true);
+        tail.swap(compressed);
+      }
+    }
+    else
+    {
+      CloseZip(tail);
+    }
+
+    Append(tail);
+    FlushBuffer();
+
+    bool success = (fflush(file_) == 0);
+
+#if defined(__linux__)
+    success = (success && fsync(fileno(file_)) == 0);
+#endif
+
+    success = (fclose(file_) == 0 && success);
+    file_ = NULL;
+
+    if (!success)
+    {
+      boost::system::error_code error;
+      boost::filesystem::remove(temporaryPath_, error);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot write the archive " + temporaryPath_);
+    }
+
+    boost::filesystem::rename(temporaryPath_, path_);
+
+    LOG(INFO) << "[ArchiveStreamWriter] Closed " << path_ << ": " << size_ << " bytes in "
+              << writesCount_ << " writes";
+  }
+
+  uint64_t ArchiveStreamWriter::GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_;
+  }
+
+  uint64_t ArchiveStreamWriter::GetWritesCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return writesCount_;
+  }
+
+  std::string ArchiveStreamWriter::GetExtension(ArchiveFormat format,
+                                                uint8_t compressionLevel)
+  {
+    switch (format)
+    {
+      case ArchiveFormat_Directory:
+        return "";
+
+      case ArchiveFormat_Tar:
+        return (compressionLevel > 0 ? ".tar.gz" : ".tar");
+
+      case ArchiveFormat_Zip:
+        return ".zip";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Saola
+{
+  enum ArchiveFormat
+  {
+    ArchiveFormat_Directory,  // One file per instance
+    ArchiveFormat_Tar,        // Compressed as ".tar.gz" if the compression level is > 0
+    ArchiveFormat_Zip
+  };
+
+  const char* EnumerationToString(ArchiveFormat format);
+
+  ArchiveFormat StringToArchiveFormat(const std::string& format);
+
+  // Streams a tar or ZIP archive into a single file. The entries can
+  // be added concurrently: each one is compressed by the calling
+  // thread, then appended to a large buffer that is written
+  // sequentially, so that the storage sees a few large writes instead
+  // of one file creation per entry. The entries are numbered by the
+  // caller: an entry that is compressed before the previous ones is
+  // kept in memory until they are appended, so that the layout of the
+  // archive follows the numbering, whatever the order of completion.
+  // The compressed tar archives are made of one gzip member per entry,
+  // which is a valid ".tar.gz".
+  // The archive is written to a temporary file, which is renamed by
+  // Close(): an interrupted export never leaves a truncated archive.
+  class ArchiveStreamWriter : public boost::noncopyable
+  {
+  private:
+    struct CentralEntry
+    {
+      std::string name_;
+      uint32_t crc32_;
+      uint16_t method_;
+      uint64_t compressedSize_;
+      uint64_t uncompressedSize_;
+      uint64_t offset_;
+    };
+
+    // Entry that cannot be appended before the previous ones
+    struct PendingEntry
+    {
+      bool skipped_;
+      std::string block_;
+      CentralEntry entry_;  // Only for ZIP
+      boost::shared_ptr<void> owner_;  // Released once the entry is appended
+
+      PendingEntry() : skipped_(false),
+                       entry_()
+      {
+      }
+    };
+
+    typedef std::map<size_t, PendingEntry> PendingEntries;
+
+    ArchiveFormat format_;
+    uint8_t compressionLevel_;
+    bool isZip64_;
+    std::string path_;
+    std::string temporaryPath_;
+    FILE* file_;
+
+    boost::mutex mutex_;
+    std::string buffer_;                  // Not written yet
+    uint64_t size_;                       // Of the archive, including "buffer_"
+    uint64_t writesCount_;
+    std::vector<CentralEntry> entries_;   // ZIP central directory
+    size_t nextIndex_;                    // Of the next entry to append
+    PendingEntries pending_;              // Entries after "nextIndex_"
+    uint16_t dosTime_;                    // Modification time of the ZIP entries
+    uint16_t dosDate_;
+
+    void Append(const std::string& block);
+
+    void FlushBuffer();
+
+    // Appends the entry, then the following ones that were pending.
+    // The block is swapped. The mutex must be locked.
+    void Commit(size_t index,
+                PendingEntry& entry);
+
+    void FormatTarEntry(std::string& target,
+                        const std::string& name,
+                        const void* data,
+                        size_t size) const;
+
+    void CloseZip(std::string& target);
+
+  public:
+    // "isZip64" allows the ZIP archives larger than 4GB or with more
+    // than 65535 entries, the ZIP64 records are only used if needed
+    ArchiveStreamWriter(const std::string& path,
+                        ArchiveFormat format,
+                        uint8_t compressionLevel,
+                        bool isZip64);
+
+    ~ArchiveStreamWriter();
+
+    // Thread-safe. "name" is the path of the entry in the archive.
+    // "index" is the position of the entry in the archive: each index
+    // from 0 must be given once, to AddEntry() or to SkipEntry().
+    // "owner" is kept until the entry is appended, so that the memory
+    // budget of the caller also bounds the entries that are waiting.
+    void AddEntry(size_t index,
+                  const std::string& name,
+                  const void* data,
+                  size_t size,
+                  const boost::shared_ptr<void>& owner);
+
+    // Thread-safe. The entry at "index" is not part of the archive.
+    void SkipEntry(size_t index);
+
+    void Close();
+
+    uint64_t GetSize();
+
+    uint64_t GetWritesCount();
+
+    // ".tar", ".tar.gz" or ".zip"
+    static std::string GetExtension(ArchiveFormat format,
+                                    uint8_t compressionLevel);
+  };
+}
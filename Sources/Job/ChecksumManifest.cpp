@@ -0,0 +1,329 @@
+#include "ChecksumManifest.h"
+#include "../DicomBuffer.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <nmmintrin.h>
+#  define SAOLA_CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#  define SAOLA_CRC32C_ARMV8 1
+#endif
+
+namespace Saola
+{
+  // Serializes the saves of the jobs that export to the same root
+  static boost::mutex saveMutex;
+
+  namespace
+  {
+    static const uint32_t CRC32C_POLYNOMIAL = 0x82f63b78;  // Castagnoli, reversed
+
+    // Slicing-by-8 tables for the CPUs without CRC32C instructions
+    class Crc32cTables : public boost::noncopyable
+    {
+    private:
+      uint32_t tables_[8][256];
+
+    public:
+      Crc32cTables()
+      {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+          uint32_t crc = i;
+          for (unsigned int bit = 0; bit < 8; bit++)
+          {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : (crc >> 1);
+          }
+
+          tables_[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; i++)
+        {
+          for (unsigned int k = 1; k < 8; k++)
+          {
+            tables_[k][i] = (tables_[k - 1][i] >> 8) ^ tables_[0][tables_[k - 1][i] & 0xff];
+          }
+        }
+      }
+
+      uint32_t Update(uint32_t crc,
+                      const uint8_t *p,
+                      size_t size) const
+      {
+        while (size >= 8)
+        {
+          const uint32_t low = crc ^ (static_cast<uint32_t>(p[0]) |
+                                      static_cast<uint32_t>(p[1]) << 8 |
+                                      static_cast<uint32_t>(p[2]) << 16 |
+                                      static_cast<uint32_t>(p[3]) << 24);
+          crc = (tables_[7][low & 0xff] ^
+                 tables_[6][(low >> 8) & 0xff] ^
+                 tables_[5][(low >> 16) & 0xff] ^
+                 tables_[4][low >> 24] ^
+                 tables_[3][p[4]] ^
+                 tables_[2][p[5]] ^
+                 tables_[1][p[6]] ^
+                 tables_[0][p[7]]);
+          p += 8;
+          size -= 8;
+        }
+
+        while (size > 0)
+        {
+          crc = (crc >> 8) ^ tables_[0][(crc ^ *p) & 0xff];
+          p++;
+          size--;
+        }
+
+        return crc;
+      }
+    };
+
+#if defined(SAOLA_CRC32C_SSE42)
+    __attribute__((target("sse4.2")))
+    uint32_t UpdateHardware(uint32_t crc,
+                            const uint8_t *p,
+                            size_t size)
+    {
+      uint64_t crc64 = crc;
+      while (size >= 8)
+      {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+      }
+
+      crc = static_cast<uint32_t>(crc64);
+      while (size > 0)
+      {
+        crc = _mm_crc32_u8(crc, *p);
+        p++;
+        size--;
+      }
+
+      return crc;
+    }
+
+    bool HasHardware()
+    {
+      static const bool supported = __builtin_cpu_supports("sse4.2");
+      return supported;
+    }
+#elif defined(SAOLA_CRC32C_ARMV8)
+    uint32_t UpdateHardware(uint32_t crc,
+                            const uint8_t *p,
+                            size_t size)
+    {
+      while (size >= 8)
+      {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        size -= 8;
+      }
+
+      while (size > 0)
+      {
+        crc = __crc32cb(crc, *p);
+        p++;
+        size--;
+      }
+
+      return crc;
+    }
+
+    bool HasHardware()
+    {
+      return true;  // Checked at compile time
+    }
+#endif
+  }
+
+  ChecksumManifest::ChecksumManifest(const std::string &root) : root_(root)
+  {
+  }
+
+  const char *ChecksumManifest::GetFilename()
+  {
+    return ".saola-checksums.crc32c";
+  }
+
+  std::string ChecksumManifest::GetRelativePath(const std::string &path) const
+  {
+    boost::filesystem::path relative = boost::filesystem::path(path).lexically_relative(root_);
+    return relative.empty() ? path : relative.generic_string();
+  }
+
+  void ChecksumManifest::Read(Entries &target,
+                              const std::string &path)
+  {
+    target.clear();
+
+    if (!boost::filesystem::is_regular_file(path))
+    {
+      return;
+    }
+
+    std::string content;
+
+    try
+    {
+      Orthanc::SystemToolbox::ReadFile(content, path);
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      LOG(WARNING) << "[ChecksumManifest] Cannot read " << path << ": " << e.What();
+      return;
+    }
+
+    std::vector<std::string> lines;
+    Orthanc::Toolbox::TokenizeString(lines, content, '\n');
+
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+      // "<8 hexadecimal digits>  <path>"
+      unsigned int crc;
+      if (lines[i].size() > 10 &&
+          lines[i].compare(8, 2, "  ") == 0 &&
+          sscanf(lines[i].c_str(), "%8x", &crc) == 1)
+      {
+        target[lines[i].substr(10)] = static_cast<uint32_t>(crc);
+      }
+      else if (!lines[i].empty())
+      {
+        LOG(WARNING) << "[ChecksumManifest] Ignoring the invalid line " << (i + 1) << " of " << path;
+      }
+    }
+  }
+
+  void ChecksumManifest::Load()
+  {
+    boost::filesystem::path path = boost::filesystem::path(root_) / GetFilename();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    Read(entries_, path.string());
+    updates_.clear();
+    removed_.clear();
+  }
+
+  bool ChecksumManifest::HasChecksum(const std::string &path) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.find(GetRelativePath(path)) != entries_.end();
+  }
+
+  void ChecksumManifest::Record(const std::string &path,
+                                uint32_t crc32c)
+  {
+    const std::string relative = GetRelativePath(path);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    entries_[relative] = crc32c;
+    updates_[relative] = crc32c;
+    removed_.erase(relative);
+  }
+
+  void ChecksumManifest::Remove(const std::string &path)
+  {
+    const std::string relative = GetRelativePath(path);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    entries_.erase(relative);
+    updates_.erase(relative);
+    removed_.insert(relative);
+  }
+
+  void ChecksumManifest::Save()
+  {
+    boost::filesystem::path path = boost::filesystem::path(root_) / GetFilename();
+    boost::filesystem::path tmp = path;
+    tmp += ".tmp";
+
+    boost::mutex::scoped_lock saveLock(saveMutex);
+
+    // Merge with the files recorded by the other jobs since Load()
+    Entries merged;
+    Read(merged, path.string());
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      for (Entries::const_iterator it = updates_.begin(); it != updates_.end(); ++it)
+      {
+        merged[it->first] = it->second;
+      }
+
+      for (std::set<std::string>::const_iterator it = removed_.begin(); it != removed_.end(); ++it)
+      {
+        merged.erase(*it);
+      }
+    }
+
+    std::string content;
+    content.reserve(merged.size() * 80);
+
+    size_t count = 0;
+    for (Entries::const_iterator it = merged.begin(); it != merged.end(); ++it)
+    {
+      boost::system::error_code error;
+      if (boost::filesystem::is_regular_file(boost::filesystem::path(root_) / it->first, error))
+      {
+        char crc[16];
+        snprintf(crc, sizeof(crc), "%08x  ", it->second);
+        content += crc;
+        content += it->first;
+        content += '\n';
+        count++;
+      }
+    }
+
+    // Never leave a truncated file behind
+    Orthanc::SystemToolbox::WriteFile(content.c_str(), content.size(), tmp.string(), true);
+    boost::filesystem::rename(tmp, path);
+
+    LOG(INFO) << "[ChecksumManifest] Saved the checksums of " << count << " files in " << path.string();
+  }
+
+  uint32_t ChecksumManifest::ComputeCrc32c(const void *data,
+                                           size_t size)
+  {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+
+#if defined(SAOLA_CRC32C_SSE42) || defined(SAOLA_CRC32C_ARMV8)
+    if (HasHardware())
+    {
+      return ~UpdateHardware(0xffffffffu, p, size);
+    }
+#endif
+
+    static const Crc32cTables tables;
+    return ~tables.Update(0xffffffffu, p, size);
+  }
+
+  uint32_t ChecksumManifest::ComputeFileCrc32c(const std::string &path)
+  {
+    if (boost::filesystem::file_size(path) == 0)
+    {
+      return ComputeCrc32c(NULL, 0);
+    }
+    else
+    {
+      DicomBuffer buffer;
+      buffer.MapFile(path);
+      return ComputeCrc32c(buffer.GetData(), buffer.GetSize());
+    }
+  }
+}
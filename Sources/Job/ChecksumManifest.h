@@ -0,0 +1,65 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Saola
+{
+  // Lists the CRC32C of the exported files in the root of an export
+  // directory, so that the consumers can verify what they received.
+  // The checksums are computed on the buffers that are written,
+  // without reading the files again. The file has one line per
+  // exported file, in the format of "sha256sum": the checksum in
+  // hexadecimal, two spaces, then the path relative to the root.
+  // Like ExportManifest, it is merged with the file on disk when it
+  // is saved, as several jobs may export to the same root. The jobs
+  // that do not compute the checksums remove the files they write,
+  // so that no stale checksum is left behind.
+  class ChecksumManifest : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, uint32_t> Entries;  // By path relative to the root
+
+    std::string root_;
+    mutable boost::mutex mutex_;
+    Entries entries_;   // Read from the disk, plus the updates
+    Entries updates_;   // Recorded by this job
+    std::set<std::string> removed_;  // Written by this job without checksum
+
+    std::string GetRelativePath(const std::string &path) const;
+
+    static void Read(Entries &target, const std::string &path);
+
+  public:
+    explicit ChecksumManifest(const std::string &root);
+
+    // A missing or corrupted file is considered as empty
+    void Load();
+
+    // "path" is the full path of the exported file
+    bool HasChecksum(const std::string &path) const;
+
+    void Record(const std::string &path,
+                uint32_t crc32c);
+
+    // The file was written again, its checksum is not known anymore
+    void Remove(const std::string &path);
+
+    // Removes the files that do not exist anymore
+    void Save();
+
+    static const char *GetFilename();
+
+    // Uses the CRC32 instructions of SSE 4.2 or ARMv8 if available
+    static uint32_t ComputeCrc32c(const void *data,
+                                  size_t size);
+
+    // Maps the file in memory, for the files that were not loaded
+    static uint32_t ComputeFileCrc32c(const std::string &path);
+  };
+}
@@ -0,0 +1,238 @@
+#include "ExportCoordinator.h"
+
+#include <Logging.h>
+
+#include <cassert>
+#include <set>
+
+namespace Saola
+{
+  ExportCoordinator &ExportCoordinator::Instance()
+  {
+    static ExportCoordinator instance;
+    return instance;
+  }
+
+  std::string ExportCoordinator::GetGroupKey(const std::list<std::string> &resources,
+                                             const std::string &transferSyntax)
+  {
+    std::set<std::string> sorted(resources.begin(), resources.end());
+
+    std::string key = transferSyntax;
+    for (std::set<std::string>::const_iterator it = sorted.begin(); it != sorted.end(); ++it)
+    {
+      key += "|" + *it;
+    }
+
+    return key;
+  }
+
+  void ExportCoordinator::SetBudget(uint64_t budget)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    budget_ = budget;
+  }
+
+  void ExportCoordinator::RemoveBuffer(Entry &entry)
+  {
+    if (entry.dicom_.get() != NULL)
+    {
+      assert(retained_ >= entry.dicom_->GetSize());
+      retained_ -= entry.dicom_->GetSize();
+      entry.dicom_.reset();
+    }
+  }
+
+  void ExportCoordinator::Register(const std::string &group,
+                                   const void *job)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Group &target = groups_[group];
+    target.jobs_[job]++;
+
+    if (target.jobs_.size() > 1)
+    {
+      LOG(INFO) << "[ExportCoordinator] " << target.jobs_.size() << " concurrent exports of the same resources, sharing their instances";
+    }
+  }
+
+  void ExportCoordinator::Unregister(const std::string &group,
+                                     const void *job)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Groups::iterator found = groups_.find(group);
+      if (found == groups_.end() ||
+          found->second.jobs_.find(job) == found->second.jobs_.end())
+      {
+        return;
+      }
+
+      std::map<const void *, unsigned int>::iterator registration = found->second.jobs_.find(job);
+      if (--registration->second == 0)
+      {
+        found->second.jobs_.erase(registration);
+      }
+
+      Entries &entries = found->second.entries_;
+      for (Entries::iterator it = entries.begin(); it != entries.end(); )
+      {
+        if (it->second.loader_ == job ||
+            found->second.jobs_.size() < 2)
+        {
+          // Nobody is left to share this instance with, or its load
+          // was interrupted: the waiting jobs load it by themselves
+          RemoveBuffer(it->second);
+          entries.erase(it++);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+
+      if (found->second.jobs_.empty())
+      {
+        groups_.erase(found);
+      }
+    }
+
+    loaded_.notify_all();
+  }
+
+  ExportCoordinator::Acquisition ExportCoordinator::Acquire(boost::shared_ptr<DicomBuffer> &dicom,
+                                                            std::string &written,
+                                                            const std::string &group,
+                                                            const void *job,
+                                                            const std::string &instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (;;)
+    {
+      Groups::iterator found = groups_.find(group);
+      if (found == groups_.end() ||
+          found->second.jobs_.size() < 2)
+      {
+        return Acquisition_Load;  // This job runs alone
+      }
+
+      Entries::iterator entry = found->second.entries_.find(instanceId);
+      if (entry == found->second.entries_.end())
+      {
+        // First job to need this instance
+        Entry &created = found->second.entries_[instanceId];
+        created.loader_ = job;
+        return Acquisition_Load;
+      }
+      else if (!entry->second.written_.empty())
+      {
+        written = entry->second.written_;
+        return Acquisition_Copy;
+      }
+      else if (entry->second.dicom_.get() != NULL)
+      {
+        dicom = entry->second.dicom_;
+
+        if (entry->second.consumers_ <= 1)
+        {
+          RemoveBuffer(entry->second);  // Every job of the group got it
+        }
+        else
+        {
+          entry->second.consumers_--;
+        }
+
+        return Acquisition_Shared;
+      }
+      else if (entry->second.loader_ == NULL ||
+               entry->second.loader_ == job)
+      {
+        // The buffer was not kept, or this job needs the instance twice
+        entry->second.loader_ = job;
+        return Acquisition_Load;
+      }
+      else
+      {
+        loaded_.wait(lock);  // Another job is loading the instance
+      }
+    }
+  }
+
+  void ExportCoordinator::Publish(const std::string &group,
+                                  const std::string &instanceId,
+                                  const boost::shared_ptr<DicomBuffer> &dicom)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Groups::iterator found = groups_.find(group);
+      if (found != groups_.end())
+      {
+        Entries::iterator entry = found->second.entries_.find(instanceId);
+        if (entry != found->second.entries_.end())
+        {
+          entry->second.loader_ = NULL;
+
+          if (dicom.get() != NULL &&
+              entry->second.dicom_.get() == NULL &&
+              found->second.jobs_.size() > 1 &&
+              retained_ + dicom->GetSize() <= budget_)
+          {
+            entry->second.dicom_ = dicom;
+            entry->second.consumers_ = static_cast<unsigned int>(found->second.jobs_.size() - 1);
+            retained_ += dicom->GetSize();
+          }
+        }
+      }
+    }
+
+    loaded_.notify_all();
+  }
+
+  void ExportCoordinator::Abandon(const std::string &group,
+                                  const std::string &instanceId)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Groups::iterator found = groups_.find(group);
+      if (found != groups_.end())
+      {
+        Entries::iterator entry = found->second.entries_.find(instanceId);
+        if (entry != found->second.entries_.end() &&
+            entry->second.written_.empty())
+        {
+          RemoveBuffer(entry->second);
+          found->second.entries_.erase(entry);
+        }
+      }
+    }
+
+    loaded_.notify_all();
+  }
+
+  void ExportCoordinator::RecordWrittenFile(const std::string &group,
+                                            const std::string &instanceId,
+                                            const std::string &path)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Groups::iterator found = groups_.find(group);
+      if (found != groups_.end() &&
+          found->second.jobs_.size() > 1)
+      {
+        // The file is cheaper to copy than the buffer to write again
+        Entry &entry = found->second.entries_[instanceId];
+        entry.loader_ = NULL;
+        entry.written_ = path;
+        RemoveBuffer(entry);
+      }
+    }
+
+    loaded_.notify_all();
+  }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "../DicomBuffer.h"
+
+#include <list>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Saola
+{
+  // Single-flight deduplication of the export jobs that run at the
+  // same time over the same resources, with the same transcoding
+  // (typically several apps exporting a new study to their own
+  // directory). Such jobs form a group: each instance is loaded and
+  // transcoded by the first job that needs it, then handed to the
+  // other jobs of the group. If the instance was already written by
+  // another job, its file is copied instead (hard link, reflink or
+  // in-kernel copy). Nothing is shared by a job that runs alone.
+  class ExportCoordinator : public boost::noncopyable
+  {
+  public:
+    enum Acquisition
+    {
+      Acquisition_Load,    // The caller loads the instance, then calls Publish() or Abandon()
+      Acquisition_Shared,  // The buffer loaded by another job is returned
+      Acquisition_Copy     // The path of the file written by another job is returned
+    };
+
+  private:
+    struct Entry
+    {
+      const void *loader_;                    // Job loading the instance, NULL once loaded
+      boost::shared_ptr<DicomBuffer> dicom_;  // Kept for the other jobs of the group
+      unsigned int consumers_;                // Jobs of the group that may still need "dicom_"
+      std::string written_;                   // File already written by a job of the group
+
+      Entry() : loader_(NULL),
+                consumers_(0)
+      {
+      }
+    };
+
+    typedef std::map<std::string, Entry> Entries;  // By instance identifier
+
+    struct Group
+    {
+      std::map<const void *, unsigned int> jobs_;
+      Entries entries_;
+    };
+
+    typedef std::map<std::string, Group> Groups;
+
+    boost::mutex mutex_;
+    boost::condition_variable loaded_;
+    Groups groups_;
+    uint64_t budget_;     // Maximum size of the buffers kept for the other jobs
+    uint64_t retained_;
+
+    void RemoveBuffer(Entry &entry);
+
+    ExportCoordinator() : budget_(256 * 1024 * 1024),
+                          retained_(0)
+    {
+    }
+
+  public:
+    static ExportCoordinator &Instance();
+
+    // "resources" and "transferSyntax" (empty if not transcoded)
+    // identify the jobs whose instances are shared
+    static std::string GetGroupKey(const std::list<std::string> &resources,
+                                   const std::string &transferSyntax);
+
+    void SetBudget(uint64_t budget);
+
+    // "job" identifies the caller, it must be unregistered before it
+    // is destroyed. The instances it was loading are given up.
+    void Register(const std::string &group,
+                  const void *job);
+
+    void Unregister(const std::string &group,
+                    const void *job);
+
+    // Waits if another job of the group is loading the instance
+    Acquisition Acquire(boost::shared_ptr<DicomBuffer> &dicom,
+                        std::string &written,
+                        const std::string &group,
+                        const void *job,
+                        const std::string &instanceId);
+
+    // The loaded instance is kept for the other jobs of the group,
+    // within the budget
+    void Publish(const std::string &group,
+                 const std::string &instanceId,
+                 const boost::shared_ptr<DicomBuffer> &dicom);
+
+    void Abandon(const std::string &group,
+                 const std::string &instanceId);
+
+    void RecordWrittenFile(const std::string &group,
+                           const std::string &instanceId,
+                           const std::string &path);
+  };
+}
@@ -0,0 +1,451 @@
+#include "ExportExecutor.h"
+#include "ExporterJob.h"
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+// Maximum duration of one long polling request
+static const unsigned int MAX_WAIT_MS = 30000;
+
+namespace Saola
+{
+  ExportExecutor &ExportExecutor::Instance()
+  {
+    static ExportExecutor instance;
+    return instance;
+  }
+
+  ExportExecutor::~ExportExecutor()
+  {
+    if (running_)
+    {
+      LOG(ERROR) << "ExportExecutor::Stop() should have been manually called";
+      Stop();
+    }
+  }
+
+  const char *ExportExecutor::EnumerationToString(State state)
+  {
+    switch (state)
+    {
+      case State_Pending:
+        return "Pending";
+
+      case State_Running:
+        return "Running";
+
+      case State_Success:
+        return "Success";
+
+      case State_Failure:
+        return "Failure";
+
+      case State_Canceled:
+        return "Canceled";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+  void ExportExecutor::Format(Json::Value &target,
+                              const Export &item) const
+  {
+    target = item.progress_;  // Description, progress and throughput
+    if (target.type() != Json::objectValue)
+    {
+      target = Json::objectValue;
+    }
+
+    target["ID"] = item.id_;
+    target["State"] = EnumerationToString(item.state_);
+    target["Version"] = static_cast<Json::UInt64>(item.version_);
+    target["CreationTime"] = boost::posix_time::to_iso_string(item.creationTime_);
+
+    if (!item.completionTime_.is_not_a_date_time())
+    {
+      target["CompletionTime"] = boost::posix_time::to_iso_string(item.completionTime_);
+    }
+
+    if (item.state_ == State_Success)
+    {
+      target["Progress"] = 1.0;
+      target["Content"] = item.content_;
+    }
+    else if (item.state_ == State_Failure)
+    {
+      target["Error"] = item.error_;
+    }
+  }
+
+  void ExportExecutor::AddFinished(Export &item)
+  {
+    item.completionTime_ = boost::posix_time::second_clock::universal_time();
+    finished_.push_back(item.id_);
+
+    while (finished_.size() > retention_)
+    {
+      exports_.erase(finished_.front());
+      finished_.pop_front();
+    }
+  }
+
+  void ExportExecutor::Finish(Export &item,
+                              State state)
+  {
+    std::unique_ptr<ExporterJob> job;  // Destroyed once the mutex is released, as it joins its threads
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      item.state_ = state;
+      item.version_++;
+      job.swap(item.job_);  // Only the result is kept
+      AddFinished(item);
+    }
+
+    exportChanged_.notify_all();
+  }
+
+  void ExportExecutor::Run(Export &item)
+  {
+    ExporterJob &job = *item.job_;
+
+    try
+    {
+      for (;;)
+      {
+        bool cancel;
+
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          cancel = item.cancel_;
+        }
+
+        if (cancel)
+        {
+          LOG(WARNING) << "[ExportExecutor] Export " << item.id_ << " canceled";
+          job.Stop(OrthancPluginJobStopReason_Canceled);
+          Finish(item, State_Canceled);
+          return;
+        }
+
+        const OrthancPluginJobStepStatus status = job.Step();
+
+        if (status == OrthancPluginJobStepStatus_Continue)
+        {
+          Json::Value progress;
+          job.FormatProgress(progress);
+
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            item.progress_.swap(progress);
+            item.version_++;
+          }
+
+          exportChanged_.notify_all();
+        }
+        else if (status == OrthancPluginJobStepStatus_Success)
+        {
+          job.Stop(OrthancPluginJobStopReason_Success);
+
+          Json::Value content;
+          if (!OrthancPlugins::ReadJson(content, job.GetContent()))
+          {
+            content = Json::objectValue;
+          }
+
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            item.content_.swap(content);
+          }
+
+          LOG(INFO) << "[ExportExecutor] Export " << item.id_ << " completed";
+          Finish(item, State_Success);
+          return;
+        }
+        else
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "The export job has failed");
+        }
+      }
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      LOG(ERROR) << "[ExportExecutor] Export " << item.id_ << " failed: " << e.What();
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        item.error_ = e.What();
+      }
+    }
+    catch (std::exception &e)
+    {
+      LOG(ERROR) << "[ExportExecutor] Export " << item.id_ << " failed: " << e.what();
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        item.error_ = e.what();
+      }
+    }
+
+    try
+    {
+      job.Stop(OrthancPluginJobStopReason_Failure);  // Stops the threads of the job, saves the manifest
+    }
+    catch (...)
+    {
+      LOG(ERROR) << "[ExportExecutor] Cannot stop the export " << item.id_;
+    }
+
+    Finish(item, State_Failure);
+  }
+
+  void ExportExecutor::Worker()
+  {
+    Orthanc::Logging::SetCurrentThreadName("EXPORT-EXECUTOR");
+
+    for (;;)
+    {
+      boost::shared_ptr<Export> item;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (running_ &&
+               queue_.empty())
+        {
+          queueChanged_.wait(lock);
+        }
+
+        if (!running_)
+        {
+          return;
+        }
+
+        Exports::iterator found = exports_.find(queue_.front());
+        queue_.pop_front();
+
+        if (found == exports_.end() ||
+            found->second->state_ != State_Pending)
+        {
+          continue;  // Canceled while pending
+        }
+
+        item = found->second;
+        item->state_ = State_Running;
+        item->version_++;
+      }
+
+      exportChanged_.notify_all();
+
+      Run(*item);
+    }
+  }
+
+  void ExportExecutor::Start(unsigned int threads,
+                             size_t retention)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (running_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    running_ = true;
+    retention_ = retention;
+
+    for (unsigned int i = 0; i < std::max(1u, threads); i++)
+    {
+      threads_.push_back(new boost::thread(&ExportExecutor::Worker, this));
+    }
+
+    LOG(WARNING) << "[ExportExecutor] Started with " << threads_.size() << " threads";
+  }
+
+  void ExportExecutor::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!running_)
+      {
+        return;
+      }
+
+      running_ = false;
+
+      for (Exports::iterator it = exports_.begin(); it != exports_.end(); ++it)
+      {
+        it->second->cancel_ = true;
+      }
+    }
+
+    queueChanged_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i]->joinable())
+      {
+        threads_[i]->join();
+      }
+
+      delete threads_[i];
+    }
+
+    threads_.clear();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // The pending exports are not resumed at the next start. They are
+      // finished in the order of their submission.
+      for (std::deque<std::string>::const_iterator it = queue_.begin(); it != queue_.end(); ++it)
+      {
+        Exports::iterator found = exports_.find(*it);
+        if (found != exports_.end() &&
+            found->second->state_ == State_Pending)
+        {
+          boost::shared_ptr<Export> item = found->second;  // Kept alive if it is evicted
+          item->state_ = State_Canceled;
+          item->version_++;
+          item->job_.reset();
+          AddFinished(*item);
+        }
+      }
+
+      queue_.clear();
+    }
+
+    exportChanged_.notify_all();
+  }
+
+  std::string ExportExecutor::Submit(ExporterJob *job)
+  {
+    std::unique_ptr<ExporterJob> protection(job);
+
+    if (job == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    boost::shared_ptr<Export> item(new Export);
+    item->id_ = Orthanc::Toolbox::GenerateUuid();
+    item->job_.reset(protection.release());
+    item->creationTime_ = boost::posix_time::second_clock::universal_time();
+    item->job_->FormatProgress(item->progress_);
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      exports_[item->id_] = item;
+      queue_.push_back(item->id_);
+    }
+
+    queueChanged_.notify_one();
+
+    LOG(INFO) << "[ExportExecutor] Export " << item->id_ << " submitted";
+    return item->id_;
+  }
+
+  bool ExportExecutor::GetExport(Json::Value &target,
+                                 const std::string &id)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Exports::const_iterator found = exports_.find(id);
+    if (found == exports_.end())
+    {
+      return false;
+    }
+    else
+    {
+      Format(target, *found->second);
+      return true;
+    }
+  }
+
+  bool ExportExecutor::WaitExport(Json::Value &target,
+                                  const std::string &id,
+                                  uint64_t since,
+                                  unsigned int timeoutMs)
+  {
+    const boost::system_time deadline = boost::get_system_time() +
+      boost::posix_time::milliseconds(std::min(timeoutMs, MAX_WAIT_MS));
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Exports::const_iterator found = exports_.find(id);
+    if (found == exports_.end())
+    {
+      return false;
+    }
+
+    // Keeps the export alive if it is removed meanwhile
+    boost::shared_ptr<Export> item = found->second;
+
+    while (item->version_ <= since)
+    {
+      if (!exportChanged_.timed_wait(lock, deadline))
+      {
+        break;  // Timeout, the current state is returned
+      }
+    }
+
+    Format(target, *item);
+    return true;
+  }
+
+  void ExportExecutor::ListExports(Json::Value &target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::arrayValue;
+
+    for (Exports::const_iterator it = exports_.begin(); it != exports_.end(); ++it)
+    {
+      Json::Value item = Json::objectValue;
+      item["ID"] = it->first;
+      item["State"] = EnumerationToString(it->second->state_);
+      item["Progress"] = (it->second->state_ == State_Success ? 1.0 :
+                          it->second->progress_.get("Progress", 0.0).asDouble());
+      target.append(item);
+    }
+  }
+
+  bool ExportExecutor::Cancel(const std::string &id)
+  {
+    bool canceled = false;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Exports::iterator found = exports_.find(id);
+      if (found != exports_.end())
+      {
+        boost::shared_ptr<Export> item = found->second;  // Kept alive if it is evicted
+
+        if (item->state_ == State_Pending)
+        {
+          // Never started, removed from the queue by the workers
+          item->state_ = State_Canceled;
+          item->version_++;
+          item->job_.reset();
+          AddFinished(*item);
+          canceled = true;
+        }
+        else if (item->state_ == State_Running)
+        {
+          item->cancel_ = true;  // Stopped by its worker after the current step
+          canceled = true;
+        }
+      }
+    }
+
+    exportChanged_.notify_all();
+    return canceled;
+  }
+}
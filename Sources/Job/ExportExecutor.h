@@ -0,0 +1,126 @@
+#pragma once
+
+#include <json/value.h>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+namespace Saola
+{
+  class ExporterJob;
+
+  // Runs the exports that are not given to the Orthanc job engine, on
+  // a pool of threads of the plugin instead of the HTTP thread that
+  // received the request. Each export gets an identifier, that the
+  // clients use to follow its progress (possibly by long polling) or
+  // to cancel it. The finished exports are kept for a while, so that
+  // their result can be retrieved.
+  class ExportExecutor : public boost::noncopyable
+  {
+  public:
+    enum State
+    {
+      State_Pending,
+      State_Running,
+      State_Success,
+      State_Failure,
+      State_Canceled
+    };
+
+  private:
+    struct Export
+    {
+      std::string id_;
+      std::unique_ptr<ExporterJob> job_;  // Released once the export is finished
+      State state_;
+      bool cancel_;
+      uint64_t version_;                  // Incremented on each change of "progress_" or "state_"
+      Json::Value progress_;
+      Json::Value content_;               // Result of a successful export
+      std::string error_;
+      boost::posix_time::ptime creationTime_;
+      boost::posix_time::ptime completionTime_;
+
+      Export() : state_(State_Pending),
+                 cancel_(false),
+                 version_(0)
+      {
+      }
+    };
+
+    typedef std::map<std::string, boost::shared_ptr<Export> > Exports;
+
+    boost::mutex mutex_;
+    boost::condition_variable queueChanged_;
+    boost::condition_variable exportChanged_;
+    Exports exports_;
+    std::deque<std::string> queue_;
+    std::list<std::string> finished_;   // Oldest first
+    std::vector<boost::thread *> threads_;
+    bool running_;
+    size_t retention_;
+
+    ExportExecutor() : running_(false),
+                       retention_(100)
+    {
+    }
+
+    // The mutex must be locked
+    void Format(Json::Value &target,
+                const Export &item) const;
+
+    // Evicts the oldest finished exports beyond the retention. The
+    // mutex must be locked.
+    void AddFinished(Export &item);
+
+    void Finish(Export &item,
+                State state);
+
+    void Run(Export &item);
+
+    void Worker();
+
+  public:
+    static ExportExecutor &Instance();
+
+    ~ExportExecutor();
+
+    static const char *EnumerationToString(State state);
+
+    // "retention" is the number of finished exports that are kept
+    void Start(unsigned int threads,
+               size_t retention);
+
+    // Cancels the running and the pending exports
+    void Stop();
+
+    // Takes ownership of the job, returns the identifier of the export
+    std::string Submit(ExporterJob *job);
+
+    bool GetExport(Json::Value &target,
+                   const std::string &id);
+
+    // Waits until the version of the export is greater than "since",
+    // or until the timeout. Returns "false" if the export is unknown.
+    bool WaitExport(Json::Value &target,
+                    const std::string &id,
+                    uint64_t since,
+                    unsigned int timeoutMs);
+
+    void ListExports(Json::Value &target);
+
+    // The export is stopped after its current step. Returns "false" if
+    // the export is unknown or already finished.
+    bool Cancel(const std::string &id);
+  };
+}
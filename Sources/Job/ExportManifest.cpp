@@ -0,0 +1,175 @@
+#include "ExportManifest.h"
+#include "../DicomBuffer.h"
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+static const char *const KEY_VERSION = "Version";
+static const char *const KEY_FILES = "Files";
+static const char *const KEY_SOURCE = "Source";
+static const char *const KEY_SIZE = "Size";
+static const char *const KEY_MD5 = "MD5";
+static const char *const KEY_TRANSFER_SYNTAX = "TransferSyntax";
+
+static const unsigned int MANIFEST_VERSION = 1;
+
+namespace Saola
+{
+  // Serializes the saves of the jobs that export to the same root
+  static boost::mutex saveMutex;
+
+  ExportManifest::ExportManifest(const std::string &root) : root_(root)
+  {
+  }
+
+  const char *ExportManifest::GetFilename()
+  {
+    return ".saola-manifest.json";
+  }
+
+  std::string ExportManifest::GetRelativePath(const std::string &path) const
+  {
+    boost::filesystem::path relative = boost::filesystem::path(path).lexically_relative(root_);
+    return relative.empty() ? path : relative.generic_string();
+  }
+
+  void ExportManifest::Read(Entries &target,
+                            const std::string &path)
+  {
+    target.clear();
+
+    if (!boost::filesystem::is_regular_file(path))
+    {
+      return;
+    }
+
+    std::string content;
+    Json::Value manifest;
+
+    try
+    {
+      Orthanc::SystemToolbox::ReadFile(content, path);
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      LOG(WARNING) << "[ExportManifest] Cannot read " << path << ": " << e.What();
+      return;
+    }
+
+    if (!OrthancPlugins::ReadJson(manifest, content) ||
+        manifest.type() != Json::objectValue ||
+        manifest[KEY_VERSION].asUInt() != MANIFEST_VERSION ||
+        manifest[KEY_FILES].type() != Json::objectValue)
+    {
+      LOG(WARNING) << "[ExportManifest] Ignoring the invalid manifest " << path;
+      return;
+    }
+
+    const Json::Value &files = manifest[KEY_FILES];
+    for (Json::Value::const_iterator it = files.begin(); it != files.end(); ++it)
+    {
+      Entry entry;
+      entry.source_ = (*it)[KEY_SOURCE].asString();
+      entry.size_ = (*it)[KEY_SIZE].asUInt64();
+      entry.md5_ = (*it)[KEY_MD5].asString();
+      entry.transferSyntax_ = (*it)[KEY_TRANSFER_SYNTAX].asString();
+      target[it.name()] = entry;
+    }
+  }
+
+  void ExportManifest::Load()
+  {
+    boost::filesystem::path path = boost::filesystem::path(root_) / GetFilename();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    Read(entries_, path.string());
+    updates_.clear();
+
+    LOG(INFO) << "[ExportManifest] " << entries_.size() << " files recorded in " << path.string();
+  }
+
+  bool ExportManifest::IsUpToDate(const std::string &path,
+                                  const Entry &source) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Entries::const_iterator found = entries_.find(GetRelativePath(path));
+    return (found != entries_.end() &&
+            found->second == source);
+  }
+
+  void ExportManifest::Record(const std::string &path,
+                              const Entry &source)
+  {
+    const std::string relative = GetRelativePath(path);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    entries_[relative] = source;
+    updates_[relative] = source;
+  }
+
+  void ExportManifest::Save()
+  {
+    boost::filesystem::path path = boost::filesystem::path(root_) / GetFilename();
+    boost::filesystem::path tmp = path;
+    tmp += ".tmp";
+
+    boost::mutex::scoped_lock saveLock(saveMutex);
+
+    // Merge with the files recorded by the other jobs since Load()
+    Entries merged;
+    Read(merged, path.string());
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      for (Entries::const_iterator it = updates_.begin(); it != updates_.end(); ++it)
+      {
+        merged[it->first] = it->second;
+      }
+    }
+
+    Json::Value manifest = Json::objectValue;
+    manifest[KEY_VERSION] = MANIFEST_VERSION;
+    manifest[KEY_FILES] = Json::objectValue;
+
+    for (Entries::const_iterator it = merged.begin(); it != merged.end(); ++it)
+    {
+      Json::Value &file = manifest[KEY_FILES][it->first];
+      file[KEY_SOURCE] = it->second.source_;
+      file[KEY_SIZE] = static_cast<Json::UInt64>(it->second.size_);
+      file[KEY_MD5] = it->second.md5_;
+      file[KEY_TRANSFER_SYNTAX] = it->second.transferSyntax_;
+    }
+
+    std::string content;
+    OrthancPlugins::WriteFastJson(content, manifest);
+
+    // Never leave a truncated manifest behind
+    Orthanc::SystemToolbox::WriteFile(content.c_str(), content.size(), tmp.string(), true);
+    boost::filesystem::rename(tmp, path);
+
+    LOG(INFO) << "[ExportManifest] Saved " << merged.size() << " files in " << path.string();
+  }
+
+  void ExportManifest::ComputeFileMD5(std::string &md5,
+                                      const std::string &path)
+  {
+    if (boost::filesystem::file_size(path) == 0)
+    {
+      Orthanc::Toolbox::ComputeMD5(md5, std::string());
+    }
+    else
+    {
+      DicomBuffer buffer;
+      buffer.MapFile(path);
+      Orthanc::Toolbox::ComputeMD5(md5, buffer.GetData(), buffer.GetSize());
+    }
+  }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Saola
+{
+  // Records, in the root of an export directory, the source of each
+  // exported file. A later incremental export of the same resources
+  // skips the files that are recorded with the same source, without
+  // reading them. Several jobs may export to the same root:
+  // the manifest is merged with the file on disk when it is saved.
+  // Removing the manifest forces the comparison of the files.
+  class ExportManifest : public boost::noncopyable
+  {
+  public:
+    struct Entry
+    {
+      std::string source_;          // Instance identifier
+      uint64_t size_;               // Of the source
+      std::string md5_;             // Of the source, empty if unknown
+      std::string transferSyntax_;  // Empty if not transcoded
+
+      Entry() : size_(0)
+      {
+      }
+
+      bool operator==(const Entry &other) const
+      {
+        return (source_ == other.source_ &&
+                size_ == other.size_ &&
+                md5_ == other.md5_ &&
+                transferSyntax_ == other.transferSyntax_);
+      }
+    };
+
+  private:
+    typedef std::map<std::string, Entry> Entries;  // By path relative to the root
+
+    std::string root_;
+    mutable boost::mutex mutex_;
+    Entries entries_;   // Read from the disk, plus the updates
+    Entries updates_;   // Recorded by this job
+
+    std::string GetRelativePath(const std::string &path) const;
+
+    static void Read(Entries &target, const std::string &path);
+
+  public:
+    explicit ExportManifest(const std::string &root);
+
+    // A missing or corrupted manifest is considered as empty
+    void Load();
+
+    // "path" is the full path of the exported file
+    bool IsUpToDate(const std::string &path,
+                    const Entry &source) const;
+
+    void Record(const std::string &path,
+                const Entry &source);
+
+    void Save();
+
+    static const char *GetFilename();
+
+    // MD5 of a file, without loading it in memory
+    static void ComputeFileMD5(std::string &md5,
+                               const std::string &path);
+  };
+}
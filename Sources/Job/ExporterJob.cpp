@@ -1,18 +1,27 @@
 #include "ExporterJob.h"
 #include "../PluginIndex.h"
+#include "../DicomBuffer.h"
 #include "HierarchicalDirWriter.h"
+#include "FileCopy.h"
+#include "ExportManifest.h"
+#include "ChecksumManifest.h"
+#include "ArchiveStreamWriter.h"
+#include "ExportCoordinator.h"
+#include "IoGovernor.h"
 
 #include <Cache/SharedArchive.h>
 #include <Compression/HierarchicalZipWriter.h>
 #include <OrthancException.h>
-#include <MultiThreading/Semaphore.h>
-#include <MultiThreading/SharedMessageQueue.h>
 #include <IDynamicObject.h>
 #include <Logging.h>
 #include <Toolbox.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <boost/range/algorithm/count.hpp>
+#include <boost/thread.hpp>
 
 #include <boost/filesystem.hpp>
 
@@ -35,103 +44,597 @@ static const char *const KEY_DIRECTORY_SIZE_MB = "DirectorySizeMB";
 static const char *const KEY_DIRECTORY_SIZE = "DirectorySize";
 
 static const char* const KEY_RESOURCES = "Resources";
+static const char* const KEY_PIPELINE = "Pipeline";
+static const char* const KEY_THROUGHPUT = "Throughput";
+
+static const char* const KEY_ROOT_DIRECTORY = "RootDirectory";
+static const char* const KEY_LEVEL = "Level";
+static const char* const KEY_EXTENDED_SOP_CLASS = "EnableExtendedSopClass";
+static const char* const KEY_LOADER_THREADS = "LoaderThreads";
+static const char* const KEY_TRANSCODER_THREADS = "TranscoderThreads";
+static const char* const KEY_WRITER_THREADS = "WriterThreads";
+static const char* const KEY_EXPAND_THREADS = "ExpandThreads";
+static const char* const KEY_ZERO_COPY = "ZeroCopy";
+static const char* const KEY_ALLOW_HARDLINK = "AllowHardlink";
+static const char* const KEY_MMAP_THRESHOLD = "MmapThreshold";
+static const char* const KEY_LOADER_MEMORY_BUDGET = "LoaderMemoryBudget";
+static const char* const KEY_STEP_BUDGET_MS = "StepBudgetMs";
+static const char* const KEY_INCREMENTAL = "Incremental";
+static const char* const KEY_ARCHIVE_FORMAT = "ArchiveFormat";
+static const char* const KEY_COMPRESSION_LEVEL = "CompressionLevel";
+static const char* const KEY_DEDUPLICATE = "Deduplicate";
+static const char* const KEY_IO_SHARE = "IoShare";
+static const char* const KEY_CHECKSUMS = "Checksums";
+static const char* const KEY_ARCHIVE = "Archive";
+static const char* const KEY_SKIPPED_FILES = "SkippedFiles";
+static const char* const KEY_CHECKPOINT = "Checkpoint";
+static const char* const KEY_FILES_COUNT = "FilesCount";
+static const char* const KEY_FINGERPRINT = "Fingerprint";
+
+// Minimum delay between two publications of the pipeline statistics in the job content
+static const unsigned int STATISTICS_UPDATE_INTERVAL_MS = 2000;
+
+// Minimum delay between two checkpoints of a running job, each one syncs the files it covers
+static const unsigned int CHECKPOINT_INTERVAL_MS = 30000;
+
+// Number of instances waiting for a transcoder thread, per transcoder thread
+static const size_t TRANSCODE_QUEUE_SIZE_PER_THREAD = 2;
 
 namespace Saola
 {
+  // Busy and idle time of the threads of one stage of the export
+  // pipeline (read, transcode or write), to tell which stage limits
+  // the throughput. A stage whose threads are always busy while the
+  // others are idle should be given more threads.
+  class ExporterJob::StageMetrics : public boost::noncopyable
+  {
+  private:
+    mutable boost::mutex mutex_;
+    unsigned int threads_;
+    uint64_t processed_;
+    uint64_t bytes_;
+    uint64_t busyUs_;
+    uint64_t idleUs_;
+
+  public:
+    class Timer : public boost::noncopyable
+    {
+    private:
+      boost::posix_time::ptime start_;
+
+    public:
+      Timer() : start_(boost::posix_time::microsec_clock::universal_time())
+      {
+      }
+
+      uint64_t GetElapsedUs() const
+      {
+        int64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - start_).total_microseconds();
+        return elapsed > 0 ? static_cast<uint64_t>(elapsed) : 0;
+      }
+    };
+
+    StageMetrics() : threads_(0),
+                     processed_(0),
+                     bytes_(0),
+                     busyUs_(0),
+                     idleUs_(0)
+    {
+    }
+
+    // 0 if the stage runs in the threads of another stage
+    void SetThreads(unsigned int threads)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      threads_ = threads;
+    }
+
+    void AddBusy(const Timer &timer,
+                 uint64_t bytes = 0)
+    {
+      const uint64_t elapsed = timer.GetElapsedUs();
+
+      boost::mutex::scoped_lock lock(mutex_);
+      processed_++;
+      bytes_ += bytes;
+      busyUs_ += elapsed;
+    }
+
+    void AddIdle(const Timer &timer)
+    {
+      const uint64_t elapsed = timer.GetElapsedUs();
+
+      boost::mutex::scoped_lock lock(mutex_);
+      idleUs_ += elapsed;
+    }
+
+    void Format(Json::Value &target) const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      target = Json::objectValue;
+      target["Threads"] = threads_;
+      target["Processed"] = static_cast<Json::UInt64>(processed_);
+      target["Bytes"] = static_cast<Json::UInt64>(bytes_);
+      target["BusySeconds"] = static_cast<double>(busyUs_) / 1000000.0;
+      target["IdleSeconds"] = static_cast<double>(idleUs_) / 1000000.0;
+      target["Utilization"] = (busyUs_ + idleUs_ == 0 ? 0.0 :
+                               static_cast<double>(busyUs_) / static_cast<double>(busyUs_ + idleUs_));
+
+      // Throughput of the stage if its threads were never idle: the
+      // stage with the lowest capacity limits the whole export
+      target["CapacityMBPerSecond"] = (busyUs_ == 0 ? 0.0 :
+                                       static_cast<double>(bytes_) / static_cast<double>(MEGA_BYTES) /
+                                       (static_cast<double>(busyUs_) / 1000000.0) * std::max(1u, threads_));
+    }
+  };
+
   class ExporterJob::InstanceLoader : public boost::noncopyable
   {
   protected:
     bool transcode_;
     Orthanc::DicomTransferSyntax transferSyntax_;
+    uint64_t mmapThreshold_;
+    StageMetrics readStage_;
+    StageMetrics transcodeStage_;
+    std::string group_;       // Of ExportCoordinator, empty if the loads are not shared
+    const void *job_;         // For ExportCoordinator and IoGovernor
+    mutable boost::mutex sharedMutex_;
+    size_t sharedBuffers_;    // Instances loaded by another job
+    size_t sharedFiles_;      // Instances already written by another job
 
   public:
-    explicit InstanceLoader(bool transcode, Orthanc::DicomTransferSyntax transferSyntax)
+    explicit InstanceLoader(bool transcode, Orthanc::DicomTransferSyntax transferSyntax, uint64_t mmapThreshold)
         : transcode_(transcode),
-          transferSyntax_(transferSyntax)
+          transferSyntax_(transferSyntax),
+          mmapThreshold_(mmapThreshold),
+          job_(NULL),
+          sharedBuffers_(0),
+          sharedFiles_(0)
     {
     }
 
-    virtual ~InstanceLoader()
+    // Shares the loads with the concurrent exports of the same
+    // resources if "group" is not empty, see ExportCoordinator
+    void SetCoordination(const std::string &group,
+                         const void *job)
+    {
+      group_ = group;
+      job_ = job;
+    }
+
+    const void *GetJob() const
+    {
+      return job_;
+    }
+
+    // Returns "true" if the instance was obtained from another job.
+    // Otherwise, the caller loads it, then calls PublishShared().
+    bool AcquireShared(boost::shared_ptr<DicomBuffer> &dicom,
+                       const std::string &instanceId)
+    {
+      if (group_.empty())
+      {
+        return false;
+      }
+
+      std::string written;
+
+      switch (ExportCoordinator::Instance().Acquire(dicom, written, group_, job_, instanceId))
+      {
+        case ExportCoordinator::Acquisition_Shared:
+        {
+          boost::mutex::scoped_lock lock(sharedMutex_);
+          sharedBuffers_++;
+          return true;
+        }
+
+        case ExportCoordinator::Acquisition_Copy:
+          try
+          {
+            // The file belongs to another job, that can rewrite or
+            // remove it at any time: it is read, never mapped. The
+            // writers still copy it in the kernel if they can, unless
+            // the export is an archive.
+            boost::shared_ptr<DicomBuffer> copy(new DicomBuffer);
+            copy->ReadFile(written);
+            copy->SetExportedFile(written);
+            dicom = copy;
+
+            boost::mutex::scoped_lock lock(sharedMutex_);
+            sharedFiles_++;
+            return true;
+          }
+          catch (Orthanc::OrthancException &e)
+          {
+            LOG(INFO) << "[ExporterJob] Cannot read " << written << ", loading the instance instead: " << e.What();
+            return false;
+          }
+          catch (std::exception &e)
+          {
+            LOG(INFO) << "[ExporterJob] Cannot read " << written << ", loading the instance instead: " << e.what();
+            return false;
+          }
+
+        default:
+          return false;
+      }
+    }
+
+    // "dicom" is NULL if the instance could not be loaded
+    void PublishShared(const std::string &instanceId,
+                       const boost::shared_ptr<DicomBuffer> &dicom)
     {
+      if (group_.empty())
+      {
+        return;
+      }
+      else if (dicom.get() != NULL)
+      {
+        ExportCoordinator::Instance().Publish(group_, instanceId, dicom);
+      }
+      else
+      {
+        ExportCoordinator::Instance().Abandon(group_, instanceId);
+      }
     }
 
-    virtual void PrepareDicom(const std::string &instanceId)
+    void RecordWrittenFile(const std::string &instanceId,
+                           const std::string &path)
+    {
+      if (!group_.empty())
+      {
+        ExportCoordinator::Instance().RecordWrittenFile(group_, instanceId, path);
+      }
+    }
+
+    virtual ~InstanceLoader()
     {
     }
 
-    bool TranscodeDicom(std::string &transcodedBuffer, const std::string &sourceBuffer, const std::string &instanceId)
+    virtual bool IsThreaded() const = 0;
+
+    // The instances are numbered in the order of the calls to PrepareDicom()
+    virtual void PrepareDicom(const std::string &instanceId,
+                              uint64_t uncompressedSize) = 0;
+
+    bool TranscodeDicom(DicomBuffer &buffer, const std::string &instanceId)
     {
       if (transcode_)
       {
+        StageMetrics::Timer timer;
         LOG(INFO) << "InstanceLoader::TranscodeDicom instanceId = " << instanceId << ", transferSyntax = "  << Orthanc::GetTransferSyntaxUid(this->transferSyntax_);
         std::unique_ptr<OrthancPlugins::DicomInstance> transcoded(
           OrthancPlugins::DicomInstance::Transcode(
-            sourceBuffer.c_str(), sourceBuffer.size(), Orthanc::GetTransferSyntaxUid(this->transferSyntax_)));
-        transcodedBuffer.assign(reinterpret_cast<const char*>(transcoded->GetBuffer()), transcoded->GetSize());
+            buffer.GetData(), buffer.GetSize(), Orthanc::GetTransferSyntaxUid(this->transferSyntax_)));
+        buffer.SetInstance(transcoded.release());  // No copy of the transcoded file
+        transcodeStage_.AddBusy(timer, buffer.GetSize());
         return true;
       }
 
       return false;
     }
 
-    virtual void GetDicom(std::string &dicom, const std::string &instanceId) = 0;
+    // Reads an instance into a new buffer, without transcoding it
+    boost::shared_ptr<DicomBuffer> ReadDicom(const std::string &instanceId)
+    {
+      StageMetrics::Timer timer;
+      boost::shared_ptr<DicomBuffer> dicom(new DicomBuffer);
+      bool found;
 
-    virtual void Clear()
+      {
+        IoGovernor::Operation io(job_, IoDirection_Read);
+        found = PluginIndex::Instance().ReadDicom(*dicom, instanceId, mmapThreshold_);
+        io.SetBytes(found ? dicom->GetSize() : 0);
+      }
+
+      readStage_.AddBusy(timer, found ? dicom->GetSize() : 0);
+
+      if (!found)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+      }
+
+      return dicom;
+    }
+
+    // Only these errors mean that the instance was removed after the
+    // job was issued. Any other error (e.g. of the transcoding) must
+    // fail the job, instead of silently leaving a file out.
+    static bool IsRemovedInstance(const Orthanc::OrthancException &e)
     {
+      return (e.GetErrorCode() == Orthanc::ErrorCode_UnknownResource ||
+              e.GetErrorCode() == Orthanc::ErrorCode_InexistentItem);
     }
-  };
 
-  class ExporterJob::SynchronousInstanceLoader : public ExporterJob::InstanceLoader
-  {
-  public:
-    explicit SynchronousInstanceLoader(bool transcode, Orthanc::DicomTransferSyntax transferSyntax)
-        : InstanceLoader(transcode, transferSyntax)
+    // Reads (and transcodes if needed) an instance into a new buffer
+    boost::shared_ptr<DicomBuffer> LoadDicom(const std::string &instanceId)
     {
+      boost::shared_ptr<DicomBuffer> dicom = ReadDicom(instanceId);
+      TranscodeDicom(*dicom, instanceId);
+      return dicom;
     }
 
-    virtual void GetDicom(std::string &dicom, const std::string &instanceId) ORTHANC_OVERRIDE
+    void FormatStatistics(Json::Value &target) const
     {
-      PluginIndex::Instance().ReadDicom(dicom, instanceId);
+      readStage_.Format(target["Read"]);
+
+      if (transcode_)
+      {
+        transcodeStage_.Format(target["Transcode"]);
+      }
 
-      if (this->transcode_)
+      if (!group_.empty())
       {
-        TranscodeDicom(dicom, dicom, instanceId);
+        boost::mutex::scoped_lock lock(sharedMutex_);
+        target["Shared"]["Buffers"] = static_cast<Json::UInt64>(sharedBuffers_);
+        target["Shared"]["Files"] = static_cast<Json::UInt64>(sharedFiles_);
       }
     }
+
+    // Returns the next instance that is ready, whatever its position:
+    // a slow read does not hold back the instances loaded after it.
+    // "dicom" is NULL if the instance could not be read. Returns
+    // "false" once all the prepared instances have been returned.
+    virtual bool GetNextDicom(size_t &sequence,
+                              std::string &instanceId,
+                              boost::shared_ptr<DicomBuffer> &dicom) = 0;
+
+    virtual void Clear()
+    {
+    }
   };
 
-  class InstanceId : public Orthanc::IDynamicObject
+  class ExporterJob::SynchronousInstanceLoader : public ExporterJob::InstanceLoader
   {
   private:
-    std::string id_;
+    boost::mutex mutex_;
+    std::deque<std::string> instances_;
+    size_t next_;
 
   public:
-    explicit InstanceId(const std::string &id) : id_(id)
+    explicit SynchronousInstanceLoader(bool transcode, Orthanc::DicomTransferSyntax transferSyntax, uint64_t mmapThreshold)
+        : InstanceLoader(transcode, transferSyntax, mmapThreshold),
+          next_(0)
+    {
+    }
+
+    virtual bool IsThreaded() const ORTHANC_OVERRIDE
     {
+      return false;
     }
 
-    virtual ~InstanceId() ORTHANC_OVERRIDE
+    virtual void PrepareDicom(const std::string &instanceId,
+                              uint64_t /* uncompressedSize */) ORTHANC_OVERRIDE
     {
+      boost::mutex::scoped_lock lock(mutex_);
+      instances_.push_back(instanceId);
     }
 
-    std::string GetId() const { return id_; };
+    // The instance is read by the calling thread
+    virtual bool GetNextDicom(size_t &sequence,
+                              std::string &instanceId,
+                              boost::shared_ptr<DicomBuffer> &dicom) ORTHANC_OVERRIDE
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (instances_.empty())
+        {
+          return false;
+        }
+
+        sequence = next_++;
+        instanceId = instances_.front();
+        instances_.pop_front();
+      }
+
+      if (!AcquireShared(dicom, instanceId))
+      {
+        try
+        {
+          dicom = LoadDicom(instanceId);
+        }
+        catch (Orthanc::OrthancException &e)
+        {
+          dicom.reset();
+
+          if (!IsRemovedInstance(e))
+          {
+            PublishShared(instanceId, dicom);  // Wakes up the other jobs waiting for this instance
+            throw;
+          }
+        }
+
+        PublishShared(instanceId, dicom);
+      }
+
+      return true;
+    }
   };
 
   class ExporterJob::ThreadedInstanceLoader : public ExporterJob::InstanceLoader
   {
-    Orthanc::Semaphore availableInstancesSemaphore_;
-    Orthanc::Semaphore bufferedInstancesSemaphore_;
-    std::map<std::string, boost::shared_ptr<std::string>> availableInstances_;
-    boost::mutex availableInstancesMutex_;
-    Orthanc::SharedMessageQueue instancesToPreload_;
+    // The memory used by the loaded instances, plus the ones being
+    // loaded, is bounded by "budget_" bytes, as estimated from the
+    // uncompressed size of the instances: no need to accumulate
+    // instances in memory if the loaders are faster than the writers.
+    // The loaded instances are queued in the order they complete, so
+    // that the writers never wait for one specific instance.
+    // If there are transcoder threads, the loader threads only read the
+    // instances, and hand them to the transcoders through a bounded
+    // queue: the I/O-bound reads and the CPU-bound transcoding are
+    // sized independently. Otherwise, the loaders also transcode.
+    struct PendingInstance
+    {
+      size_t sequence_;
+      std::string id_;
+      uint64_t reservedSize_;
+
+      PendingInstance(size_t sequence,
+                      const std::string &id,
+                      uint64_t reservedSize) : sequence_(sequence),
+                                               id_(id),
+                                               reservedSize_(reservedSize)
+      {
+      }
+    };
+
+    struct LoadedInstance
+    {
+      size_t sequence_;
+      std::string id_;
+      boost::shared_ptr<DicomBuffer> dicom_;  // NULL if the instance was removed, or on error
+      boost::shared_ptr<Orthanc::OrthancException> error_;  // Thrown to the writer, to fail the job
+      uint64_t reservedSize_;
+    };
+
+    // Deleter of the buffers given to the writers: the memory of an
+    // instance is only given back to the loaders once it is written
+    class Reservation
+    {
+    private:
+      ThreadedInstanceLoader *loader_;
+      uint64_t size_;
+      boost::shared_ptr<DicomBuffer> dicom_;
+
+    public:
+      Reservation(ThreadedInstanceLoader *loader,
+                  uint64_t size,
+                  const boost::shared_ptr<DicomBuffer> &dicom) : loader_(loader),
+                                                                 size_(size),
+                                                                 dicom_(dicom)
+      {
+      }
+
+      void operator()(DicomBuffer *)
+      {
+        dicom_.reset();
+        loader_->Release(size_);
+      }
+    };
+
+    boost::mutex mutex_;
+    boost::condition_variable loadersCondition_;      // Signaled when there is an instance to load, and memory to load it
+    boost::condition_variable transcodersCondition_;  // Signaled when an instance is waiting for transcoding
+    boost::condition_variable writersCondition_;      // Signaled when an instance is loaded
+    std::deque<PendingInstance> instancesToPreload_;
+    std::deque<LoadedInstance> instancesToTranscode_;
+    std::deque<LoadedInstance> completedInstances_;
+    bool separateTranscoding_;
+    size_t transcodeQueueSize_;
+    size_t preparedCount_;
+    size_t returnedCount_;
+    uint64_t reservedBytes_;
+    uint64_t budget_;
+    bool done_;
     std::vector<boost::thread *> threads_;
+    std::vector<boost::thread *> transcoders_;
 
-  public:
-    ThreadedInstanceLoader(size_t threadCount, bool transcode, Orthanc::DicomTransferSyntax transferSyntax)
-        : InstanceLoader(transcode, transferSyntax),
-          availableInstancesSemaphore_(0),
-          bufferedInstancesSemaphore_(3 * threadCount)
+    // An instance larger than the whole budget is loaded alone
+    bool ReserveNextInstance(PendingInstance &target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (!done_ &&
+             (instancesToPreload_.empty() ||
+              (separateTranscoding_ &&
+               instancesToTranscode_.size() >= transcodeQueueSize_) ||
+              (reservedBytes_ > 0 &&
+               reservedBytes_ + instancesToPreload_.front().reservedSize_ > budget_)))
+      {
+        loadersCondition_.wait(lock);
+      }
+
+      if (done_)
+      {
+        return false;
+      }
+
+      target = instancesToPreload_.front();
+      instancesToPreload_.pop_front();
+      reservedBytes_ += target.reservedSize_;
+      return true;
+    }
+
+    void Release(uint64_t size)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        assert(reservedBytes_ >= size);
+        reservedBytes_ -= size;
+      }
+
+      loadersCondition_.notify_all(); // unlock the "flow" of loaders
+    }
+
+    bool TakeNextTranscode(LoadedInstance &target)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (!done_ &&
+               instancesToTranscode_.empty())
+        {
+          transcodersCondition_.wait(lock);
+        }
+
+        if (done_)
+        {
+          return false;
+        }
+
+        target = instancesToTranscode_.front();
+        instancesToTranscode_.pop_front();
+      }
+
+      loadersCondition_.notify_all();  // There is room in the transcoding queue
+      return true;
+    }
+
+    void PushToTranscode(const LoadedInstance &instance)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        instancesToTranscode_.push_back(instance);
+      }
+
+      transcodersCondition_.notify_one();
+    }
+
+    void PushCompleted(const LoadedInstance &instance)
     {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        completedInstances_.push_back(instance);
+      }
+
+      writersCondition_.notify_one();
+    }
+
+  public:
+    ThreadedInstanceLoader(size_t threadCount, size_t transcoderCount, bool transcode, Orthanc::DicomTransferSyntax transferSyntax,
+                           uint64_t mmapThreshold, uint64_t budget)
+        : InstanceLoader(transcode, transferSyntax, mmapThreshold),
+          separateTranscoding_(transcode && transcoderCount > 0),
+          transcodeQueueSize_(TRANSCODE_QUEUE_SIZE_PER_THREAD * transcoderCount),
+          preparedCount_(0),
+          returnedCount_(0),
+          reservedBytes_(0),
+          budget_(budget),
+          done_(false)
+    {
+      readStage_.SetThreads(threadCount);
+
+      if (separateTranscoding_)
+      {
+        transcodeStage_.SetThreads(transcoderCount);
+
+        for (size_t i = 0; i < transcoderCount; i++)
+        {
+          transcoders_.push_back(new boost::thread(TranscoderWorkerThread, this));
+        }
+      }
+
       for (size_t i = 0; i < threadCount; i++)
       {
         threads_.push_back(new boost::thread(PreloaderWorkerThread, this));
@@ -143,115 +646,222 @@ namespace Saola
       Clear();
     }
 
+    virtual bool IsThreaded() const ORTHANC_OVERRIDE
+    {
+      return true;
+    }
+
     virtual void Clear() ORTHANC_OVERRIDE
     {
-      for (size_t i = 0; i < threads_.size(); i++)
       {
-        instancesToPreload_.Enqueue(NULL);
+        boost::mutex::scoped_lock lock(mutex_);
+        done_ = true;
       }
+      loadersCondition_.notify_all();
+      transcodersCondition_.notify_all();
+      writersCondition_.notify_all();
 
-      for (size_t i = 0; i < threads_.size(); i++)
+      JoinThreads(threads_);
+      JoinThreads(transcoders_);
+
+      instancesToPreload_.clear();
+      instancesToTranscode_.clear();
+      completedInstances_.clear();
+    }
+
+    static void JoinThreads(std::vector<boost::thread *> &threads)
+    {
+      for (size_t i = 0; i < threads.size(); i++)
       {
-        if (threads_[i]->joinable())
+        if (threads[i]->joinable())
         {
-          threads_[i]->join();
+          threads[i]->join();
         }
-        delete threads_[i];
+        delete threads[i];
       }
 
-      threads_.clear();
-      availableInstances_.clear();
+      threads.clear();
     }
 
     static void PreloaderWorkerThread(ThreadedInstanceLoader *that)
     {
-      static uint16_t threadCounter = 0;
+      static std::atomic<uint16_t> threadCounter(0);
       Orthanc::Logging::SetCurrentThreadName(std::string("ARCH-LOAD-") + boost::lexical_cast<std::string>(threadCounter++));
 
+      PendingInstance instance(0, "", 0);
+
       while (true)
       {
-        std::unique_ptr<InstanceId> instanceId(dynamic_cast<InstanceId *>(that->instancesToPreload_.Dequeue(0)));
-        if (instanceId.get() == NULL) // that's the signal to exit the thread
         {
-          return;
+          StageMetrics::Timer timer;
+          bool reserved = that->ReserveNextInstance(instance);
+          that->readStage_.AddIdle(timer);
+
+          if (!reserved)
+          {
+            return;
+          }
         }
 
-        // wait for the consumers (zip writer), no need to accumulate instances in memory if loaders are faster than writers
-        that->bufferedInstancesSemaphore_.Acquire();
-        try
+        LoadedInstance loaded;
+        loaded.sequence_ = instance.sequence_;
+        loaded.id_ = instance.id_;
+        loaded.reservedSize_ = instance.reservedSize_;
+
+        if (that->AcquireShared(loaded.dicom_, instance.id_))
         {
-          boost::shared_ptr<std::string> dicomContent(new std::string());
-          PluginIndex::Instance().ReadDicom(*dicomContent, instanceId->GetId());
+          that->PushCompleted(loaded);  // Already transcoded, if needed
+          continue;
+        }
 
-          if (that->transcode_)
+        try
+        {
+          if (that->separateTranscoding_)
           {
-            boost::shared_ptr<std::string> transcodedDicom(new std::string());
-            if (that->TranscodeDicom(*transcodedDicom, *dicomContent, instanceId->GetId()))
-            {
-              dicomContent = transcodedDicom;
-            }
+            loaded.dicom_ = that->ReadDicom(instance.id_);
           }
-
+          else
           {
-            boost::mutex::scoped_lock lock(that->availableInstancesMutex_);
-            that->availableInstances_[instanceId->GetId()] = dicomContent;
+            loaded.dicom_ = that->LoadDicom(instance.id_);
           }
-
-          that->availableInstancesSemaphore_.Release();
         }
         catch (Orthanc::OrthancException &e)
         {
-          boost::mutex::scoped_lock lock(that->availableInstancesMutex_);
           // store a NULL result to notify that we could not read the instance
-          that->availableInstances_[instanceId->GetId()] = boost::shared_ptr<std::string>();
-          that->availableInstancesSemaphore_.Release();
+          loaded.dicom_.reset();
+
+          if (!IsRemovedInstance(e))
+          {
+            loaded.error_.reset(new Orthanc::OrthancException(e));
+          }
+        }
+        catch (std::exception &e)
+        {
+          // For instance, "std::bad_alloc": an exception escaping the
+          // thread would terminate Orthanc
+          loaded.dicom_.reset();
+          loaded.error_.reset(new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, e.what()));
+        }
+
+        if (that->separateTranscoding_ &&
+            loaded.dicom_.get() != NULL)
+        {
+          that->PushToTranscode(loaded);
+        }
+        else
+        {
+          that->PublishShared(loaded.id_, loaded.dicom_);
+          that->PushCompleted(loaded);
         }
       }
     }
 
-    virtual void PrepareDicom(const std::string &instanceId) ORTHANC_OVERRIDE
+    static void TranscoderWorkerThread(ThreadedInstanceLoader *that)
     {
-      instancesToPreload_.Enqueue(new InstanceId(instanceId));
-    }
+      static std::atomic<uint16_t> threadCounter(0);
+      Orthanc::Logging::SetCurrentThreadName(std::string("ARCH-TRANSCODE-") + boost::lexical_cast<std::string>(threadCounter++));
 
-    virtual void GetDicom(std::string &dicom, const std::string &instanceId) ORTHANC_OVERRIDE
-    {
       while (true)
       {
-        // wait for an instance to be available but this might not be the one we are waiting for !
-        availableInstancesSemaphore_.Acquire();
-        bufferedInstancesSemaphore_.Release(); // unlock the "flow" of loaders
+        LoadedInstance loaded;  // Not kept across iterations: the budget is released once the writer drops the buffer
 
-        boost::shared_ptr<std::string> dicomContent;
         {
-          boost::mutex::scoped_lock lock(availableInstancesMutex_);
+          StageMetrics::Timer timer;
+          bool taken = that->TakeNextTranscode(loaded);
+          that->transcodeStage_.AddIdle(timer);
 
-          if (availableInstances_.find(instanceId) != availableInstances_.end())
+          if (!taken)
           {
-            // this is the instance we were waiting for
-            dicomContent = availableInstances_[instanceId];
-            availableInstances_.erase(instanceId);
-
-            if (dicomContent.get() == NULL) // there has been an error while reading the file
-            {
-              throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
-            }
-            dicom.swap(*dicomContent);
-
-            if (availableInstances_.size() > 0)
-            {
-              // we have just read the instance we were waiting for but there are still other instances available ->
-              // make sure the next GetDicom call does not wait !
-              availableInstancesSemaphore_.Release();
-            }
             return;
           }
-          // we have not found the expected instance, simply wait for the next loader thread to signal the semaphore when
-          // a new instance is available
         }
+
+        try
+        {
+          that->TranscodeDicom(*loaded.dicom_, loaded.id_);
+        }
+        catch (Orthanc::OrthancException &e)
+        {
+          loaded.dicom_.reset();
+          loaded.error_.reset(new Orthanc::OrthancException(e));
+        }
+        catch (std::exception &e)
+        {
+          loaded.dicom_.reset();
+          loaded.error_.reset(new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, e.what()));
+        }
+
+        that->PublishShared(loaded.id_, loaded.dicom_);
+        that->PushCompleted(loaded);
       }
     }
-  };
+
+    virtual void PrepareDicom(const std::string &instanceId,
+                              uint64_t uncompressedSize) ORTHANC_OVERRIDE
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        instancesToPreload_.push_back(PendingInstance(preparedCount_++, instanceId, std::max<uint64_t>(uncompressedSize, 1)));
+      }
+
+      loadersCondition_.notify_one();
+    }
+
+    virtual bool GetNextDicom(size_t &sequence,
+                              std::string &instanceId,
+                              boost::shared_ptr<DicomBuffer> &dicom) ORTHANC_OVERRIDE
+    {
+      LoadedInstance loaded;
+      bool isLast;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (!done_ &&
+               completedInstances_.empty() &&
+               returnedCount_ < preparedCount_)
+        {
+          writersCondition_.wait(lock);
+        }
+
+        if (completedInstances_.empty())
+        {
+          return false;  // Either all the instances were returned, or the loader is cleared
+        }
+
+        loaded = completedInstances_.front();
+        completedInstances_.pop_front();
+        returnedCount_++;
+        isLast = (returnedCount_ == preparedCount_);
+      }
+
+      if (isLast)
+      {
+        writersCondition_.notify_all();  // wake up the other writers, there is nothing left for them
+      }
+
+      sequence = loaded.sequence_;
+      instanceId = loaded.id_;
+
+      if (loaded.error_.get() != NULL)
+      {
+        Release(loaded.reservedSize_);
+        throw *loaded.error_;
+      }
+      else if (loaded.dicom_.get() == NULL) // the instance was removed
+      {
+        Release(loaded.reservedSize_);
+        dicom.reset();
+      }
+      else
+      {
+        DicomBuffer *buffer = loaded.dicom_.get();
+        dicom.reset(buffer, Reservation(this, loaded.reservedSize_, loaded.dicom_));
+      }
+
+      return true;
+    }
+  };
 
   // This enum defines specific resource types to be used when exporting the archive.
   // It defines if we should use the PatientInfo from the Patient or from the Study.
@@ -429,9 +1039,88 @@ namespace Saola
     virtual void Close() = 0;
 
     virtual void AddInstance(const std::string &instanceId,
-                             uint64_t uncompressedSize) = 0;
+                             uint64_t uncompressedSize,
+                             const std::string &uncompressedMD5) = 0;
   };
 
+  // Runs "task(0)" to "task(count - 1)" on at most "threadsCount"
+  // threads. The first error is rethrown once all the threads are done.
+  template <typename Task>
+  static void RunInParallel(size_t count,
+                            unsigned int threadsCount,
+                            Task task)
+  {
+    if (count <= 1 ||
+        threadsCount <= 1)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        task(i);
+      }
+
+      return;
+    }
+
+    boost::mutex mutex;
+    size_t next = 0;
+    std::unique_ptr<Orthanc::OrthancException> error;
+
+    std::vector<boost::thread *> threads;
+    for (size_t t = 0; t < std::min<size_t>(threadsCount, count); t++)
+    {
+      threads.push_back(new boost::thread([&]()
+      {
+        while (true)
+        {
+          size_t i;
+
+          {
+            boost::mutex::scoped_lock lock(mutex);
+            if (next == count ||
+                error.get() != NULL)
+            {
+              return;
+            }
+
+            i = next++;
+          }
+
+          try
+          {
+            task(i);
+          }
+          catch (Orthanc::OrthancException &e)
+          {
+            boost::mutex::scoped_lock lock(mutex);
+            if (error.get() == NULL)
+            {
+              error.reset(new Orthanc::OrthancException(e));
+            }
+          }
+          catch (std::exception &e)
+          {
+            boost::mutex::scoped_lock lock(mutex);
+            if (error.get() == NULL)
+            {
+              error.reset(new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, e.what()));
+            }
+          }
+        }
+      }));
+    }
+
+    for (size_t t = 0; t < threads.size(); t++)
+    {
+      threads[t]->join();
+      delete threads[t];
+    }
+
+    if (error.get() != NULL)
+    {
+      throw Orthanc::OrthancException(*error);
+    }
+  }
+
   class ExporterJob::ArchiveIndex : public boost::noncopyable
   {
   private:
@@ -439,10 +1128,13 @@ namespace Saola
     {
       std::string id_;
       uint64_t uncompressedSize_;
+      std::string uncompressedMD5_;  // Empty if unknown
 
       Instance(const std::string &id,
-               uint64_t uncompressedSize) : id_(id),
-                                            uncompressedSize_(uncompressedSize)
+               uint64_t uncompressedSize,
+               const std::string &uncompressedMD5) : id_(id),
+                                                     uncompressedSize_(uncompressedSize),
+                                                     uncompressedMD5_(uncompressedMD5)
       {
       }
     };
@@ -463,7 +1155,7 @@ namespace Saola
         int64_t revision; // ignored
         if (index.LookupAttachment(tmp, revision, id, Orthanc::FileContentType_Dicom))
         {
-          instances_.push_back(Instance(id, tmp.GetUncompressedSize()));
+          instances_.push_back(Instance(id, tmp.GetUncompressedSize(), tmp.GetUncompressedMD5()));
         }
       }
       else
@@ -521,37 +1213,111 @@ namespace Saola
       }
     }
 
-    void Expand(PluginIndex &index)
+    // The resources of one level of the tree are looked up concurrently
+    // (REST calls, directory scans and stats), and the results are
+    // stored in the order of the tree, so that the plan does not depend
+    // on the number of threads
+    void Expand(PluginIndex &index,
+                unsigned int threadsCount)
     {
-      if (level_ == ArchiveResourceType_Instance)
+      struct Expansion
       {
-        // Expanding an instance node makes no sense
-        return;
-      }
+        ArchiveIndex *node_;
+        Resources::iterator resource_;
+        std::list<std::string> children_;
+      };
 
-      for (Resources::iterator it = resources_.begin();
-           it != resources_.end(); ++it)
+      struct Lookup
       {
-        if (it->second == NULL)
+        ArchiveIndex *node_;
+        std::string id_;
+        bool found_;
+        Orthanc::FileInfo attachment_;
+      };
+
+      std::vector<ArchiveIndex *> level(1, this);
+
+      while (!level.empty())
+      {
+        std::vector<Expansion> expansions;
+
+        for (size_t i = 0; i < level.size(); i++)
         {
-          // This is resource is marked for expansion
-          std::list<std::string> children;
-          index.GetChildren(children, it->first);
+          for (Resources::iterator it = level[i]->resources_.begin(); it != level[i]->resources_.end(); ++it)
+          {
+            if (it->second == NULL)
+            {
+              // This is resource is marked for expansion
+              Expansion expansion;
+              expansion.node_ = level[i];
+              expansion.resource_ = it;
+              expansions.push_back(expansion);
+            }
+          }
+        }
+
+        RunInParallel(expansions.size(), threadsCount, [&](size_t i)
+        {
+          index.GetChildren(expansions[i].children_, expansions[i].resource_->first);
+        });
+
+        std::vector<Lookup> lookups;
+
+        for (size_t i = 0; i < expansions.size(); i++)
+        {
+          std::unique_ptr<ArchiveIndex> child(new ArchiveIndex(GetChildResourceType(expansions[i].node_->level_)));
+
+          for (std::list<std::string>::const_iterator it = expansions[i].children_.begin();
+               it != expansions[i].children_.end(); ++it)
+          {
+            if (child->level_ == ArchiveResourceType_Instance)
+            {
+              Lookup lookup;
+              lookup.node_ = child.get();
+              lookup.id_ = *it;
+              lookup.found_ = false;
+              lookups.push_back(lookup);
+            }
+            else
+            {
+              child->resources_[*it] = NULL;
+            }
+          }
+
+          expansions[i].resource_->second = child.release();
+        }
 
-          std::unique_ptr<ArchiveIndex> child(new ArchiveIndex(GetChildResourceType(level_)));
+        RunInParallel(lookups.size(), threadsCount, [&](size_t i)
+        {
+          int64_t revision; // ignored
+          lookups[i].found_ = index.LookupAttachment(lookups[i].attachment_, revision, lookups[i].id_,
+                                                     Orthanc::FileContentType_Dicom);
+        });
 
-          for (std::list<std::string>::const_iterator
-                   it2 = children.begin();
-               it2 != children.end(); ++it2)
+        for (size_t i = 0; i < lookups.size(); i++)
+        {
+          if (lookups[i].found_)
           {
-            child->AddResourceToExpand(index, *it2);
+            lookups[i].node_->instances_.push_back(Instance(lookups[i].id_, lookups[i].attachment_.GetUncompressedSize(),
+                                                            lookups[i].attachment_.GetUncompressedMD5()));
           }
+        }
 
-          it->second = child.release();
+        std::vector<ArchiveIndex *> next;
+
+        for (size_t i = 0; i < level.size(); i++)
+        {
+          for (Resources::const_iterator it = level[i]->resources_.begin(); it != level[i]->resources_.end(); ++it)
+          {
+            assert(it->second != NULL);
+            if (it->second->level_ != ArchiveResourceType_Instance)
+            {
+              next.push_back(it->second);
+            }
+          }
         }
 
-        assert(it->second != NULL);
-        it->second->Expand(index);
+        level.swap(next);
       }
     }
 
@@ -563,7 +1329,7 @@ namespace Saola
                  it = instances_.begin();
              it != instances_.end(); ++it)
         {
-          visitor.AddInstance(it->id_, it->uncompressedSize_);
+          visitor.AddInstance(it->id_, it->uncompressedSize_, it->uncompressedMD5_);
         }
       }
       else
@@ -580,15 +1346,136 @@ namespace Saola
     }
   };
 
+  static const char *const FILE_URI_PREFIX = "file://";
+
+  static bool IsFileUri(const std::string &instanceId)
+  {
+    return instanceId.compare(0, strlen(FILE_URI_PREFIX), FILE_URI_PREFIX) == 0;
+  }
+
+  static void CopyInstanceFile(const std::string &source,
+                               const std::string &target,
+                               bool allowHardlink)
+  {
+    // Same atomic replacement as HierarchicalDirWriter::WriteFile()
+    const std::string temporary = Saola::HierarchicalDirWriter::GetTemporaryPath(target);
+
+    try
+    {
+      FileCopyMethod method = CopyFile(source, temporary, allowHardlink);
+      Saola::HierarchicalDirWriter::CommitTemporaryFile(temporary, target);
+      LOG(TRACE) << "[ExporterJob] Copied " << source << " to " << target << " (" << EnumerationToString(method) << ")";
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      boost::system::error_code error;
+      boost::filesystem::remove(temporary, error);
+
+      if (e.GetErrorCode() == Orthanc::ErrorCode_InexistentFile)
+      {
+        LOG(WARNING) << "An instance was removed after the job was issued: " << source;
+      }
+      else
+      {
+        throw;
+      }
+    }
+  }
+
+  // Copies a file written by a concurrent export of the same
+  // instance. Returns "false" if it is not there anymore.
+  static bool CopyExportedFile(const std::string &source,
+                               const std::string &target,
+                               bool allowHardlink)
+  {
+    const std::string temporary = Saola::HierarchicalDirWriter::GetTemporaryPath(target);
+
+    try
+    {
+      CopyFile(source, temporary, allowHardlink);
+      Saola::HierarchicalDirWriter::CommitTemporaryFile(temporary, target);
+      return true;
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      boost::system::error_code error;
+      boost::filesystem::remove(temporary, error);
+
+      LOG(INFO) << "[ExporterJob] Cannot copy " << source << ", writing " << target << " instead: " << e.What();
+      return false;
+    }
+  }
+
+  // FNV-1a hash of the paths of the written files, to check that a
+  // checkpoint still matches the plan when the export is resumed
+  static void UpdateFingerprint(uint64_t &fingerprint,
+                                const std::string &path)
+  {
+    for (size_t i = 0; i <= path.size(); i++)  // Including the final '\0'
+    {
+      fingerprint ^= static_cast<uint8_t>(path.c_str()[i]);
+      fingerprint *= 1099511628211ULL;
+    }
+  }
+
   // ------------------------------------------------------------------------
   class ExporterJob::DirectoryCommands : public boost::noncopyable
   {
+  public:
+    // An instance to be written at a path that is already resolved
+    struct WriteTask
+    {
+      std::string instanceId_;  // Source path if "copy_" is set
+      std::string path_;
+      bool copy_;
+      uint64_t uncompressedSize_;
+      std::string uncompressedMD5_;  // Of the source, empty if unknown
+
+      WriteTask(const std::string &instanceId,
+                const std::string &path,
+                bool copy,
+                uint64_t uncompressedSize,
+                const std::string &uncompressedMD5) : instanceId_(instanceId),
+                                                      path_(path),
+                                                      copy_(copy),
+                                                      uncompressedSize_(uncompressedSize),
+                                                      uncompressedMD5_(uncompressedMD5)
+      {
+      }
+
+      // Identifier of the instance, whether it is copied or loaded
+      std::string GetSource() const
+      {
+        return copy_ ? FILE_URI_PREFIX + instanceId_ : instanceId_;
+      }
+
+      // Path of the source, if the source is a file
+      bool LookupSourceFile(std::string &path) const
+      {
+        if (copy_)
+        {
+          path = instanceId_;
+          return true;
+        }
+        else if (IsFileUri(instanceId_))
+        {
+          path = instanceId_.substr(strlen(FILE_URI_PREFIX));
+          return true;
+        }
+        else
+        {
+          return false;
+        }
+      }
+    };
+
   private:
     enum Type
     {
       Type_OpenDirectory,
       Type_CloseDirectory,
-      Type_WriteInstance
+      Type_WriteInstance,
+      Type_CopyFile      // The instance is a file that is copied as is, without being loaded
     };
 
     class Command : public boost::noncopyable
@@ -597,33 +1484,40 @@ namespace Saola
       Type type_;
       std::string filename_;
       std::string instanceId_;
+      uint64_t uncompressedSize_;
+      std::string uncompressedMD5_;
 
     public:
-      explicit Command(Type type) : type_(type)
+      explicit Command(Type type) : type_(type),
+                                    uncompressedSize_(0)
       {
         assert(type_ == Type_CloseDirectory);
       }
 
       Command(Type type,
               const std::string &filename) : type_(type),
-                                             filename_(filename)
+                                             filename_(filename),
+                                             uncompressedSize_(0)
       {
         assert(type_ == Type_OpenDirectory);
       }
 
       Command(Type type,
               const std::string &filename,
-              const std::string &instanceId) : type_(type),
-                                               filename_(filename),
-                                               instanceId_(instanceId)
+              const std::string &instanceId,
+              uint64_t uncompressedSize,
+              const std::string &uncompressedMD5) : type_(type),
+                                                    filename_(filename),
+                                                    instanceId_(instanceId),
+                                                    uncompressedSize_(uncompressedSize),
+                                                    uncompressedMD5_(uncompressedMD5)
       {
-        assert(type_ == Type_WriteInstance);
+        assert(type_ == Type_WriteInstance ||
+               type_ == Type_CopyFile);
       }
 
-      void Apply(Saola::HierarchicalDirWriter &writer,
-                 InstanceLoader &instanceLoader,
-                 bool transcode,
-                 Orthanc::DicomTransferSyntax transferSyntax) const
+      void Plan(Saola::HierarchicalDirWriter &writer,
+                std::vector<WriteTask> &tasks) const
       {
         switch (type_)
         {
@@ -636,21 +1530,12 @@ namespace Saola
           break;
 
         case Type_WriteInstance:
-        {
-          std::string content;
+          tasks.push_back(WriteTask(instanceId_, writer.PlanFile(filename_.c_str()), false, uncompressedSize_, uncompressedMD5_));
+          break;
 
-          try
-          {
-            instanceLoader.GetDicom(content, instanceId_);
-          }
-          catch (Orthanc::OrthancException &e)
-          {
-            LOG(WARNING) << "An instance was removed after the job was issued: " << instanceId_;
-            return;
-          }
-          writer.Write(content, filename_.c_str());
+        case Type_CopyFile:
+          tasks.push_back(WriteTask(instanceId_, writer.PlanFile(filename_.c_str()), true, uncompressedSize_, uncompressedMD5_));
           break;
-        }
 
         default:
           throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
@@ -661,26 +1546,17 @@ namespace Saola
     std::deque<Command *> commands_;
     uint64_t uncompressedSize_;
     unsigned int instancesCount_;
-    InstanceLoader &instanceLoader_;
-
-    void ApplyInternal(Saola::HierarchicalDirWriter &writer,
-                       InstanceLoader &instanceLoader,
-                       size_t index,
-                       bool transcode,
-                       Orthanc::DicomTransferSyntax transferSyntax) const
-    {
-      if (index >= commands_.size())
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
-      }
-
-      commands_[index]->Apply(writer, instanceLoader, transcode, transferSyntax);
-    }
+    bool copyFiles_;
+    bool allowHardlink_;
 
   public:
-    explicit DirectoryCommands(InstanceLoader &instanceLoader) : uncompressedSize_(0),
-                                                                 instancesCount_(0),
-                                                                 instanceLoader_(instanceLoader)
+    // If "copyFiles" is set, the "file://" instances are copied by the
+    // kernel instead of being read by the loader and written back
+    DirectoryCommands(bool copyFiles,
+                      bool allowHardlink) : uncompressedSize_(0),
+                                            instancesCount_(0),
+                                            copyFiles_(copyFiles),
+                                            allowHardlink_(allowHardlink)
     {
     }
 
@@ -709,13 +1585,23 @@ namespace Saola
       return uncompressedSize_;
     }
 
-    void Apply(Saola::HierarchicalDirWriter &writer,
-               InstanceLoader &instanceLoader,
-               size_t index,
-               bool transcode,
-               Orthanc::DicomTransferSyntax transferSyntax) const
+    bool IsAllowHardlink() const
+    {
+      return allowHardlink_;
+    }
+
+    // Creates the directories and resolves the path of all the files
+    // upfront, so that the files can then be written in any order
+    void Plan(Saola::HierarchicalDirWriter &writer,
+              std::vector<WriteTask> &tasks) const
     {
-      ApplyInternal(writer, instanceLoader, index, transcode, transferSyntax);
+      tasks.reserve(instancesCount_);
+
+      for (std::deque<Command *>::const_iterator it = commands_.begin();
+           it != commands_.end(); ++it)
+      {
+        (*it)->Plan(writer, tasks);
+      }
     }
 
     void AddOpenDirectory(const std::string &filename)
@@ -730,10 +1616,18 @@ namespace Saola
 
     void AddWriteInstance(const std::string &filename,
                           const std::string &instanceId,
-                          uint64_t uncompressedSize)
+                          uint64_t uncompressedSize,
+                          const std::string &uncompressedMD5)
     {
-      instanceLoader_.PrepareDicom(instanceId);
-      commands_.push_back(new Command(Type_WriteInstance, filename, instanceId));
+      if (copyFiles_ && IsFileUri(instanceId))
+      {
+        commands_.push_back(new Command(Type_CopyFile, filename, instanceId.substr(strlen(FILE_URI_PREFIX)), uncompressedSize, uncompressedMD5));
+      }
+      else
+      {
+        commands_.push_back(new Command(Type_WriteInstance, filename, instanceId, uncompressedSize, uncompressedMD5));
+      }
+
       instancesCount_++;
       uncompressedSize_ += uncompressedSize;
     }
@@ -805,7 +1699,8 @@ namespace Saola
     }
 
     virtual void AddInstance(const std::string &instanceId,
-                             uint64_t uncompressedSize) ORTHANC_OVERRIDE
+                             uint64_t uncompressedSize,
+                             const std::string &uncompressedMD5) ORTHANC_OVERRIDE
     {
       // char filename[24];
       // snprintf(filename, sizeof(filename) - 1, instanceFormat_, counter_);
@@ -816,134 +1711,1218 @@ namespace Saola
       // - orthanc://instanceId
       // - file:///path/to/file.dcm
       // Hence using booost::fielsystem::path(instanceId).filename().string() to get the file name
-      commands_.AddWriteInstance(boost::filesystem::path(instanceId).filename().string(), instanceId, uncompressedSize); // --> Use this instead
+      commands_.AddWriteInstance(boost::filesystem::path(instanceId).filename().string(), instanceId, uncompressedSize, uncompressedMD5); // --> Use this instead
     }
   };
 
   // ---------------------------------------------------------------------------------------
 
-  class ExporterJob::DirectoryWriterIterator : public boost::noncopyable
+  class ExporterJob::WriterPool : public boost::noncopyable
   {
   private:
+    typedef DirectoryCommands::WriteTask WriteTask;
+
     InstanceLoader &instanceLoader_;
-    DirectoryCommands commands_;
-    std::unique_ptr<Saola::HierarchicalDirWriter> dir_;
+    Saola::HierarchicalDirWriter &writer_;
+    bool allowHardlink_;
+    ExportManifest *manifest_;          // NULL if the export is not incremental
+    ChecksumManifest *checksums_;       // NULL if there is no checksum file
+    bool computeChecksums_;             // Otherwise, the checksums of the written files are removed
+    std::string transferSyntax_;        // Empty if the instances are not transcoded
+    std::vector<WriteTask> tasks_;
+    std::vector<size_t> verifications_; // Index of the files to compare with their source (incremental export)
+    std::vector<size_t> toWrite_;       // Index of the files to write, once all the files are compared
+    std::vector<size_t> copies_;        // Index of the files copied without the loader
+    std::vector<size_t> loadedTasks_;   // Index of the loaded instances, by loader sequence number
+    std::vector<size_t> unchecked_;     // Index of the files not written by this run that have no checksum
+    std::vector<bool> written_;         // By task index
+    Checkpoint checkpoint_;
+    boost::mutex mutex_;
+    boost::condition_variable progress_;
+    size_t nextVerification_;
+    size_t verified_;
+    size_t skipped_;
+    bool scheduled_;                    // Whether "toWrite_" was given to the copiers and to the loader
+    size_t nextCopy_;
+    size_t nextUnchecked_;
+    size_t completed_;
+    size_t pendingChecksums_;           // Files of "unchecked_" that are completed, but not checked yet
+    bool stopped_;
+    std::unique_ptr<Orthanc::OrthancException> error_;  // First error of the writers
+    std::vector<boost::thread *> threads_;
+    StageMetrics writeStage_;
+    StageMetrics checksumStage_;        // In the writer threads
 
-  public:
-    DirectoryWriterIterator(InstanceLoader &instanceLoader,
-                            ArchiveIndex &archive,
-                            const std::string rootDir,
-                            bool enableExtendedSopClass) : instanceLoader_(instanceLoader),
-                                                           commands_(instanceLoader)
+    ExportManifest::Entry GetManifestEntry(size_t task) const
+    {
+      ExportManifest::Entry entry;
+      entry.source_ = tasks_[task].GetSource();
+      entry.size_ = tasks_[task].uncompressedSize_;
+      entry.md5_ = tasks_[task].uncompressedMD5_;
+      entry.transferSyntax_ = transferSyntax_;
+      return entry;
+    }
+
+    // CRC32C of a buffer that was just written
+    void RecordChecksum(const std::string &path,
+                        const void *data,
+                        size_t size)
+    {
+      if (checksums_ == NULL)
+      {
+        return;
+      }
+      else if (computeChecksums_)
+      {
+        StageMetrics::Timer timer;
+        checksums_->Record(path, ChecksumManifest::ComputeCrc32c(data, size));
+        checksumStage_.AddBusy(timer, size);
+      }
+      else
+      {
+        checksums_->Remove(path);
+      }
+    }
+
+    // CRC32C of a file that was not written by this run (resumed, or
+    // skipped by an incremental export before the checksums were
+    // enabled). Returns the number of bytes that were read.
+    uint64_t RecordFileChecksum(const std::string &path)
+    {
+      boost::system::error_code error;
+      if (!boost::filesystem::is_regular_file(path, error))
+      {
+        return 0;  // The instance was removed
+      }
+
+      try
+      {
+        StageMetrics::Timer timer;
+        const uint64_t size = boost::filesystem::file_size(path);
+        checksums_->Record(path, ChecksumManifest::ComputeFileCrc32c(path));
+        checksumStage_.AddBusy(timer, size);
+        return size;
+      }
+      catch (Orthanc::OrthancException &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot compute the checksum of " << path << ": " << e.What();
+        return 0;
+      }
+      catch (std::exception &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot compute the checksum of " << path << ": " << e.what();
+        return 0;
+      }
+    }
+
+    // The checksum of a file that is not written by this run is
+    // computed by the writer threads, once the writes are scheduled.
+    // The mutex must be locked, before the file is completed.
+    void AddUnchecked(size_t task)
+    {
+      if (checksums_ != NULL &&
+          computeChecksums_ &&
+          !checksums_->HasChecksum(tasks_[task].path_))
+      {
+        unchecked_.push_back(task);
+        pendingChecksums_++;
+      }
+    }
+
+    // Cheap check of the files recorded in the manifest: they are not
+    // read, but they could have been removed or truncated
+    static bool HasSize(const std::string &path,
+                        uint64_t size)
+    {
+      boost::system::error_code error;
+      uint64_t actual = boost::filesystem::file_size(path, error);
+      return (!error && actual == size);
+    }
+
+    // Incremental export: compares an existing file with its source,
+    // by size first, then by MD5. The MD5 of the instances stored by
+    // Orthanc is known, only the source files are hashed.
+    static bool IsSameFile(const WriteTask &task)
+    {
+      if (!HasSize(task.path_, task.uncompressedSize_))
+      {
+        return false;
+      }
+
+      std::string sourceMD5 = task.uncompressedMD5_;
+      std::string sourcePath;
+
+      if (sourceMD5.empty())
+      {
+        if (!task.LookupSourceFile(sourcePath))
+        {
+          return false;  // Cannot compare
+        }
+
+        ExportManifest::ComputeFileMD5(sourceMD5, sourcePath);
+      }
+
+      std::string targetMD5;
+      ExportManifest::ComputeFileMD5(targetMD5, task.path_);
+      return targetMD5 == sourceMD5;
+    }
+
+    // A file is only completed once its checksum is known. The mutex
+    // must be locked.
+    size_t GetCompletedCount() const
+    {
+      return (completed_ > pendingChecksums_ ? completed_ - pendingChecksums_ : 0);
+    }
+
+    // Gives the files to write to the copiers and to the loader, in the
+    // order of the plan. The mutex must be locked.
+    void ScheduleWrites()
+    {
+      std::sort(toWrite_.begin(), toWrite_.end());
+
+      for (size_t i = 0; i < toWrite_.size(); i++)
+      {
+        const WriteTask &task = tasks_[toWrite_[i]];
+
+        if (task.copy_)
+        {
+          copies_.push_back(toWrite_[i]);
+        }
+        else
+        {
+          // The loader numbers the instances in the order of the calls
+          loadedTasks_.push_back(toWrite_[i]);
+          instanceLoader_.PrepareDicom(task.instanceId_, task.uncompressedSize_);
+        }
+      }
+
+      toWrite_.clear();
+      scheduled_ = true;
+    }
+
+    void Verify(size_t task)
+    {
+      bool same;
+
+      try
+      {
+        StageMetrics::Timer timer;
+        IoGovernor::Operation io(instanceLoader_.GetJob(), IoDirection_Read);
+        same = IsSameFile(tasks_[task]);
+        io.SetBytes(tasks_[task].uncompressedSize_);
+        writeStage_.AddBusy(timer);
+      }
+      catch (Orthanc::OrthancException &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot compare " << tasks_[task].path_ << ", it is written again: " << e.What();
+        same = false;
+      }
+      catch (std::exception &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot compare " << tasks_[task].path_ << ", it is written again: " << e.what();
+        same = false;
+      }
+
+      if (same)
+      {
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          AddUnchecked(task);
+        }
+
+        MarkCompleted(task, true);
+      }
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (same)
+        {
+          skipped_++;
+        }
+        else
+        {
+          toWrite_.push_back(task);
+        }
+
+        verified_++;
+        if (verified_ == verifications_.size())
+        {
+          ScheduleWrites();
+        }
+      }
+
+      progress_.notify_all();
+    }
+
+    // "exported" is false if the instance was removed
+    void MarkCompleted(size_t task,
+                       bool exported)
+    {
+      if (exported &&
+          manifest_ != NULL)
+      {
+        manifest_->Record(tasks_[task].path_, GetManifestEntry(task));
+      }
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        completed_++;
+        written_[task] = true;
+
+        // The files are written out of order: the checkpoint only
+        // covers the files before the first one that is not written
+        while (checkpoint_.filesCount_ < tasks_.size() &&
+               written_[checkpoint_.filesCount_])
+        {
+          UpdateFingerprint(checkpoint_.fingerprint_, tasks_[checkpoint_.filesCount_].path_);
+          checkpoint_.filesCount_++;
+        }
+      }
+
+      progress_.notify_all();
+    }
+
+    // Writes one file, whichever is ready first. Returns "false" if
+    // there is nothing left to write.
+    bool WriteNext()
+    {
+      size_t verification = 0;
+      bool hasVerification = false;
+      size_t copy = 0;
+      bool hasCopy = false;
+      size_t unchecked = 0;
+      bool hasUnchecked = false;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (nextVerification_ < verifications_.size())
+        {
+          verification = verifications_[nextVerification_++];
+          hasVerification = true;
+        }
+        else
+        {
+          // The other threads are comparing the last files
+          while (!scheduled_ &&
+                 !stopped_ &&
+                 error_.get() == NULL)
+          {
+            progress_.wait(lock);
+          }
+
+          if (!scheduled_)
+          {
+            return false;
+          }
+
+          if (nextUnchecked_ < unchecked_.size())
+          {
+            unchecked = unchecked_[nextUnchecked_++];
+            hasUnchecked = true;
+          }
+          else if (nextCopy_ < copies_.size())
+          {
+            copy = nextCopy_++;
+            hasCopy = true;
+          }
+        }
+      }
+
+      if (hasVerification)
+      {
+        Verify(verification);
+        return true;
+      }
+
+      if (hasUnchecked)
+      {
+        {
+          IoGovernor::Operation io(instanceLoader_.GetJob(), IoDirection_Read);
+          io.SetBytes(RecordFileChecksum(tasks_[unchecked].path_));
+        }
+
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          pendingChecksums_--;
+        }
+
+        progress_.notify_all();
+        return true;
+      }
+
+      if (hasCopy)
+      {
+        const WriteTask &task = tasks_[copies_[copy]];
+
+        StageMetrics::Timer timer;
+
+        {
+          IoGovernor::Operation io(instanceLoader_.GetJob(), IoDirection_Write);
+          CopyInstanceFile(task.instanceId_, task.path_, allowHardlink_);
+          io.SetBytes(task.uncompressedSize_);
+        }
+
+        writeStage_.AddBusy(timer, task.uncompressedSize_);
+        writer_.RecordWrittenFile(task.uncompressedSize_);
+
+        // The files are only copied without the checksums, as the copy
+        // would have to be read again: the former checksum is stale
+        if (checksums_ != NULL)
+        {
+          checksums_->Remove(task.path_);
+        }
+
+        MarkCompleted(copies_[copy], true);
+        return true;
+      }
+
+      size_t sequence;
+      std::string instanceId;
+      boost::shared_ptr<DicomBuffer> content;
+
+      {
+        // With the synchronous loader, this includes the time to read the instance
+        StageMetrics::Timer timer;
+        bool hasNext = instanceLoader_.GetNextDicom(sequence, instanceId, content);
+        writeStage_.AddIdle(timer);
+
+        if (!hasNext)
+        {
+          return false;
+        }
+      }
+
+      if (sequence >= loadedTasks_.size())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const std::string &path = tasks_[loadedTasks_[sequence]].path_;
+      const bool exported = (content.get() != NULL);
+
+      if (!exported)
+      {
+        LOG(WARNING) << "An instance was removed after the job was issued: " << instanceId;
+        writer_.SkipPlanned(path);
+      }
+      else
+      {
+        try
+        {
+          StageMetrics::Timer timer;
+
+          {
+            IoGovernor::Operation io(instanceLoader_.GetJob(), IoDirection_Write);
+
+            if (writer_.IsArchive() ||
+                content->GetExportedFile().empty() ||
+                !CopyExportedFile(content->GetExportedFile(), path, allowHardlink_))
+            {
+              writer_.WritePlanned(content->GetData(), content->GetSize(), path, content);
+            }
+            else
+            {
+              writer_.RecordWrittenFile(content->GetSize());
+            }
+
+            io.SetBytes(content->GetSize());
+          }
+
+          writeStage_.AddBusy(timer, content->GetSize());
+
+          if (!writer_.IsArchive())
+          {
+            instanceLoader_.RecordWrittenFile(instanceId, path);
+            RecordChecksum(path, content->GetData(), content->GetSize());
+          }
+        }
+        catch (Orthanc::OrthancException &e)
+        {
+          LOG(ERROR) << "[ExporterJob] ERROR while writing " << path << ": " << e.What();
+          throw;
+        }
+      }
+
+      MarkCompleted(loadedTasks_[sequence], exported);
+      return true;
+    }
+
+    static void WriterWorkerThread(WriterPool *that, size_t threadIndex)
+    {
+      Orthanc::Logging::SetCurrentThreadName(std::string("EXPORT-WRITE-") + boost::lexical_cast<std::string>(threadIndex));
+
+      while (true)
+      {
+        {
+          boost::mutex::scoped_lock lock(that->mutex_);
+          if (that->stopped_ ||
+              that->error_.get() != NULL)
+          {
+            return;
+          }
+        }
+
+        try
+        {
+          if (!that->WriteNext())
+          {
+            return;
+          }
+        }
+        catch (Orthanc::OrthancException &e)
+        {
+          {
+            boost::mutex::scoped_lock lock(that->mutex_);
+            if (that->error_.get() == NULL)
+            {
+              that->error_.reset(new Orthanc::OrthancException(e));
+            }
+          }
+
+          that->progress_.notify_all();
+          return;
+        }
+        catch (std::exception &e)
+        {
+          // An exception escaping the thread would terminate Orthanc
+          {
+            boost::mutex::scoped_lock lock(that->mutex_);
+            if (that->error_.get() == NULL)
+            {
+              that->error_.reset(new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, e.what()));
+            }
+          }
+
+          that->progress_.notify_all();
+          return;
+        }
+      }
+    }
+
+  public:
+    // With no thread, the files are written by Step(). The files
+    // covered by "resume" are not written again, if they are still the
+    // first files of the plan. If "manifest" is not NULL, the export is
+    // incremental: the files recorded in the manifest are skipped, and
+    // the other existing files are compared with their source before
+    // anything is loaded, so that only the changed files are written.
+    WriterPool(InstanceLoader &instanceLoader,
+               const DirectoryCommands &commands,
+               Saola::HierarchicalDirWriter &writer,
+               size_t threadCount,
+               const Checkpoint &resume,
+               ExportManifest *manifest,
+               ChecksumManifest *checksums,
+               bool computeChecksums,
+               const std::string &transferSyntax) : instanceLoader_(instanceLoader),
+                                                    writer_(writer),
+                                                    allowHardlink_(commands.IsAllowHardlink()),
+                                                    manifest_(manifest),
+                                                    checksums_(checksums),
+                                                    computeChecksums_(computeChecksums),
+                                                    transferSyntax_(transferSyntax),
+                                                    nextVerification_(0),
+                                                    verified_(0),
+                                                    skipped_(0),
+                                                    scheduled_(false),
+                                                    nextCopy_(0),
+                                                    nextUnchecked_(0),
+                                                    completed_(0),
+                                                    pendingChecksums_(0),
+                                                    stopped_(false)
+    {
+      commands.Plan(writer, tasks_);
+      written_.resize(tasks_.size(), false);
+
+      if (resume.filesCount_ > 0)
+      {
+        Checkpoint current;
+        while (current.filesCount_ < resume.filesCount_ &&
+               current.filesCount_ < tasks_.size())
+        {
+          UpdateFingerprint(current.fingerprint_, tasks_[current.filesCount_].path_);
+          current.filesCount_++;
+        }
+
+        if (current.filesCount_ == resume.filesCount_ &&
+            current.fingerprint_ == resume.fingerprint_)
+        {
+          LOG(WARNING) << "[ExporterJob] Resuming the export after " << resume.filesCount_ << " files already written";
+          checkpoint_ = resume;
+          completed_ = resume.filesCount_;
+          std::fill(written_.begin(), written_.begin() + resume.filesCount_, true);
+
+          for (size_t i = 0; i < resume.filesCount_; i++)
+          {
+            AddUnchecked(i);
+          }
+        }
+        else
+        {
+          LOG(WARNING) << "[ExporterJob] The exported resources have changed since the checkpoint, exporting all the files again";
+        }
+      }
+
+      for (size_t i = checkpoint_.filesCount_; i < tasks_.size(); i++)
+      {
+        if (manifest_ == NULL)
+        {
+          toWrite_.push_back(i);
+        }
+        else if (manifest_->IsUpToDate(tasks_[i].path_, GetManifestEntry(i)) &&
+                 (transferSyntax_.empty() ?
+                  HasSize(tasks_[i].path_, tasks_[i].uncompressedSize_) :
+                  boost::filesystem::is_regular_file(tasks_[i].path_)))
+        {
+          skipped_++;
+          AddUnchecked(i);
+          MarkCompleted(i, false);
+        }
+        else if (transferSyntax_.empty())
+        {
+          verifications_.push_back(i);
+        }
+        else
+        {
+          toWrite_.push_back(i);  // A transcoded file cannot be compared with its source
+        }
+      }
+
+      if (verifications_.empty())
+      {
+        ScheduleWrites();
+      }
+
+      writeStage_.SetThreads(threadCount);
+
+      for (size_t i = 0; i < threadCount; i++)
+      {
+        threads_.push_back(new boost::thread(WriterWorkerThread, this, i));
+      }
+    }
+
+    ~WriterPool()
+    {
+      Stop();
+    }
+
+    void Stop()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        stopped_ = true;
+      }
+
+      progress_.notify_all();
+
+      for (size_t i = 0; i < threads_.size(); i++)
+      {
+        if (threads_[i]->joinable())
+        {
+          threads_[i]->join();
+        }
+        delete threads_[i];
+      }
+
+      threads_.clear();
+    }
+
+    size_t GetTasksCount() const
+    {
+      return tasks_.size();
+    }
+
+    Checkpoint GetCheckpoint()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return checkpoint_;
+    }
+
+    // The plan does not change once the pool is created
+    void GetPaths(std::vector<std::string> &target,
+                  size_t from,
+                  size_t to) const
+    {
+      target.clear();
+
+      for (size_t i = from; i < to && i < tasks_.size(); i++)
+      {
+        target.push_back(tasks_[i].path_);
+      }
+    }
+
+    // Files of an incremental export that were already up-to-date
+    size_t GetSkippedCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return skipped_;
+    }
+
+    void FormatStatistics(Json::Value &target) const
+    {
+      writeStage_.Format(target["Write"]);
+
+      if (checksums_ != NULL &&
+          computeChecksums_)
+      {
+        checksumStage_.Format(target["Checksum"]);
+      }
+    }
+
+    // If there is no writer thread, writes files until "budgetMs" is
+    // elapsed (at least one file). Otherwise, waits until the threads
+    // have written all the files, or until "budgetMs" is elapsed.
+    // Returns the number of files written so far. The first error of
+    // the writer threads is rethrown here, so that it is reported by
+    // the job engine.
+    size_t Step(unsigned int budgetMs)
+    {
+      const boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(budgetMs);
+
+      if (threads_.empty())
+      {
+        while (GetCompletedCount() < GetTasksCount())
+        {
+          if (!WriteNext())
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+          }
+
+          if (boost::get_system_time() >= deadline)
+          {
+            break;
+          }
+        }
+
+        boost::mutex::scoped_lock lock(mutex_);
+        return GetCompletedCount();
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (GetCompletedCount() < GetTasksCount() &&
+             error_.get() == NULL)
+      {
+        if (!progress_.timed_wait(lock, deadline))
+        {
+          break;
+        }
+      }
+
+      if (error_.get() != NULL)
+      {
+        throw Orthanc::OrthancException(*error_);
+      }
+
+      return GetCompletedCount();
+    }
+  };
+
+  // ---------------------------------------------------------------------------------------
+
+  class ExporterJob::DirectoryWriterIterator : public boost::noncopyable
+  {
+  private:
+    InstanceLoader &instanceLoader_;
+    DirectoryCommands commands_;
+    std::unique_ptr<Saola::HierarchicalDirWriter> dir_;
+    std::unique_ptr<WriterPool> pool_;
+
+  public:
+    DirectoryWriterIterator(InstanceLoader &instanceLoader,
+                            ArchiveIndex &archive,
+                            const std::string rootDir,
+                            bool enableExtendedSopClass,
+                            unsigned int writerThreads,
+                            bool copyFiles,
+                            bool allowHardlink,
+                            const Checkpoint &resume,
+                            ExportManifest *manifest,
+                            ChecksumManifest *checksums,
+                            bool computeChecksums,
+                            const std::string &transferSyntax,
+                            ArchiveFormat archiveFormat,
+                            uint8_t compressionLevel,
+                            unsigned int expandThreads) : instanceLoader_(instanceLoader),
+                                                          commands_(copyFiles, allowHardlink)
+    {
+      ArchiveIndexVisitor visitor(commands_);
+      archive.Expand(PluginIndex::Instance(), expandThreads);
+      archive.Apply(visitor);
+
+      if (archiveFormat == ArchiveFormat_Directory)
+      {
+        dir_.reset(new Saola::HierarchicalDirWriter(rootDir)); // TODO hard code
+      }
+      else
+      {
+        dir_.reset(new Saola::HierarchicalDirWriter(rootDir, archiveFormat));
+        dir_->SetCompressionLevel(compressionLevel);
+      }
+
+      pool_.reset(new WriterPool(instanceLoader_, commands_, *dir_, writerThreads, resume, manifest, checksums, computeChecksums, transferSyntax));
+    }
+
+    void Close()
+    {
+      if (dir_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        if (pool_.get() != NULL)
+        {
+          pool_->Stop();
+        }
+
+        dir_->Close();
+      }
+    }
+
+    // The files written so far stay on the disk
+    void StopThreads()
+    {
+      if (pool_.get() != NULL)
+      {
+        pool_->Stop();
+      }
+    }
+
+    WriterPool &GetWriterPool()
+    {
+      if (pool_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        return *pool_;
+      }
+    }
+
+    // Makes the files of the plan in [from, to) durable
+    void SyncFiles(size_t from,
+                   size_t to)
+    {
+      if (dir_.get() == NULL ||
+          pool_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        std::vector<std::string> paths;
+        pool_->GetPaths(paths, from, to);
+        dir_->SyncFiles(paths);
+      }
+    }
+
+    uint64_t GetWrittenFilesCount()
+    {
+      if (dir_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        return dir_->GetWrittenFilesCount();
+      }
+    }
+
+    uint64_t GetWrittenBytes()
+    {
+      if (dir_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        return dir_->GetWrittenBytes();
+      }
+    }
+
+    uint64_t GetDirectorySize()
+    {
+      if (dir_.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+      else
+      {
+        return dir_->GetDirectorySize();
+      }
+    }
+
+    unsigned int GetInstancesCount() const
+    {
+      return commands_.GetInstancesCount();
+    }
+
+    uint64_t GetUncompressedSize() const
+    {
+      return commands_.GetUncompressedSize();
+    }
+  };
+
+  // ------------------------------------------------------------------------
+
+  ExporterJob::ExporterJob(bool enableExtendedSopClass,
+                           const std::string &rootDir,
+                           Orthanc::ResourceType jobLevel) : OrthancPlugins::OrthancJob(GetJobType()),
+                                                             archive_(new ArchiveIndex(GetArchiveResourceType(jobLevel))),
+                                                             jobLevel_(jobLevel),
+                                                             enableExtendedSopClass_(enableExtendedSopClass),
+                                                             rootDir_(rootDir)
+  {
+  }
+
+  ExporterJob::~ExporterJob()
+  {
+    LOG(INFO) << "[ExporterJob] Destructor called, cleaning up resources";
+
+    if (instanceLoader_.get() != NULL)
+    {
+      instanceLoader_->Clear();  // Wake up the writers waiting for an instance
+    }
+
+    writer_.reset();
+    LeaveCoordination();
+  }
+
+  const char *ExporterJob::GetJobType()
+  {
+    return "Exporter";
+  }
+
+  ExporterJob *ExporterJob::Unserialize(const Json::Value &serialized)
+  {
+    if (serialized.type() != Json::objectValue ||
+        !serialized.isMember(KEY_ROOT_DIRECTORY) ||
+        !serialized.isMember(KEY_LEVEL) ||
+        !serialized.isMember(KEY_RESOURCES) ||
+        serialized[KEY_RESOURCES].type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Cannot unserialize an export job");
+    }
+
+    std::unique_ptr<ExporterJob> job(new ExporterJob(serialized.get(KEY_EXTENDED_SOP_CLASS, false).asBool(),
+                                                     serialized[KEY_ROOT_DIRECTORY].asString(),
+                                                     Orthanc::StringToResourceType(serialized[KEY_LEVEL].asCString())));
+
+    job->description_ = serialized.get(KEY_DESCRIPTION, "").asString();
+
+    if (serialized.isMember(KEY_TRANSCODE))
+    {
+      job->transcode_ = true;
+      job->transferSyntax_ = Orthanc::GetTransferSyntax(serialized[KEY_TRANSCODE].asString());
+    }
+
+    job->loaderThreads_ = serialized.get(KEY_LOADER_THREADS, job->loaderThreads_).asUInt();
+    job->transcoderThreads_ = serialized.get(KEY_TRANSCODER_THREADS, job->transcoderThreads_).asUInt();
+    job->writerThreads_ = serialized.get(KEY_WRITER_THREADS, job->writerThreads_).asUInt();
+    job->expandThreads_ = serialized.get(KEY_EXPAND_THREADS, job->loaderThreads_).asUInt();  // Older jobs expanded with the loaders
+    job->zeroCopy_ = serialized.get(KEY_ZERO_COPY, job->zeroCopy_).asBool();
+    job->allowHardlink_ = serialized.get(KEY_ALLOW_HARDLINK, job->allowHardlink_).asBool();
+    job->mmapThreshold_ = serialized.get(KEY_MMAP_THRESHOLD, static_cast<Json::UInt64>(job->mmapThreshold_)).asUInt64();
+    job->loaderMemoryBudget_ = serialized.get(KEY_LOADER_MEMORY_BUDGET, static_cast<Json::UInt64>(job->loaderMemoryBudget_)).asUInt64();
+    job->stepBudgetMs_ = std::max(1u, serialized.get(KEY_STEP_BUDGET_MS, job->stepBudgetMs_).asUInt());
+    job->incremental_ = serialized.get(KEY_INCREMENTAL, job->incremental_).asBool();
+    job->archiveFormat_ = StringToArchiveFormat(serialized.get(KEY_ARCHIVE_FORMAT, EnumerationToString(job->archiveFormat_)).asString());
+    job->compressionLevel_ = static_cast<uint8_t>(serialized.get(KEY_COMPRESSION_LEVEL, job->compressionLevel_).asUInt());
+    job->deduplicate_ = serialized.get(KEY_DEDUPLICATE, job->deduplicate_).asBool();
+    job->ioShare_ = std::max(1u, serialized.get(KEY_IO_SHARE, job->ioShare_).asUInt());
+    job->checksums_ = serialized.get(KEY_CHECKSUMS, job->checksums_).asBool();
+
+    // The resources are only looked up by Start(), as the jobs are
+    // unserialized while Orthanc is starting
+    for (Json::Value::ArrayIndex i = 0; i < serialized[KEY_RESOURCES].size(); i++)
+    {
+      job->resources_.push_back(serialized[KEY_RESOURCES][i].asString());
+      job->unresolvedResources_.push_back(serialized[KEY_RESOURCES][i].asString());
+    }
+
+    if (serialized.isMember(KEY_CHECKPOINT))
+    {
+      // Only the Orthanc exceptions are handled by the unserializer of the jobs
+      const Json::Value &checkpoint = serialized[KEY_CHECKPOINT];
+      if (checkpoint.type() != Json::objectValue ||
+          !checkpoint.isMember(KEY_FILES_COUNT) ||
+          !checkpoint[KEY_FILES_COUNT].isUInt64() ||
+          !checkpoint.isMember(KEY_FINGERPRINT) ||
+          checkpoint[KEY_FINGERPRINT].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad checkpoint of an export job");
+      }
+
+      job->checkpoint_.filesCount_ = checkpoint[KEY_FILES_COUNT].asUInt64();
+
+      try
+      {
+        job->checkpoint_.fingerprint_ = boost::lexical_cast<uint64_t>(checkpoint[KEY_FINGERPRINT].asString());
+      }
+      catch (boost::bad_lexical_cast &)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                        "Bad fingerprint in the checkpoint of an export job: " + checkpoint[KEY_FINGERPRINT].asString());
+      }
+    }
+
+    job->Serialize();  // The job must stay serializable if Orthanc stops before it is started
+    return job.release();
+  }
+
+  void ExporterJob::Serialize()
+  {
+    Json::Value value = Json::objectValue;
+    value[KEY_DESCRIPTION] = description_;
+    value[KEY_ROOT_DIRECTORY] = rootDir_;
+    value[KEY_LEVEL] = Orthanc::EnumerationToString(jobLevel_);
+    value[KEY_EXTENDED_SOP_CLASS] = enableExtendedSopClass_;
+
+    value[KEY_RESOURCES] = Json::arrayValue;
+    for (std::list<std::string>::const_iterator it = resources_.begin(); it != resources_.end(); ++it)
+    {
+      value[KEY_RESOURCES].append(*it);
+    }
+
+    if (transcode_)
+    {
+      value[KEY_TRANSCODE] = Orthanc::GetTransferSyntaxUid(transferSyntax_);
+    }
+
+    value[KEY_LOADER_THREADS] = loaderThreads_;
+    value[KEY_TRANSCODER_THREADS] = transcoderThreads_;
+    value[KEY_WRITER_THREADS] = writerThreads_;
+    value[KEY_EXPAND_THREADS] = expandThreads_;
+    value[KEY_ZERO_COPY] = zeroCopy_;
+    value[KEY_ALLOW_HARDLINK] = allowHardlink_;
+    value[KEY_MMAP_THRESHOLD] = static_cast<Json::UInt64>(mmapThreshold_);
+    value[KEY_LOADER_MEMORY_BUDGET] = static_cast<Json::UInt64>(loaderMemoryBudget_);
+    value[KEY_STEP_BUDGET_MS] = stepBudgetMs_;
+    value[KEY_INCREMENTAL] = incremental_;
+    value[KEY_ARCHIVE_FORMAT] = EnumerationToString(archiveFormat_);
+    value[KEY_COMPRESSION_LEVEL] = compressionLevel_;
+    value[KEY_DEDUPLICATE] = deduplicate_;
+    value[KEY_IO_SHARE] = ioShare_;
+    value[KEY_CHECKSUMS] = checksums_;
+
+    value[KEY_CHECKPOINT] = Json::objectValue;
+    value[KEY_CHECKPOINT][KEY_FILES_COUNT] = static_cast<Json::UInt64>(checkpoint_.filesCount_);
+    value[KEY_CHECKPOINT][KEY_FINGERPRINT] = boost::lexical_cast<std::string>(checkpoint_.fingerprint_);
+
+    UpdateSerialized(value);
+  }
+
+  void ExporterJob::UpdateCheckpoint()
+  {
+    if (writer_.get() != NULL)
+    {
+      Checkpoint checkpoint = writer_->GetWriterPool().GetCheckpoint();
+
+      if (checkpoint.filesCount_ != checkpoint_.filesCount_ ||
+          checkpoint.fingerprint_ != checkpoint_.fingerprint_)
+      {
+        // The files are not synced as they are written: the files newly
+        // covered by the checkpoint must be on the disk before it is
+        // stored. Only these files are synced, not the whole filesystem.
+        if (checkpoint.filesCount_ > checkpoint_.filesCount_)
+        {
+          writer_->SyncFiles(checkpoint_.filesCount_, checkpoint.filesCount_);
+        }
+
+        checkpoint_ = checkpoint;
+        Serialize();
+      }
+    }
+  }
+
+  void ExporterJob::SetDescription(const std::string &description)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      description_ = description;
+    }
+  }
+
+  void ExporterJob::AddResource(const std::string &publicId)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    resources_.push_back(publicId);
+    ResolveResource(publicId);
+  }
+
+  void ExporterJob::ResolveResource(const std::string &publicId)
+  {
+    resourceIdentifiers_.reset(new ResourceIdentifiers(PluginIndex::Instance(), publicId));
+    archive_->Add(PluginIndex::Instance(), *resourceIdentifiers_);
+  }
+
+
+  void ExporterJob::SetTranscode(Orthanc::DicomTransferSyntax transferSyntax)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      this->transcode_ = true;
+      this->transferSyntax_ = transferSyntax;
+    }
+  }
+
+  void ExporterJob::SetLoaderThreads(unsigned int loaderThreads)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      loaderThreads_ = loaderThreads;
+    }
+  }
+
+  void ExporterJob::SetTranscoderThreads(unsigned int transcoderThreads)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      transcoderThreads_ = transcoderThreads;
+    }
+  }
+
+  void ExporterJob::SetExpandThreads(unsigned int expandThreads)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      expandThreads_ = expandThreads;
+    }
+  }
+
+  void ExporterJob::SetWriterThreads(unsigned int writerThreads)
+  {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
     {
-      ArchiveIndexVisitor visitor(commands_);
-      archive.Expand(PluginIndex::Instance());
-      archive.Apply(visitor);
-      dir_.reset(new Saola::HierarchicalDirWriter(rootDir)); // TODO hard code
+      writerThreads_ = writerThreads;
     }
+  }
 
-    void Close()
+  void ExporterJob::SetZeroCopy(bool zeroCopy,
+                                bool allowHardlink)
+  {
+    if (writer_.get() != NULL) // Already started
     {
-      if (dir_.get() == NULL)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
-      }
-      else
-      {
-        dir_->Close();
-      }
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
-
-    uint64_t GetDirectorySize() const
+    else
     {
-      if (dir_.get() == NULL)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
-      }
-      else
-      {
-        return dir_->GetDirectorySize();
-      }
+      zeroCopy_ = zeroCopy;
+      allowHardlink_ = allowHardlink;
     }
+  }
 
-    size_t GetStepsCount() const
+  void ExporterJob::SetMmapThreshold(uint64_t mmapThreshold)
+  {
+    if (writer_.get() != NULL) // Already started
     {
-      return commands_.GetSize() + 1;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
-
-    void RunStep(size_t index,
-                 bool transcode,
-                 Orthanc::DicomTransferSyntax transferSyntax)
+    else
     {
-      if (index > commands_.GetSize())
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
-      }
-      else if (dir_.get() == NULL)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
-      }
-      else if (index == commands_.GetSize())
-      {
-        // Last step: Do nothing. @TODO
-      }
-      else
-      {
-        commands_.Apply(*dir_, instanceLoader_, index, transcode, transferSyntax);
-      }
+      mmapThreshold_ = mmapThreshold;
     }
+  }
 
-    unsigned int GetInstancesCount() const
+  void ExporterJob::SetStepBudget(unsigned int budgetMs)
+  {
+    if (writer_.get() != NULL) // Already started
     {
-      return commands_.GetInstancesCount();
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
-
-    uint64_t GetUncompressedSize() const
+    else
     {
-      return commands_.GetUncompressedSize();
+      stepBudgetMs_ = std::max(1u, budgetMs);
     }
-  };
-
-  // ------------------------------------------------------------------------
+  }
 
-  ExporterJob::ExporterJob(bool enableExtendedSopClass,
-                           const std::string &rootDir,
-                           Orthanc::ResourceType jobLevel) : OrthancPlugins::OrthancJob("Exporter"),
-                                                             archive_(new ArchiveIndex(GetArchiveResourceType(jobLevel))),
-                                                             enableExtendedSopClass_(enableExtendedSopClass),
-                                                             rootDir_(rootDir)
+  void ExporterJob::SetLoaderMemoryBudget(uint64_t budget)
   {
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      loaderMemoryBudget_ = budget;
+    }
   }
 
-  ExporterJob::~ExporterJob()
+  void ExporterJob::SetIncremental(bool incremental)
   {
-    LOG(INFO) << "[ExporterJob] Destructor called, cleaning up resources";
+    if (writer_.get() != NULL) // Already started
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      incremental_ = incremental;
+    }
   }
 
-  void ExporterJob::SetDescription(const std::string &description)
+  void ExporterJob::SetArchiveFormat(ArchiveFormat format,
+                                     uint8_t compressionLevel)
   {
     if (writer_.get() != NULL) // Already started
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
+    else if (compressionLevel > 9)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "The compression level must be between 0 and 9");
+    }
     else
     {
-      description_ = description;
+      archiveFormat_ = format;
+      compressionLevel_ = compressionLevel;
     }
   }
 
-  void ExporterJob::AddResource(const std::string &publicId)
+  void ExporterJob::SetDeduplication(bool deduplicate)
   {
     if (writer_.get() != NULL) // Already started
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
-    resourceIdentifiers_.reset(new ResourceIdentifiers(PluginIndex::Instance(), publicId));
-    archive_->Add(PluginIndex::Instance(), *resourceIdentifiers_);
+    else
+    {
+      deduplicate_ = deduplicate;
+    }
   }
 
-
-  void ExporterJob::SetTranscode(Orthanc::DicomTransferSyntax transferSyntax)
+  void ExporterJob::SetChecksums(bool checksums)
   {
     if (writer_.get() != NULL) // Already started
     {
@@ -951,12 +2930,11 @@ namespace Saola
     }
     else
     {
-      this->transcode_ = true;
-      this->transferSyntax_ = transferSyntax;
+      checksums_ = checksums;
     }
   }
 
-  void ExporterJob::SetLoaderThreads(unsigned int loaderThreads)
+  void ExporterJob::SetIoShare(unsigned int share)
   {
     if (writer_.get() != NULL) // Already started
     {
@@ -964,36 +2942,193 @@ namespace Saola
     }
     else
     {
-      loaderThreads_ = loaderThreads;
+      ioShare_ = std::max(1u, share);
+    }
+  }
+
+  void ExporterJob::LeaveCoordination()
+  {
+    if (!coordinationGroup_.empty())
+    {
+      ExportCoordinator::Instance().Unregister(coordinationGroup_, this);
+      coordinationGroup_.clear();
+    }
+
+    IoGovernor::Instance().Unregister(this);
+  }
+
+  void ExporterJob::SaveManifest()
+  {
+    if (manifest_.get() != NULL)
+    {
+      // The export itself is not impacted: the next incremental export
+      // will compare the files that are not in the manifest
+      try
+      {
+        manifest_->Save();
+      }
+      catch (Orthanc::OrthancException &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot save the manifest of " << rootDir_ << ": " << e.What();
+      }
+      catch (std::exception &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot save the manifest of " << rootDir_ << ": " << e.what();
+      }
+    }
+
+    if (checksumManifest_.get() != NULL)
+    {
+      try
+      {
+        checksumManifest_->Save();
+      }
+      catch (Orthanc::OrthancException &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot save the checksums of " << rootDir_ << ": " << e.What();
+      }
+      catch (std::exception &e)
+      {
+        LOG(WARNING) << "[ExporterJob] Cannot save the checksums of " << rootDir_ << ": " << e.what();
+      }
+    }
+  }
+
+  void ExporterJob::StopThreads()
+  {
+    if (instanceLoader_.get() != NULL)
+    {
+      instanceLoader_->Clear();  // First, to wake up the writers waiting for an instance
+    }
+
+    if (writer_.get() != NULL)
+    {
+      writer_->StopThreads();
     }
+
+    UpdateCheckpoint();  // Once the writers are stopped, the checkpoint does not move anymore
+    writer_.reset();
+  }
+
+  void ExporterJob::PrepareRestart()
+  {
+    instanceLoader_.reset();
+    isStarted_ = false;
+    currentStep_ = 0;
+    startStep_ = 0;
+    startTime_ = boost::posix_time::ptime();
+    lastStatisticsUpdate_ = boost::posix_time::ptime();
+    lastCheckpoint_ = boost::posix_time::ptime();
   }
 
   void ExporterJob::Reset()
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
-                                    "Cannot resubmit the creation of an archive");
+    LOG(INFO) << "[ExporterJob::Reset] Resubmitted, resuming after " << checkpoint_.filesCount_ << " files";
+
+    StopThreads();
+    PrepareRestart();
   }
 
   void ExporterJob::Start()
   {
-    LOG(INFO) << "[ExporterJob::Start] Starting job with loaderThreads=" << loaderThreads_;
+    LOG(INFO) << "[ExporterJob::Start] Starting job with loaderThreads=" << loaderThreads_ << ", transcoderThreads=" << transcoderThreads_
+              << ", writerThreads=" << writerThreads_ << ", expandThreads=" << expandThreads_;
+
+    // Identify all the resources in a few REST calls
+    PluginIndex::Instance().Prefetch(unresolvedResources_);
+
+    for (std::list<std::string>::const_iterator it = unresolvedResources_.begin(); it != unresolvedResources_.end(); ++it)
+    {
+      ResolveResource(*it);
+    }
+
+    unresolvedResources_.clear();
+
+    if (deduplicate_)
+    {
+      coordinationGroup_ = ExportCoordinator::GetGroupKey(
+        resources_, transcode_ ? Orthanc::GetTransferSyntaxUid(transferSyntax_) : std::string());
+      ExportCoordinator::Instance().Register(coordinationGroup_, this);
+    }
+
+    IoGovernor::Instance().Register(this, ioShare_);
+
     if (loaderThreads_ == 0)
     {
       // default behaviour before loaderThreads was introducted in 1.10.0
-      instanceLoader_.reset(new SynchronousInstanceLoader(transcode_, transferSyntax_));
+      instanceLoader_.reset(new SynchronousInstanceLoader(transcode_, transferSyntax_, mmapThreshold_));
     }
     else
     {
-      instanceLoader_.reset(new ThreadedInstanceLoader(loaderThreads_, transcode_, transferSyntax_));
+      instanceLoader_.reset(new ThreadedInstanceLoader(loaderThreads_, transcoderThreads_, transcode_, transferSyntax_, mmapThreshold_,
+                                                       loaderMemoryBudget_));
     }
 
+    instanceLoader_->SetCoordination(coordinationGroup_, this);
+
     if (writer_.get() != NULL)
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
     }
     else
     {
-      writer_.reset(new DirectoryWriterIterator(*instanceLoader_, *archive_, rootDir_, enableExtendedSopClass_));
+      // An archive is a single stream, written from scratch: the files
+      // are neither copied, nor skipped, nor resumed
+      const bool isArchive = (archiveFormat_ != ArchiveFormat_Directory);
+
+      if (isArchive &&
+          incremental_)
+      {
+        LOG(WARNING) << "[ExporterJob::Start] Incremental exports are not available for archives, exporting all the files";
+      }
+
+      if (incremental_ &&
+          !isArchive)
+      {
+        manifest_.reset(new ExportManifest(rootDir_));
+        manifest_->Load();
+      }
+      else
+      {
+        manifest_.reset();
+      }
+
+      // Without the checksums, the file is still updated if it exists,
+      // so that the files written by this job lose their former checksum
+      if (!isArchive &&  // The archives have their own CRC32
+          (checksums_ ||
+           boost::filesystem::is_regular_file(boost::filesystem::path(rootDir_) / ChecksumManifest::GetFilename())))
+      {
+        checksumManifest_.reset(new ChecksumManifest(rootDir_));
+        checksumManifest_->Load();
+      }
+      else
+      {
+        checksumManifest_.reset();
+      }
+
+      if (zeroCopy_ &&
+          checksums_ &&
+          !isArchive)
+      {
+        LOG(INFO) << "[ExporterJob::Start] The instances are loaded instead of copied, so that their checksum is computed without reading them again";
+      }
+
+      writer_.reset(new DirectoryWriterIterator(*instanceLoader_, *archive_, rootDir_, enableExtendedSopClass_, writerThreads_,
+                                                zeroCopy_ && !transcode_ && !isArchive && !checksums_, allowHardlink_,
+                                                isArchive ? Checkpoint() : checkpoint_, manifest_.get(), checksumManifest_.get(), checksums_,
+                                                transcode_ ? Orthanc::GetTransferSyntaxUid(transferSyntax_) : std::string(),
+                                                archiveFormat_, compressionLevel_,
+                                                expandThreads_));
+
+      // The checkpoint is reset if it does not match the plan anymore
+      checkpoint_ = writer_->GetWriterPool().GetCheckpoint();
+      currentStep_ = checkpoint_.filesCount_;
+      Serialize();
+
+      startTime_ = boost::posix_time::microsec_clock::universal_time();
+      lastCheckpoint_ = startTime_;
+      startStep_ = currentStep_;
 
       instancesCount_ = writer_->GetInstancesCount();
       uncompressedSize_ = writer_->GetUncompressedSize();
@@ -1025,13 +3160,100 @@ namespace Saola
     };
   }
 
+  void ExporterJob::FormatPipelineStatistics(Json::Value &target) const
+  {
+    target = Json::objectValue;
+
+    if (instanceLoader_.get() != NULL)
+    {
+      instanceLoader_->FormatStatistics(target);
+    }
+
+    if (writer_.get() != NULL)
+    {
+      writer_->GetWriterPool().FormatStatistics(target);
+    }
+
+    IoGovernor::Instance().FormatStatistics(target["Io"], this);
+  }
+
+  void ExporterJob::FormatThroughput(Json::Value &target,
+                                     const Json::Value &pipeline) const
+  {
+    target = Json::objectValue;
+
+    if (writer_.get() == NULL ||
+        startTime_.is_not_a_date_time())
+    {
+      return;
+    }
+
+    const double elapsed = static_cast<double>(
+      (boost::posix_time::microsec_clock::universal_time() - startTime_).total_microseconds()) / 1000000.0;
+    const uint64_t bytes = writer_->GetWrittenBytes();
+    const size_t total = writer_->GetWriterPool().GetTasksCount();
+    const size_t processed = (currentStep_ > startStep_ ? currentStep_ - startStep_ : 0);
+
+    target["ElapsedSeconds"] = elapsed;
+    target["WrittenBytes"] = static_cast<Json::UInt64>(bytes);
+    target["WrittenFiles"] = static_cast<Json::UInt64>(writer_->GetWrittenFilesCount());
+
+    if (elapsed > 0)
+    {
+      const double instancesPerSecond = static_cast<double>(processed) / elapsed;
+      target["MBPerSecond"] = static_cast<double>(bytes) / static_cast<double>(MEGA_BYTES) / elapsed;
+      target["InstancesPerSecond"] = instancesPerSecond;
+
+      // Extrapolated from the files processed by this run, which
+      // includes the files skipped by an incremental export
+      if (currentStep_ >= total)
+      {
+        target["ETASeconds"] = 0.0;
+      }
+      else if (instancesPerSecond > 0)
+      {
+        target["ETASeconds"] = static_cast<double>(total - currentStep_) / instancesPerSecond;
+      }
+    }
+
+    std::string bottleneck;
+    double lowest = 0;
+
+    for (Json::Value::const_iterator it = pipeline.begin(); it != pipeline.end(); ++it)
+    {
+      if (!it->isMember("CapacityMBPerSecond"))
+      {
+        continue;  // Not a stage, e.g. "Io" or "Shared"
+      }
+
+      const double capacity = (*it)["CapacityMBPerSecond"].asDouble();
+      if ((*it)["Bytes"].asUInt64() > 0 &&
+          (bottleneck.empty() || capacity < lowest))
+      {
+        bottleneck = it.name();
+        lowest = capacity;
+      }
+    }
+
+    if (!bottleneck.empty())
+    {
+      target["Bottleneck"] = bottleneck;
+    }
+  }
+
   void ExporterJob::FinalizeTarget()
   {
     LOG(INFO) << "[ExporterJob::FinalizeTarget] Finalizing target";
-    directorySize_ = writer_->GetDirectorySize();
+
+    Json::Value pipeline, throughput;
+    FormatPipelineStatistics(pipeline);  // Before the writer is released
+    FormatThroughput(throughput, pipeline);
+    size_t skippedFiles = 0;
     if (writer_.get() != NULL)
     {
+      skippedFiles = writer_->GetWriterPool().GetSkippedCount();
       writer_->Close(); // Flush all the results
+      directorySize_ = writer_->GetDirectorySize();  // Once the archive is complete
       writer_.reset();
       LOG(INFO) << "[ExporterJob::FinalizeTarget] Writer closed and reset";
     }
@@ -1042,6 +3264,10 @@ namespace Saola
       LOG(INFO) << "[ExporterJob::FinalizeTarget] Instance loader cleared";
     }
 
+    LeaveCoordination();
+
+    SaveManifest();
+
     {
       Json::Value value = Json::objectValue;
       value[KEY_DESCRIPTION] = description_;
@@ -1052,6 +3278,16 @@ namespace Saola
       value[KEY_DIRECTORY_SIZE] = directorySize_;
       value[KEY_DIRECTORY_SIZE_MB] =
           static_cast<unsigned int>(directorySize_ / MEGA_BYTES);
+      value[KEY_PIPELINE] = pipeline;
+      value[KEY_THROUGHPUT] = throughput;
+      if (incremental_)
+      {
+        value[KEY_SKIPPED_FILES] = static_cast<Json::UInt64>(skippedFiles);
+      }
+      if (archiveFormat_ != ArchiveFormat_Directory)
+      {
+        value[KEY_ARCHIVE] = rootDir_ + ArchiveStreamWriter::GetExtension(archiveFormat_, compressionLevel_);
+      }
       value[KEY_RESOURCES] = Json::arrayValue;
       {
         Json::Value resource = Json::objectValue;
@@ -1078,48 +3314,105 @@ namespace Saola
 
     assert(writer_.get() != NULL);
 
-    {
-      UpdateProgress(static_cast<float>(currentStep_) /
-                     static_cast<float>(writer_->GetStepsCount() - 1));
-    }
+    // Without writer threads, each step writes as many files as fit in
+    // the step budget. Otherwise the files are written by the writer
+    // threads, and the steps only report the progress and the errors
+    // of the writers. In both cases, the job engine gets back control
+    // (to report the progress, or to pause or cancel the job) after
+    // about "stepBudgetMs_", whatever the number of files.
+    WriterPool &pool = writer_->GetWriterPool();
 
-    if (writer_->GetStepsCount() == 0)
-    {
-      FinalizeTarget();
-      return OrthancPluginJobStepStatus_Success;
-    }
-    else
+    if (currentStep_ < pool.GetTasksCount())
     {
       try
       {
-        writer_->RunStep(currentStep_, transcode_, transferSyntax_);
+        currentStep_ = pool.Step(stepBudgetMs_);
       }
       catch (Orthanc::OrthancException &e)
       {
         LOG(ERROR) << "[ExporterJob::Step] ERROR while creating an archive: " << e.What();
         throw;
       }
+    }
 
-      currentStep_++;
+    if (currentStep_ == pool.GetTasksCount())
+    {
+      FinalizeTarget();
+      return OrthancPluginJobStepStatus_Success;
+    }
+    else
+    {
+      UpdateProgress(static_cast<float>(currentStep_) /
+                     static_cast<float>(pool.GetTasksCount()));
 
-      if (currentStep_ == writer_->GetStepsCount())
+      const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      if (lastStatisticsUpdate_.is_not_a_date_time() ||
+          now - lastStatisticsUpdate_ >= boost::posix_time::milliseconds(STATISTICS_UPDATE_INTERVAL_MS))
       {
-        FinalizeTarget();
-        return OrthancPluginJobStepStatus_Success;
+        Json::Value value = Json::objectValue;
+        value[KEY_DESCRIPTION] = description_;
+        FormatPipelineStatistics(value[KEY_PIPELINE]);
+        FormatThroughput(value[KEY_THROUGHPUT], value[KEY_PIPELINE]);
+        UpdateContent(value);
+        lastStatisticsUpdate_ = now;
       }
-      else
+
+      if (now - lastCheckpoint_ >= boost::posix_time::milliseconds(CHECKPOINT_INTERVAL_MS))
       {
-        return OrthancPluginJobStepStatus_Continue;
+        UpdateCheckpoint();
+        lastCheckpoint_ = now;
       }
+
+      return OrthancPluginJobStepStatus_Continue;
     }
   }
 
   void ExporterJob::Stop(OrthancPluginJobStopReason reason)
   {
+    if (reason == OrthancPluginJobStopReason_Success)
+    {
+      return;  // Already finalized by Step()
+    }
+
+    // Otherwise, the threads would keep on exporting in the background,
+    // even while the job is paused
+    LOG(INFO) << "[ExporterJob::Stop] Stopping the loader and writer threads";
+
+    StopThreads();
+    LeaveCoordination();
+    SaveManifest();  // Keep track of the files written before the interruption
+
+    if (reason == OrthancPluginJobStopReason_Paused)
+    {
+      LOG(INFO) << "[ExporterJob::Stop] Paused, will resume after " << checkpoint_.filesCount_ << " files";
+      PrepareRestart();  // Start() is called again by the next step
+    }
   }
 
   const std::string &ExporterJob::GetContent() const
   {
     return this->content_;
   }
+
+  void ExporterJob::FormatProgress(Json::Value &target) const
+  {
+    target = Json::objectValue;
+    target[KEY_DESCRIPTION] = description_;
+
+    if (writer_.get() == NULL)
+    {
+      target["Progress"] = 0.0;  // Not started, or already finalized
+    }
+    else
+    {
+      const size_t total = writer_->GetWriterPool().GetTasksCount();
+      target["Progress"] = (total == 0 ? 1.0 : static_cast<double>(currentStep_) / static_cast<double>(total));
+      target["FilesCount"] = static_cast<Json::UInt64>(total);
+      target["WrittenFiles"] = static_cast<Json::UInt64>(currentStep_);
+
+      Json::Value pipeline;
+      FormatPipelineStatistics(pipeline);
+      FormatThroughput(target[KEY_THROUGHPUT], pipeline);
+    }
+  }
 }
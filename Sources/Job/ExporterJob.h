@@ -5,15 +5,20 @@
 #include <Enumerations.h>
 #include <list>
 #include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 #include <Compatibility.h>
 #include <Compression/ZipWriter.h>
 #include <TemporaryFile.h>
 
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+#include "ArchiveStreamWriter.h"
 
 namespace Saola
 {
+  class ExportManifest;
+  class ChecksumManifest;
+
   class ExporterJob : public OrthancPlugins::OrthancJob
   {
   private:
@@ -26,26 +31,92 @@ namespace Saola
     class SynchronousInstanceLoader;
     class ThreadedInstanceLoader;
     class DirectoryWriterIterator;
+    class WriterPool;
+    class StageMetrics;
+
+    // The first "filesCount_" planned files are known to be written,
+    // which allows to resume an interrupted export. "fingerprint_" is
+    // computed over the paths of these files, to detect a change of
+    // the plan (e.g. new or removed instances) between the two runs.
+    struct Checkpoint
+    {
+      size_t filesCount_ = 0;
+      uint64_t fingerprint_ = 0;
+    };
 
     std::unique_ptr<InstanceLoader> instanceLoader_;
     std::unique_ptr<ResourceIdentifiers> resourceIdentifiers_;
     boost::shared_ptr<ArchiveIndex> archive_;
+    Orthanc::ResourceType jobLevel_;
+    std::list<std::string> resources_;
+    std::list<std::string> unresolvedResources_;  // Of an unserialized job, resolved by Start()
     bool enableExtendedSopClass_ = false;
     std::string description_;
     std::string content_;
 
+    std::unique_ptr<ExportManifest> manifest_;  // Must outlive "writer_"
+    std::unique_ptr<ChecksumManifest> checksumManifest_;  // Idem
     boost::shared_ptr<DirectoryWriterIterator> writer_;
     size_t currentStep_ = 0;
     unsigned int instancesCount_ = 0;
     uint64_t uncompressedSize_ = 0;
     uint64_t directorySize_ = 0;
     std::string rootDir_;
+    Checkpoint checkpoint_;
 
     bool isStarted_ = false;
-    bool transcode_;
+    bool transcode_ = false;
     Orthanc::DicomTransferSyntax transferSyntax_ = Orthanc::DicomTransferSyntax_LittleEndianImplicit;
 
     unsigned int loaderThreads_ = 0;
+    unsigned int transcoderThreads_ = 0;
+    unsigned int writerThreads_ = 0;
+    unsigned int expandThreads_ = 0;
+    bool zeroCopy_ = false;
+    bool allowHardlink_ = false;
+    uint64_t mmapThreshold_ = 0;
+    uint64_t loaderMemoryBudget_ = 256 * 1024 * 1024;
+    unsigned int stepBudgetMs_ = 200;
+    bool incremental_ = false;
+    ArchiveFormat archiveFormat_ = ArchiveFormat_Directory;
+    uint8_t compressionLevel_ = 6;
+    bool deduplicate_ = false;
+    std::string coordinationGroup_;  // Of ExportCoordinator, empty if not registered
+    unsigned int ioShare_ = 1;
+    bool checksums_ = false;
+
+    boost::posix_time::ptime lastStatisticsUpdate_;
+    boost::posix_time::ptime lastCheckpoint_;
+    boost::posix_time::ptime startTime_;  // Of this run, set by Start()
+    size_t startStep_ = 0;                // Files already written by a previous run
+
+    void FormatPipelineStatistics(Json::Value &target) const;
+
+    // Live MB/s, instances/s and ETA, plus the stage that limits the
+    // throughput according to "pipeline"
+    void FormatThroughput(Json::Value &target,
+                          const Json::Value &pipeline) const;
+
+    void ResolveResource(const std::string &publicId);
+
+    // Stores the parameters of the job and its checkpoint, so that the
+    // job can be resumed after a restart of Orthanc
+    void Serialize();
+
+    void UpdateCheckpoint();
+
+    // Stops the loader and the writer threads, then stores the
+    // checkpoint of the files they wrote
+    void StopThreads();
+
+    // The next step starts the export again, from the checkpoint
+    void PrepareRestart();
+
+    // Saves the ExportManifest and the ChecksumManifest
+    void SaveManifest();
+
+    // Leaves the ExportCoordinator group and the IoGovernor
+    void LeaveCoordination();
 
     void FinalizeTarget();
 
@@ -54,6 +125,11 @@ namespace Saola
                 const std::string& rootDir,
                 Orthanc::ResourceType jobLevel);
 
+    static const char* GetJobType();
+
+    // Recreates a job from the output of Serialize(), the files that
+    // were already written are not exported again
+    static ExporterJob* Unserialize(const Json::Value &serialized);
 
 
     void SetDescription(const std::string &description);
@@ -69,10 +145,74 @@ namespace Saola
 
     void SetLoaderThreads(unsigned int loaderThreads);
 
+    // Threads dedicated to the transcoding, so that the CPU-bound
+    // transcoding is sized independently of the I/O-bound loaders. 0
+    // transcodes in the loader threads. Only used if "loaderThreads" > 0.
+    void SetTranscoderThreads(unsigned int transcoderThreads);
+
+    // 0 writes the files from Step(), otherwise the files are written
+    // in parallel by a pool of threads
+    void SetWriterThreads(unsigned int writerThreads);
+
+    // Concurrent lookups of the resources when the export is planned,
+    // independently of the loaders that read the storage
+    void SetExpandThreads(unsigned int expandThreads);
+
+    // Copy the "file://" instances with reflinks, hard links (only if
+    // allowed) or in-kernel copies when they are not transcoded
+    void SetZeroCopy(bool zeroCopy,
+                     bool allowHardlink);
+
+    // The "file://" instances of at least this size (in bytes) are
+    // mapped in memory instead of being read, 0 to always read them
+    void SetMmapThreshold(uint64_t mmapThreshold);
+
+    // Maximum duration of one step of the job: the files are written
+    // by batches instead of one step per file, which would be a lot of
+    // overhead in the job engine for large studies
+    void SetStepBudget(unsigned int budgetMs);
+
+    // Maximum number of bytes of instances loaded ahead of the writers
+    // by the loader threads
+    void SetLoaderMemoryBudget(uint64_t budget);
+
+    // Skip the files that are already present in the root directory
+    // with the same content, typically after a previous export of the
+    // same resources. See ExportManifest.
+    void SetIncremental(bool incremental);
+
+    // Stream the export into a single tar or ZIP file, next to the
+    // root directory, instead of one file per instance. The files are
+    // compressed in parallel by the writer threads. 0 does not compress.
+    void SetArchiveFormat(ArchiveFormat format,
+                          uint8_t compressionLevel);
+
+    // Share the loaded and transcoded instances with the other jobs
+    // that export the same resources at the same time, with the same
+    // transcoding. See ExportCoordinator.
+    void SetDeduplication(bool deduplicate);
+
+    // Write the CRC32C of the exported files in the root directory,
+    // computed by the writer threads on the buffers they write. Not
+    // available for the archives. The instances are then loaded, even
+    // if zero-copy is enabled. See ChecksumManifest.
+    void SetChecksums(bool checksums);
+
+    // Weight of the job in the IoGovernor when the storage is shared
+    // with other exports, 1 by default
+    void SetIoShare(unsigned int share);
+
     const std::string &GetContent() const;
 
+    // Files written so far and live throughput, for the exports that
+    // are not run by the job engine (see ExportExecutor). Must be
+    // called from the thread that calls Step().
+    void FormatProgress(Json::Value &target) const;
+
     void Start();
 
+    // Called when a failed or canceled job is resubmitted: the export
+    // is resumed from the last checkpoint
     virtual void Reset() override;
 
     virtual OrthancPluginJobStepStatus Step() override;
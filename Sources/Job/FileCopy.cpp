@@ -0,0 +1,278 @@
+#include "FileCopy.h"
+
+#include <OrthancException.h>
+#include <Logging.h>
+
+#include <memory>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/noncopyable.hpp>
+
+#if defined(__linux__)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/ioctl.h>
+#  include <sys/sendfile.h>
+#  include <sys/stat.h>
+#  include <linux/fs.h>
+#endif
+
+namespace Saola
+{
+  const char* EnumerationToString(FileCopyMethod method)
+  {
+    switch (method)
+    {
+      case FileCopyMethod_Reflink:
+        return "Reflink";
+
+      case FileCopyMethod_Hardlink:
+        return "Hardlink";
+
+      case FileCopyMethod_CopyFileRange:
+        return "CopyFileRange";
+
+      case FileCopyMethod_Sendfile:
+        return "Sendfile";
+
+      case FileCopyMethod_Buffered:
+        return "Buffered";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+#if defined(__linux__)
+  namespace
+  {
+    class FileDescriptor : public boost::noncopyable
+    {
+    private:
+      int fd_;
+
+    public:
+      explicit FileDescriptor(int fd) : fd_(fd)
+      {
+      }
+
+      ~FileDescriptor()
+      {
+        Close();
+      }
+
+      int Get() const
+      {
+        return fd_;
+      }
+
+      bool IsValid() const
+      {
+        return fd_ >= 0;
+      }
+
+      void Close()
+      {
+        if (fd_ >= 0)
+        {
+          close(fd_);
+          fd_ = -1;
+        }
+      }
+    };
+  }
+
+  static int OpenTarget(const std::string& target)
+  {
+    int fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                      "Cannot create file: " + target);
+    }
+
+    return fd;
+  }
+
+  // Returns "false" if nothing was copied because the method is not
+  // supported between these two files, so that the next one can be tried
+  static bool CopyInKernel(int sourceFd,
+                           int targetFd,
+                           uint64_t size,
+                           bool useCopyFileRange,
+                           const std::string& target)
+  {
+    uint64_t copied = 0;
+
+    while (copied < size)
+    {
+      ssize_t count;
+
+      if (useCopyFileRange)
+      {
+        count = copy_file_range(sourceFd, NULL, targetFd, NULL, size - copied, 0);
+      }
+      else
+      {
+        count = sendfile(targetFd, sourceFd, NULL, size - copied);
+      }
+
+      if (count < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        else if (copied == 0 &&
+                 (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                  errno == EOPNOTSUPP || errno == EBADF))
+        {
+          return false;
+        }
+        else
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                          "Cannot copy to file: " + target);
+        }
+      }
+      else if (count == 0)
+      {
+        // The source was truncated in the meantime
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile,
+                                        "Short copy to file " + target + ": " + boost::lexical_cast<std::string>(copied) +
+                                        " bytes out of " + boost::lexical_cast<std::string>(size));
+      }
+
+      copied += static_cast<uint64_t>(count);
+    }
+
+    return true;
+  }
+
+  static void CopyBuffered(int sourceFd,
+                           int targetFd,
+                           uint64_t size,
+                           const std::string& target)
+  {
+    char buffer[64 * 1024];
+    uint64_t copied = 0;
+
+    while (true)
+    {
+      ssize_t count = read(sourceFd, buffer, sizeof(buffer));
+      if (count < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      else if (count < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                        "Cannot read while copying to file: " + target);
+      }
+      else if (count == 0)
+      {
+        if (copied != size)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile,
+                                          "Short copy to file " + target + ": " + boost::lexical_cast<std::string>(copied) +
+                                          " bytes out of " + boost::lexical_cast<std::string>(size));
+        }
+
+        return;
+      }
+
+      ssize_t written = 0;
+      while (written < count)
+      {
+        ssize_t tmp = write(targetFd, buffer + written, count - written);
+        if (tmp < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        else if (tmp < 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                          "Cannot write file: " + target);
+        }
+
+        written += tmp;
+      }
+
+      copied += static_cast<uint64_t>(count);
+    }
+  }
+
+  FileCopyMethod CopyFile(const std::string& source,
+                          const std::string& target,
+                          bool allowHardlink)
+  {
+    FileDescriptor sourceFd(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!sourceFd.IsValid())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot read file: " + source);
+    }
+
+    struct stat info;
+    if (fstat(sourceFd.Get(), &info) != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot read file: " + source);
+    }
+
+    std::unique_ptr<FileDescriptor> targetFd(new FileDescriptor(OpenTarget(target)));
+
+    if (ioctl(targetFd->Get(), FICLONE, sourceFd.Get()) == 0)
+    {
+      return FileCopyMethod_Reflink;
+    }
+
+    if (allowHardlink)
+    {
+      // "link()" fails with EXDEV if the target is on another filesystem
+      targetFd->Close();
+      if (unlink(target.c_str()) == 0 &&
+          link(source.c_str(), target.c_str()) == 0)
+      {
+        return FileCopyMethod_Hardlink;
+      }
+
+      targetFd.reset(new FileDescriptor(OpenTarget(target)));
+    }
+
+    const uint64_t size = static_cast<uint64_t>(info.st_size);
+
+    if (CopyInKernel(sourceFd.Get(), targetFd->Get(), size, true, target))
+    {
+      return FileCopyMethod_CopyFileRange;
+    }
+
+    if (CopyInKernel(sourceFd.Get(), targetFd->Get(), size, false, target))
+    {
+      return FileCopyMethod_Sendfile;
+    }
+
+    CopyBuffered(sourceFd.Get(), targetFd->Get(), size, target);
+    return FileCopyMethod_Buffered;
+  }
+
+#else
+
+  FileCopyMethod CopyFile(const std::string& source,
+                          const std::string& target,
+                          bool allowHardlink)
+  {
+    if (!boost::filesystem::is_regular_file(source))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot read file: " + source);
+    }
+
+    boost::filesystem::remove(target);
+    boost::filesystem::copy_file(source, target);
+    return FileCopyMethod_Buffered;
+  }
+
+#endif
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+namespace Saola
+{
+  enum FileCopyMethod
+  {
+    FileCopyMethod_Reflink,        // Blocks shared with the source (copy-on-write filesystems)
+    FileCopyMethod_Hardlink,       // Same inode as the source
+    FileCopyMethod_CopyFileRange,  // In-kernel copy, possibly offloaded to the storage
+    FileCopyMethod_Sendfile,       // In-kernel copy
+    FileCopyMethod_Buffered        // Read/write through a small user-space buffer
+  };
+
+  const char* EnumerationToString(FileCopyMethod method);
+
+  // Copies "source" to "target" (which is overwritten) without loading
+  // the file in memory, using the cheapest method supported by the
+  // filesystems. Hard links are only created if "allowHardlink" is
+  // set, as the target then shares its content with the source.
+  // Throws ErrorCode_InexistentFile if the source cannot be opened,
+  // and ErrorCode_CorruptedFile if it gets shorter during the copy.
+  FileCopyMethod CopyFile(const std::string& source,
+                          const std::string& target,
+                          bool allowHardlink);
+}
@@ -22,14 +22,24 @@
 
 #include "HierarchicalDirWriter.h"
 
+#include <Logging.h>
 #include <Toolbox.h>
 #include <SystemToolbox.h>
 
+#include <set>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
+#if defined(__linux__)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <string.h>
+#  include <unistd.h>
+#endif
+
 namespace Saola
 {
   std::string HierarchicalDirWriter::Index::KeepAlphanumeric(const std::string &source)
@@ -148,7 +158,29 @@ namespace Saola
     stack_.pop_back();
   }
 
-  HierarchicalDirWriter::HierarchicalDirWriter(const std::string& root) : root_(root)
+  HierarchicalDirWriter::HierarchicalDirWriter(const std::string& root) :
+    root_(root),
+    format_(ArchiveFormat_Directory),
+    isZip64_(true),
+    compressionLevel_(0),
+    plannedCount_(0),
+    writtenFiles_(0),
+    writtenBytes_(0),
+    hasCurrentFile_(false)
+  {
+    RemoveTemporaryFiles(root_);
+  }
+
+  HierarchicalDirWriter::HierarchicalDirWriter(const std::string& root,
+                                               ArchiveFormat format) :
+    root_(root),
+    format_(format),
+    isZip64_(true),
+    compressionLevel_(format == ArchiveFormat_Zip ? 6 : 0),
+    plannedCount_(0),
+    writtenFiles_(0),
+    writtenBytes_(0),
+    hasCurrentFile_(false)
   {
   }
 
@@ -156,22 +188,76 @@ namespace Saola
   {
   }
 
+  ArchiveStreamWriter& HierarchicalDirWriter::GetArchive()
+  {
+    boost::mutex::scoped_lock lock(archiveMutex_);
+
+    if (archive_.get() == NULL)
+    {
+      archive_.reset(new ArchiveStreamWriter(GetArchivePath(), format_, compressionLevel_, isZip64_));
+    }
+
+    return *archive_;
+  }
+
+  size_t HierarchicalDirWriter::TakePlannedEntry(const std::string &planned)
+  {
+    boost::mutex::scoped_lock lock(archiveMutex_);
+
+    std::map<std::string, size_t>::iterator found = plannedEntries_.find(planned);
+    if (found == plannedEntries_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls, "Not a planned file: " + planned);
+    }
+
+    const size_t index = found->second;
+    plannedEntries_.erase(found);
+    return index;
+  }
+
+  std::string HierarchicalDirWriter::GetArchivePath() const
+  {
+    if (!IsArchive())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    return root_ + ArchiveStreamWriter::GetExtension(format_, compressionLevel_);
+  }
+
   void HierarchicalDirWriter::SetZip64(bool isZip64)
   {
+    if (archive_.get() != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    isZip64_ = isZip64;
   }
 
   bool HierarchicalDirWriter::IsZip64() const
   {
-    return true;
+    return isZip64_;
   }
 
   void HierarchicalDirWriter::SetCompressionLevel(uint8_t level)
   {
+    if (archive_.get() != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    if (level > 9)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    compressionLevel_ = level;
   }
 
   uint8_t HierarchicalDirWriter::GetCompressionLevel() const
   {
-    return 1;
+    return compressionLevel_;
   }
 
   void HierarchicalDirWriter::SetAppendToExisting(bool append)
@@ -183,18 +269,36 @@ namespace Saola
     return true;
   }
 
+  void HierarchicalDirWriter::FlushCurrentFile()
+  {
+    if (hasCurrentFile_)
+    {
+      WritePlanned(currentData_.c_str(), currentData_.size(), currentFile_);
+      hasCurrentFile_ = false;
+      currentData_.clear();
+    }
+  }
+
   void HierarchicalDirWriter::OpenFile(const char *name)
   {
+    FlushCurrentFile();
+    currentFile_ = PlanFile(name);
+    hasCurrentFile_ = true;
   }
 
   void HierarchicalDirWriter::OpenDirectory(const char *name)
   {
     indexer_.OpenDirectory(name);
-    std::string p = indexer_.GetCurrentDirectoryPath();
 
-    boost::filesystem::path path = root_;
-    path /= p;
-    boost::filesystem::create_directories(path);
+    if (!IsArchive())
+    {
+      std::string p = indexer_.GetCurrentDirectoryPath();
+
+      boost::filesystem::path path = root_;
+      path /= p;
+      boost::filesystem::create_directories(path);
+      RemoveTemporaryFiles(path.string());
+    }
   }
 
   void HierarchicalDirWriter::CloseDirectory()
@@ -209,23 +313,342 @@ namespace Saola
 
   void HierarchicalDirWriter::Write(const void *data, size_t length)
   {
+    if (!hasCurrentFile_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    currentData_.append(reinterpret_cast<const char *>(data), length);
   }
 
   void HierarchicalDirWriter::Write(const std::string &data, const char *name)
   {
-    boost::filesystem::path path = this->root_;
-    path /= indexer_.OpenFile(name);
-    Orthanc::SystemToolbox::WriteFile(data.c_str(), data.size(), path.string(), false);
+    WritePlanned(data.c_str(), data.size(), PlanFile(name));
+  }
+
+  void HierarchicalDirWriter::Write(const void *data, size_t size, const char *name)
+  {
+    WritePlanned(data, size, PlanFile(name));
+  }
+
+  std::string HierarchicalDirWriter::PlanFile(const char *name)
+  {
+    if (IsArchive())
+    {
+      std::string planned = indexer_.OpenFile(name);
+
+      boost::mutex::scoped_lock lock(archiveMutex_);
+      plannedEntries_[planned] = plannedCount_++;
+      return planned;
+    }
+    else
+    {
+      boost::filesystem::path path = this->root_;
+      path /= indexer_.OpenFile(name);
+      return path.string();
+    }
+  }
+
+  void HierarchicalDirWriter::WritePlanned(const void *data, size_t size, const std::string &planned)
+  {
+    WritePlanned(data, size, planned, boost::shared_ptr<void>());
+  }
+
+  void HierarchicalDirWriter::WritePlanned(const void *data, size_t size, const std::string &planned,
+                                           const boost::shared_ptr<void> &owner)
+  {
+    if (IsArchive())
+    {
+      const size_t index = TakePlannedEntry(planned);
+      GetArchive().AddEntry(index, planned, data, size, owner);
+    }
+    else
+    {
+      WriteFile(data, size, planned);
+    }
+
+    RecordWrittenFile(size);
+  }
+
+  void HierarchicalDirWriter::SkipPlanned(const std::string &planned)
+  {
+    if (IsArchive())
+    {
+      const size_t index = TakePlannedEntry(planned);
+      GetArchive().SkipEntry(index);
+    }
+  }
+
+  void HierarchicalDirWriter::RecordWrittenFile(uint64_t size)
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    writtenFiles_++;
+    writtenBytes_ += size;
+  }
+
+  uint64_t HierarchicalDirWriter::GetWrittenFilesCount()
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    return writtenFiles_;
+  }
+
+  uint64_t HierarchicalDirWriter::GetWrittenBytes()
+  {
+    boost::mutex::scoped_lock lock(statisticsMutex_);
+    return writtenBytes_;
+  }
+
+  void HierarchicalDirWriter::WriteFile(const std::string &data, const std::string &path)
+  {
+    WriteFile(data.c_str(), data.size(), path);
+  }
+
+#if defined(__linux__)
+  static void WriteTemporaryFile(const void *data, size_t size, const std::string &path)
+  {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot create " + path + ": " + strerror(errno));
+    }
+
+    // Reserve the blocks at once, so that the file is not fragmented
+    // by the concurrent writers. Not supported by all the filesystems.
+    if (size > 0)
+    {
+      fallocate(fd, 0, 0, static_cast<off_t>(size));
+    }
+
+    const char *p = reinterpret_cast<const char *>(data);
+    size_t remaining = size;
+
+    while (remaining > 0)
+    {
+      ssize_t written = write(fd, p, remaining);
+      if (written < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      else if (written <= 0)
+      {
+        const std::string message = strerror(errno);
+        close(fd);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot write " + path + ": " + message);
+      }
+
+      p += written;
+      remaining -= static_cast<size_t>(written);
+    }
+
+    if (close(fd) != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot write " + path + ": " + strerror(errno));
+    }
+  }
+#endif
+
+  void HierarchicalDirWriter::WriteFile(const void *data, size_t size, const std::string &path)
+  {
+    const std::string temporary = GetTemporaryPath(path);
+
+    try
+    {
+#if defined(__linux__)
+      WriteTemporaryFile(data, size, temporary);
+#else
+      Orthanc::SystemToolbox::WriteFile(data, size, temporary, false);
+#endif
+    }
+    catch (Orthanc::OrthancException &)
+    {
+      boost::system::error_code error;
+      boost::filesystem::remove(temporary, error);
+      throw;
+    }
+
+    CommitTemporaryFile(temporary, path);
+  }
+
+  std::string HierarchicalDirWriter::GetTemporaryPath(const std::string &path)
+  {
+    // Hidden, and never a valid exported name (see KeepAlphanumeric())
+    boost::filesystem::path p(path);
+    return (p.parent_path() / ("." + p.filename().string() + ".tmp")).string();
+  }
+
+  void HierarchicalDirWriter::RemoveTemporaryFiles(const std::string &directory)
+  {
+    boost::system::error_code error;
+    boost::filesystem::directory_iterator it(directory, error);
+
+    if (error)
+    {
+      return;  // Not created yet
+    }
+
+    for (; it != boost::filesystem::directory_iterator(); it.increment(error))
+    {
+      if (error)
+      {
+        break;
+      }
+
+      const std::string name = it->path().filename().string();
+      if (name.size() > 5 &&
+          name[0] == '.' &&
+          boost::algorithm::ends_with(name, ".tmp"))
+      {
+        boost::system::error_code ignored;
+        if (boost::filesystem::is_regular_file(it->path(), ignored) &&
+            boost::filesystem::remove(it->path(), ignored))
+        {
+          LOG(INFO) << "[HierarchicalDirWriter] Removed the stale temporary file " << it->path().string();
+        }
+      }
+    }
+  }
+
+  void HierarchicalDirWriter::CommitTemporaryFile(const std::string &temporaryPath,
+                                                  const std::string &path)
+  {
+    boost::system::error_code error;
+    boost::filesystem::rename(temporaryPath, path, error);
+
+    if (error)
+    {
+      boost::system::error_code ignored;
+      boost::filesystem::remove(temporaryPath, ignored);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot rename " + temporaryPath + ": " + error.message());
+    }
+  }
+
+  void HierarchicalDirWriter::Sync()
+  {
+    if (IsArchive())
+    {
+      return;  // The archive is synced once complete
+    }
+
+#if defined(__linux__)
+    // Flushes the data and the renames of all the files at once
+    int fd = open(root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      LOG(WARNING) << "[HierarchicalDirWriter] Cannot open " << root_ << " to sync it: " << strerror(errno);
+      return;
+    }
+
+    if (syncfs(fd) != 0)
+    {
+      const std::string message = strerror(errno);
+      close(fd);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot sync " + root_ + ": " + message);
+    }
+
+    close(fd);
+#endif
+  }
+
+#if defined(__linux__)
+  static void SyncPath(const std::string &path,
+                       bool isDirectory)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | (isDirectory ? O_DIRECTORY : 0));
+    if (fd < 0)
+    {
+      if (errno == ENOENT)
+      {
+        return;  // E.g. the instance was removed
+      }
+
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot open " + path + " to sync it: " + strerror(errno));
+    }
+
+    if (fsync(fd) != 0)
+    {
+      const std::string message = strerror(errno);
+      close(fd);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Cannot sync " + path + ": " + message);
+    }
+
+    close(fd);
+  }
+#endif
+
+  void HierarchicalDirWriter::SyncFiles(const std::vector<std::string> &paths)
+  {
+    if (IsArchive())
+    {
+      return;  // The archive is synced once complete
+    }
+
+#if defined(__linux__)
+    std::set<std::string> directories;
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      SyncPath(paths[i], false);
+      directories.insert(boost::filesystem::path(paths[i]).parent_path().string());
+    }
+
+    // The renames of the temporary files are in the directories
+    for (std::set<std::string>::const_iterator it = directories.begin(); it != directories.end(); ++it)
+    {
+      SyncPath(it->empty() ? "." : *it, true);
+    }
+#endif
   }
 
   void HierarchicalDirWriter::Close()
   {
+    FlushCurrentFile();
+
+    if (IsArchive())
+    {
+      GetArchive().Close();
+    }
+    else
+    {
+      Sync();
+    }
   }
 
-  uint64_t HierarchicalDirWriter::GetDirectorySize() const
+  uint64_t HierarchicalDirWriter::GetDirectorySize()
   {
-    // @TODO
-    return 1;
-    // return Orthanc::SystemToolbox::GetFileSize(this->root_);
+    if (IsArchive())
+    {
+      return GetArchive().GetSize();
+    }
+    else
+    {
+      uint64_t size = 0;
+
+      boost::system::error_code error;
+      boost::filesystem::recursive_directory_iterator it(root_, error);
+
+      if (!error)
+      {
+        for (; it != boost::filesystem::recursive_directory_iterator(); it.increment(error))
+        {
+          if (error)
+          {
+            LOG(WARNING) << "[HierarchicalDirWriter] Cannot list " << root_ << ", its size is incomplete: " << error.message();
+            break;
+          }
+
+          boost::system::error_code ignored;
+          if (boost::filesystem::is_regular_file(it->status()))
+          {
+            const uint64_t fileSize = boost::filesystem::file_size(it->path(), ignored);
+            if (!ignored)
+            {
+              size += fileSize;
+            }
+          }
+        }
+      }
+
+      return size;
+    }
   }
 }
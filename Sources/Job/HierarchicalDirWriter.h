@@ -23,11 +23,16 @@
 
 #pragma once
 
+#include "ArchiveStreamWriter.h"
+
 #include <Compression/ZipWriter.h>
 
 #include <map>
 #include <list>
+#include <memory>
+#include <vector>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
 
 #if ORTHANC_BUILD_UNIT_TESTS == 1
 #  include <gtest/gtest_prod.h>
@@ -81,12 +86,40 @@ namespace Saola
     Index indexer_;
 
     std::string root_;
+    ArchiveFormat format_;
+    bool isZip64_;
+    uint8_t compressionLevel_;
+
+    boost::mutex archiveMutex_;
+    std::unique_ptr<ArchiveStreamWriter> archive_;  // Created by the first entry
+    std::map<std::string, size_t> plannedEntries_;  // Index in the archive of the planned files not written yet
+    size_t plannedCount_;
+
+    boost::mutex statisticsMutex_;
+    uint64_t writtenFiles_;
+    uint64_t writtenBytes_;
+
+    bool hasCurrentFile_;
+    std::string currentFile_;   // Opened by OpenFile(), filled by Write()
+    std::string currentData_;
+
+    ArchiveStreamWriter& GetArchive();
+
+    size_t TakePlannedEntry(const std::string& planned);
+
+    void FlushCurrentFile();
 
   public:
     explicit HierarchicalDirWriter(const std::string& root);
 
+    // With an archive format, the hierarchy is streamed into the single
+    // file "root" + ArchiveStreamWriter::GetExtension()
+    HierarchicalDirWriter(const std::string& root,
+                          ArchiveFormat format);
+
     ~HierarchicalDirWriter();
 
+    // The archive settings must be set before the first file is written
     void SetZip64(bool isZip64);
 
     bool IsZip64() const;
@@ -111,12 +144,78 @@ namespace Saola
 
     void Write(const std::string& data, const char* name);
 
+    void Write(const void* data, size_t size, const char* name);
+
+    // Reserves a unique name in the current directory and returns the
+    // full path of the file, without writing it. The file can then be
+    // written later, possibly from another thread, with WritePlanned().
+    // In an archive, the path is relative to the root of the archive,
+    // and the entries are in the order of the calls to PlanFile().
+    std::string PlanFile(const char* name);
+
+    // Thread-safe. Writes the file, or adds it to the archive.
+    void WritePlanned(const void* data, size_t size, const std::string& planned);
+
+    // Same, "owner" holds "data" until it is added to the archive
+    // (an entry waits for the entries planned before it)
+    void WritePlanned(const void* data, size_t size, const std::string& planned,
+                      const boost::shared_ptr<void>& owner);
+
+    // Thread-safe. A planned file that will not be written (e.g. its
+    // instance was removed): the next entries of the archive do not
+    // wait for it anymore.
+    void SkipPlanned(const std::string& planned);
+
+    // Thread-safe. Accounts for a planned file that was written without
+    // WritePlanned() (e.g. copied from the storage).
+    void RecordWrittenFile(uint64_t size);
+
+    uint64_t GetWrittenFilesCount();
+
+    // Before compression
+    uint64_t GetWrittenBytes();
+
+    bool IsArchive() const
+    {
+      return format_ != ArchiveFormat_Directory;
+    }
+
+    std::string GetArchivePath() const;
+
+    // The file is written under a temporary name in the same directory,
+    // then renamed: a crash never leaves a truncated file at "path".
+    // The data is not flushed to the disk, see Sync().
+    static void WriteFile(const std::string& data, const std::string& path);
+
+    static void WriteFile(const void* data, size_t size, const std::string& path);
+
+    static std::string GetTemporaryPath(const std::string& path);
+
+    // Renames a file written at GetTemporaryPath() to its final path
+    static void CommitTemporaryFile(const std::string& temporaryPath,
+                                    const std::string& path);
+
+    // Makes all the files written so far durable, with a single sync of
+    // the filesystem instead of one fsync per file. Called by Close().
+    void Sync();
+
+    // Makes the given files durable, with their directories, without
+    // flushing the rest of the filesystem. The missing files are ignored.
+    void SyncFiles(const std::vector<std::string>& paths);
+
+    // Removes the temporary files left in "directory" by an interrupted
+    // export (see GetTemporaryPath())
+    static void RemoveTemporaryFiles(const std::string& directory);
+
     // The lifetime of the "target" buffer must be larger than that of HierarchicalDirWriter
     static HierarchicalDirWriter* CreateToMemory(std::string& target,
                                                  bool isZip64);
 
     void Close();
 
-    uint64_t GetDirectorySize() const;
+    // Size of the target: the size of the archive, if any, otherwise
+    // the total size of the files in the directory, including the files
+    // of the previous runs of a resumed or incremental export
+    uint64_t GetDirectorySize();
   };
 }
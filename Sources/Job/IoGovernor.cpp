@@ -0,0 +1,265 @@
+#include "IoGovernor.h"
+
+#include <Logging.h>
+
+#include <algorithm>
+#include <cmath>
+
+// The ingest is considered active until this delay after the last received instance
+static const unsigned int INGEST_WINDOW_MS = 2000;
+
+// Maximum delay before a waiting operation checks the limits again
+static const unsigned int MAX_WAIT_MS = 100;
+
+namespace Saola
+{
+  IoGovernor::IoGovernor() : maxRunning_(0),
+                             running_(0),
+                             ingestPercent_(100),
+                             factor_(1)
+  {
+  }
+
+  IoGovernor &IoGovernor::Instance()
+  {
+    static IoGovernor instance;
+    return instance;
+  }
+
+  bool IoGovernor::IsIngestActive(const boost::posix_time::ptime &now) const
+  {
+    return (!lastIngest_.is_not_a_date_time() &&
+            (now - lastIngest_).total_milliseconds() < INGEST_WINDOW_MS);
+  }
+
+  void IoGovernor::Refill(const boost::posix_time::ptime &now)
+  {
+    factor_ = (IsIngestActive(now) ? static_cast<double>(ingestPercent_) / 100.0 : 1.0);
+
+    const double elapsed = (lastRefill_.is_not_a_date_time() ? 0.0 :
+                            static_cast<double>((now - lastRefill_).total_microseconds()) / 1000000.0);
+    lastRefill_ = now;
+
+    Bucket *buckets[] = { &bandwidth_[IoDirection_Read], &bandwidth_[IoDirection_Write], &operations_ };
+
+    for (size_t i = 0; i < 3; i++)
+    {
+      if (buckets[i]->rate_ > 0)
+      {
+        // Bursts of at most one second of the limit
+        const double rate = buckets[i]->rate_ * factor_;
+        buckets[i]->tokens_ = std::min(buckets[i]->tokens_ + rate * std::max(0.0, elapsed), rate);
+      }
+    }
+  }
+
+  unsigned int IoGovernor::GetRefillDelayMs(IoDirection direction) const
+  {
+    const Bucket *buckets[] = { &bandwidth_[direction], &operations_ };
+
+    double delay = 0;
+
+    for (size_t i = 0; i < 2; i++)
+    {
+      if (buckets[i]->rate_ > 0 &&
+          buckets[i]->tokens_ < 0)
+      {
+        delay = std::max(delay, -buckets[i]->tokens_ / (buckets[i]->rate_ * factor_) * 1000.0);
+      }
+    }
+
+    return static_cast<unsigned int>(std::ceil(delay));
+  }
+
+  bool IoGovernor::IsTurn(const void *job,
+                          IoDirection direction) const
+  {
+    Jobs::const_iterator found = jobs_.find(job);
+    if (found == jobs_.end())
+    {
+      return true;  // Not accounted
+    }
+
+    for (Jobs::const_iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+    {
+      if (it->first != job &&
+          it->second.waiting_[direction] > 0 &&
+          it->second.usage_ < found->second.usage_)
+      {
+        return false;  // Another job is behind its share
+      }
+    }
+
+    return true;
+  }
+
+  void IoGovernor::Begin(const void *job,
+                         IoDirection direction)
+  {
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Jobs::iterator found = jobs_.find(job);
+      if (found != jobs_.end())
+      {
+        found->second.waiting_[direction]++;
+      }
+
+      for (;;)
+      {
+        Refill(boost::posix_time::microsec_clock::universal_time());
+
+        const unsigned int maxRunning = (maxRunning_ == 0 ? 0 :
+                                         std::max(1u, static_cast<unsigned int>(maxRunning_ * factor_)));
+        const unsigned int delay = GetRefillDelayMs(direction);
+
+        if (delay == 0 &&
+            (maxRunning == 0 || running_ < maxRunning) &&
+            IsTurn(job, direction))
+        {
+          break;
+        }
+
+        // The end of the other operations also wakes up this thread
+        changed_.timed_wait(lock, boost::posix_time::milliseconds(delay == 0 ? MAX_WAIT_MS : std::min(delay, MAX_WAIT_MS)));
+      }
+
+      running_++;
+
+      if (operations_.rate_ > 0)
+      {
+        operations_.tokens_ -= 1;
+      }
+
+      found = jobs_.find(job);  // The job may have been unregistered meanwhile
+      if (found != jobs_.end())
+      {
+        if (found->second.waiting_[direction] > 0)
+        {
+          found->second.waiting_[direction]--;
+        }
+
+        found->second.operations_++;
+        found->second.waitUs_ += static_cast<uint64_t>(std::max<int64_t>(
+          0, (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()));
+      }
+    }
+
+    changed_.notify_all();  // The next job in line may go
+  }
+
+  void IoGovernor::End(const void *job,
+                       IoDirection direction,
+                       uint64_t bytes)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (running_ > 0)
+      {
+        running_--;
+      }
+
+      if (bandwidth_[direction].rate_ > 0)
+      {
+        bandwidth_[direction].tokens_ -= static_cast<double>(bytes);
+      }
+
+      Jobs::iterator found = jobs_.find(job);
+      if (found != jobs_.end())
+      {
+        found->second.usage_ += static_cast<double>(bytes) / static_cast<double>(found->second.share_);
+        found->second.bytes_ += bytes;
+      }
+    }
+
+    changed_.notify_all();
+  }
+
+  void IoGovernor::Configure(unsigned int readMBPerSecond,
+                             unsigned int writeMBPerSecond,
+                             unsigned int operationsPerSecond,
+                             unsigned int maxRunning,
+                             unsigned int ingestPercent)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      bandwidth_[IoDirection_Read].rate_ = static_cast<double>(readMBPerSecond) * 1024.0 * 1024.0;
+      bandwidth_[IoDirection_Write].rate_ = static_cast<double>(writeMBPerSecond) * 1024.0 * 1024.0;
+      operations_.rate_ = static_cast<double>(operationsPerSecond);
+      maxRunning_ = maxRunning;
+      ingestPercent_ = std::max(1u, std::min(100u, ingestPercent));
+
+      // Start with a full second of tokens
+      bandwidth_[IoDirection_Read].tokens_ = bandwidth_[IoDirection_Read].rate_;
+      bandwidth_[IoDirection_Write].tokens_ = bandwidth_[IoDirection_Write].rate_;
+      operations_.tokens_ = operations_.rate_;
+      lastRefill_ = boost::posix_time::microsec_clock::universal_time();
+    }
+
+    changed_.notify_all();
+
+    LOG(WARNING) << "[IoGovernor] Exports limited to " << readMBPerSecond << " MB/s read, " << writeMBPerSecond
+                 << " MB/s written, " << operationsPerSecond << " operations/s, " << maxRunning
+                 << " concurrent operations (0 = unlimited), " << ingestPercent_ << "% during the ingest";
+  }
+
+  void IoGovernor::Register(const void *job,
+                            unsigned int share)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (jobs_.find(job) == jobs_.end())
+    {
+      // A new job starts at the usage of the least served job, so that
+      // it does not monopolize the storage to catch up with the others
+      double usage = 0;
+      for (Jobs::const_iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+      {
+        usage = (it == jobs_.begin() ? it->second.usage_ : std::min(usage, it->second.usage_));
+      }
+
+      Job &created = jobs_[job];
+      created.usage_ = usage;
+      created.share_ = std::max(1u, share);
+    }
+  }
+
+  void IoGovernor::Unregister(const void *job)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      jobs_.erase(job);
+    }
+
+    changed_.notify_all();
+  }
+
+  void IoGovernor::NotifyIngest()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    lastIngest_ = boost::posix_time::microsec_clock::universal_time();
+  }
+
+  void IoGovernor::FormatStatistics(Json::Value &target,
+                                    const void *job)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target = Json::objectValue;
+    target["Running"] = running_;
+    target["IngestActive"] = IsIngestActive(boost::posix_time::microsec_clock::universal_time());
+
+    Jobs::const_iterator found = jobs_.find(job);
+    if (found != jobs_.end())
+    {
+      target["Share"] = found->second.share_;
+      target["Operations"] = static_cast<Json::UInt64>(found->second.operations_);
+      target["Bytes"] = static_cast<Json::UInt64>(found->second.bytes_);
+      target["WaitSeconds"] = static_cast<double>(found->second.waitUs_) / 1000000.0;
+    }
+  }
+}
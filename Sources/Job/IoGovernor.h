@@ -0,0 +1,150 @@
+#pragma once
+
+#include <json/value.h>
+
+#include <map>
+#include <stdint.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Saola
+{
+  enum IoDirection
+  {
+    IoDirection_Read,
+    IoDirection_Write
+  };
+
+  // Process-wide scheduler of the reads and the writes of all the
+  // export jobs, whatever their number of threads. The bandwidth and
+  // the operations per second are limited by token buckets, and the
+  // number of operations in progress by a counter. When several jobs
+  // wait, the one that got the least I/O relative to its share goes
+  // first. While Orthanc is receiving instances, the exports only get
+  // a percentage of the limits, so that the ingest keeps its latency.
+  class IoGovernor : public boost::noncopyable
+  {
+  private:
+    struct Bucket
+    {
+      double rate_;    // Per second, 0 if unlimited
+      double tokens_;  // Negative once an operation exceeded the tokens left
+
+      Bucket() : rate_(0),
+                 tokens_(0)
+      {
+      }
+    };
+
+    struct Job
+    {
+      unsigned int share_;
+      double usage_;               // Bytes divided by the share
+      unsigned int waiting_[2];    // Threads waiting, by direction
+      uint64_t operations_;
+      uint64_t bytes_;
+      uint64_t waitUs_;
+
+      Job() : share_(1),
+              usage_(0),
+              operations_(0),
+              bytes_(0),
+              waitUs_(0)
+      {
+        waiting_[0] = 0;
+        waiting_[1] = 0;
+      }
+    };
+
+    typedef std::map<const void *, Job> Jobs;
+
+    boost::mutex mutex_;
+    boost::condition_variable changed_;
+    Bucket bandwidth_[2];  // By direction, in bytes
+    Bucket operations_;    // Reads and writes
+    unsigned int maxRunning_;
+    unsigned int running_;
+    unsigned int ingestPercent_;
+    double factor_;        // Of the limits, lower while instances are received
+    boost::posix_time::ptime lastRefill_;
+    boost::posix_time::ptime lastIngest_;
+    Jobs jobs_;
+
+    IoGovernor();
+
+    bool IsIngestActive(const boost::posix_time::ptime &now) const;
+
+    void Refill(const boost::posix_time::ptime &now);
+
+    // Delay before the tokens needed by "direction" are refilled, 0 if
+    // they are available
+    unsigned int GetRefillDelayMs(IoDirection direction) const;
+
+    bool IsTurn(const void *job,
+                IoDirection direction) const;
+
+    void Begin(const void *job,
+               IoDirection direction);
+
+    void End(const void *job,
+             IoDirection direction,
+             uint64_t bytes);
+
+  public:
+    // One read or write of an export job, the calling thread waits
+    // for its turn in the constructor
+    class Operation : public boost::noncopyable
+    {
+    private:
+      const void *job_;
+      IoDirection direction_;
+      uint64_t bytes_;
+
+    public:
+      Operation(const void *job,
+                IoDirection direction) : job_(job),
+                                         direction_(direction),
+                                         bytes_(0)
+      {
+        IoGovernor::Instance().Begin(job, direction);
+      }
+
+      ~Operation()
+      {
+        IoGovernor::Instance().End(job_, direction_, bytes_);
+      }
+
+      // The bytes are charged once they are known, the next
+      // operations wait for the tokens that were exceeded
+      void SetBytes(uint64_t bytes)
+      {
+        bytes_ = bytes;
+      }
+    };
+
+    static IoGovernor &Instance();
+
+    // 0 does not limit. "ingestPercent" is the percentage of the
+    // limits kept by the exports while instances are received.
+    void Configure(unsigned int readMBPerSecond,
+                   unsigned int writeMBPerSecond,
+                   unsigned int operationsPerSecond,
+                   unsigned int maxRunning,
+                   unsigned int ingestPercent);
+
+    // "share" is the weight of the job relative to the other jobs
+    void Register(const void *job,
+                  unsigned int share);
+
+    void Unregister(const void *job);
+
+    // Called for each instance received by Orthanc
+    void NotifyIngest();
+
+    void FormatStatistics(Json::Value &target,
+                          const void *job);
+  };
+}
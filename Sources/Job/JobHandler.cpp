@@ -1,7 +1,7 @@
 #include "JobHandler.h"
 
 #include "../Config/SaolaConfiguration.h"
-#include "../SaolaDatabase.h"
+#include "../Database/EventQueueStore.h"
 
 #include "../DTO/StableEventDTOUpdate.h"
 
@@ -42,11 +42,10 @@ namespace Saola
     try
     {
       TransferJobDTOGet dto;
-      if (SaolaDatabase::Instance().GetById(jobId, dto))
+      if (EventQueueStore::Instance().GetById(jobId, dto))
       {
         LOG(INFO) << "[OnJobSuccess] Deleting JOB " << dto.ToJsonString();
-        SaolaDatabase::Instance().DeleteTransferJobsByQueueId(dto.queue_id_);
-        SaolaDatabase::Instance().DeleteEventByIds(std::list<int64_t>{dto.queue_id_});
+        EventQueueStore::Instance().Complete(dto.queue_id_);
       }
       else
       {
@@ -70,16 +69,16 @@ namespace Saola
     try
     {
       TransferJobDTOGet dto;
-      if (SaolaDatabase::Instance().GetById(jobId, dto))
+      if (EventQueueStore::Instance().GetById(jobId, dto))
       {
         LOG(INFO) << "[OnJobFailure] Deleting job " << dto.ToJsonString();
-        SaolaDatabase::Instance().DeleteTransferJobsByQueueId(dto.queue_id_);
+        EventQueueStore::Instance().DeleteTransferJobsByQueueId(dto.queue_id_);
         StableEventDTOGet dtoGet;
-        if (SaolaDatabase::Instance().GetById(dto.queue_id_, dtoGet))
+        if (EventQueueStore::Instance().GetById(dto.queue_id_, dtoGet))
         {
           dtoGet.retry_ += 1;
           LOG(INFO) << "[OnJobFailure] Updating queue " << dtoGet.ToJsonString();
-          SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dtoGet.id_, "Callback OnJobFailure triggered", dtoGet.retry_, Saola::GetNextXSecondsFromNowInString(dtoGet.delay_sec_).c_str()));
+          EventQueueStore::Instance().Fail(StableEventDTOUpdate(dtoGet.id_, "Callback OnJobFailure triggered", dtoGet.retry_, Saola::GetNextXSecondsFromNowInString(dtoGet.delay_sec_).c_str()));
           Json::Value notification;
           notification[ERROR_DETAIL] = dto.ToJsonString();
           notification[ERROR_MESSAGE] = "Job Failure for queue_id=" + std::to_string(dto.queue_id_) + ", jobId=" + jobId + ", increasing retry to " + std::to_string(dtoGet.retry_);
@@ -1,9 +1,20 @@
 #pragma once
 
+#include <stdint.h>
+#include <string>
+
 struct Pagination
 {
   /* data */
   unsigned int offset_ = 0;
   unsigned int limit_ = 100;
   std::string  sort_by_ = "id";
+
+  // Keyset pagination: only return the rows that come strictly after
+  // (after_value_, after_id_) in the "ORDER BY sort_by_, id" order.
+  // "offset_" is ignored in this case. "after_value_" is unused if
+  // sorting by id.
+  bool         has_after_ = false;
+  std::string  after_value_;
+  int64_t      after_id_ = 0;
 };
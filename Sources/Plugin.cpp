@@ -16,10 +16,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  **/
 
-#include "SaolaDatabase.h"
+#include "Database/EventQueueStore.h"
 #include "Scheduler/StableEventScheduler.h"
 #include "Scheduler/RemoveFileScheduler.h"
 #include "Scheduler/PollingDBScheduler.h"
+#include "Scheduler/DatabaseMaintenanceScheduler.h"
+#include "Scheduler/StoragePathIndexScheduler.h"
 #include "DTO/StableEventDTOCreate.h"
 #include "DTO/MainDicomTags.h"
 #include "Config/SaolaConfiguration.h"
@@ -27,7 +29,12 @@
 #include "Controller/RestApi.h"
 #include "Job/JobHandler.h"
 #include "Job/ExporterJob.h"
+#include "Job/ExportCoordinator.h"
+#include "Job/IoGovernor.h"
+#include "Job/ExportExecutor.h"
 #include "Cache/InMemoryJobCache.h"
+#include "PluginIndex.h"
+#include "SaolaDatabase.h"
 
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
@@ -55,6 +62,10 @@ static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeTyp
     }
 
     PollingDBScheduler::Instance().Start();
+    DatabaseMaintenanceScheduler::Instance().Start();
+    StoragePathIndexScheduler::Instance().Start();
+    Saola::ExportExecutor::Instance().Start(SaolaConfiguration::Instance().GetExportExecutorThreads(),
+                                            SaolaConfiguration::Instance().GetExportExecutorRetention());
 
     break;
   }
@@ -66,6 +77,23 @@ static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeTyp
     {
       RemoveFileScheduler::Instance().Stop();
     }
+    DatabaseMaintenanceScheduler::Instance().Stop();
+    StoragePathIndexScheduler::Instance().Stop();
+    Saola::ExportExecutor::Instance().Stop();
+    EventQueueStore::Close();
+    break;
+
+  case OrthancPluginChangeType_NewInstance:
+    StoragePathIndexScheduler::Instance().NotifyNewInstance(resourceId);
+    Saola::IoGovernor::Instance().NotifyIngest();
+    break;
+
+  case OrthancPluginChangeType_Deleted:
+    if (resourceType == OrthancPluginResourceType_Instance ||
+        resourceType == OrthancPluginResourceType_Series)
+    {
+      StoragePathIndexScheduler::Instance().NotifyDeleted(resourceId);
+    }
     break;
 
   case OrthancPluginChangeType_JobSubmitted:
@@ -87,6 +115,35 @@ static OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeTyp
   return OrthancPluginErrorCode_Success;
 }
 
+// Resumes the export jobs that were interrupted by a restart of Orthanc
+static OrthancPluginJob *JobsUnserializer(const char *jobType,
+                                         const char *serialized)
+{
+  if (jobType == NULL ||
+      serialized == NULL ||
+      std::string(jobType) != Saola::ExporterJob::GetJobType())
+  {
+    return NULL;
+  }
+
+  try
+  {
+    Json::Value value;
+    if (!OrthancPlugins::ReadJson(value, std::string(serialized)))
+    {
+      LOG(ERROR) << "Cannot parse a serialized export job";
+      return NULL;
+    }
+
+    return OrthancPlugins::OrthancJob::Create(Saola::ExporterJob::Unserialize(value));
+  }
+  catch (Orthanc::OrthancException &e)
+  {
+    LOG(ERROR) << "Cannot unserialize an export job: " << e.What();
+    return NULL;
+  }
+}
+
 extern "C"
 {
   ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext *context)
@@ -118,11 +175,32 @@ extern "C"
       LOG(WARNING) << "Path to the database of the Saola plugin: " << SaolaConfiguration::Instance().GetDbPath();
       boost::filesystem::path dbPath = SaolaConfiguration::Instance().GetDbPath();
       Orthanc::SystemToolbox::MakeDirectory(dbPath.parent_path().string());
-      SaolaDatabase::Instance().Open(SaolaConfiguration::Instance().GetDbPath());
+      EventQueueStore::Open(SaolaConfiguration::Instance().GetQueueBackend(), SaolaConfiguration::Instance().GetDbPath());
+
+      // The index of the storage paths lives in the SQLite database,
+      // whatever the backend of the event queues
+      if (SaolaConfiguration::Instance().IsExportPathIndex() &&
+          SaolaConfiguration::Instance().GetQueueBackend() != EventQueueStore::SQLITE)
+      {
+        SaolaDatabase::Instance().Open(SaolaConfiguration::Instance().GetDbPath());
+      }
+
+      PluginIndex::Instance().SetBackend(PluginIndex::StringToBackend(SaolaConfiguration::Instance().GetExportIndexBackend()));
+
+      // The instances kept for the concurrent exports get the same budget as the loaders of one export
+      Saola::ExportCoordinator::Instance().SetBudget(
+        static_cast<uint64_t>(SaolaConfiguration::Instance().GetExportLoaderBudgetMB()) * 1024 * 1024);
+
+      Saola::IoGovernor::Instance().Configure(SaolaConfiguration::Instance().GetExportIoReadMBPerSecond(),
+                                              SaolaConfiguration::Instance().GetExportIoWriteMBPerSecond(),
+                                              SaolaConfiguration::Instance().GetExportIoOperationsPerSecond(),
+                                              SaolaConfiguration::Instance().GetExportIoMaxConcurrent(),
+                                              SaolaConfiguration::Instance().GetExportIoIngestPercent());
 
       RegisterRestEndpoint();
 
       OrthancPluginRegisterOnChangeCallback(context, OnChangeCallback);
+      OrthancPluginRegisterJobsUnserializer(context, JobsUnserializer);
     }
     catch (Orthanc::OrthancException &e)
     {
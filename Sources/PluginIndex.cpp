@@ -1,157 +1,502 @@
 #include "PluginIndex.h"
+#include "DicomBuffer.h"
+#include "SaolaDatabase.h"
+#include "Config/SaolaConfiguration.h"
 
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <fstream>
-#include <sstream>
+#include <set>
+#include <vector>
 
 #include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
 
-bool PluginIndex::LookupParent(std::string &target,
-                               const std::string &publicId)
+static const char *const KEY_TYPE = "Type";
+static const char *const KEY_RESOURCES = "Resources";
+
+// Enough for the instances of a large study, a few MB of memory
+static const size_t RESOURCE_CACHE_SIZE = 16384;
+
+void PluginIndex::CacheResource(const std::string &publicId,
+                                const ResourceEntry &entry)
 {
-  Json::Value result;
-  bool ok = false;
-  if (OrthancPlugins::RestApiGet(result, "/instances/" + publicId + "/series", false) && !result.empty())
+  boost::mutex::scoped_lock lock(cacheMutex_);
+
+  cache_.AddOrMakeMostRecent(publicId, entry);
+
+  while (cache_.GetSize() > RESOURCE_CACHE_SIZE)
   {
-    ok = true;
+    cache_.RemoveOldest();
   }
-  else if (OrthancPlugins::RestApiGet(result, "/series/" + publicId + "/study", false) && !result.empty())
+}
+
+bool PluginIndex::LookupCachedResource(ResourceEntry &entry,
+                                       const std::string &publicId)
+{
+  boost::mutex::scoped_lock lock(cacheMutex_);
+
+  if (cache_.Contains(publicId, entry))
   {
-    ok = true;
+    cache_.MakeMostRecent(publicId);
+    return true;
   }
-  else if (OrthancPlugins::RestApiGet(result, "/studies/" + publicId + "/patient", false) && !result.empty())
+  else
   {
-    ok = true;
+    return false;
   }
-  else if (OrthancPlugins::RestApiGet(result, "/patients/" + publicId, false) && !result.empty())
+}
+
+static bool ParseResource(std::string &publicId,
+                          Orthanc::ResourceType &level,
+                          std::string &parent,
+                          const Json::Value &resource)
+{
+  if (resource.type() != Json::objectValue ||
+      !resource.isMember("ID") ||
+      !resource.isMember(KEY_TYPE))
   {
-    ok = true;
+    return false;
   }
 
-  if (ok)
+  publicId = resource["ID"].asString();
+
+  const std::string type = resource[KEY_TYPE].asString();
+  const char *parentKey = NULL;
+
+  if (type == "Instance")
+  {
+    level = Orthanc::ResourceType_Instance;
+    parentKey = "ParentSeries";
+  }
+  else if (type == "Series")
+  {
+    level = Orthanc::ResourceType_Series;
+    parentKey = "ParentStudy";
+  }
+  else if (type == "Study")
+  {
+    level = Orthanc::ResourceType_Study;
+    parentKey = "ParentPatient";
+  }
+  else if (type == "Patient")
   {
-    target = result["ID"].asString();
+    level = Orthanc::ResourceType_Patient;
+  }
+  else
+  {
+    return false;
   }
 
-  return ok;
+  if (parentKey == NULL)
+  {
+    parent.clear();
+    return true;
+  }
+  else if (resource.isMember(parentKey))
+  {
+    parent = resource[parentKey].asString();
+    return true;
+  }
+  else
+  {
+    return false;
+  }
 }
 
-bool PluginIndex::LookupResourceType(Orthanc::ResourceType &type,
-                                     const std::string &publicId)
+bool PluginIndex::ResolveBulk(ResolvedResources &target,
+                              const std::list<std::string> &publicIds)
 {
-  Json::Value result;
-  if (OrthancPlugins::RestApiGet(result, "/instances/" + publicId, false) && !result.empty())
+  target.clear();
+
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    if (!hasBulkContent_)
+    {
+      return false;
+    }
+  }
+
+  Json::Value body = Json::objectValue;
+  body[KEY_RESOURCES] = Json::arrayValue;
+  for (std::list<std::string>::const_iterator it = publicIds.begin(); it != publicIds.end(); ++it)
+  {
+    body[KEY_RESOURCES].append(*it);
+  }
+
+  Json::Value response;
+  if (!OrthancPlugins::RestApiPost(response, "/tools/bulk-content", body, false) ||
+      response.type() != Json::arrayValue)
+  {
+    return false;
+  }
+
+  for (Json::Value::ArrayIndex i = 0; i < response.size(); i++)
+  {
+    std::string publicId;
+    ResourceEntry entry;
+    if (ParseResource(publicId, entry.level_, entry.parent_, response[i]))
+    {
+      target[publicId] = entry;
+      CacheResource(publicId, entry);
+    }
+  }
+
+  return true;
+}
+
+bool PluginIndex::ResolveSingle(ResourceEntry &entry,
+                                const std::string &publicId)
+{
+  // The full description of a resource contains its parent
+  static const char *const URIS[] = {"/instances/", "/series/", "/studies/", "/patients/"};
+
+  for (size_t i = 0; i < sizeof(URIS) / sizeof(URIS[0]); i++)
+  {
+    Json::Value result;
+    if (OrthancPlugins::RestApiGet(result, URIS[i] + publicId, false) && !result.empty())
+    {
+      std::string id;
+      if (ParseResource(id, entry.level_, entry.parent_, result))
+      {
+        CacheResource(publicId, entry);
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void PluginIndex::Prefetch(const std::list<std::string> &publicIds)
+{
+  std::list<std::string> missing;
+  for (std::list<std::string>::const_iterator it = publicIds.begin(); it != publicIds.end(); ++it)
+  {
+    ResourceEntry entry;
+    if (!LookupCachedResource(entry, *it))
+    {
+      missing.push_back(*it);
+    }
+  }
+
+  // One call per level at most, up to the studies (the patients are
+  // never looked up while identifying the resources of an export)
+  for (unsigned int depth = 0; depth < 3 && !missing.empty(); depth++)
+  {
+    ResolvedResources resolved;
+    if (!ResolveBulk(resolved, missing))
+    {
+      return;  // The lookups will resolve the resources one by one
+    }
+
+    std::set<std::string> parents;
+    for (ResolvedResources::const_iterator it = resolved.begin(); it != resolved.end(); ++it)
+    {
+      ResourceEntry parent;
+      if (it->second.level_ == Orthanc::ResourceType_Instance ||
+          it->second.level_ == Orthanc::ResourceType_Series)
+      {
+        if (!LookupCachedResource(parent, it->second.parent_))
+        {
+          parents.insert(it->second.parent_);
+        }
+      }
+    }
+
+    missing.assign(parents.begin(), parents.end());
+  }
+}
+
+bool PluginIndex::LookupResource(ResourceEntry &entry,
+                                 const std::string &publicId)
+{
+  if (LookupCachedResource(entry, publicId))
   {
-    type = Orthanc::ResourceType_Instance;
     return true;
   }
-  else if (OrthancPlugins::RestApiGet(result, "/series/" + publicId, false) && !result.empty())
+
+  std::list<std::string> publicIds;
+  publicIds.push_back(publicId);
+
+  ResolvedResources resolved;
+  if (ResolveBulk(resolved, publicIds))
+  {
+    ResolvedResources::const_iterator found = resolved.find(publicId);
+    if (found == resolved.end())
+    {
+      return false;
+    }
+    else
+    {
+      entry = found->second;
+      return true;
+    }
+  }
+  else if (ResolveSingle(entry, publicId))
   {
-    type = Orthanc::ResourceType_Series;
+    // The resource exists, so the bulk route itself is missing: this
+    // is an Orthanc version that predates "/tools/bulk-content"
+    LOG(WARNING) << "[PluginIndex] \"/tools/bulk-content\" is not available, resolving the resources one by one";
+
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    hasBulkContent_ = false;
     return true;
   }
-  else if (OrthancPlugins::RestApiGet(result, "/studies/" + publicId, false) && !result.empty())
+  else
+  {
+    return false;
+  }
+}
+
+bool PluginIndex::LookupParent(std::string &target,
+                               const std::string &publicId)
+{
+  ResourceEntry entry;
+  if (LookupResource(entry, publicId) &&
+      !entry.parent_.empty())
   {
-    type = Orthanc::ResourceType_Study;
+    target = entry.parent_;
     return true;
   }
-  else if (OrthancPlugins::RestApiGet(result, "/patients/" + publicId, false) && !result.empty())
+  else
   {
-    type = Orthanc::ResourceType_Patient;
+    return false;
+  }
+}
+
+bool PluginIndex::LookupResourceType(Orthanc::ResourceType &type,
+                                     const std::string &publicId)
+{
+  ResourceEntry entry;
+  if (LookupResource(entry, publicId))
+  {
+    type = entry.level_;
     return true;
   }
-  return false;
+  else
+  {
+    return false;
+  }
 }
 
 void PluginIndex::GetChildren(std::list<std::string> &result,
                               const std::string &publicId)
 {
+  // The level comes from the cache most of the time, which saves the
+  // requests to the levels the resource does not belong to. The
+  // children are cached in turn, before their own expansion.
+  Orthanc::ResourceType level;
+  if (!LookupResourceType(level, publicId))
+  {
+    return;
+  }
+
   Json::Value response = Json::objectValue;
-  if (OrthancPlugins::RestApiGet(response, "/patients/" + publicId, false) && !response.empty())
+  switch (level)
   {
-    for (const auto &study : response["Studies"])
+  case Orthanc::ResourceType_Patient:
+    if (OrthancPlugins::RestApiGet(response, "/patients/" + publicId, false) && !response.empty())
     {
-      result.push_back(study.asString());
+      for (const auto &study : response["Studies"])
+      {
+        result.push_back(study.asString());
+        CacheResource(study.asString(), ResourceEntry{Orthanc::ResourceType_Study, publicId});
+      }
     }
-    return;
+    break;
+
+  case Orthanc::ResourceType_Study:
+    if (OrthancPlugins::RestApiGet(response, "/studies/" + publicId, false) && !response.empty())
+    {
+      for (const auto &series : response["Series"])
+      {
+        result.push_back(series.asString());
+        CacheResource(series.asString(), ResourceEntry{Orthanc::ResourceType_Series, publicId});
+      }
+    }
+    break;
+
+  case Orthanc::ResourceType_Series:
+    if (OrthancPlugins::RestApiGet(response, "/series/" + publicId, false) && !response.empty())
+    {
+      std::list<std::string> instances;
+      for (const auto &instance : response["Instances"])
+      {
+        instances.push_back(instance.asString());
+      }
+
+      GetInstanceUris(result, publicId, instances);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Orthanc identifier of the "orthanc://" URIs, and of the identifiers
+// without scheme (backward compatibility)
+static std::string GetOrthancInstanceId(const std::string &uri)
+{
+  if (uri.substr(0, 10) == "orthanc://")
+  {
+    return uri.substr(10);
+  }
+  else
+  {
+    return uri;
   }
-  else if (OrthancPlugins::RestApiGet(response, "/studies/" + publicId, false) && !response.empty())
+}
+
+static bool IsStoragePathIndexEnabled()
+{
+  return (SaolaConfiguration::Instance().IsExportPathIndex() &&
+          SaolaDatabase::Instance().IsOpen());
+}
+
+static bool IsValidPath(const SaolaDatabase::InstancePath &path)
+{
+  boost::system::error_code ec;
+  uintmax_t size = boost::filesystem::file_size(path.path_, ec);
+  return (!ec && size == path.size_);
+}
+
+bool PluginIndex::LookupStoragePath(SaolaDatabase::InstancePath &target,
+                                    const std::string &instanceId,
+                                    const std::string &seriesId)
+{
+  Json::Value info;
+  if (!OrthancPlugins::RestApiGet(info, "/instances/" + instanceId + "/attachments/dicom/info", true) ||
+      !info.isMember("Path"))
+  {
+    return false;
+  }
+
+  // The compressed attachments cannot be read as DICOM files
+  if (info["CompressedSize"].asUInt64() != info["UncompressedSize"].asUInt64())
   {
-    for (const auto &study : response["Series"])
+    return false;
+  }
+
+  target.instanceId_ = instanceId;
+  target.seriesId_ = seriesId;
+  target.path_ = info["Path"].asString();
+  target.size_ = info["UncompressedSize"].asUInt64();
+
+  return IsValidPath(target);
+}
+
+void PluginIndex::GetInstanceUris(std::list<std::string> &result,
+                                  const std::string &seriesId,
+                                  const std::list<std::string> &instanceIds)
+{
+  // Without the index, the paths are asked to Orthanc on each export
+  const bool indexed = IsStoragePathIndexEnabled();
+
+  SaolaDatabase::InstancePaths known;
+  if (indexed)
+  {
+    SaolaDatabase::Instance().LookupInstancePaths(known, instanceIds);
+  }
+
+  std::list<SaolaDatabase::InstancePath> discovered;
+  size_t direct = 0;
+
+  // Each instance gets its own scheme: a series whose files are
+  // spread over several folders, or that shares its folder, is still
+  // read directly from the storage
+  for (std::list<std::string>::const_iterator it = instanceIds.begin(); it != instanceIds.end(); ++it)
+  {
+    SaolaDatabase::InstancePaths::const_iterator found = known.find(*it);
+    SaolaDatabase::InstancePath path;
+
+    if (found != known.end() &&
+        IsValidPath(found->second))
     {
-      result.push_back(study.asString());
+      result.push_back("file://" + found->second.path_);
+      direct++;
+    }
+    else if (LookupStoragePath(path, *it, seriesId))
+    {
+      result.push_back("file://" + path.path_);
+      discovered.push_back(path);
+      direct++;
+    }
+    else
+    {
+      result.push_back("orthanc://" + *it);
     }
-    return;
   }
-  else if (OrthancPlugins::RestApiGet(response, "/series/" + publicId, false) && !response.empty())
+
+  if (indexed &&
+      !discovered.empty())
   {
-    if (response.isMember("Instances") && response["Instances"].isArray() && response["Instances"].size() > 0)
-    {
-      std::string firstInstanceId = response["Instances"][0].asString();
-      LOG(INFO) << "[PluginIndex::GetChildren] firstInstanceId: " << firstInstanceId << std::endl;
+    SaolaDatabase::Instance().StoreInstancePaths(discovered);
+  }
 
-      // Query the attachment info to get the actual file path
-      Json::Value attachmentInfo;
-      if (OrthancPlugins::RestApiGet(attachmentInfo, "/instances/" + firstInstanceId + "/attachments/dicom/info", true)
-          && attachmentInfo.isMember("Path"))
-      {
-        std::string instancePath = attachmentInfo["Path"].asString();
-        LOG(INFO) << "[PluginIndex::GetChildren] firstInstanceId: " << firstInstanceId << ", instancePath=" << instancePath << std::endl;
-        
-        // Get the parent directory (series folder) by going up one level
-        boost::filesystem::path seriesFolder = boost::filesystem::path(instancePath).parent_path();
-        
-        // Count files in the series folder
-        size_t fileCount = 0;
-        std::list<std::string> filePaths;
+  LOG(INFO) << "[PluginIndex::GetChildren] Series " << seriesId << ": " << direct << "/" << instanceIds.size()
+            << " instances read from the storage (" << (indexed ? discovered.size() : 0) << " newly indexed)";
+}
 
-        if (boost::filesystem::exists(seriesFolder) && boost::filesystem::is_directory(seriesFolder))
-        {
-          for (const auto &entry : boost::filesystem::directory_iterator(seriesFolder))
-          {
-            if (boost::filesystem::is_regular_file(entry.path()))
-            {
-              fileCount++;
-              filePaths.push_back(entry.path().string());
-            }
-          }
-        }
- 
-        // Check if the number of instances matches the number of files in the series folder
-        size_t instanceCount = response["Instances"].size();
-        LOG(INFO) << "[PluginIndex::GetChildren] instanceCount from response: " << instanceCount << ", fileCount in folder: " << fileCount;
+void PluginIndex::IndexStoragePaths(const std::list<std::string> &instanceIds)
+{
+  if (instanceIds.empty() ||
+      !IsStoragePathIndexEnabled())
+  {
+    return;
+  }
 
-        if (instanceCount == fileCount)
-        {
-          // If equal, use file scheme URI (file://path)
-          LOG(INFO) << "[PluginIndex::GetChildren] Using file scheme - counts match";
-          for (const auto &filePath : filePaths)
-          {
-            result.push_back("file://" + filePath);
-          }
-        }
-        else
-        {
-          // If not equal, use orthanc scheme URI (orthanc://instanceId)
-          LOG(INFO) << "[PluginIndex::GetChildren] Using orthanc scheme - counts don't match";
-          for (const auto &instance : response["Instances"])
-          {
-            result.push_back("orthanc://" + instance.asString());
-          }
-        }
-      }
-      else
+  std::list<SaolaDatabase::InstancePath> paths;
+
+  for (std::list<std::string>::const_iterator it = instanceIds.begin(); it != instanceIds.end(); ++it)
+  {
+    try
+    {
+      std::string seriesId;
+      SaolaDatabase::InstancePath path;
+
+      if (LookupParent(seriesId, *it) &&
+          LookupStoragePath(path, *it, seriesId))
       {
-        // Fallback: if we can't get the file path, use orthanc scheme
-        LOG(WARNING) << "[PluginIndex::GetChildren] Cannot get file path, using orthanc scheme as fallback";
-        for (const auto &instance : response["Instances"])
-        {
-          result.push_back("orthanc://" + instance.asString());
-        }
+        paths.push_back(path);
       }
     }
+    catch (Orthanc::OrthancException &e)
+    {
+      // The path will be looked up by the first export of the instance
+      LOG(WARNING) << "[PluginIndex] Cannot index the storage path of instance " << *it << ": " << e.What();
+    }
+  }
 
-    return;
+  try
+  {
+    if (!paths.empty())
+    {
+      SaolaDatabase::Instance().StoreInstancePaths(paths);
+    }
+  }
+  catch (Orthanc::OrthancException &e)
+  {
+    LOG(WARNING) << "[PluginIndex] Cannot index the storage path of " << paths.size() << " instance(s): " << e.What();
+  }
+}
+
+void PluginIndex::RemoveStoragePaths(const std::string &resourceId)
+{
+  try
+  {
+    if (IsStoragePathIndexEnabled())
+    {
+      SaolaDatabase::Instance().RemoveInstancePaths(resourceId);
+    }
+  }
+  catch (Orthanc::OrthancException &e)
+  {
+    // The stale paths are detected by the exports
+    LOG(WARNING) << "[PluginIndex] Cannot remove the storage paths of " << resourceId << ": " << e.What();
   }
 }
 
@@ -243,10 +588,26 @@ bool PluginIndex::ReadDicom(std::string& dicom, const std::string& instancePubli
     std::ifstream file(filePath, std::ios::binary);
     if (file.is_open())
     {
-      std::stringstream buffer;
-      buffer << file.rdbuf();
-      dicom = buffer.str();
-      file.close();
+      // Read straight into a buffer of the size of the file, instead of
+      // going through a stringstream that would copy the file twice
+      file.seekg(0, std::ios::end);
+      std::streamoff size = file.tellg();
+      file.seekg(0, std::ios::beg);
+
+      if (size < 0)
+      {
+        LOG(ERROR) << "Cannot read file: " << filePath;
+        return false;
+      }
+
+      dicom.resize(static_cast<size_t>(size));
+      if (size > 0 &&
+          !file.read(&dicom[0], size))
+      {
+        LOG(ERROR) << "Cannot read file: " << filePath;
+        return false;
+      }
+
       return true;
     }
     else
@@ -255,19 +616,330 @@ bool PluginIndex::ReadDicom(std::string& dicom, const std::string& instancePubli
       return false;
     }
   }
-  else if (instancePublicId.substr(0, 10) == "orthanc://")
+  else if (GetBackend() == Backend_Rest)
   {
-    // Orthanc scheme: extract instance ID and use REST API
-    std::string orthancInstanceId = instancePublicId.substr(10); // Remove "orthanc://" prefix
-    return OrthancPlugins::RestApiGetString(dicom, "/instances/" + orthancInstanceId + "/file", false);
+    return OrthancPlugins::RestApiGetString(dicom, "/instances/" + GetOrthancInstanceId(instancePublicId) + "/file", false);
   }
   else
   {
-    // Fallback: assume it's an Orthanc instance ID without scheme (backward compatibility)
-    return OrthancPlugins::RestApiGetString(dicom, "/instances/" + instancePublicId + "/file", false);
+    DicomBuffer buffer;
+    if (ReadInstance(buffer, GetOrthancInstanceId(instancePublicId), Backend_Sdk))
+    {
+      dicom.assign(reinterpret_cast<const char*>(buffer.GetData()), buffer.GetSize());
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+}
+
+bool PluginIndex::ReadDicom(DicomBuffer& dicom, const std::string& instancePublicId, uint64_t mmapThreshold)
+{
+  if (mmapThreshold > 0 &&
+      instancePublicId.substr(0, 7) == "file://")
+  {
+    std::string filePath = instancePublicId.substr(7); // Remove "file://" prefix
+
+    boost::system::error_code ec;
+    uintmax_t size = boost::filesystem::file_size(filePath, ec);
+    if (!ec && size >= mmapThreshold)
+    {
+      try
+      {
+        dicom.MapFile(filePath);
+        return true;
+      }
+      catch (const boost::interprocess::interprocess_exception &e)
+      {
+        LOG(WARNING) << "Cannot map file: " << filePath << " - " << e.what() << ", reading it instead";
+      }
+    }
+  }
+
+  if (instancePublicId.substr(0, 7) == "file://")
+  {
+    return ReadDicom(dicom.GetContent(), instancePublicId);
+  }
+  else
+  {
+    return ReadInstance(dicom, GetOrthancInstanceId(instancePublicId), GetBackend());
+  }
+}
+
+bool PluginIndex::ReadInstance(DicomBuffer &dicom,
+                               const std::string &instanceId,
+                               Backend backend)
+{
+  switch (backend)
+  {
+  case Backend_Rest:
+    return OrthancPlugins::RestApiGetString(dicom.GetContent(), "/instances/" + instanceId + "/file", false);
+
+  case Backend_Sdk:
+  {
+    // No URI routing, and the buffer of Orthanc is kept as is
+    std::unique_ptr<OrthancPlugins::MemoryBuffer> buffer(new OrthancPlugins::MemoryBuffer);
+
+    try
+    {
+      buffer->GetDicomInstance(instanceId);
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      if (e.GetErrorCode() == Orthanc::ErrorCode_UnknownResource ||
+          e.GetErrorCode() == Orthanc::ErrorCode_InexistentItem)
+      {
+        return false;
+      }
+      else
+      {
+        throw;
+      }
+    }
+
+    dicom.SetMemoryBuffer(buffer.release());
+    return true;
+  }
+
+  default:
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
   }
 }
 
+PluginIndex::Backend PluginIndex::StringToBackend(const std::string &backend)
+{
+  std::string s = backend;
+  Orthanc::Toolbox::ToUpperCase(s);
+
+  if (s == "REST")
+  {
+    return Backend_Rest;
+  }
+  else if (s == "SDK")
+  {
+    return Backend_Sdk;
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "Unknown index backend: " + backend);
+  }
+}
+
+const char *PluginIndex::EnumerationToString(Backend backend)
+{
+  switch (backend)
+  {
+  case Backend_Rest:
+    return "REST";
+
+  case Backend_Sdk:
+    return "SDK";
+
+  default:
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+void PluginIndex::SetBackend(Backend backend)
+{
+  boost::mutex::scoped_lock lock(cacheMutex_);
+  backend_ = backend;
+}
+
+PluginIndex::Backend PluginIndex::GetBackend()
+{
+  boost::mutex::scoped_lock lock(cacheMutex_);
+  return backend_;
+}
+
+static double GetElapsedSeconds(const boost::posix_time::ptime &start)
+{
+  return static_cast<double>((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000000.0;
+}
+
+static const PluginIndex::Backend BENCHMARK_BACKENDS[] = {PluginIndex::Backend_Rest, PluginIndex::Backend_Sdk};
+static const size_t BENCHMARK_BACKENDS_COUNT = sizeof(BENCHMARK_BACKENDS) / sizeof(BENCHMARK_BACKENDS[0]);
+
+// The benchmark reads a whole study, possibly several times: it runs
+// in the job engine of Orthanc, with one step per round and backend,
+// instead of in the HTTP thread that received the request
+class PluginIndex::BenchmarkJob : public OrthancPlugins::OrthancJob
+{
+private:
+  std::string studyId_;
+  unsigned int limit_;
+  unsigned int rounds_;
+  std::list<std::string> instanceIds_;
+  std::vector<double> best_;  // By backend
+  uint64_t bytes_;
+  size_t step_;               // 0 lists the instances, then one step per round and backend, then the lookups
+
+  size_t GetStepsCount() const
+  {
+    return 2 + rounds_ * BENCHMARK_BACKENDS_COUNT;
+  }
+
+  void ListInstances()
+  {
+    Json::Value instances;
+    if (!OrthancPlugins::RestApiGet(instances, "/studies/" + studyId_ + "/instances", false) ||
+        instances.type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource, "Unknown study: " + studyId_);
+    }
+
+    for (Json::Value::ArrayIndex i = 0; i < instances.size() && (limit_ == 0 || i < limit_); i++)
+    {
+      instanceIds_.push_back(instances[i]["ID"].asString());
+    }
+  }
+
+  void ReadInstances(unsigned int round,
+                     size_t backend)
+  {
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    bytes_ = 0;
+
+    for (std::list<std::string>::const_iterator it = instanceIds_.begin(); it != instanceIds_.end(); ++it)
+    {
+      DicomBuffer dicom;
+      if (!PluginIndex::Instance().ReadInstance(dicom, *it, BENCHMARK_BACKENDS[backend]))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource, "Cannot read instance: " + *it);
+      }
+
+      bytes_ += dicom.GetSize();
+    }
+
+    // Best time of each backend. The first round also warms up the
+    // cache of the storage, hence the default of 2 rounds.
+    const double elapsed = GetElapsedSeconds(start);
+    if (round == 0 || elapsed < best_[backend])
+    {
+      best_[backend] = elapsed;
+    }
+  }
+
+  void FormatResult(Json::Value &result)
+  {
+    PluginIndex &index = PluginIndex::Instance();
+
+    result = Json::objectValue;
+    result["Study"] = studyId_;
+    result["Instances"] = static_cast<Json::UInt64>(instanceIds_.size());
+    result["Bytes"] = static_cast<Json::UInt64>(bytes_);
+    result["Rounds"] = rounds_;
+    result["Backend"] = EnumerationToString(index.GetBackend());
+    result["Read"] = Json::objectValue;
+
+    for (size_t i = 0; i < BENCHMARK_BACKENDS_COUNT; i++)
+    {
+      Json::Value item = Json::objectValue;
+      item["Seconds"] = best_[i];
+      item["MBPerSecond"] = (best_[i] > 0 ? static_cast<double>(bytes_) / (1024.0 * 1024.0) / best_[i] : 0.0);
+      item["InstancesPerSecond"] = (best_[i] > 0 ? static_cast<double>(instanceIds_.size()) / best_[i] : 0.0);
+      result["Read"][EnumerationToString(BENCHMARK_BACKENDS[i])] = item;
+    }
+
+    // Identification of the instances, bypassing the cache: probing of
+    // the levels one resource at a time, against a bulk request
+    {
+      const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      for (std::list<std::string>::const_iterator it = instanceIds_.begin(); it != instanceIds_.end(); ++it)
+      {
+        ResourceEntry entry;
+        index.ResolveSingle(entry, *it);
+      }
+      result["Lookup"]["Probing"]["Seconds"] = GetElapsedSeconds(start);
+    }
+
+    {
+      const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      ResolvedResources resolved;
+      if (index.ResolveBulk(resolved, instanceIds_))
+      {
+        result["Lookup"]["Bulk"]["Seconds"] = GetElapsedSeconds(start);
+      }
+      else
+      {
+        result["Lookup"]["Bulk"] = Json::nullValue;  // Not available in this version of Orthanc
+      }
+    }
+  }
+
+public:
+  BenchmarkJob(const std::string &studyId,
+               unsigned int limit,
+               unsigned int rounds) :
+    OrthancJob("SaolaIndexBenchmark"),
+    studyId_(studyId),
+    limit_(limit),
+    rounds_(std::max(1u, rounds)),
+    bytes_(0),
+    step_(0)
+  {
+    best_.resize(BENCHMARK_BACKENDS_COUNT, 0);
+
+    Json::Value content = Json::objectValue;
+    content["Study"] = studyId_;
+    UpdateContent(content);
+  }
+
+  virtual OrthancPluginJobStepStatus Step() ORTHANC_OVERRIDE
+  {
+    try
+    {
+      if (step_ == 0)
+      {
+        ListInstances();
+      }
+      else if (step_ + 1 < GetStepsCount())
+      {
+        const size_t read = step_ - 1;
+        ReadInstances(static_cast<unsigned int>(read / BENCHMARK_BACKENDS_COUNT), read % BENCHMARK_BACKENDS_COUNT);
+      }
+      else
+      {
+        Json::Value result;
+        FormatResult(result);
+        UpdateContent(result);
+        return OrthancPluginJobStepStatus_Success;
+      }
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      LOG(ERROR) << "[PluginIndex] Benchmark of study " << studyId_ << " failed: " << e.What();
+      throw;
+    }
+
+    step_++;
+    UpdateProgress(static_cast<float>(step_) / static_cast<float>(GetStepsCount()));
+    return OrthancPluginJobStepStatus_Continue;
+  }
+
+  virtual void Stop(OrthancPluginJobStopReason /* reason */) ORTHANC_OVERRIDE
+  {
+  }
+
+  virtual void Reset() ORTHANC_OVERRIDE
+  {
+    instanceIds_.clear();
+    std::fill(best_.begin(), best_.end(), 0);
+    bytes_ = 0;
+    step_ = 0;
+  }
+};
+
+std::string PluginIndex::SubmitBenchmark(const std::string &studyId,
+                                         unsigned int limit,
+                                         unsigned int rounds)
+{
+  return OrthancPlugins::OrthancJob::Submit(new BenchmarkJob(studyId, limit, rounds), 0 /* priority */);
+}
+
 bool PluginIndex::GetMainDicomTags(Json::Value& tags, const std::string& publicId, Orthanc::ResourceType level)
 {
   std::string resource = "";
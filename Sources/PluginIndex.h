@@ -2,22 +2,115 @@
 
 #include <string>
 #include <list>
+#include <map>
 
 #include <Enumerations.h>
 
+#include "SaolaDatabase.h"
+
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
+#include <Cache/LeastRecentlyUsedIndex.h>
 #include <FileStorage/FileInfo.h>
 
+#include <boost/thread/mutex.hpp>
+
+class DicomBuffer;
+
 class PluginIndex
 {
+public:
+  enum Backend
+  {
+    Backend_Rest,  // Internal REST API of Orthanc
+    Backend_Sdk    // Direct calls to the plugin SDK, where they exist
+  };
+
 private:
-  PluginIndex()
+  class BenchmarkJob;
+
+  // The level and the parent of a resource never change, as the
+  // Orthanc identifiers are hashes of the DICOM UIDs
+  struct ResourceEntry
+  {
+    Orthanc::ResourceType level_;
+    std::string parent_;  // Empty for a patient
+  };
+
+  typedef Orthanc::LeastRecentlyUsedIndex<std::string, ResourceEntry> ResourceCache;
+  typedef std::map<std::string, ResourceEntry> ResolvedResources;
+
+  boost::mutex cacheMutex_;
+  ResourceCache cache_;
+  bool hasBulkContent_;
+  Backend backend_;
+
+  PluginIndex() :
+    hasBulkContent_(true),
+    backend_(Backend_Rest)
   {}
 
+  void CacheResource(const std::string &publicId,
+                     const ResourceEntry &entry);
+
+  bool LookupCachedResource(ResourceEntry &entry,
+                            const std::string &publicId);
+
+  // One "/tools/bulk-content" call for all the resources. Returns
+  // "false" if this route is not available.
+  bool ResolveBulk(ResolvedResources &target,
+                   const std::list<std::string> &publicIds);
+
+  // Fallback for the Orthanc versions without "/tools/bulk-content"
+  bool ResolveSingle(ResourceEntry &entry,
+                     const std::string &publicId);
+
+  bool LookupResource(ResourceEntry &entry,
+                      const std::string &publicId);
+
+  // Asks Orthanc where the DICOM file of an instance is stored
+  bool LookupStoragePath(SaolaDatabase::InstancePath &target,
+                         const std::string &instanceId,
+                         const std::string &seriesId);
+
+  // "file://" URIs for the instances whose path is known, from the
+  // index in the Saola database or from Orthanc, "orthanc://" URIs
+  // for the others
+  void GetInstanceUris(std::list<std::string> &result,
+                       const std::string &seriesId,
+                       const std::list<std::string> &instanceIds);
+
+  // "instanceId" is an Orthanc identifier, without scheme
+  bool ReadInstance(DicomBuffer &dicom,
+                    const std::string &instanceId,
+                    Backend backend);
+
 public:
   static PluginIndex &Instance();
 
+  // "REST" or "SDK"
+  static Backend StringToBackend(const std::string &backend);
+
+  static const char *EnumerationToString(Backend backend);
+
+  // The SDK has no access to the parents nor to the attachments of
+  // the resources: only the reads of the instances depend on this
+  void SetBackend(Backend backend);
+
+  Backend GetBackend();
+
+  // Submits an Orthanc job that reads the instances of a study (at
+  // most "limit", 0 for all) with each backend, "rounds" times, and
+  // reports the best timings in its content. Returns the job ID.
+  std::string SubmitBenchmark(const std::string &studyId,
+                              unsigned int limit,
+                              unsigned int rounds);
+
+  // Resolves the level and the parents of the resources in a few
+  // REST calls, so that the subsequent LookupResourceType() and
+  // LookupParent() are served from the cache
+  void Prefetch(const std::list<std::string> &publicIds);
+
   bool LookupParent(std::string &target,
                     const std::string &publicId);
 
@@ -27,6 +120,14 @@ public:
   void GetChildren(std::list<std::string> &result,
                    const std::string &publicId);
 
+  // Maintenance of the index of the storage paths, from the changes
+  // of Orthanc (see StoragePathIndexScheduler). Do nothing if
+  // "ExportPathIndex" is disabled. The paths of the new instances are
+  // stored in a single transaction.
+  void IndexStoragePaths(const std::list<std::string> &instanceIds);
+
+  void RemoveStoragePaths(const std::string &resourceId);
+
   bool LookupAttachment(Orthanc::FileInfo &attachment,
                         int64_t &revision,
                         const std::string &instancePublicId,
@@ -35,4 +136,9 @@ public:
   bool GetMainDicomTags(Json::Value& tags, const std::string& publicId, Orthanc::ResourceType resourceIdLevel);
 
   bool ReadDicom(std::string& dicom, const std::string& instancePublicId);
+
+  // Same as above, but the "file://" instances whose size is at least
+  // "mmapThreshold" bytes are mapped in memory instead of being read
+  // (0 never maps)
+  bool ReadDicom(DicomBuffer& dicom, const std::string& instancePublicId, uint64_t mmapThreshold);
 };
\ No newline at end of file
@@ -9,7 +9,8 @@ CREATE TABLE StableEventQueues(
   retry INTEGER DEFAULT 0,
   failed_reason TEXT,
   last_updated_time TEXT,
-  creation_time TEXT
+  creation_time TEXT,
+  due_time INTEGER    -- Seconds since epoch: last_updated_time + delay_sec
 );
 
 CREATE TABLE TransferJobs(
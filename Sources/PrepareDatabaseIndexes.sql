@@ -0,0 +1,21 @@
+-- Executed each time the database is opened, so that the databases
+-- created by older versions of the plugin get the indexes and the
+-- tables that were added later as well
+
+-- Storage path of the instances, filled by the exports and at ingest
+CREATE TABLE IF NOT EXISTS InstancePaths(
+  instance_id TEXT PRIMARY KEY,
+  series_id TEXT NOT NULL,
+  path TEXT NOT NULL,
+  size INTEGER NOT NULL
+);
+
+CREATE INDEX IF NOT EXISTS InstancePathsSeriesId ON InstancePaths(series_id);
+
+CREATE INDEX IF NOT EXISTS StableEventQueuesAppType ON StableEventQueues(app_type, retry);
+CREATE INDEX IF NOT EXISTS StableEventQueuesAppId ON StableEventQueues(app_id);
+CREATE INDEX IF NOT EXISTS StableEventQueuesLastUpdatedTime ON StableEventQueues(last_updated_time);
+CREATE INDEX IF NOT EXISTS StableEventQueuesCreationTime ON StableEventQueues(creation_time);
+CREATE INDEX IF NOT EXISTS StableEventQueuesDueTime ON StableEventQueues(due_time, retry);
+
+CREATE INDEX IF NOT EXISTS TransferJobsQueueId ON TransferJobs(queue_id);
@@ -6,6 +6,7 @@
 #include <EmbeddedResources.h>
 #include <SQLite/Transaction.h>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/filesystem.hpp>
 
 void SaolaDatabase::AddFileInternal(const std::string &path,
                                     const std::time_t time,
@@ -28,8 +29,73 @@ void SaolaDatabase::AddFileInternal(const std::string &path,
   transaction.Commit();
 }
 
+static int64_t ReadPragma(Orthanc::SQLite::Connection& db, const std::string& pragma)
+{
+  Orthanc::SQLite::Statement statement(db, "PRAGMA " + pragma);
+  if (statement.Step())
+  {
+    return statement.ColumnInt64(0);
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+static bool HasColumn(Orthanc::SQLite::Connection& db, const std::string& table, const std::string& column)
+{
+  Orthanc::SQLite::Statement statement(db, "PRAGMA table_info(" + table + ")");
+  while (statement.Step())
+  {
+    if (statement.ColumnString(1) == column)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// The databases created by older versions have no "due_time" column:
+// add it and compute it from the last update time and the delay
+static void AddDueTime(Orthanc::SQLite::Connection& db)
+{
+  db.Execute("ALTER TABLE StableEventQueues ADD COLUMN due_time INTEGER");
+
+  std::list<std::pair<int64_t, int64_t> > dueTimes;
+
+  {
+    Orthanc::SQLite::Statement statement(db, "SELECT id, last_updated_time, delay_sec FROM StableEventQueues");
+    while (statement.Step())
+    {
+      dueTimes.push_back(std::make_pair(statement.ColumnInt64(0),
+                                        Saola::ToSecondsSinceEpoch(statement.ColumnString(1)) + statement.ColumnInt(2)));
+    }
+  }
+
+  for (const auto &dueTime : dueTimes)
+  {
+    Orthanc::SQLite::Statement statement(db, SQLITE_FROM_HERE, "UPDATE StableEventQueues SET due_time=? WHERE id=?");
+    statement.BindInt64(0, dueTime.second);
+    statement.BindInt64(1, dueTime.first);
+    statement.Run();
+  }
+
+  LOG(WARNING) << "SaolaDatabase - Added the due time of " << dueTimes.size() << " events";
+}
+
 void SaolaDatabase::Initialize()
 {
+  // The queue sees a lot of inserts and deletes: let the free pages
+  // be given back to the filesystem by "PRAGMA incremental_vacuum".
+  // This only applies to the new databases, as it has to be set before
+  // the tables are created. The databases created by older versions
+  // are converted by "ConvertToIncrementalVacuum()", on demand.
+  if (!db_.DoesTableExist("StableEventQueues"))
+  {
+    db_.Execute("PRAGMA AUTO_VACUUM=INCREMENTAL;");
+  }
+
   {
     Orthanc::SQLite::Transaction transaction(db_);
     transaction.Begin();
@@ -40,6 +106,16 @@ void SaolaDatabase::Initialize()
       Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE);
       db_.Execute(sql);
     }
+    else if (!HasColumn(db_, "StableEventQueues", "due_time"))
+    {
+      AddDueTime(db_);
+    }
+
+    {
+      std::string sql;
+      Orthanc::EmbeddedResources::GetFileResource(sql, Orthanc::EmbeddedResources::PREPARE_DATABASE_INDEXES);
+      db_.Execute(sql);
+    }
 
     transaction.Commit();
   }
@@ -55,8 +131,10 @@ void SaolaDatabase::Initialize()
 void SaolaDatabase::Open(const std::string &path)
 {
   boost::mutex::scoped_lock lock(mutex_);
+  path_ = path;
   db_.Open(path);
   Initialize();
+  isOpen_ = true;
 }
 
 void SaolaDatabase::OpenInMemory()
@@ -64,6 +142,164 @@ void SaolaDatabase::OpenInMemory()
   boost::mutex::scoped_lock lock(mutex_);
   db_.OpenInMemory();
   Initialize();
+  isOpen_ = true;
+}
+
+bool SaolaDatabase::IsOpen()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return isOpen_;
+}
+
+int64_t SaolaDatabase::GetTotalChanges()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE, "SELECT total_changes()");
+  statement.Step();
+  return statement.ColumnInt64(0);
+}
+
+void SaolaDatabase::Checkpoint(bool truncate)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // PASSIVE copies what it can without waiting, TRUNCATE also resets the WAL file to zero bytes
+  Orthanc::SQLite::Statement statement(db_, truncate ? "PRAGMA WAL_CHECKPOINT(TRUNCATE)" : "PRAGMA WAL_CHECKPOINT(PASSIVE)");
+  if (statement.Step())
+  {
+    LOG(TRACE) << "SaolaDatabase::Checkpoint truncate=" << truncate << ", busy=" << statement.ColumnInt(0)
+               << ", walFrames=" << statement.ColumnInt(1) << ", checkpointedFrames=" << statement.ColumnInt(2);
+  }
+}
+
+void SaolaDatabase::IncrementalVacuum(unsigned int pages)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // Must go through "Execute()": each step of a prepared statement
+  // only frees one page
+  db_.Execute("PRAGMA INCREMENTAL_VACUUM(" + std::to_string(pages) + ");");
+}
+
+bool SaolaDatabase::ConvertToIncrementalVacuum()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (ReadPragma(db_, "AUTO_VACUUM") == 2 /* INCREMENTAL */)
+  {
+    return false;
+  }
+
+  // Rewrites the whole file: the queue is blocked meanwhile
+  LOG(WARNING) << "SaolaDatabase - Enabling incremental vacuum, this may take a while for large databases";
+  db_.Execute("PRAGMA AUTO_VACUUM=INCREMENTAL;");
+  db_.Execute("VACUUM;");
+  return true;
+}
+
+void SaolaDatabase::Optimize()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  db_.Execute("PRAGMA OPTIMIZE;");
+}
+
+void SaolaDatabase::LookupInstancePaths(InstancePaths& target,
+                                        const std::list<std::string>& instanceIds)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  target.clear();
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  for (std::list<std::string>::const_iterator it = instanceIds.begin(); it != instanceIds.end(); ++it)
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "SELECT series_id, path, size FROM InstancePaths WHERE instance_id=?");
+    statement.BindString(0, *it);
+
+    if (statement.Step())
+    {
+      InstancePath& path = target[*it];
+      path.instanceId_ = *it;
+      path.seriesId_ = statement.ColumnString(0);
+      path.path_ = statement.ColumnString(1);
+      path.size_ = static_cast<uint64_t>(statement.ColumnInt64(2));
+    }
+  }
+
+  transaction.Commit();
+}
+
+void SaolaDatabase::StoreInstancePaths(const std::list<InstancePath>& paths)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+
+  for (std::list<InstancePath>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                         "INSERT OR REPLACE INTO InstancePaths VALUES(?, ?, ?, ?)");
+    statement.BindString(0, it->instanceId_);
+    statement.BindString(1, it->seriesId_);
+    statement.BindString(2, it->path_);
+    statement.BindInt64(3, static_cast<int64_t>(it->size_));
+    statement.Run();
+  }
+
+  transaction.Commit();
+}
+
+void SaolaDatabase::RemoveInstancePaths(const std::string& resourceId)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "DELETE FROM InstancePaths WHERE instance_id=? OR series_id=?");
+  statement.BindString(0, resourceId);
+  statement.BindString(1, resourceId);
+  statement.Run();
+}
+
+void SaolaDatabase::GetStatistics(Json::Value &stats)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  stats = Json::objectValue;
+  stats["backend"] = "SQLite";
+  stats["path"] = path_;
+
+  boost::system::error_code ec;
+  uintmax_t fileSize = boost::filesystem::file_size(path_, ec);
+  stats["fileSize"] = Json::Value::UInt64(ec ? 0 : fileSize);
+  uintmax_t walSize = boost::filesystem::file_size(path_ + "-wal", ec);
+  stats["walSize"] = Json::Value::UInt64(ec ? 0 : walSize);
+
+  stats["pageSize"] = Json::Value::Int64(ReadPragma(db_, "PAGE_SIZE"));
+  stats["pageCount"] = Json::Value::Int64(ReadPragma(db_, "PAGE_COUNT"));
+  stats["freelistCount"] = Json::Value::Int64(ReadPragma(db_, "FREELIST_COUNT"));
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE, "SELECT COUNT(*) FROM StableEventQueues");
+    statement.Step();
+    stats["events"] = Json::Value::Int64(statement.ColumnInt64(0));
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE, "SELECT COUNT(*) FROM TransferJobs");
+    statement.Step();
+    stats["transferJobs"] = Json::Value::Int64(statement.ColumnInt64(0));
+  }
+
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE, "SELECT COUNT(*) FROM InstancePaths");
+    statement.Step();
+    stats["instancePaths"] = Json::Value::Int64(statement.ColumnInt64(0));
+  }
 }
 
 bool SaolaDatabase::GetById(int64_t id, StableEventDTOGet &result)
@@ -226,7 +462,7 @@ bool SaolaDatabase::GetByIds(const std::list<int64_t> &ids, std::list<StableEven
 
 
 
-void SaolaDatabase::FindAll(const Pagination &page, std::list<StableEventDTOGet> &results)
+void SaolaDatabase::List(const Pagination &page, const StableEventFilter &filter, std::list<StableEventDTOGet> &results)
 {
   boost::mutex::scoped_lock lock(mutex_);
 
@@ -245,17 +481,97 @@ void SaolaDatabase::FindAll(const Pagination &page, std::list<StableEventDTOGet>
     sortBy = page.sort_by_;
   }
 
+  // Each condition comes with the list of its string parameters, in order
+  std::list<std::string> conditions;
+  std::list<std::string> parameters;
+
+  if (!filter.app_id_.empty())
+  {
+    conditions.push_back("app_id = ?");
+    parameters.push_back(filter.app_id_);
+  }
+
+  if (!filter.app_type_.empty())
+  {
+    conditions.push_back("app_type = ?");
+    parameters.push_back(filter.app_type_);
+  }
+
+  if (filter.min_retry_ >= 0)
+  {
+    conditions.push_back("retry >= ?");
+    parameters.push_back(std::to_string(filter.min_retry_));
+  }
+
+  if (filter.max_retry_ >= 0)
+  {
+    conditions.push_back("retry <= ?");
+    parameters.push_back(std::to_string(filter.max_retry_));
+  }
+
+  if (!filter.created_before_.empty())
+  {
+    conditions.push_back("creation_time <= ?");
+    parameters.push_back(filter.created_before_);
+  }
+
+  if (!filter.created_after_.empty())
+  {
+    conditions.push_back("creation_time >= ?");
+    parameters.push_back(filter.created_after_);
+  }
+
+  // Keyset pagination: seek directly after the last row of the
+  // previous page, instead of reading and dropping "offset" rows
+  if (page.has_after_)
+  {
+    if (sortBy == "id")
+    {
+      conditions.push_back("id > ?");
+      parameters.push_back(std::to_string(page.after_id_));
+    }
+    else
+    {
+      conditions.push_back("(" + sortBy + ", id) > (?, ?)");
+      parameters.push_back(page.after_value_);
+      parameters.push_back(std::to_string(page.after_id_));
+    }
+  }
+
   std::string sql = "SELECT id, iuid, resource_id, resource_type, app_id, app_type, "
                     "delay_sec, retry, failed_reason, last_updated_time, creation_time "
-                    "FROM StableEventQueues ORDER BY " + sortBy + " LIMIT ? OFFSET ?";
+                    "FROM StableEventQueues";
 
-  // LOG(INFO) << "SaolaDatabase::FindAll sql=" << sql << ", limit=" << page.limit_ << ", offset=" << page.offset_;
+  if (!conditions.empty())
+  {
+    sql += " WHERE " + boost::algorithm::join(conditions, " AND ");
+  }
+
+  sql += " ORDER BY " + sortBy + (sortBy == "id" ? "" : ", id") + " LIMIT ?";
+
+  if (!page.has_after_)
+  {
+    sql += " OFFSET ?";
+  }
+
+  // LOG(INFO) << "SaolaDatabase::List sql=" << sql << ", limit=" << page.limit_ << ", offset=" << page.offset_;
 
   Orthanc::SQLite::Statement statement(db_, sql);
   
-  // Bind the parameters
-  statement.BindInt(0, page.limit_);
-  statement.BindInt64(1, page.offset_);
+  // Bind the parameters. Numeric values are bound as strings as well:
+  // the INTEGER affinity of the columns converts them back.
+  int paramIndex = 0;
+  for (const auto &parameter : parameters)
+  {
+    statement.BindString(paramIndex++, parameter);
+  }
+
+  statement.BindInt(paramIndex++, page.limit_);
+
+  if (!page.has_after_)
+  {
+    statement.BindInt64(paramIndex, page.offset_);
+  }
 
   while (statement.Step())
   {
@@ -351,7 +667,7 @@ void SaolaDatabase::FindByRetryLessThan(int retry, std::list<StableEventDTOGet>
 // }
 
 
-void SaolaDatabase::FindByAppTypeInRetryLessThan(const std::list<std::string> &appTypes, bool included, int retry, int limit, std::list<StableEventDTOGet> &results)
+void SaolaDatabase::GetDueBatch(const std::list<std::string> &appTypes, bool included, int maxRetry, int limit, std::list<StableEventDTOGet> &results)
 {
   boost::mutex::scoped_lock lock(mutex_);
 
@@ -377,9 +693,11 @@ void SaolaDatabase::FindByAppTypeInRetryLessThan(const std::list<std::string> &a
   }
   inClause += ")";
   
-  // Complete the query with placeholders for retry and limit
-  std::string sql = baseQuery + inClause + " AND retry <= ? ORDER BY retry ASC LIMIT ?";
-  // LOG(INFO) << "SaolaDatabase::FindByAppTypeInRetryLessThan sql=" << sql;
+  // Only the due events are selected (same condition as
+  // "Saola::IsOverDue()"), so that the ones that are not due yet
+  // cannot fill the batch and starve the others
+  std::string sql = baseQuery + inClause + " AND retry <= ? AND due_time < ? ORDER BY retry ASC, id ASC LIMIT ?";
+  // LOG(INFO) << "SaolaDatabase::GetDueBatch sql=" << sql;
   
   // Prepare the statement
   Orthanc::SQLite::Statement statement(db_, sql);
@@ -390,8 +708,9 @@ void SaolaDatabase::FindByAppTypeInRetryLessThan(const std::list<std::string> &a
     statement.BindString(paramIndex++, appType);
   }
   
-  // Bind retry and limit parameters
-  statement.BindInt(paramIndex++, retry);  
+  // Bind retry, due time and limit parameters
+  statement.BindInt(paramIndex++, maxRetry);
+  statement.BindInt64(paramIndex++, Saola::ToSecondsSinceEpoch(Saola::GetNow()));
   statement.BindInt(paramIndex, limit);
   
   // Execute and gather results
@@ -416,28 +735,53 @@ void SaolaDatabase::FindByAppTypeInRetryLessThan(const std::list<std::string> &a
   transaction.Commit();
 }
 
-int64_t SaolaDatabase::AddEvent(const StableEventDTOCreate &obj)
+int64_t SaolaDatabase::EnqueueInternal(const StableEventDTOCreate &obj)
+{
+  Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
+                                       "INSERT INTO StableEventQueues (iuid, resource_id, resource_type, app_id, app_type, delay_sec, last_updated_time, creation_time, due_time) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?)");
+  const boost::posix_time::ptime now = Saola::GetNow();
+  statement.BindString(0, obj.iuid_);
+  statement.BindString(1, obj.resource_id_);
+  statement.BindString(2, obj.resouce_type_);
+  statement.BindString(3, obj.app_id_);
+  statement.BindString(4, obj.app_type_);
+  statement.BindInt(5, obj.delay_);
+  statement.BindString(6, boost::posix_time::to_iso_string(now));
+  statement.BindString(7, boost::posix_time::to_iso_string(now));
+  statement.BindInt64(8, Saola::ToSecondsSinceEpoch(now) + obj.delay_);
+  statement.Run();
+
+  return db_.GetLastInsertRowId();
+}
+
+int64_t SaolaDatabase::Enqueue(const StableEventDTOCreate &obj)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+  int64_t id = EnqueueInternal(obj);
+  transaction.Commit();
+  return id;
+}
+
+void SaolaDatabase::EnqueueBatch(const std::list<StableEventDTOCreate> &objs, std::list<int64_t> &ids)
 {
   boost::mutex::scoped_lock lock(mutex_);
 
+  // A single transaction for the whole batch: one journal sync instead
+  // of one per event, and a rollback if any insertion fails
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
+
+  std::list<int64_t> tmp;
+  for (const auto &obj : objs)
   {
-    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "INSERT INTO StableEventQueues (iuid, resource_id, resource_type, app_id, app_type, delay_sec, last_updated_time, creation_time) VALUES(?, ?, ?, ?, ?, ?, ?, ?)");
-    statement.BindString(0, obj.iuid_);
-    statement.BindString(1, obj.resource_id_);
-    statement.BindString(2, obj.resouce_type_);
-    statement.BindString(3, obj.app_id_);
-    statement.BindString(4, obj.app_type_);
-    statement.BindInt(5, obj.delay_);
-    statement.BindString(6, boost::posix_time::to_iso_string(Saola::GetNow()));
-    statement.BindString(7, boost::posix_time::to_iso_string(Saola::GetNow()));
-    statement.Run();
+    tmp.push_back(EnqueueInternal(obj));
   }
 
   transaction.Commit();
-  return db_.GetLastInsertRowId();
+  ids.splice(ids.end(), tmp);
 }
 
 // bool SaolaDatabase::DeleteEventByIds(const std::list<int64_t> &ids)
@@ -552,7 +896,33 @@ bool SaolaDatabase::DeleteEventByIds(const std::list<int64_t> &ids)
 }
 
 
-bool SaolaDatabase::UpdateEvent(const StableEventDTOUpdate &obj)
+bool SaolaDatabase::Complete(int64_t id)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  Orthanc::SQLite::Transaction transaction(db_);
+  transaction.Begin();
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE, "DELETE FROM TransferJobs WHERE queue_id=?");
+    statement.BindInt64(0, id);
+    statement.Run();
+  }
+  {
+    Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE, "DELETE FROM StableEventQueues WHERE id=?");
+    statement.BindInt64(0, id);
+    statement.Run();
+  }
+
+  transaction.Commit();
+  return true;
+}
+
+bool SaolaDatabase::Fail(const StableEventDTOUpdate &obj)
+{
+  return Reschedule(obj);
+}
+
+bool SaolaDatabase::Reschedule(const StableEventDTOUpdate &obj)
 {
   boost::mutex::scoped_lock lock(mutex_);
 
@@ -560,11 +930,12 @@ bool SaolaDatabase::UpdateEvent(const StableEventDTOUpdate &obj)
   transaction.Begin();
   {
     Orthanc::SQLite::Statement statement(db_, SQLITE_FROM_HERE,
-                                         "UPDATE StableEventQueues SET failed_reason=?, retry=?, last_updated_time=? WHERE id=?");
+                                         "UPDATE StableEventQueues SET failed_reason=?, retry=?, last_updated_time=?, due_time=?+delay_sec WHERE id=?");
     statement.BindString(0, obj.failed_reason_);
     statement.BindInt(1, obj.retry_);
     statement.BindString(2, obj.last_updated_time_);
-    statement.BindInt64(3, obj.id_);
+    statement.BindInt64(3, Saola::ToSecondsSinceEpoch(obj.last_updated_time_));
+    statement.BindInt64(4, obj.id_);
     statement.Run();
   }
 
@@ -607,24 +978,27 @@ bool SaolaDatabase::ResetEvents(const std::list<int64_t> &ids)
 {
   boost::mutex::scoped_lock lock(mutex_);
 
+  const boost::posix_time::ptime now = Saola::GetNow();
+
   Orthanc::SQLite::Transaction transaction(db_);
   transaction.Begin();
 
   if (ids.empty())
   {
     // Reset all events when no ids are specified
-    std::string sql = "UPDATE StableEventQueues SET failed_reason=?, retry=?, last_updated_time=?";
+    std::string sql = "UPDATE StableEventQueues SET failed_reason=?, retry=?, last_updated_time=?, due_time=?+delay_sec";
     LOG(INFO) << "SaolaDatabase::ResetEvents sql=" << sql;
     Orthanc::SQLite::Statement statement(db_, sql);
     statement.BindString(0, "Reset");
     statement.BindInt(1, 0);
-    statement.BindString(2, boost::posix_time::to_iso_string(Saola::GetNow()));
+    statement.BindString(2, boost::posix_time::to_iso_string(now));
+    statement.BindInt64(3, Saola::ToSecondsSinceEpoch(now));
     statement.Run();
   }
   else
   {
     // Create SQL with placeholders for both update values and the IN clause
-    std::string sql = "UPDATE StableEventQueues SET failed_reason=?, retry=?, last_updated_time=? WHERE id IN (";
+    std::string sql = "UPDATE StableEventQueues SET failed_reason=?, retry=?, last_updated_time=?, due_time=?+delay_sec WHERE id IN (";
     
     // Add the appropriate number of parameter placeholders for IDs
     for (size_t i = 0; i < ids.size(); i++)
@@ -640,7 +1014,8 @@ bool SaolaDatabase::ResetEvents(const std::list<int64_t> &ids)
     int paramIndex = 0;
     statement.BindString(paramIndex++, "Reset");
     statement.BindInt(paramIndex++, 0);
-    statement.BindString(paramIndex++, boost::posix_time::to_iso_string(Saola::GetNow()));
+    statement.BindString(paramIndex++, boost::posix_time::to_iso_string(now));
+    statement.BindInt64(paramIndex++, Saola::ToSecondsSinceEpoch(now));
     
     // Then bind each ID for the IN clause
     for (const auto &id : ids)
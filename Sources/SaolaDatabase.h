@@ -1,17 +1,11 @@
 #pragma once
 
-#include "DTO/StableEventDTOCreate.h"
-#include "DTO/StableEventDTOUpdate.h"
-#include "DTO/StableEventDTOGet.h"
-
-#include "DTO/TransferJobDTOCreate.h"
-#include "DTO/TransferJobDTOGet.h"
+#include "Database/IEventQueueStore.h"
 
 #include "FailedJobFilter.h"
 
-#include "Pagination.h"
-
 #include <list>
+#include <map>
 
 #include <OrthancFramework.h>  // To have ORTHANC_ENABLE_SQLITE defined
 #include <SQLite/Connection.h>
@@ -21,7 +15,7 @@
 
 
 
-class SaolaDatabase : public boost::noncopyable
+class SaolaDatabase : public IEventQueueStore
 {
 public:
   enum FileStatus
@@ -44,20 +38,40 @@ public:
                                const std::string& instanceId) = 0;
   };  
 
+  // Location of an instance in the storage area of Orthanc
+  struct InstancePath
+  {
+    std::string instanceId_;
+    std::string seriesId_;
+    std::string path_;
+    uint64_t size_;
+
+    InstancePath() : size_(0)
+    {
+    }
+  };
+
+  typedef std::map<std::string, InstancePath> InstancePaths;  // By instance identifier
+
 
 private:
   boost::mutex                 mutex_;
   Orthanc::SQLite::Connection  db_;
+  std::string                  path_;
+  bool                         isOpen_;
   
   void Initialize();
 
+  int64_t EnqueueInternal(const StableEventDTOCreate& obj);
+
   void AddFileInternal(const std::string& path,
                        const std::time_t time,
                        const uintmax_t size,
                        bool isDicom,
                        const std::string& instanceId);
 
-  SaolaDatabase()
+  SaolaDatabase() :
+    isOpen_(false)
   {}
 
 public:
@@ -68,6 +82,35 @@ public:
 
   void OpenInMemory();  // For unit tests
 
+  bool IsOpen();
+
+  // Maintenance of the SQLite file, run by DatabaseMaintenanceScheduler
+
+  // Number of rows modified since the database was opened, to detect idle periods
+  int64_t GetTotalChanges();
+
+  void Checkpoint(bool truncate);
+
+  void IncrementalVacuum(unsigned int pages);
+
+  // The databases created before the incremental vacuum was enabled
+  // need a full VACUUM. Returns "false" if there is nothing to do.
+  bool ConvertToIncrementalVacuum();
+
+  void Optimize();
+
+  // Index of the storage paths of the instances, used by the exports
+  // to read the files directly. The entries may be stale: the callers
+  // must check that the file is still there.
+
+  void LookupInstancePaths(InstancePaths& target,
+                           const std::list<std::string>& instanceIds);
+
+  void StoreInstancePaths(const std::list<InstancePath>& paths);
+
+  // "resourceId" is an instance or a series
+  void RemoveInstancePaths(const std::string& resourceId);
+
   FileStatus LookupFile(std::string& oldInstanceId,
                         const std::string& path,
                         const std::time_t time,
@@ -81,38 +124,53 @@ public:
   // Returns "false" iff. this instance has not been previously
   // registerded using "AddDicomInstance()", which indicates the
   // import of an external DICOM file
-  int64_t AddEvent(const StableEventDTOCreate& obj);
+  virtual int64_t Enqueue(const StableEventDTOCreate& obj) ORTHANC_OVERRIDE;
 
-  bool DeleteEventByIds(const std::list<int64_t>& ids);
+  virtual void EnqueueBatch(const std::list<StableEventDTOCreate>& objs,
+                            std::list<int64_t>& ids) ORTHANC_OVERRIDE;
 
-  bool UpdateEvent(const StableEventDTOUpdate& obj);
+  virtual void GetDueBatch(const std::list<std::string>& appTypes,
+                           bool included,
+                           int maxRetry,
+                           int limit,
+                           std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
 
-  bool ResetEvents(const std::list<int64_t>& ids);
+  virtual bool Complete(int64_t id) ORTHANC_OVERRIDE;
 
-  bool GetById(int64_t id, StableEventDTOGet& result);
+  virtual bool Fail(const StableEventDTOUpdate& obj) ORTHANC_OVERRIDE;
 
-  bool GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results);
+  virtual bool Reschedule(const StableEventDTOUpdate& obj) ORTHANC_OVERRIDE;
 
-  void FindAll(const Pagination& page, std::list<StableEventDTOGet>& results);
+  virtual void List(const Pagination& page,
+                    const StableEventFilter& filter,
+                    std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
 
-  void FindByRetryLessThan(int retry, std::list<StableEventDTOGet>& results);
+  virtual bool DeleteEventByIds(const std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool ResetEvents(const std::list<int64_t>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool GetById(int64_t id, StableEventDTOGet& result) ORTHANC_OVERRIDE;
 
-  void FindByAppTypeInRetryLessThan(const std::list<std::string>& appType, bool included, int retry, int limit, std::list<StableEventDTOGet>& results);
+  virtual bool GetByIds(const std::list<int64_t>& ids, std::list<StableEventDTOGet>& results) ORTHANC_OVERRIDE;
 
-  void SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result);
+  void FindByRetryLessThan(int retry, std::list<StableEventDTOGet>& results);
+
+  virtual void SaveTransferJob(const TransferJobDTOCreate& dto, TransferJobDTOGet& result) ORTHANC_OVERRIDE;
 
   // void FindAll(const Pagination& page, const FailedJobFilter& filter, std::list<FailedJobDTOGet>& results);
 
   bool ResetFailedJob(const std::list<std::string>& ids);
 
-  bool DeleteTransferJobByIds(const std::list<std::string>& ids);
+  virtual bool DeleteTransferJobByIds(const std::list<std::string>& ids) ORTHANC_OVERRIDE;
+
+  virtual bool DeleteTransferJobsByQueueId(int64_t id) ORTHANC_OVERRIDE;
 
-  bool DeleteTransferJobsByQueueId(int64_t id);
+  virtual bool GetById(const std::string& id, TransferJobDTOGet& result) ORTHANC_OVERRIDE;
 
-  bool GetById(const std::string& id, TransferJobDTOGet& result);
+  virtual bool GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results) ORTHANC_OVERRIDE;
 
-  bool GetTransferJobsByByQueueId(int64_t id, std::list<TransferJobDTOGet>& results);
+  virtual bool GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results) ORTHANC_OVERRIDE;
 
-  bool GetTransferJobsByByQueueIds(const std::list<int64_t>& ids, std::list<TransferJobDTOGet>& results);
+  virtual void GetStatistics(Json::Value& stats) ORTHANC_OVERRIDE;
 
 };
@@ -0,0 +1,120 @@
+#include "DatabaseMaintenanceScheduler.h"
+
+#include "../Database/EventQueueStore.h"
+#include "../SaolaDatabase.h"
+#include "../Config/SaolaConfiguration.h"
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <Enumerations.h>
+
+// Number of pages given back to the filesystem per idle round (4MB with the default page size)
+static const unsigned int VACUUM_PAGES = 1000;
+
+// "PRAGMA optimize" is cheap but only useful once in a while
+static const unsigned int OPTIMIZE_PERIOD = 3600;  // In second(s)
+
+DatabaseMaintenanceScheduler &DatabaseMaintenanceScheduler::Instance()
+{
+  static DatabaseMaintenanceScheduler instance;
+  return instance;
+}
+
+DatabaseMaintenanceScheduler::~DatabaseMaintenanceScheduler()
+{
+  if (this->m_state == State_Running)
+  {
+    OrthancPlugins::LogError("DatabaseMaintenanceScheduler::Stop() should have been manually called");
+    Stop();
+  }
+}
+
+void DatabaseMaintenanceScheduler::RunMaintenance()
+{
+  SaolaDatabase &db = SaolaDatabase::Instance();
+
+  // Copy the WAL into the database without blocking the writers, so
+  // that the WAL does not grow between the automatic checkpoints
+  db.Checkpoint(false);
+
+  int64_t changes = db.GetTotalChanges();
+  if (changes == this->m_lastChanges)
+  {
+    // Idle: reset the WAL file to zero bytes and release the free pages
+    db.Checkpoint(true);
+
+    if (!this->m_vacuumConverted &&
+        SaolaConfiguration::Instance().IsDatabaseConvertToIncrementalVacuum())
+    {
+      db.ConvertToIncrementalVacuum();
+      this->m_vacuumConverted = true;
+    }
+
+    db.IncrementalVacuum(VACUUM_PAGES);
+  }
+  this->m_lastChanges = db.GetTotalChanges();
+
+  this->m_roundsSinceOptimize++;
+  if (this->m_roundsSinceOptimize * SaolaConfiguration::Instance().GetDatabaseMaintenanceInterval() >= OPTIMIZE_PERIOD)
+  {
+    db.Optimize();
+    this->m_roundsSinceOptimize = 0;
+  }
+}
+
+void DatabaseMaintenanceScheduler::MonitorDatabase()
+{
+  while (this->m_state == State_Running)
+  {
+    for (int i = 0; i < SaolaConfiguration::Instance().GetDatabaseMaintenanceInterval() * 10; i++)
+    {
+      if (this->m_state != State_Running)
+      {
+        return;
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+
+    try
+    {
+      RunMaintenance();
+    }
+    catch (Orthanc::OrthancException &e)
+    {
+      LOG(ERROR) << "DatabaseMaintenanceScheduler - Maintenance of the queue database failed: " << e.What();
+    }
+  }
+}
+
+void DatabaseMaintenanceScheduler::Start()
+{
+  if (SaolaConfiguration::Instance().GetQueueBackend() != EventQueueStore::SQLITE ||
+      SaolaConfiguration::Instance().GetDatabaseMaintenanceInterval() <= 0)
+  {
+    return;
+  }
+  if (this->m_state != State_Setup)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  this->m_state = State_Running;
+
+  this->m_worker = new boost::thread([this]() {
+    this->MonitorDatabase();
+  });
+}
+
+void DatabaseMaintenanceScheduler::Stop()
+{
+  if (this->m_state == State_Running)
+  {
+    this->m_state = State_Done;
+    if (this->m_worker->joinable())
+      this->m_worker->join();
+    delete this->m_worker;
+    this->m_worker = NULL;
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <boost/thread.hpp>
+
+#include <boost/noncopyable.hpp>
+
+// Periodic housekeeping of the SQLite event queue: WAL checkpoints,
+// incremental vacuum and "PRAGMA optimize". The expensive operations
+// are only run when no change was made to the queue since the
+// previous round, so that they do not compete with the scheduler.
+class DatabaseMaintenanceScheduler : public boost::noncopyable
+{
+private:
+  enum State
+  {
+    State_Setup,
+    State_Running,
+    State_Done
+  };
+
+  boost::thread *m_worker;
+
+  State m_state;
+
+  int64_t m_lastChanges;
+
+  unsigned int m_roundsSinceOptimize;
+
+  bool m_vacuumConverted;
+
+  DatabaseMaintenanceScheduler() : m_worker(NULL), m_state(State_Setup), m_lastChanges(-1), m_roundsSinceOptimize(0), m_vacuumConverted(false)
+  {
+  }
+
+  void RunMaintenance();
+
+  void MonitorDatabase();
+
+public:
+  static DatabaseMaintenanceScheduler &Instance();
+
+  ~DatabaseMaintenanceScheduler();
+
+  void Start();
+
+  void Stop();
+};
@@ -1,5 +1,5 @@
 #include "StableEventScheduler.h"
-#include "../SaolaDatabase.h"
+#include "../Database/EventQueueStore.h"
 #include "../TimeUtil.h"
 
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
@@ -331,7 +331,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
     // - Success --> Delete queue and its jobs
     // - Running --> Chec if task is overdue. YES --> set try to max. NO --> wait until it finishes or being overdue
     // - Pending, Failure, Paused, Retry --> Increase queue's retry by 1 and return
-    if (dto.id_ >= 0 && SaolaDatabase::Instance().GetTransferJobsByByQueueId(dto.id_, jobs))
+    if (dto.id_ >= 0 && EventQueueStore::Instance().GetTransferJobsByByQueueId(dto.id_, jobs))
     {
       LOG(INFO) << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " Found existing jobs.size()=" << jobs.size() << " for queue_id=" << dto.id_;
       std::list<std::string> availableJobIds;
@@ -350,8 +350,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
           if (response["State"].asString() == Orthanc::EnumerationToString(Orthanc::JobState_Success))
           {
             LOG(INFO) << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << "DELETING queue_id=" << std::to_string(dto.id_) << ", and its jobs. RETURNING TRUE";
-            SaolaDatabase::Instance().DeleteTransferJobsByQueueId(dto.id_); // dto.id_ >= 0 as condition in FOR loop
-            SaolaDatabase::Instance().DeleteEventByIds(std::list<int64_t>{dto.id_});
+            EventQueueStore::Instance().Complete(dto.id_); // dto.id_ >= 0 as condition in FOR loop
             return true;
           }
           else if (response["State"].asString() == Orthanc::EnumerationToString(Orthanc::JobState_Failure) ||
@@ -374,7 +373,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
       if (invalidJobIds.size() > 0)
       {
         LOG(INFO) << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " INVALID JOBS size= " << invalidJobIds.size() << " Delete invalid jobs: " << boost::algorithm::join(invalidJobIds, ",") << " jobs";
-        SaolaDatabase::Instance().DeleteTransferJobByIds(invalidJobIds);
+        EventQueueStore::Instance().DeleteTransferJobByIds(invalidJobIds);
       }
 
       if (availableJobIds.empty())
@@ -383,7 +382,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
         ss << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " ERROR All "<< jobs.size() << " jobs are UNAVAILABLE for queue_id=" << dto.id_ << ", jobs.size()=" << jobs.size() << " . Increasing job retry to " << dto.retry_ + 1;
         LOG(ERROR) << ss.str();
         dto.failed_reason_ = ss.str();
-        SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
+        EventQueueStore::Instance().Fail(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
         return false;
       }
       LOG(INFO) << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " AVAILABLE JOBS size= " << availableJobIds.size() << " for queue_id=" << dto.id_ << ", jobs.size()=" << jobs.size() << " . RETURNING TRUE";
@@ -402,7 +401,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
       OrthancPlugins::WriteFastJson(s, jobResponse);
       ss << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " ERROR Send to API: " << appConfig.url_ << " , Failed response=" << s;
       dto.failed_reason_ = ss.str();
-      SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
+      EventQueueStore::Instance().Fail(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
 
       notification[Notification::ERROR_DETAIL] = dto.ToJsonString();
       notification[Notification::ERROR_MESSAGE] = ss.str();
@@ -416,10 +415,10 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
     TransferJobDTOGet result;
     if (dto.id_ >= 0)
     {
-      SaolaDatabase::Instance().SaveTransferJob(TransferJobDTOCreate(jobResponse["ID"].asString(), dto.id_), result);
+      EventQueueStore::Instance().SaveTransferJob(TransferJobDTOCreate(jobResponse["ID"].asString(), dto.id_), result);
       if (dto.retry_ > 0)
       {
-        SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
+        EventQueueStore::Instance().Reschedule(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
       }
 
       LOG(INFO) << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " Save JOB " << result.ToJsonString();
@@ -431,7 +430,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
     std::stringstream ss;
     ss << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " ERROR EXCEPTION Orthanc::OrthancException: " << e.What();
     dto.failed_reason_ = ss.str();
-    SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
+    EventQueueStore::Instance().Fail(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
     LOG(ERROR) << ss.str();
     notification[Notification::ERROR_DETAIL] = dto.ToJsonString();
     notification[Notification::ERROR_MESSAGE] = ss.str();
@@ -443,7 +442,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
     std::stringstream ss;
     ss << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " ERROR EXCEPTION std::exception: " << e.what();
     dto.failed_reason_ = ss.str();
-    SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
+    EventQueueStore::Instance().Fail(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
     LOG(ERROR) << ss.str();
     notification[Notification::ERROR_DETAIL] = dto.ToJsonString();
     notification[Notification::ERROR_MESSAGE] = ss.str();
@@ -455,7 +454,7 @@ static bool ProcessAsyncTask(const AppConfiguration &appConfig, StableEventDTOGe
     std::stringstream ss;
     ss << "[ProcessAsyncTask][Task-" << dto.id_ << "]" << " ERROR EXCEPTION occurs but no specific reason";
     dto.failed_reason_ = ss.str();
-    SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
+    EventQueueStore::Instance().Fail(StableEventDTOUpdate(dto.id_, dto.failed_reason_.c_str(), dto.retry_ + 1, Saola::GetNextXSecondsFromNowInString(dto.delay_sec_).c_str()));
     LOG(ERROR) << ss.str();
     notification[Notification::ERROR_DETAIL] = dto.ToJsonString();
     notification[Notification::ERROR_MESSAGE] = ss.str();
@@ -478,7 +477,7 @@ static bool ProcessSyncTask(const AppConfiguration &appConfig, StableEventDTOGet
       ConstructAndSendMessage(appConfig, mainDicomTags);
       if (dto.id_ >= 0)
       {
-        SaolaDatabase::Instance().DeleteEventByIds(std::list<int64_t>{dto.id_});
+        EventQueueStore::Instance().Complete(dto.id_);
       }
       return true;
     }
@@ -541,15 +540,11 @@ static void MonitorTasks(std::list<StableEventDTOGet> &tasks)
     if (!appConfig)
     {
       LOG(ERROR) << "[MonitorTasks] ERROR Cannot find any AppConfiguration " << task.app_id_;
-      SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(task.id_, "[MonitorTasks] Cannot find any AppConfiguration", SaolaConfiguration::Instance().GetMaxRetry() + 1, Saola::GetNextXSecondsFromNowInString(60).c_str()));
-      SaolaDatabase::Instance().DeleteTransferJobsByQueueId(task.id_);
+      EventQueueStore::Instance().Fail(StableEventDTOUpdate(task.id_, "[MonitorTasks] Cannot find any AppConfiguration", SaolaConfiguration::Instance().GetMaxRetry() + 1, Saola::GetNextXSecondsFromNowInString(60).c_str()));
+      EventQueueStore::Instance().DeleteTransferJobsByQueueId(task.id_);
       continue;
     }
 
-    if (!Saola::IsOverDue(task.last_updated_time_, task.delay_sec_))
-    {
-      continue;
-    }
     LOG(INFO) << "[MonitorTasks] Processing task " << task.ToJsonString();
 
     Json::Value notification;
@@ -562,7 +557,7 @@ static void MonitorTasks(std::list<StableEventDTOGet> &tasks)
     {
       if (!ProcessSyncTask(*appConfig, task, notification))
       {
-        SaolaDatabase::Instance().UpdateEvent(StableEventDTOUpdate(task.id_, task.failed_reason_.c_str(), task.retry_ + 1, Saola::GetNextXSecondsFromNowInString(task.delay_sec_).c_str()));
+        EventQueueStore::Instance().Fail(StableEventDTOUpdate(task.id_, task.failed_reason_.c_str(), task.retry_ + 1, Saola::GetNextXSecondsFromNowInString(task.delay_sec_).c_str()));
         Notification::Instance().SendMessage(notification);
       }
     }
@@ -599,7 +594,7 @@ void StableEventScheduler::Start()
     {
       LOG(TRACE) << "[StableEventScheduler::MonitorDatabase] Start monitoring Ris/StoreServer tasks ...";
       std::list<StableEventDTOGet> results;
-      SaolaDatabase::Instance().FindByAppTypeInRetryLessThan(FIRST_PRIORITY_APP_TYPES, true, SaolaConfiguration::Instance().GetMaxRetry(), SaolaConfiguration::Instance().GetQueryLimit(), results);
+      EventQueueStore::Instance().GetDueBatch(FIRST_PRIORITY_APP_TYPES, true, SaolaConfiguration::Instance().GetMaxRetry(), SaolaConfiguration::Instance().GetQueryLimit(), results);
       MonitorTasks(results);
       for (int i = 0; i < 10; i++)
       {
@@ -616,12 +611,12 @@ void StableEventScheduler::Start()
       {
         if (InMemoryJobCache::Instance().GetSize() < SaolaConfiguration::Instance().GetInMemJobCacheLimit())
         {
-          SaolaDatabase::Instance().FindByAppTypeInRetryLessThan(FIRST_PRIORITY_APP_TYPES, false, SaolaConfiguration::Instance().GetMaxRetry(), SaolaConfiguration::Instance().GetQueryLimit(), results);
+          EventQueueStore::Instance().GetDueBatch(FIRST_PRIORITY_APP_TYPES, false, SaolaConfiguration::Instance().GetMaxRetry(), SaolaConfiguration::Instance().GetQueryLimit(), results);
         }
       }
       else
       {
-        SaolaDatabase::Instance().FindByAppTypeInRetryLessThan(FIRST_PRIORITY_APP_TYPES, false, SaolaConfiguration::Instance().GetMaxRetry(), SaolaConfiguration::Instance().GetQueryLimit(), results);
+        EventQueueStore::Instance().GetDueBatch(FIRST_PRIORITY_APP_TYPES, false, SaolaConfiguration::Instance().GetMaxRetry(), SaolaConfiguration::Instance().GetQueryLimit(), results);
       }
 
       MonitorTasks(results);
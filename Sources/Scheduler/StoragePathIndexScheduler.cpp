@@ -0,0 +1,173 @@
+#include "StoragePathIndexScheduler.h"
+
+#include "../PluginIndex.h"
+#include "../Config/SaolaConfiguration.h"
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+
+#include <list>
+
+// Changes waiting for the background thread, beyond which the new instances are not indexed eagerly
+static const size_t MAX_QUEUE_SIZE = 100000;
+
+// Instances indexed in one SQLite transaction
+static const size_t BATCH_SIZE = 100;
+
+StoragePathIndexScheduler &StoragePathIndexScheduler::Instance()
+{
+  static StoragePathIndexScheduler instance;
+  return instance;
+}
+
+StoragePathIndexScheduler::~StoragePathIndexScheduler()
+{
+  if (this->m_state == State_Running)
+  {
+    OrthancPlugins::LogError("StoragePathIndexScheduler::Stop() should have been manually called");
+    Stop();
+  }
+}
+
+void StoragePathIndexScheduler::Push(const std::string &resourceId, bool deleted)
+{
+  {
+    boost::mutex::scoped_lock lock(this->m_mutex);
+
+    if (this->m_state != State_Running)
+    {
+      return;
+    }
+
+    // A deletion is always queued, so that no stale path is indexed after it
+    if (!deleted &&
+        this->m_queue.size() >= MAX_QUEUE_SIZE)
+    {
+      if (this->m_dropped++ == 0)
+      {
+        LOG(WARNING) << "StoragePathIndexScheduler - Too many instances received, their storage path will be looked up by the exports";
+      }
+      return;
+    }
+
+    Change change;
+    change.deleted_ = deleted;
+    change.resourceId_ = resourceId;
+    this->m_queue.push_back(change);
+  }
+
+  this->m_changed.notify_one();
+}
+
+void StoragePathIndexScheduler::NotifyNewInstance(const std::string &instanceId)
+{
+  Push(instanceId, false);
+}
+
+void StoragePathIndexScheduler::NotifyDeleted(const std::string &resourceId)
+{
+  Push(resourceId, true);
+}
+
+void StoragePathIndexScheduler::ProcessChanges()
+{
+  for (;;)
+  {
+    std::deque<Change> changes;
+
+    {
+      boost::mutex::scoped_lock lock(this->m_mutex);
+
+      while (this->m_state == State_Running &&
+             this->m_queue.empty())
+      {
+        this->m_changed.wait(lock);
+      }
+
+      if (this->m_state != State_Running)
+      {
+        return;  // The changes still queued are caught up by the exports
+      }
+
+      while (!this->m_queue.empty() &&
+             changes.size() < BATCH_SIZE)
+      {
+        changes.push_back(this->m_queue.front());
+        this->m_queue.pop_front();
+      }
+
+      if (this->m_queue.empty() &&
+          this->m_dropped > 0)
+      {
+        LOG(WARNING) << "StoragePathIndexScheduler - The storage path of " << this->m_dropped << " instance(s) was not indexed on reception";
+        this->m_dropped = 0;
+      }
+    }
+
+    // The new instances are indexed in a single transaction, until a
+    // deletion, that must come after them
+    std::list<std::string> instances;
+
+    for (std::deque<Change>::const_iterator it = changes.begin(); it != changes.end(); ++it)
+    {
+      if (it->deleted_)
+      {
+        PluginIndex::Instance().IndexStoragePaths(instances);
+        instances.clear();
+        PluginIndex::Instance().RemoveStoragePaths(it->resourceId_);
+      }
+      else
+      {
+        instances.push_back(it->resourceId_);
+      }
+    }
+
+    PluginIndex::Instance().IndexStoragePaths(instances);
+  }
+}
+
+void StoragePathIndexScheduler::Start()
+{
+  if (!SaolaConfiguration::Instance().IsExportPathIndex())
+  {
+    return;
+  }
+
+  {
+    boost::mutex::scoped_lock lock(this->m_mutex);
+
+    if (this->m_state != State_Setup)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    this->m_state = State_Running;
+  }
+
+  this->m_worker = new boost::thread([this]() {
+    this->ProcessChanges();
+  });
+}
+
+void StoragePathIndexScheduler::Stop()
+{
+  {
+    boost::mutex::scoped_lock lock(this->m_mutex);
+
+    if (this->m_state != State_Running)
+    {
+      return;
+    }
+
+    this->m_state = State_Done;
+    this->m_queue.clear();
+  }
+
+  this->m_changed.notify_all();
+
+  if (this->m_worker->joinable())
+    this->m_worker->join();
+  delete this->m_worker;
+  this->m_worker = NULL;
+}
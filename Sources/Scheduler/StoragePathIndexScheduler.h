@@ -0,0 +1,65 @@
+#pragma once
+
+#include <deque>
+#include <stdint.h>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+// Maintains the index of the storage paths of the instances (see
+// "ExportPathIndex") outside of the change callback of Orthanc: the
+// callback only queues the identifiers, the REST calls and the SQLite
+// writes are made by a background thread, in batches. If the queue is
+// full, the new instances are dropped: their path is looked up by the
+// first export that reads them.
+class StoragePathIndexScheduler : public boost::noncopyable
+{
+private:
+  enum State
+  {
+    State_Setup,
+    State_Running,
+    State_Done
+  };
+
+  struct Change
+  {
+    bool deleted_;
+    std::string resourceId_;
+  };
+
+  boost::thread *m_worker;
+
+  State m_state;
+
+  boost::mutex m_mutex;
+
+  boost::condition_variable m_changed;
+
+  std::deque<Change> m_queue;
+
+  uint64_t m_dropped;
+
+  StoragePathIndexScheduler() : m_worker(NULL), m_state(State_Setup), m_dropped(0)
+  {
+  }
+
+  void Push(const std::string &resourceId, bool deleted);
+
+  void ProcessChanges();
+
+public:
+  static StoragePathIndexScheduler &Instance();
+
+  ~StoragePathIndexScheduler();
+
+  // Do nothing if the scheduler is not running
+  void NotifyNewInstance(const std::string &instanceId);
+
+  void NotifyDeleted(const std::string &resourceId);
+
+  void Start();
+
+  void Stop();
+};
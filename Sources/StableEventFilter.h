@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string>
+
+struct StableEventFilter
+{
+  /* data */
+  std::string app_id_;          // Empty means any app
+  std::string app_type_;        // Empty means any app type
+  int         min_retry_ = -1;  // Negative means no lower bound
+  int         max_retry_ = -1;  // Negative means no upper bound
+  std::string created_before_;  // ISO time, empty means no bound
+  std::string created_after_;   // ISO time, empty means no bound
+};
@@ -2,6 +2,8 @@
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <stdint.h>
+
 namespace Saola
 {
   static boost::posix_time::ptime GetNow()
@@ -24,6 +26,18 @@ namespace Saola
     return boost::posix_time::second_clock::universal_time() - boost::posix_time::from_iso_string(time) > boost::posix_time::seconds(seconds);
   }
 
+  // Stored by the SQLite queue, so that the due time of the events
+  // can be compared and indexed by SQL
+  static int64_t ToSecondsSinceEpoch(const boost::posix_time::ptime &time)
+  {
+    return (time - boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1))).total_seconds();
+  }
+
+  static int64_t ToSecondsSinceEpoch(const std::string &time)
+  {
+    return ToSecondsSinceEpoch(boost::posix_time::from_iso_string(time));
+  }
+
   static auto Elapsed(const std::string &time)
   {
     return boost::posix_time::second_clock::universal_time() - boost::posix_time::from_iso_string(time);
@@ -0,0 +1,240 @@
+#include <gtest/gtest.h>
+
+#include "../Sources/Job/ArchiveStreamWriter.h"
+
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+class ArchiveStreamWriterTest : public ::testing::Test
+{
+protected:
+  std::string directory_;
+
+  virtual void SetUp() ORTHANC_OVERRIDE
+  {
+    directory_ = (boost::filesystem::temp_directory_path() / ("saola-" + Orthanc::Toolbox::GenerateUuid())).string();
+  }
+
+  virtual void TearDown() ORTHANC_OVERRIDE
+  {
+    boost::filesystem::remove_all(directory_);
+  }
+
+  std::string GetPath(const char* name) const
+  {
+    return (boost::filesystem::path(directory_) / name).string();
+  }
+};
+
+
+static uint16_t Read16(const std::string& s,
+                       size_t offset)
+{
+  return static_cast<uint16_t>(static_cast<uint8_t>(s[offset]) |
+                               (static_cast<uint8_t>(s[offset + 1]) << 8));
+}
+
+static uint32_t Read32(const std::string& s,
+                       size_t offset)
+{
+  return static_cast<uint32_t>(Read16(s, offset)) | (static_cast<uint32_t>(Read16(s, offset + 2)) << 16);
+}
+
+static uint64_t Read64(const std::string& s,
+                       size_t offset)
+{
+  return static_cast<uint64_t>(Read32(s, offset)) | (static_cast<uint64_t>(Read32(s, offset + 4)) << 32);
+}
+
+static void AddEntry(Saola::ArchiveStreamWriter& writer,
+                     size_t index,
+                     const std::string& name,
+                     const std::string& content)
+{
+  writer.AddEntry(index, name, content.c_str(), content.size(), boost::shared_ptr<void>());
+}
+
+
+TEST_F(ArchiveStreamWriterTest, Tar)
+{
+  const std::string path = GetPath("a.tar");
+
+  {
+    Saola::ArchiveStreamWriter writer(path, Saola::ArchiveFormat_Tar, 0, true);
+
+    // Completed out of order, appended in the order of the indexes
+    AddEntry(writer, 2, "study/c", "world");
+    writer.SkipEntry(1);
+    AddEntry(writer, 0, "study/a", "hello");
+    AddEntry(writer, 3, "study/d", std::string(513, 'x'));
+    writer.Close();
+  }
+
+  std::string tar;
+  Orthanc::SystemToolbox::ReadFile(tar, path);
+
+  // 3 headers, 1 + 1 + 2 data blocks, 2 blocks of end of archive
+  ASSERT_EQ(9u * 512u, tar.size());
+
+  ASSERT_EQ("study/a", std::string(tar.c_str()));
+  ASSERT_EQ("00000000005", tar.substr(124, 11));
+  ASSERT_EQ("ustar", std::string(tar.c_str() + 257));
+  ASSERT_EQ("hello", tar.substr(512, 5));
+
+  ASSERT_EQ("study/c", std::string(tar.c_str() + 2 * 512));
+  ASSERT_EQ("world", tar.substr(3 * 512, 5));
+
+  ASSERT_EQ("study/d", std::string(tar.c_str() + 4 * 512));
+  ASSERT_EQ("00000001001", tar.substr(4 * 512 + 124, 11));
+  ASSERT_EQ(std::string(513, 'x'), tar.substr(5 * 512, 513));
+
+  ASSERT_EQ(std::string(2 * 512, '\0'), tar.substr(7 * 512));
+
+  // Checksum of the first header, computed with its field set to spaces
+  std::string header = tar.substr(0, 512);
+  const unsigned int expected = strtoul(header.substr(148, 7).c_str(), NULL, 8);
+  header.replace(148, 8, 8, ' ');
+
+  unsigned int checksum = 0;
+  for (size_t i = 0; i < header.size(); i++)
+  {
+    checksum += static_cast<uint8_t>(header[i]);
+  }
+
+  ASSERT_EQ(expected, checksum);
+}
+
+
+TEST_F(ArchiveStreamWriterTest, Zip)
+{
+  const std::string path = GetPath("a.zip");
+
+  {
+    Saola::ArchiveStreamWriter writer(path, Saola::ArchiveFormat_Zip, 0, false);
+    AddEntry(writer, 1, "b", "world!");
+    AddEntry(writer, 0, "a", "hello");
+    writer.Close();
+  }
+
+  std::string zip;
+  Orthanc::SystemToolbox::ReadFile(zip, path);
+
+  // End of central directory record, without comment
+  ASSERT_LE(22u, zip.size());
+  const size_t end = zip.size() - 22;
+  ASSERT_EQ(0x06054b50u, Read32(zip, end));
+  ASSERT_EQ(2u, Read16(zip, end + 10));
+
+  const uint32_t directorySize = Read32(zip, end + 12);
+  const uint32_t directoryOffset = Read32(zip, end + 16);
+  ASSERT_EQ(end, directoryOffset + directorySize);
+
+  const char* names[] = { "a", "b" };
+  const char* contents[] = { "hello", "world!" };
+  size_t position = directoryOffset;
+  size_t localOffset = 0;
+
+  for (size_t i = 0; i < 2; i++)
+  {
+    ASSERT_EQ(0x02014b50u, Read32(zip, position));
+    ASSERT_EQ(0u, Read16(zip, position + 10));  // Stored
+    ASSERT_EQ(strlen(contents[i]), Read32(zip, position + 20));
+    ASSERT_EQ(strlen(contents[i]), Read32(zip, position + 24));
+    ASSERT_EQ(localOffset, Read32(zip, position + 42));
+
+    const uint16_t nameLength = Read16(zip, position + 28);
+    ASSERT_EQ(names[i], zip.substr(position + 46, nameLength));
+
+    // Local file header, followed by the data
+    ASSERT_EQ(0x04034b50u, Read32(zip, localOffset));
+    ASSERT_EQ(Read32(zip, position + 16), Read32(zip, localOffset + 14));  // CRC-32
+    ASSERT_EQ(names[i], zip.substr(localOffset + 30, Read16(zip, localOffset + 26)));
+
+    const size_t data = localOffset + 30 + Read16(zip, localOffset + 26) + Read16(zip, localOffset + 28);
+    ASSERT_EQ(contents[i], zip.substr(data, strlen(contents[i])));
+
+    localOffset = data + strlen(contents[i]);
+    position += 46 + nameLength + Read16(zip, position + 30) + Read16(zip, position + 32);
+  }
+
+  ASSERT_EQ(directoryOffset, localOffset);
+  ASSERT_EQ(end, position);
+}
+
+
+TEST_F(ArchiveStreamWriterTest, Zip64)
+{
+  // More than 65535 entries require the ZIP64 end of central directory
+  static const size_t COUNT = 65536;
+
+  const std::string path = GetPath("a.zip");
+
+  {
+    Saola::ArchiveStreamWriter writer(path, Saola::ArchiveFormat_Zip, 0, true);
+    for (size_t i = 0; i < COUNT; i++)
+    {
+      AddEntry(writer, i, boost::lexical_cast<std::string>(i), "");
+    }
+
+    writer.Close();
+  }
+
+  std::string zip;
+  Orthanc::SystemToolbox::ReadFile(zip, path);
+
+  const size_t end = zip.size() - 22;
+  ASSERT_EQ(0x06054b50u, Read32(zip, end));
+  ASSERT_EQ(0xffffu, Read16(zip, end + 8));
+  ASSERT_EQ(0xffffu, Read16(zip, end + 10));
+
+  // ZIP64 end of central directory locator, then record
+  const size_t locator = end - 20;
+  ASSERT_EQ(0x07064b50u, Read32(zip, locator));
+
+  const uint64_t record = Read64(zip, locator + 8);
+  ASSERT_EQ(locator - 56, record);
+  ASSERT_EQ(0x06064b50u, Read32(zip, record));
+  ASSERT_EQ(COUNT, Read64(zip, record + 24));
+  ASSERT_EQ(COUNT, Read64(zip, record + 32));
+  ASSERT_EQ(record, Read64(zip, record + 48) + Read64(zip, record + 40));
+
+  // The central directory follows the order of the indexes
+  const uint64_t directoryOffset = Read64(zip, record + 48);
+  ASSERT_EQ(0x02014b50u, Read32(zip, directoryOffset));
+  ASSERT_EQ("0", zip.substr(directoryOffset + 46, Read16(zip, directoryOffset + 28)));
+}
+
+
+TEST_F(ArchiveStreamWriterTest, MissingEntry)
+{
+  const std::string path = GetPath("a.zip");
+
+  {
+    Saola::ArchiveStreamWriter writer(path, Saola::ArchiveFormat_Zip, 0, true);
+    AddEntry(writer, 1, "b", "world");
+    ASSERT_THROW(AddEntry(writer, 1, "b", "world"), Orthanc::OrthancException);
+    ASSERT_THROW(writer.Close(), Orthanc::OrthancException);
+  }
+
+  // An incomplete archive is removed
+  ASSERT_FALSE(boost::filesystem::exists(path));
+  ASSERT_FALSE(boost::filesystem::exists(path + ".tmp"));
+
+  {
+    Saola::ArchiveStreamWriter writer(path, Saola::ArchiveFormat_Zip, 0, false);
+    for (size_t i = 0; i < 65535; i++)
+    {
+      writer.SkipEntry(i);
+    }
+
+    AddEntry(writer, 65535, "a", "hello");
+    writer.Close();  // A single entry, no ZIP64
+  }
+
+  ASSERT_TRUE(boost::filesystem::exists(path));
+}
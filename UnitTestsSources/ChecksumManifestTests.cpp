@@ -0,0 +1,152 @@
+#include <gtest/gtest.h>
+
+#include "../Sources/Job/ChecksumManifest.h"
+
+#include <Compatibility.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+
+
+using namespace Saola;
+
+class ChecksumManifestTest : public ::testing::Test
+{
+protected:
+  std::string root_;
+
+  virtual void SetUp() ORTHANC_OVERRIDE
+  {
+    root_ = (boost::filesystem::temp_directory_path() / ("saola-" + Orthanc::Toolbox::GenerateUuid())).string();
+    boost::filesystem::create_directories(root_);
+  }
+
+  virtual void TearDown() ORTHANC_OVERRIDE
+  {
+    boost::filesystem::remove_all(root_);
+  }
+
+  std::string WriteFile(const char* name,
+                        const std::string& content) const
+  {
+    const std::string path = (boost::filesystem::path(root_) / name).string();
+    boost::filesystem::create_directories(boost::filesystem::path(path).parent_path());
+    Orthanc::SystemToolbox::WriteFile(content, path);
+    return path;
+  }
+};
+
+
+// Bitwise reference implementation
+static uint32_t ComputeReference(const std::string& data)
+{
+  uint32_t crc = 0xffffffffu;
+
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    crc ^= static_cast<uint8_t>(data[i]);
+    for (unsigned int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+    }
+  }
+
+  return ~crc;
+}
+
+
+TEST(ChecksumManifest, Crc32c)
+{
+  // Check value of the CRC-32C (Castagnoli), and the vectors of RFC 3720
+  ASSERT_EQ(0x00000000u, ChecksumManifest::ComputeCrc32c(NULL, 0));
+  ASSERT_EQ(0xe3069283u, ChecksumManifest::ComputeCrc32c("123456789", 9));
+  ASSERT_EQ(0x8a9136aau, ChecksumManifest::ComputeCrc32c(std::string(32, '\0').c_str(), 32));
+  ASSERT_EQ(0x62a8ab43u, ChecksumManifest::ComputeCrc32c(std::string(32, '\xff').c_str(), 32));
+
+  std::string ascending, descending;
+  for (int i = 0; i < 32; i++)
+  {
+    ascending.push_back(static_cast<char>(i));
+    descending.push_back(static_cast<char>(31 - i));
+  }
+
+  ASSERT_EQ(0x46dd794eu, ChecksumManifest::ComputeCrc32c(ascending.c_str(), ascending.size()));
+  ASSERT_EQ(0x113fdb5cu, ChecksumManifest::ComputeCrc32c(descending.c_str(), descending.size()));
+
+  // All the lengths and alignments around the 8-byte words
+  std::string data;
+  for (size_t i = 0; i < 100; i++)
+  {
+    data.push_back(static_cast<char>(i * 37 + 11));
+  }
+
+  for (size_t offset = 0; offset < 8; offset++)
+  {
+    for (size_t size = 0; size + offset <= data.size(); size++)
+    {
+      const std::string chunk = data.substr(offset, size);
+      ASSERT_EQ(ComputeReference(chunk), ChecksumManifest::ComputeCrc32c(data.c_str() + offset, size));
+    }
+  }
+}
+
+
+TEST_F(ChecksumManifestTest, ComputeFile)
+{
+  ASSERT_EQ(0xe3069283u, ChecksumManifest::ComputeFileCrc32c(WriteFile("a", "123456789")));
+  ASSERT_EQ(0x00000000u, ChecksumManifest::ComputeFileCrc32c(WriteFile("empty", "")));
+}
+
+
+TEST_F(ChecksumManifestTest, SaveAndLoad)
+{
+  const std::string a = WriteFile("study/a.dcm", "hello");
+  const std::string b = WriteFile("study/b.dcm", "world");
+  const std::string c = WriteFile("study/c.dcm", "!");
+
+  {
+    ChecksumManifest manifest(root_);
+    manifest.Load();
+    ASSERT_FALSE(manifest.HasChecksum(a));
+
+    manifest.Record(a, 0x12345678);
+    manifest.Record(b, 0xabcdef00);
+    manifest.Record(c, 0x00000001);
+    manifest.Save();
+  }
+
+  std::string content;
+  Orthanc::SystemToolbox::ReadFile(content, (boost::filesystem::path(root_) / ChecksumManifest::GetFilename()).string());
+  ASSERT_EQ("12345678  study/a.dcm\n"
+            "abcdef00  study/b.dcm\n"
+            "00000001  study/c.dcm\n", content);
+
+  boost::filesystem::remove(c);  // The missing files are dropped
+
+  {
+    // A job without checksums rewrites "b": its former checksum is stale
+    ChecksumManifest manifest(root_);
+    manifest.Load();
+    ASSERT_TRUE(manifest.HasChecksum(a));
+    ASSERT_TRUE(manifest.HasChecksum(b));
+
+    manifest.Remove(b);
+    ASSERT_FALSE(manifest.HasChecksum(b));
+    manifest.Save();
+  }
+
+  Orthanc::SystemToolbox::ReadFile(content, (boost::filesystem::path(root_) / ChecksumManifest::GetFilename()).string());
+  ASSERT_EQ("12345678  study/a.dcm\n", content);
+
+  {
+    ChecksumManifest manifest(root_);
+    manifest.Load();
+    manifest.Remove(a);
+    manifest.Record(a, 0x87654321);  // Written again, with its checksum
+    manifest.Save();
+  }
+
+  Orthanc::SystemToolbox::ReadFile(content, (boost::filesystem::path(root_) / ChecksumManifest::GetFilename()).string());
+  ASSERT_EQ("87654321  study/a.dcm\n", content);
+}
@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+
+#include "../Sources/Database/InMemoryEventQueueStore.h"
+
+// Last update time far in the past, so that the event is due whatever its delay
+static const char* const PAST = "20000101T000000";
+
+
+static int64_t Enqueue(IEventQueueStore& store,
+                       const char* appType,
+                       int delay)
+{
+  StableEventDTOCreate obj;
+  obj.iuid_ = "1.2.3";
+  obj.resource_id_ = "resource";
+  obj.resouce_type_ = "Study";
+  obj.app_id_ = "app";
+  obj.app_type_ = appType;
+  obj.delay_ = delay;
+  return store.Enqueue(obj);
+}
+
+
+static std::list<int64_t> GetDueBatch(IEventQueueStore& store,
+                                      const std::list<std::string>& appTypes,
+                                      bool included,
+                                      int maxRetry,
+                                      int limit)
+{
+  std::list<StableEventDTOGet> events;
+  store.GetDueBatch(appTypes, included, maxRetry, limit, events);
+
+  std::list<int64_t> ids;
+  for (const auto& event : events)
+  {
+    ids.push_back(event.id_);
+  }
+
+  return ids;
+}
+
+
+TEST(InMemoryEventQueueStore, DueBatch)
+{
+  InMemoryEventQueueStore store;
+
+  const int64_t a = Enqueue(store, "Transfer", 0);
+  const int64_t b = Enqueue(store, "Transfer", 0);
+  const int64_t c = Enqueue(store, "Transfer", 0);
+  const int64_t d = Enqueue(store, "Transfer", 0);
+  const int64_t e = Enqueue(store, "StoreSCU", 0);
+  Enqueue(store, "Transfer", 3600);  // Not due before one hour
+
+  ASSERT_TRUE(store.Fail(StableEventDTOUpdate(a, "Failure", 2, PAST)));
+  ASSERT_TRUE(store.Fail(StableEventDTOUpdate(b, "Failure", 1, PAST)));
+  ASSERT_TRUE(store.Fail(StableEventDTOUpdate(c, "Failure", 1, PAST)));
+  ASSERT_TRUE(store.Fail(StableEventDTOUpdate(e, "Failure", 0, PAST)));
+
+  {
+    StableEventDTOGet event;
+    ASSERT_TRUE(store.GetById(d, event));
+    ASSERT_TRUE(store.DeleteEventByIds(std::list<int64_t>(1, d)));
+    ASSERT_FALSE(store.GetById(d, event));
+  }
+
+  const std::list<std::string> transfer(1, "Transfer");
+
+  // Sorted by retry then by id, the events that are not due never fill the batch
+  ASSERT_EQ(std::list<int64_t>({ b, c, a }), GetDueBatch(store, transfer, true, 5, 10));
+  ASSERT_EQ(std::list<int64_t>({ b, c }), GetDueBatch(store, transfer, true, 5, 2));
+  ASSERT_EQ(std::list<int64_t>({ b, c }), GetDueBatch(store, transfer, true, 1, 10));
+  ASSERT_EQ(std::list<int64_t>({ e }), GetDueBatch(store, transfer, false, 5, 10));
+  ASSERT_TRUE(GetDueBatch(store, std::list<std::string>(), true, 5, 10).empty());
+
+  // Nothing is claimed by "GetDueBatch()": the events stay until they are completed
+  ASSERT_EQ(std::list<int64_t>({ b, c, a }), GetDueBatch(store, transfer, true, 5, 10));
+
+  ASSERT_TRUE(store.Complete(b));
+  ASSERT_EQ(std::list<int64_t>({ c, a }), GetDueBatch(store, transfer, true, 5, 10));
+
+  // A reset event starts over with its delay
+  ASSERT_TRUE(store.ResetEvents(std::list<int64_t>(1, a)));
+
+  StableEventDTOGet event;
+  ASSERT_TRUE(store.GetById(a, event));
+  ASSERT_EQ(0, event.retry_);
+  ASSERT_EQ("Reset", event.failed_reason_);
+}
+
+
+TEST(InMemoryEventQueueStore, Reschedule)
+{
+  InMemoryEventQueueStore store;
+
+  const int64_t a = Enqueue(store, "Transfer", 60);
+  ASSERT_TRUE(store.Fail(StableEventDTOUpdate(a, "Failure", 1, PAST)));
+
+  const std::list<std::string> transfer(1, "Transfer");
+  ASSERT_EQ(std::list<int64_t>({ a }), GetDueBatch(store, transfer, true, 5, 10));
+
+  // The job of the retried event is submitted again: the event waits for its delay
+  ASSERT_TRUE(store.Reschedule(StableEventDTOUpdate(a, "Failure", 2, "29991231T000000")));
+  ASSERT_TRUE(GetDueBatch(store, transfer, true, 5, 10).empty());
+
+  StableEventDTOGet event;
+  ASSERT_TRUE(store.GetById(a, event));
+  ASSERT_EQ(2, event.retry_);
+}
+
+
+TEST(InMemoryEventQueueStore, TransferJobs)
+{
+  InMemoryEventQueueStore store;
+
+  const int64_t a = Enqueue(store, "Transfer", 0);
+  const int64_t b = Enqueue(store, "Transfer", 0);
+
+  TransferJobDTOGet job;
+  store.SaveTransferJob(TransferJobDTOCreate("job1", a), job);
+  ASSERT_EQ("job1", job.id_);
+  ASSERT_EQ(a, job.queue_id_);
+
+  store.SaveTransferJob(TransferJobDTOCreate("job2", b), job);
+  store.SaveTransferJob(TransferJobDTOCreate("job3", b), job);
+
+  std::list<TransferJobDTOGet> jobs;
+  ASSERT_TRUE(store.GetTransferJobsByByQueueId(b, jobs));
+  ASSERT_EQ(2u, jobs.size());
+
+  // Completing an event drops its transfer jobs
+  ASSERT_TRUE(store.Complete(b));
+  ASSERT_FALSE(store.GetById("job2", job));
+  ASSERT_FALSE(store.GetById("job3", job));
+  ASSERT_TRUE(store.GetById("job1", job));
+  ASSERT_EQ(a, job.queue_id_);
+
+  // No identifier means all the events
+  ASSERT_TRUE(store.DeleteEventByIds(std::list<int64_t>()));
+  ASSERT_FALSE(store.GetById("job1", job));
+
+  std::list<StableEventDTOGet> events;
+  store.List(Pagination(), StableEventFilter(), events);
+  ASSERT_TRUE(events.empty());
+}
@@ -0,0 +1,186 @@
+#include <gtest/gtest.h>
+
+#include "../Sources/Job/ExportCoordinator.h"
+
+#include <boost/thread.hpp>
+
+
+using namespace Saola;
+
+namespace
+{
+  // Acquires an instance from another thread, as a concurrent export
+  class AsynchronousAcquire : public boost::noncopyable
+  {
+  private:
+    std::string group_;
+    const void* job_;
+    std::string instanceId_;
+    boost::mutex mutex_;
+    bool done_;
+    ExportCoordinator::Acquisition acquisition_;
+    boost::shared_ptr<DicomBuffer> dicom_;
+    std::string written_;
+    boost::thread thread_;
+
+    void Worker()
+    {
+      boost::shared_ptr<DicomBuffer> dicom;
+      std::string written;
+      ExportCoordinator::Acquisition acquisition =
+        ExportCoordinator::Instance().Acquire(dicom, written, group_, job_, instanceId_);
+
+      boost::mutex::scoped_lock lock(mutex_);
+      acquisition_ = acquisition;
+      dicom_ = dicom;
+      written_ = written;
+      done_ = true;
+    }
+
+  public:
+    AsynchronousAcquire(const std::string& group,
+                        const void* job,
+                        const std::string& instanceId) :
+      group_(group),
+      job_(job),
+      instanceId_(instanceId),
+      done_(false),
+      acquisition_(ExportCoordinator::Acquisition_Load)
+    {
+      thread_ = boost::thread(&AsynchronousAcquire::Worker, this);
+    }
+
+    ~AsynchronousAcquire()
+    {
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+    }
+
+    bool IsDone()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return done_;
+    }
+
+    ExportCoordinator::Acquisition Join(boost::shared_ptr<DicomBuffer>& dicom,
+                                        std::string& written)
+    {
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+
+      dicom = dicom_;
+      written = written_;
+      return acquisition_;
+    }
+  };
+}
+
+
+static bool WaitsForLoader(AsynchronousAcquire& acquire)
+{
+  boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  return !acquire.IsDone();
+}
+
+
+TEST(ExportCoordinator, Alone)
+{
+  const std::string group = "alone";
+  int job;
+
+  ExportCoordinator::Instance().Register(group, &job);
+
+  boost::shared_ptr<DicomBuffer> dicom;
+  std::string written;
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job, "a"));
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job, "a"));
+
+  ExportCoordinator::Instance().Unregister(group, &job);
+}
+
+
+TEST(ExportCoordinator, SingleFlight)
+{
+  const std::string group = "single-flight";
+  int job1, job2, job3;
+
+  ExportCoordinator::Instance().Register(group, &job1);
+  ExportCoordinator::Instance().Register(group, &job2);
+  ExportCoordinator::Instance().Register(group, &job3);
+
+  boost::shared_ptr<DicomBuffer> dicom, shared;
+  std::string written;
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job1, "a"));
+
+  {
+    // The other jobs wait for the load of the first one, and get its buffer
+    AsynchronousAcquire acquire2(group, &job2, "a");
+    AsynchronousAcquire acquire3(group, &job3, "a");
+    ASSERT_TRUE(WaitsForLoader(acquire2));
+    ASSERT_TRUE(WaitsForLoader(acquire3));
+
+    boost::shared_ptr<DicomBuffer> loaded(new DicomBuffer);
+    loaded->GetContent() = "dicom";
+    ExportCoordinator::Instance().Publish(group, "a", loaded);
+
+    ASSERT_EQ(ExportCoordinator::Acquisition_Shared, acquire2.Join(shared, written));
+    ASSERT_EQ(loaded.get(), shared.get());
+    ASSERT_EQ(ExportCoordinator::Acquisition_Shared, acquire3.Join(shared, written));
+    ASSERT_EQ(loaded.get(), shared.get());
+  }
+
+  // Every job got the buffer, it is not kept anymore: the instance is loaded again
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job1, "a"));
+  ExportCoordinator::Instance().Abandon(group, "a");
+
+  // Once a job wrote the file, the others copy it
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job1, "b"));
+  ExportCoordinator::Instance().RecordWrittenFile(group, "b", "/export/1/b.dcm");
+  ASSERT_EQ(ExportCoordinator::Acquisition_Copy, ExportCoordinator::Instance().Acquire(dicom, written, group, &job2, "b"));
+  ASSERT_EQ("/export/1/b.dcm", written);
+
+  ExportCoordinator::Instance().Unregister(group, &job1);
+  ExportCoordinator::Instance().Unregister(group, &job2);
+  ExportCoordinator::Instance().Unregister(group, &job3);
+}
+
+
+TEST(ExportCoordinator, InterruptedLoad)
+{
+  const std::string group = "interrupted";
+  int job1, job2;
+
+  ExportCoordinator::Instance().Register(group, &job1);
+  ExportCoordinator::Instance().Register(group, &job2);
+
+  boost::shared_ptr<DicomBuffer> dicom;
+  std::string written;
+
+  // The load failed: the waiting job loads the instance by itself
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job1, "a"));
+
+  {
+    AsynchronousAcquire acquire(group, &job2, "a");
+    ASSERT_TRUE(WaitsForLoader(acquire));
+    ExportCoordinator::Instance().Abandon(group, "a");
+    ASSERT_EQ(ExportCoordinator::Acquisition_Load, acquire.Join(dicom, written));
+  }
+
+  ExportCoordinator::Instance().Publish(group, "a", boost::shared_ptr<DicomBuffer>());
+
+  // The loading job stopped: same thing
+  ASSERT_EQ(ExportCoordinator::Acquisition_Load, ExportCoordinator::Instance().Acquire(dicom, written, group, &job1, "b"));
+
+  {
+    AsynchronousAcquire acquire(group, &job2, "b");
+    ASSERT_TRUE(WaitsForLoader(acquire));
+    ExportCoordinator::Instance().Unregister(group, &job1);
+    ASSERT_EQ(ExportCoordinator::Acquisition_Load, acquire.Join(dicom, written));
+  }
+
+  ExportCoordinator::Instance().Unregister(group, &job2);
+}
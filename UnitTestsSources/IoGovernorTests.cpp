@@ -0,0 +1,202 @@
+#include <gtest/gtest.h>
+
+#include "../Sources/Job/IoGovernor.h"
+
+#include <Compatibility.h>
+
+#include <boost/thread.hpp>
+
+
+using namespace Saola;
+
+class IoGovernorTest : public ::testing::Test
+{
+protected:
+  virtual void TearDown() ORTHANC_OVERRIDE
+  {
+    IoGovernor::Instance().Configure(0, 0, 0, 0, 100);  // The governor is shared by the whole process
+  }
+
+  static int64_t GetElapsedMs(const boost::posix_time::ptime& start)
+  {
+    return (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+  }
+};
+
+
+namespace
+{
+  // Runs one operation from another thread, until "Release()"
+  class AsynchronousOperation : public boost::noncopyable
+  {
+  private:
+    const void* job_;
+    boost::mutex mutex_;
+    boost::condition_variable changed_;
+    bool started_;
+    bool released_;
+    boost::thread thread_;
+
+    void Worker()
+    {
+      IoGovernor::Operation operation(job_, IoDirection_Read);
+
+      boost::mutex::scoped_lock lock(mutex_);
+      started_ = true;
+      changed_.notify_all();
+
+      while (!released_)
+      {
+        changed_.wait(lock);
+      }
+    }
+
+  public:
+    explicit AsynchronousOperation(const void* job) :
+      job_(job),
+      started_(false),
+      released_(false)
+    {
+      thread_ = boost::thread(&AsynchronousOperation::Worker, this);
+    }
+
+    ~AsynchronousOperation()
+    {
+      Release();
+
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+    }
+
+    bool IsStarted()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return started_;
+    }
+
+    void Release()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      released_ = true;
+      changed_.notify_all();
+    }
+  };
+}
+
+
+TEST_F(IoGovernorTest, Unlimited)
+{
+  int job;
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  for (size_t i = 0; i < 100; i++)
+  {
+    IoGovernor::Operation operation(&job, IoDirection_Write);
+    operation.SetBytes(1024 * 1024 * 1024);
+  }
+
+  ASSERT_LT(GetElapsedMs(start), 1000);
+}
+
+
+TEST_F(IoGovernorTest, Bandwidth)
+{
+  IoGovernor::Instance().Configure(0, 1, 0, 0, 100);
+
+  int job;
+
+  {
+    // The bucket starts full with 1 MB, the operation exceeds it by 512 KB
+    IoGovernor::Operation operation(&job, IoDirection_Write);
+    operation.SetBytes(3 * 512 * 1024);
+  }
+
+  {
+    // The reads are not limited
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    IoGovernor::Operation operation(&job, IoDirection_Read);
+    operation.SetBytes(1024 * 1024 * 1024);
+    ASSERT_LT(GetElapsedMs(start), 250);
+  }
+
+  {
+    // The next write waits until the 512 KB are refilled, at 1 MB/s
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    IoGovernor::Operation operation(&job, IoDirection_Write);
+    ASSERT_GE(GetElapsedMs(start), 400);
+  }
+}
+
+
+TEST_F(IoGovernorTest, Operations)
+{
+  IoGovernor::Instance().Configure(0, 0, 10, 0, 100);
+
+  int job;
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  // 10 tokens at start, an operation may use the last one in
+  // advance, then one operation every 100 ms
+  for (size_t i = 0; i < 15; i++)
+  {
+    IoGovernor::Operation operation(&job, i % 2 == 0 ? IoDirection_Read : IoDirection_Write);
+  }
+
+  ASSERT_GE(GetElapsedMs(start), 300);
+}
+
+
+TEST_F(IoGovernorTest, MaxRunning)
+{
+  IoGovernor::Instance().Configure(0, 0, 0, 1, 100);
+
+  int job1, job2;
+
+  AsynchronousOperation first(&job1);
+  while (!first.IsStarted())
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  AsynchronousOperation second(&job2);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  ASSERT_FALSE(second.IsStarted());
+
+  first.Release();
+
+  while (!second.IsStarted())
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+}
+
+
+TEST_F(IoGovernorTest, Statistics)
+{
+  int job;
+  IoGovernor::Instance().Register(&job, 3);
+
+  {
+    IoGovernor::Operation operation(&job, IoDirection_Read);
+    operation.SetBytes(100);
+  }
+
+  {
+    IoGovernor::Operation operation(&job, IoDirection_Write);
+    operation.SetBytes(20);
+  }
+
+  Json::Value statistics;
+  IoGovernor::Instance().FormatStatistics(statistics, &job);
+  ASSERT_EQ(3u, statistics["Share"].asUInt());
+  ASSERT_EQ(2u, statistics["Operations"].asUInt());
+  ASSERT_EQ(120u, statistics["Bytes"].asUInt());
+  ASSERT_EQ(0u, statistics["Running"].asUInt());
+
+  IoGovernor::Instance().Unregister(&job);
+
+  IoGovernor::Instance().FormatStatistics(statistics, &job);
+  ASSERT_FALSE(statistics.isMember("Bytes"));
+}
@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+
+#include "../Sources/Database/SegmentLogEventQueueStore.h"
+
+#include <Toolbox.h>
+
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+
+class SegmentLogEventQueueStoreTest : public ::testing::Test
+{
+protected:
+  std::string directory_;
+
+  virtual void SetUp() ORTHANC_OVERRIDE
+  {
+    directory_ = (boost::filesystem::temp_directory_path() / ("saola-" + Orthanc::Toolbox::GenerateUuid())).string();
+  }
+
+  virtual void TearDown() ORTHANC_OVERRIDE
+  {
+    boost::filesystem::remove_all(directory_);
+  }
+};
+
+
+static int64_t Enqueue(IEventQueueStore& store,
+                       const char* iuid)
+{
+  StableEventDTOCreate obj;
+  obj.iuid_ = iuid;
+  obj.resource_id_ = "resource";
+  obj.resouce_type_ = "Study";
+  obj.app_id_ = "app";
+  obj.app_type_ = "Transfer";
+  obj.delay_ = 10;
+  return store.Enqueue(obj);
+}
+
+
+TEST_F(SegmentLogEventQueueStoreTest, Replay)
+{
+  int64_t a, b, c;
+
+  {
+    SegmentLogEventQueueStore store;
+    store.Open(directory_);
+
+    a = Enqueue(store, "1.2.1");
+    b = Enqueue(store, "1.2.2");
+    c = Enqueue(store, "1.2.3");
+
+    ASSERT_TRUE(store.Fail(StableEventDTOUpdate(b, "Timeout", 3, "20000101T000000")));
+    ASSERT_TRUE(store.Complete(a));
+
+    TransferJobDTOGet job;
+    store.SaveTransferJob(TransferJobDTOCreate("job-b", b), job);
+    store.SaveTransferJob(TransferJobDTOCreate("job-c", c), job);
+    ASSERT_TRUE(store.DeleteTransferJobByIds(std::list<std::string>(1, "job-c")));
+
+    store.Close();
+  }
+
+  SegmentLogEventQueueStore store;
+  store.Open(directory_);
+
+  StableEventDTOGet event;
+  ASSERT_FALSE(store.GetById(a, event));
+
+  ASSERT_TRUE(store.GetById(b, event));
+  ASSERT_EQ("1.2.2", event.iuid_);
+  ASSERT_EQ("Timeout", event.failed_reason_);
+  ASSERT_EQ(3, event.retry_);
+  ASSERT_EQ(10, event.delay_sec_);
+  ASSERT_EQ("20000101T000000", event.last_updated_time_);
+
+  ASSERT_TRUE(store.GetById(c, event));
+  ASSERT_EQ(0, event.retry_);
+
+  TransferJobDTOGet job;
+  ASSERT_TRUE(store.GetById("job-b", job));
+  ASSERT_EQ(b, job.queue_id_);
+  ASSERT_FALSE(store.GetById("job-c", job));
+
+  // The identifiers are not reused after a restart
+  ASSERT_LT(c, Enqueue(store, "1.2.4"));
+
+  std::list<StableEventDTOGet> due;
+  store.GetDueBatch(std::list<std::string>(1, "Transfer"), true, 5, 10, due);
+  ASSERT_EQ(1u, due.size());
+  ASSERT_EQ(b, due.front().id_);
+
+  store.Close();
+}
+
+
+TEST_F(SegmentLogEventQueueStoreTest, IncompleteSegment)
+{
+  {
+    SegmentLogEventQueueStore store;
+    store.Open(directory_);
+    Enqueue(store, "1.2.1");
+    store.Close();
+  }
+
+  // Left by a crash while a segment was being created
+  const boost::filesystem::path incomplete = boost::filesystem::path(directory_) / "segment-00000099.log";
+
+  {
+    std::ofstream f(incomplete.string().c_str(), std::ios::binary);
+  }
+
+  SegmentLogEventQueueStore store;
+  store.Open(directory_);
+  ASSERT_FALSE(boost::filesystem::exists(incomplete));
+
+  std::list<StableEventDTOGet> events;
+  store.List(Pagination(), StableEventFilter(), events);
+  ASSERT_EQ(1u, events.size());
+  ASSERT_EQ("1.2.1", events.front().iuid_);
+
+  store.Close();
+}
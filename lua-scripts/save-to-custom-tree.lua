@@ -23,20 +23,10 @@ function AddToEventQueue(studyId, tags, metadata)
   -- https://groups.google.com/g/orthanc-users/c/hmv2y-LgKm8/m/oMAuGJWMBgAJ
   -- RestApiPost(SAOLA_URL .. 'event-queues' , DumpJson(body, false))
 
-  -- Send dicom to RIS
-  body["app"] = "Ris1"
+  -- Send dicom to RIS, metadata to store server and to exporter, in one call
+  body["apps"] = { "Ris1", "StoreServer1", "Transfer1" }
   PrintRecursive(body)
-  RestApiPost(SAOLA_URL .. 'event-queues' , DumpJson(body, false))
-
-  -- Send metadata to store server
-  body["app"] = "StoreServer1"
-  PrintRecursive(body)
-  RestApiPost(SAOLA_URL .. 'event-queues' , DumpJson(body, false))
-
-  -- Send metadata to exporter
-  body["app"] = "Transfer1"
-  PrintRecursive(body)
-  RestApiPost(SAOLA_URL .. 'event-queues' , DumpJson(body, false))
+  RestApiPost(SAOLA_URL .. 'event-queues/bulk' , DumpJson(body, false))
 end
 
 